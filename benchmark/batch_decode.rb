@@ -0,0 +1,174 @@
+# -*- encoding: utf-8 -*-
+#
+# Batch decode benchmark: encodes one batch of EVENTS events on paths from a
+# monorepo-like tree the way fsevent_watch would for every format in FORMATS,
+# then reports the bytes per event of each and how long the readers take to
+# turn it back into paths, as JSON to OUTPUT (stdout by default).
+#
+# Each reader gets the frame ITERATIONS times through a pipe, and the median
+# is reported. interned is measured with every path of the batch already
+# sent, which is where it settles once a project is warm, alongside what its
+# first frame cost.
+#
+#   EVENTS=10000 ITERATIONS=50 rake bench_decode
+#
+$LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
+require 'rb-fsevent'
+require 'json'
+require 'rbconfig'
+
+module BatchDecode
+  EVENTS     = Integer(ENV['EVENTS'] || 10_000)
+  ITERATIONS = Integer(ENV['ITERATIONS'] || 20)
+  FORMATS    = (ENV['FORMATS'] || 'niw,binary,frontcoded,interned').split(',')
+  SEED       = Integer(ENV['SEED'] || 1)
+
+  ROOT       = '/Users/ci/src/monorepo'
+  SERVICES   = %w[accounts billing catalog checkout gateway inventory notifications
+                  orders payments search shipping users]
+  LAYOUT     = %w[app/models app/controllers app/serializers app/jobs lib spec/models
+                  spec/controllers spec/jobs]
+  NAMES      = %w[account address adjustment audit cart charge coupon customer
+                  discount invoice item ledger line order payment plan price
+                  product refund report session shipment subscription tax token]
+
+  def self.now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  # An editor save or a branch switch: files across a few services, in no
+  # particular order, some of them touched more than once
+  def self.batch
+    random = Random.new(SEED)
+    paths  = Array.new((EVENTS * 0.7).ceil) do
+      service = SERVICES[random.rand(SERVICES.length)]
+      dir     = LAYOUT[random.rand(LAYOUT.length)]
+      name    = NAMES[random.rand(NAMES.length)]
+      name   += "_#{NAMES[random.rand(NAMES.length)]}" if random.rand(2) == 0
+      suffix  = dir.start_with?('spec') ? '_spec' : ''
+      "#{ROOT}/services/#{service}/#{dir}/#{name}#{suffix}.rb"
+    end
+    Array.new(EVENTS) do |i|
+      [paths[i < paths.length ? i : random.rand(paths.length)], 0x1000 | random.rand(0x400), 100_000 + i]
+    end
+  end
+
+  def self.niw(events)
+    events.map { |path, flags, id| "#{flags}:#{id}:#{path}\n" }.join + "\n"
+  end
+
+  def self.binary(events)
+    body = events.map { |path, flags, id| [flags, id & 0xffffffff, id >> 32, path.bytesize].pack('VVVV') + path }.join
+    [events.length, body.bytesize].pack('VV') + body
+  end
+
+  def self.frontcoded(events)
+    previous = ''
+    body = events.each_with_index.sort_by { |(path, _, _), i| [path, i] }.map { |(path, flags, id), _|
+      shared = 0
+      shared += 1 while shared < path.length && path[shared] == previous[shared]
+      previous = path
+      [flags, id & 0xffffffff, id >> 32, shared, path.length - shared].pack('VVVVV') + path[shared..-1]
+    }.join
+    [events.length, body.bytesize].pack('VV') + body
+  end
+
+  # the first frame of a connection sends every path, with its directory the
+  # first time that comes up; the second only refers to them
+  def self.interned(events)
+    table  = {}
+    frames = Array.new(2) do
+      body = events.map { |path, flags, id|
+        head = [flags, id & 0xffffffff, id >> 32].pack('VVV')
+        next head + [table[path]].pack('V') if table[path]
+
+        prefix = path[0, path.rindex('/', -2) + 1]
+        if table[prefix]
+          dir, rest = table[prefix], path[prefix.length..-1]
+        else
+          dir, rest = (table[prefix] = table.size) | 0x80000000, path
+        end
+        table[path] = table.size
+        head + [table[path] | 0x80000000, dir, rest.bytesize].pack('VVV') + rest
+      }.join
+      [events.length, body.bytesize].pack('VV') + body
+    end
+    frames
+  end
+
+  def self.readers
+    readers = [FSEvent::Reader]
+    readers << FSEvent::NativeReader if defined?(FSEvent::NativeReader)
+    readers
+  end
+
+  # the median seconds reader_class takes over a frame, after warm-up frames
+  # are through
+  def self.time(reader_class, format, frame, warmup = [])
+    reader, writer = IO.pipe
+    feeding = Thread.new do
+      warmup.each { |data| writer.write data }
+      ITERATIONS.times { writer.write frame }
+      writer.close
+    end
+    source = reader_class.new(reader, format)
+    warmup.length.times { source.next_batch }
+
+    samples = Array.new(ITERATIONS) do
+      started = now
+      paths = source.next_batch
+      elapsed = now - started
+      raise "#{reader_class} decoded #{paths.length} of #{EVENTS} #{format} events" unless paths.length == EVENTS
+      elapsed
+    end
+    feeding.join
+    reader.close
+    samples.sort[samples.length / 2]
+  end
+
+  def self.run
+    events = batch
+    raw    = events.inject(0) { |sum, (path, _, _)| sum + path.bytesize }
+
+    results = FORMATS.map do |format|
+      $stderr.puts "batch decode: #{format}"
+      result = { 'format' => format }
+      if format == 'interned'
+        first, frame = interned(events)
+        result['first_bytes_per_event'] = first.bytesize.to_f / EVENTS
+        warmup = [first]
+      else
+        frame  = send(format, events)
+        warmup = []
+      end
+      result['bytes']           = frame.bytesize
+      result['bytes_per_event'] = frame.bytesize.to_f / EVENTS
+      result['decode'] = Hash[readers.map { |reader_class|
+        seconds = time(reader_class, format, frame, warmup)
+        [reader_class.name, { 'ms' => seconds * 1000, 'us_per_event' => seconds * 1_000_000 / EVENTS }]
+      }]
+      result
+    end
+
+    {
+      'benchmark'            => 'batch_decode',
+      'time'                 => Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ'),
+      'ruby'                 => RUBY_DESCRIPTION,
+      'platform'             => RbConfig::CONFIG['host_os'],
+      'events'               => EVENTS,
+      'distinct_paths'       => events.map(&:first).uniq.length,
+      'path_bytes_per_event' => raw.to_f / EVENTS,
+      'iterations'           => ITERATIONS,
+      'results'              => results
+    }
+  end
+end
+
+if $0 == __FILE__
+  json = JSON.pretty_generate(BatchDecode.run)
+  if ENV['OUTPUT']
+    File.open(ENV['OUTPUT'], 'w') { |f| f.puts json }
+  else
+    puts json
+  end
+end
@@ -0,0 +1,194 @@
+# -*- encoding: utf-8 -*-
+#
+# Event storm benchmark: creates, modifies, renames and deletes FILES files
+# spread over DIRS directories at RATE operations per second (0 for as fast
+# as possible) under a temporary directory, once for every --format, and
+# writes what it measured as JSON to OUTPUT (stdout by default).
+#
+# Latency is the time from just before the syscall to the callback receiving
+# a path it touched. Several operations on one path that are reported
+# together all count as observed by that batch. Watcher CPU time comes from
+# the exited fsevent_watch, ruby CPU time from this process.
+#
+#   FILES=2000 DIRS=20 RATE=0 FORMATS=niw,binary TRANSPORT=shm rake benchmark
+#   WATCHER=ext/build/fsevent_watch ruby benchmark/event_storm.rb
+#
+$LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
+require 'rb-fsevent'
+require 'tmpdir'
+require 'json'
+require 'rbconfig'
+
+module EventStorm
+  FILES   = Integer(ENV['FILES'] || 1000)
+  DIRS    = Integer(ENV['DIRS'] || 10)
+  RATE    = Float(ENV['RATE'] || 0)
+  LATENCY = Float(ENV['LATENCY'] || 0.1)
+  SETTLE  = Float(ENV['SETTLE'] || 5)
+  FORMATS = (ENV['FORMATS'] || FSEvent::Reader::FORMATS.join(',')).split(',')
+  WATCHER = ENV['WATCHER'] || FSEvent.watcher_path
+  TRANSPORT = ENV['TRANSPORT'] || 'pipe'
+
+  def self.now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  # nearest-rank percentile of sorted samples
+  def self.percentile(sorted, p)
+    return nil if sorted.empty?
+    sorted[[(sorted.length * p / 100.0).ceil - 1, 0].max]
+  end
+
+  class Run
+    def initialize(format)
+      @format  = format
+      @pending = {}
+      @lock    = Mutex.new
+      @samples = []
+      @events  = 0
+      @batches = 0
+    end
+
+    def call
+      Dir.mktmpdir('rb-fsevent-storm') do |tmp|
+        root = File.realpath(tmp)
+        dirs = Array.new(DIRS) { |d| File.join(root, "dir#{d}") }
+        dirs.each { |dir| Dir.mkdir(dir) }
+        files = Array.new(FILES) { |f| File.join(dirs[f % DIRS], "file#{f}") }
+
+        fsevent = FSEvent.new
+        fsevent.watch(root, :latency => LATENCY, :file_events => true, :format => @format,
+                            :transport => TRANSPORT) do |paths|
+          observe(paths)
+        end
+
+        before  = Process.times
+        watcher = Thread.new { fsevent.run }
+        sleep 1 # let the watcher register before the storm starts
+
+        started = EventStorm.now
+        storm(files)
+        settle
+        finished = EventStorm.now
+
+        fsevent.stop
+        watcher.join
+        after = Process.times
+
+        report(started, finished, before, after)
+      end
+    end
+
+    private
+
+    # create, modify, rename and delete every file, a phase at a time
+    def storm(files)
+      @ops = 0
+      @storm_started = EventStorm.now
+      files.each { |path| operation(path) { File.open(path, 'w') {} } }
+      files.each { |path| operation(path) { File.open(path, 'a') { |f| f.write('x') } } }
+      files.each { |path| operation("#{path}.renamed") { File.rename(path, "#{path}.renamed") } }
+      files.each { |path| operation("#{path}.renamed") { File.delete("#{path}.renamed") } }
+    end
+
+    # expect an event for path from the syscall in the block
+    def operation(path)
+      if RATE > 0
+        delay = @storm_started + @ops / RATE - EventStorm.now
+        sleep delay if delay > 0
+      end
+      @lock.synchronize { (@pending[path] ||= []) << EventStorm.now }
+      yield
+      @ops += 1
+    end
+
+    def observe(paths)
+      at = EventStorm.now
+      @lock.synchronize do
+        @batches += 1
+        @events  += paths.length
+        paths.each do |path|
+          times = @pending.delete(path)
+          times.each { |t| @samples << at - t } if times
+        end
+      end
+    end
+
+    # wait for stragglers until everything is seen or nothing arrives for a while
+    def settle
+      quiet_since = EventStorm.now
+      seen = -1
+      loop do
+        events, pending = @lock.synchronize { [@events, @pending.length] }
+        break if pending == 0
+        quiet_since = EventStorm.now if events != seen
+        seen = events
+        break if EventStorm.now - quiet_since > SETTLE
+        sleep LATENCY
+      end
+    end
+
+    def report(started, finished, before, after)
+      samples  = @samples.sort
+      duration = finished - started
+      {
+        'format'            => @format,
+        'operations'        => @ops,
+        'observed'          => samples.length,
+        'missed'            => @pending.values.inject(0) { |sum, times| sum + times.length },
+        'events'            => @events,
+        'batches'           => @batches,
+        'duration'          => duration,
+        'events_per_second' => duration > 0 ? @events / duration : nil,
+        'latency'           => {
+          'p50'  => EventStorm.percentile(samples, 50),
+          'p99'  => EventStorm.percentile(samples, 99),
+          'max'  => samples.last,
+          'mean' => samples.empty? ? nil : samples.inject(:+) / samples.length
+        },
+        'watcher_cpu'       => {
+          'user'   => after.cutime - before.cutime,
+          'system' => after.cstime - before.cstime
+        },
+        'ruby_cpu'          => {
+          'user'   => after.utime - before.utime,
+          'system' => after.stime - before.stime
+        }
+      }
+    end
+  end
+
+  def self.run
+    watcher = WATCHER
+    FSEvent.singleton_class.send(:define_method, :watcher_path) { watcher }
+
+    results = FORMATS.map do |format|
+      $stderr.puts "event storm: #{format}"
+      Run.new(format).call
+    end
+
+    {
+      'benchmark'   => 'event_storm',
+      'time'        => Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ'),
+      'ruby'        => RUBY_DESCRIPTION,
+      'platform'    => RbConfig::CONFIG['host_os'],
+      'reader'      => FSEvent.reader_class.name,
+      'watcher'     => watcher,
+      'files'       => FILES,
+      'directories' => DIRS,
+      'rate'        => RATE,
+      'latency'     => LATENCY,
+      'transport'   => TRANSPORT,
+      'results'     => results
+    }
+  end
+end
+
+if $0 == __FILE__
+  json = JSON.pretty_generate(EventStorm.run)
+  if ENV['OUTPUT']
+    File.open(ENV['OUTPUT'], 'w') { |f| f.puts json }
+  else
+    puts json
+  end
+end
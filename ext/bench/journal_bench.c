@@ -0,0 +1,141 @@
+//
+//  journal_bench.c
+//  fsevent_watch
+//
+//  Microbenchmark of the --journal event history. A million synthetic events
+//  are appended in batches of 1,000, the way fsevent_watch's callback
+//  journals them, and the journal is closed and reopened before being
+//  replayed: all of it, from an id in the middle, and from the newest id,
+//  which only costs the --since-when lookup. Replay hands each chunk to a
+//  callback that just touches every path, so the times are the journal's
+//  alone, not the encoding and writing fsevent_watch does after it.
+//
+//  Run by `rake bench_journal`, with the journal in a temporary directory
+//  (TMPDIR, or /tmp) that is removed afterwards.
+//
+
+#include "common.h"
+#include "journal.h"
+
+#include <sys/time.h>
+#include <time.h>
+
+#define JOURNAL_BENCH_EVENTS  1000000
+#define JOURNAL_BENCH_BATCH   1000
+#define JOURNAL_BENCH_MAX     ((size_t)1024 * 1024 * 1024)
+
+static double journal_bench_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec * 1e3 + (double)tv.tv_usec / 1e3;
+#endif
+}
+
+struct journal_bench_replay {
+  size_t    numEvents;
+  size_t    bytes;
+};
+
+static void journal_bench_count(void* info,
+                                size_t numEvents,
+                                char** paths,
+                                __attribute__((unused)) FSEventStreamEventFlags flags[],
+                                __attribute__((unused)) FSEventStreamEventId ids[])
+{
+  struct journal_bench_replay* replay = info;
+
+  replay->numEvents += numEvents;
+  for (size_t i = 0; i < numEvents; i++) {
+    replay->bytes += (size_t)(unsigned char)paths[i][0];
+  }
+}
+
+static void journal_bench_replay(struct journal* journal, const char* name,
+                                 FSEventStreamEventId sinceWhen)
+{
+  struct journal_bench_replay replay = {0, 0};
+  double start = journal_bench_now();
+
+  journal_replay(journal, sinceWhen, journal_bench_count, &replay);
+
+  double elapsed = journal_bench_now() - start;
+  fprintf(stdout, "%-24s %10zu events %10.3f ms %8.1f ns/event\n",
+          name, replay.numEvents, elapsed,
+          replay.numEvents ? elapsed * 1e6 / (double)replay.numEvents : 0.0);
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) const char* argv[])
+{
+  const char* tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  char dir[PATH_MAX / 2];
+  char path[PATH_MAX];
+  char index[PATH_MAX];
+
+  snprintf(dir, sizeof(dir), "%s/journal_bench.XXXXXX", tmpdir);
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  snprintf(path, sizeof(path), "%s/journal", dir);
+  snprintf(index, sizeof(index), "%s/journal.idx", dir);
+
+  struct journal* journal = journal_open(path, JOURNAL_BENCH_MAX);
+  if (!journal) {
+    perror("journal_open");
+    return EXIT_FAILURE;
+  }
+
+  // paths of a typical project tree, with flags like the event sources'
+  char* paths[JOURNAL_BENCH_BATCH];
+  FSEventStreamEventFlags flags[JOURNAL_BENCH_BATCH];
+  for (size_t i = 0; i < JOURNAL_BENCH_BATCH; i++) {
+    char buffer[PATH_MAX];
+    snprintf(buffer, sizeof(buffer), "/home/developer/src/project/app/models/dir%03zu/file%05zu.rb",
+             i % 97, i);
+    paths[i] = strdup(buffer);
+    flags[i] = (FSEventStreamEventFlags)(0x00010000 | (0x100 << (i % 4)));
+  }
+
+  double start = journal_bench_now();
+  for (size_t n = 0; n < JOURNAL_BENCH_EVENTS; n += JOURNAL_BENCH_BATCH) {
+    if (!journal_append(journal, JOURNAL_BENCH_BATCH, paths, flags)) {
+      perror("journal_append");
+      return EXIT_FAILURE;
+    }
+  }
+  double elapsed = journal_bench_now() - start;
+  fprintf(stdout, "%-24s %10d events %10.3f ms %8.1f ns/event\n",
+          "append", JOURNAL_BENCH_EVENTS, elapsed, elapsed * 1e6 / JOURNAL_BENCH_EVENTS);
+
+  journal_close(journal);
+
+  start = journal_bench_now();
+  journal = journal_open(path, JOURNAL_BENCH_MAX);
+  if (!journal) {
+    perror("journal_open");
+    return EXIT_FAILURE;
+  }
+  elapsed = journal_bench_now() - start;
+  fprintf(stdout, "%-24s %10s        %10.3f ms\n", "reopen", "", elapsed);
+
+  FSEventStreamEventId lastId = journal_last_id(journal);
+  journal_bench_replay(journal, "replay all", 0);
+  journal_bench_replay(journal, "replay second half", lastId / 2);
+  journal_bench_replay(journal, "replay nothing (lookup)", lastId);
+
+  journal_close(journal);
+  for (size_t i = 0; i < JOURNAL_BENCH_BATCH; i++) {
+    free(paths[i]);
+  }
+  unlink(path);
+  unlink(index);
+  rmdir(dir);
+
+  return EXIT_SUCCESS;
+}
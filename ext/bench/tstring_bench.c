@@ -0,0 +1,266 @@
+//
+//  tstring_bench.c
+//  fsevent_watch
+//
+//  Microbenchmark of TNetstring/OTNetstring batch encoding. Batches of 1, 100
+//  and 10,000 synthetic events, each a path, flags and an id, go through
+//  output_encoder_encode, which is what fsevent_watch's callback runs. On
+//  darwin the CoreFoundation encoder in TSICTString is measured as well,
+//  building the CF objects for every batch the way fsevent_watch used to.
+//
+//  Reports ns, heap allocations and bytes copied per event in steady state:
+//  every configuration runs once before it is timed, so buffers have already
+//  grown to size. Built with TSITSTRING_STATS by `rake bench_tstring`.
+//
+
+#include "common.h"
+#include "output_encoder.h"
+#ifdef __APPLE__
+#include "TSICTString.h"
+#endif
+
+#include <sys/time.h>
+#include <time.h>
+
+// events encoded per configuration, spread over as many batches as it takes
+#define TSTRING_BENCH_EVENTS  2000000
+
+struct tstring_bench_batch {
+  size_t                    numEvents;
+  char**                    paths;
+  FSEventStreamEventFlags*  flags;
+  FSEventStreamEventId*     ids;
+};
+
+struct tstring_bench_result {
+  double                    nsPerEvent;
+  double                    allocationsPerEvent;
+  double                    bytesCopiedPerEvent;
+  double                    bytesPerEvent;
+};
+
+static double tstring_bench_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec * 1e9 + (double)tv.tv_usec * 1e3;
+#endif
+}
+
+// paths of a typical project tree, with flags and ids like FSEvents' own
+static void tstring_bench_batch_init(struct tstring_bench_batch* batch, size_t numEvents)
+{
+  batch->numEvents = numEvents;
+  batch->paths = malloc(numEvents * sizeof(char*));
+  batch->flags = malloc(numEvents * sizeof(FSEventStreamEventFlags));
+  batch->ids = malloc(numEvents * sizeof(FSEventStreamEventId));
+
+  for (size_t i = 0; i < numEvents; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/Users/developer/src/project/app/models/dir%03zu/file%05zu.rb",
+             i % 97, i);
+    batch->paths[i] = strdup(path);
+    batch->flags[i] = (FSEventStreamEventFlags)(0x00010000 | (0x100 << (i % 4)));
+    batch->ids[i] = (FSEventStreamEventId)(1234567890ULL + i);
+  }
+}
+
+static void tstring_bench_batch_free(struct tstring_bench_batch* batch)
+{
+  for (size_t i = 0; i < batch->numEvents; i++) {
+    free(batch->paths[i]);
+  }
+  free(batch->paths);
+  free(batch->flags);
+  free(batch->ids);
+}
+
+static size_t tstring_bench_iterations(size_t numEvents)
+{
+  size_t iterations = TSTRING_BENCH_EVENTS / numEvents;
+  return iterations ? iterations : 1;
+}
+
+static void tstring_bench_output_encoder(const struct tstring_bench_batch* batch,
+                                         enum FSEventWatchOutputFormat format,
+                                         struct tstring_bench_result* result)
+{
+  struct output_encoder encoder;
+  size_t iterations = tstring_bench_iterations(batch->numEvents);
+  size_t length = 0;
+
+  output_encoder_init(&encoder);
+  output_encoder_encode(&encoder, format, batch->numEvents, batch->paths,
+                        batch->flags, batch->ids, NULL, &length);
+
+  unsigned long long allocations = TSITStringAllocations;
+  unsigned long long copied = TSITStringBytesCopied;
+  double start = tstring_bench_now();
+
+  for (size_t i = 0; i < iterations; i++) {
+    output_encoder_encode(&encoder, format, batch->numEvents, batch->paths,
+                          batch->flags, batch->ids, NULL, &length);
+  }
+
+  double elapsed = tstring_bench_now() - start;
+  double events = (double)iterations * (double)batch->numEvents;
+
+  result->nsPerEvent = elapsed / events;
+  result->allocationsPerEvent = (double)(TSITStringAllocations - allocations) / events;
+  result->bytesCopiedPerEvent = (double)(TSITStringBytesCopied - copied) / events;
+  result->bytesPerEvent = (double)length / (double)batch->numEvents;
+
+  output_encoder_free(&encoder);
+}
+
+#ifdef __APPLE__
+// every CoreFoundation allocation made with the default allocator
+static unsigned long long tstring_bench_cf_allocations = 0;
+
+static void* tstring_bench_cf_allocate(CFIndex size, __attribute__((unused)) CFOptionFlags hint,
+                                       __attribute__((unused)) void* info)
+{
+  tstring_bench_cf_allocations++;
+  return malloc((size_t)size);
+}
+
+static void* tstring_bench_cf_reallocate(void* ptr, CFIndex size,
+                                         __attribute__((unused)) CFOptionFlags hint,
+                                         __attribute__((unused)) void* info)
+{
+  tstring_bench_cf_allocations++;
+  return realloc(ptr, (size_t)size);
+}
+
+static void tstring_bench_cf_deallocate(void* ptr, __attribute__((unused)) void* info)
+{
+  free(ptr);
+}
+
+static CFDataRef tstring_bench_cf_encode(const struct tstring_bench_batch* batch,
+                                         TSITStringFormat format)
+{
+  CFMutableArrayRef events = CFArrayCreateMutable(kCFAllocatorDefault,
+                                                  (CFIndex)batch->numEvents,
+                                                  &kCFTypeArrayCallBacks);
+
+  for (size_t i = 0; i < batch->numEvents; i++) {
+    CFMutableDictionaryRef event = CFDictionaryCreateMutable(kCFAllocatorDefault, 3,
+                                                             &kCFTypeDictionaryKeyCallBacks,
+                                                             &kCFTypeDictionaryValueCallBacks);
+    CFStringRef path = CFStringCreateWithFileSystemRepresentation(kCFAllocatorDefault,
+                                                                  batch->paths[i]);
+    CFNumberRef flags = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &batch->flags[i]);
+    CFNumberRef id = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &batch->ids[i]);
+
+    CFDictionarySetValue(event, CFSTR("path"), path);
+    CFDictionarySetValue(event, CFSTR("flags"), flags);
+    CFDictionarySetValue(event, CFSTR("id"), id);
+    CFArrayAppendValue(events, event);
+
+    CFRelease(path);
+    CFRelease(flags);
+    CFRelease(id);
+    CFRelease(event);
+  }
+
+  CFIndex numEvents = (CFIndex)batch->numEvents;
+  CFNumberRef count = CFNumberCreate(kCFAllocatorDefault, kCFNumberCFIndexType, &numEvents);
+  CFMutableDictionaryRef meta = CFDictionaryCreateMutable(kCFAllocatorDefault, 2,
+                                                          &kCFTypeDictionaryKeyCallBacks,
+                                                          &kCFTypeDictionaryValueCallBacks);
+  CFDictionarySetValue(meta, CFSTR("events"), events);
+  CFDictionarySetValue(meta, CFSTR("numEvents"), count);
+  CFRelease(events);
+  CFRelease(count);
+
+  CFDataRef data = TSICTStringCreateRenderedDataFromObjectWithFormat(meta, format);
+  CFRelease(meta);
+  return data;
+}
+
+static void tstring_bench_tsictstring(const struct tstring_bench_batch* batch,
+                                      TSITStringFormat format,
+                                      struct tstring_bench_result* result)
+{
+  size_t iterations = tstring_bench_iterations(batch->numEvents);
+  size_t length = 0;
+
+  CFRelease(tstring_bench_cf_encode(batch, format));
+
+  unsigned long long allocations = TSITStringAllocations + tstring_bench_cf_allocations;
+  unsigned long long copied = TSITStringBytesCopied;
+  double start = tstring_bench_now();
+
+  for (size_t i = 0; i < iterations; i++) {
+    CFDataRef data = tstring_bench_cf_encode(batch, format);
+    length = (size_t)CFDataGetLength(data);
+    CFRelease(data);
+  }
+
+  double elapsed = tstring_bench_now() - start;
+  double events = (double)iterations * (double)batch->numEvents;
+
+  result->nsPerEvent = elapsed / events;
+  result->allocationsPerEvent = (double)(TSITStringAllocations + tstring_bench_cf_allocations
+                                         - allocations) / events;
+  result->bytesCopiedPerEvent = (double)(TSITStringBytesCopied - copied) / events;
+  result->bytesPerEvent = (double)length / (double)batch->numEvents;
+}
+#endif
+
+static void tstring_bench_report(const char* encoder, const char* format, size_t numEvents,
+                                 const struct tstring_bench_result* result)
+{
+  fprintf(stdout, "%-16s %-12s %8zu %12.1f %12.3f %12.1f %10.1f\n",
+          encoder, format, numEvents, result->nsPerEvent, result->allocationsPerEvent,
+          result->bytesCopiedPerEvent, result->bytesPerEvent);
+  fflush(stdout);
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) const char* argv[])
+{
+  static const size_t batchSizes[] = {1, 100, 10000};
+  static const size_t numBatchSizes = sizeof(batchSizes) / sizeof(batchSizes[0]);
+
+#ifdef __APPLE__
+  CFAllocatorContext context = {0, NULL, NULL, NULL, NULL,
+                                tstring_bench_cf_allocate,
+                                tstring_bench_cf_reallocate,
+                                tstring_bench_cf_deallocate,
+                                NULL};
+  CFAllocatorRef allocator = CFAllocatorCreate(kCFAllocatorUseContext, &context);
+  CFAllocatorSetDefault(allocator);
+#endif
+
+  fprintf(stdout, "%-16s %-12s %8s %12s %12s %12s %10s\n",
+          "encoder", "format", "events", "ns/event", "allocs/event", "copied/event", "out/event");
+
+  for (size_t b = 0; b < numBatchSizes; b++) {
+    struct tstring_bench_batch batch;
+    struct tstring_bench_result result;
+
+    tstring_bench_batch_init(&batch, batchSizes[b]);
+
+    tstring_bench_output_encoder(&batch, kFSEventWatchOutputFormatTNetstring, &result);
+    tstring_bench_report("output_encoder", "tnetstring", batch.numEvents, &result);
+    tstring_bench_output_encoder(&batch, kFSEventWatchOutputFormatOTNetstring, &result);
+    tstring_bench_report("output_encoder", "otnetstring", batch.numEvents, &result);
+
+#ifdef __APPLE__
+    tstring_bench_tsictstring(&batch, kTSITStringFormatTNetstring, &result);
+    tstring_bench_report("TSICTString", "tnetstring", batch.numEvents, &result);
+    tstring_bench_tsictstring(&batch, kTSITStringFormatOTNetstring, &result);
+    tstring_bench_report("TSICTString", "otnetstring", batch.numEvents, &result);
+#endif
+
+    tstring_bench_batch_free(&batch);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,16 @@
+# -*- encoding: utf-8 -*-
+require 'mkmf'
+
+# the reader is an optional speedup: rubies without a C API get a Makefile
+# that builds nothing, and FSEvent falls back to parsing in ruby.
+if defined?(RUBY_ENGINE) && RUBY_ENGINE != 'ruby'
+  File.open('Makefile', 'w') do |makefile|
+    makefile.puts "all install clean distclean:\n\t@true"
+  end
+else
+  $CFLAGS << ' -std=c99 -Wall'
+  have_func('rb_enc_interned_str', 'ruby/encoding.h')
+  have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+  have_func('memfd_create', 'sys/mman.h')
+  create_makefile('rb-fsevent/fsevent_native')
+end
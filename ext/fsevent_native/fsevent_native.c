@@ -0,0 +1,917 @@
+//
+//  fsevent_native.c
+//  rb-fsevent
+//
+//  FSEvent::NativeReader, a drop-in replacement for FSEvent::Reader. The
+//  watcher pipe is read in large chunks with the GVL released, and complete
+//  frames in any of fsevent_watch's output formats are parsed straight out of
+//  the buffer. Paths are returned as frozen, interned strings, so the same
+//  path reported over and over is the same object every time.
+//
+//  With fsevent_watch --transport=shm the pipe only carries a doorbell byte
+//  per batch, and frames are parsed in place in the shared ring buffer.
+//
+
+#include <ruby.h>
+#include <ruby/encoding.h>
+#include <ruby/io.h>
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FSEVENT_READER_CHUNK (64 * 1024)
+
+// The ring buffer of fsevent_watch --transport=shm, laid out as described in
+// ext/fsevent_watch/shm_ring.h
+#define FSEVENT_RING_MAGIC        "FSWRING1"
+#define FSEVENT_RING_HEADER_SIZE  192
+#define FSEVENT_RING_WRAP         0xffffffffU
+
+struct fsevent_ring_header {
+  char magic[8];
+  uint64_t capacity;
+  char reserved0[48];
+  uint64_t head;
+  char reserved1[56];
+  uint64_t tail;
+  char reserved2[56];
+};
+
+enum fsevent_reader_format {
+  kFSEventReaderFormatClassic,
+  kFSEventReaderFormatNIW,
+  kFSEventReaderFormatNIWRoot,
+  kFSEventReaderFormatTNetstring,
+  kFSEventReaderFormatOTNetstring,
+  kFSEventReaderFormatBinary,
+  kFSEventReaderFormatInterned,
+  kFSEventReaderFormatFrontCoded
+};
+
+#define FSEVENT_INTERNED_RESET  0x80000000U
+#define FSEVENT_INTERNED_NEW    0x80000000U
+#define FSEVENT_INTERNED_NONE   0xffffffffU
+
+struct fsevent_reader {
+  VALUE io;
+  enum fsevent_reader_format format;
+  int eof;
+
+  // roots of the last batch, or nil for formats without them
+  VALUE roots;
+
+  // every path an interned watcher has sent so far, by id
+  VALUE table;
+
+  // the shared memory file mapped for --transport=shm, or NULL
+  VALUE shm;
+  char* ring;
+  size_t ring_size;
+
+  // unparsed input is bytes[start, length)
+  char* bytes;
+  size_t start;
+  size_t length;
+  size_t capacity;
+};
+
+struct fsevent_reader_read {
+  int fd;
+  char* bytes;
+  size_t length;
+  ssize_t result;
+  int error;
+};
+
+static ID id_fileno;
+#ifndef HAVE_RB_ENC_INTERNED_STR
+static ID id_uminus;
+#endif
+
+
+static void fsevent_reader_mark(void* ptr)
+{
+  struct fsevent_reader* reader = ptr;
+  rb_gc_mark(reader->io);
+  rb_gc_mark(reader->roots);
+  rb_gc_mark(reader->table);
+  rb_gc_mark(reader->shm);
+}
+
+static void fsevent_reader_free(void* ptr)
+{
+  struct fsevent_reader* reader = ptr;
+  if (reader->ring) {
+    munmap(reader->ring, reader->ring_size);
+  }
+  xfree(reader->bytes);
+  xfree(reader);
+}
+
+static size_t fsevent_reader_memsize(const void* ptr)
+{
+  const struct fsevent_reader* reader = ptr;
+  return sizeof(*reader) + reader->capacity;
+}
+
+static const rb_data_type_t fsevent_reader_type = {
+  "FSEvent::NativeReader",
+  { fsevent_reader_mark, fsevent_reader_free, fsevent_reader_memsize, },
+  NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE fsevent_reader_alloc(VALUE klass)
+{
+  struct fsevent_reader* reader;
+  VALUE self = TypedData_Make_Struct(klass, struct fsevent_reader,
+                                     &fsevent_reader_type, reader);
+  reader->io = Qnil;
+  reader->roots = Qnil;
+  reader->table = Qnil;
+  reader->shm = Qnil;
+  return self;
+}
+
+static struct fsevent_reader* fsevent_reader_get(VALUE self)
+{
+  struct fsevent_reader* reader;
+  TypedData_Get_Struct(self, struct fsevent_reader, &fsevent_reader_type, reader);
+  if (NIL_P(reader->io)) {
+    rb_raise(rb_eRuntimeError, "uninitialized FSEvent::NativeReader");
+  }
+  return reader;
+}
+
+static inline VALUE fsevent_reader_path(const char* bytes, size_t length)
+{
+#ifdef HAVE_RB_ENC_INTERNED_STR
+  return rb_enc_interned_str(bytes, (long)length, rb_filesystem_encoding());
+#else
+  VALUE path = rb_enc_str_new(bytes, (long)length, rb_filesystem_encoding());
+  return rb_funcall(path, id_uminus, 0);
+#endif
+}
+
+static void fsevent_reader_malformed(struct fsevent_reader* reader)
+{
+  static const char* const names[] = {"classic", "niw", "niwroot", "tnetstring", "otnetstring",
+                                       "binary", "interned", "frontcoded"};
+  rb_raise(rb_eRuntimeError, "malformed %s output from fsevent_watch",
+           names[reader->format]);
+}
+
+
+// reading
+
+static void* fsevent_reader_blocking_read(void* ptr)
+{
+  struct fsevent_reader_read* args = ptr;
+  args->result = read(args->fd, args->bytes, args->length);
+  args->error = (args->result < 0) ? errno : 0;
+  return NULL;
+}
+
+// Append at least one more chunk of input to the buffer, or set eof
+static void fsevent_reader_fill(struct fsevent_reader* reader)
+{
+  // raises IOError once FSEvent#stop has closed the pipe
+  int fd = NUM2INT(rb_funcall(reader->io, id_fileno, 0));
+
+  if (reader->start > 0) {
+    memmove(reader->bytes, reader->bytes + reader->start, reader->length - reader->start);
+    reader->length -= reader->start;
+    reader->start = 0;
+  }
+
+  // a frame larger than the buffer keeps doubling it
+  if (reader->capacity - reader->length < FSEVENT_READER_CHUNK / 2) {
+    size_t capacity = reader->capacity ? reader->capacity * 2 : FSEVENT_READER_CHUNK;
+    REALLOC_N(reader->bytes, char, capacity);
+    reader->capacity = capacity;
+  }
+
+  struct fsevent_reader_read args;
+  args.fd = fd;
+  args.bytes = reader->bytes + reader->length;
+  args.length = reader->capacity - reader->length;
+
+  for (;;) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(fsevent_reader_blocking_read, &args, RUBY_UBF_IO, NULL);
+#else
+    rb_thread_wait_fd(fd);
+    fsevent_reader_blocking_read(&args);
+#endif
+
+    if (args.result >= 0) {
+      break;
+    } else if (args.error == EINTR) {
+      rb_thread_check_ints();
+    } else if (args.error == EAGAIN || args.error == EWOULDBLOCK) {
+      // popen pipes are non-blocking on newer rubies
+      rb_thread_wait_fd(fd);
+    } else {
+      rb_syserr_fail(args.error, "fsevent_watch pipe");
+    }
+  }
+
+  if (args.result == 0) {
+    reader->eof = 1;
+  } else {
+    reader->length += (size_t)args.result;
+  }
+}
+
+
+// frames
+
+// Each parser returns the paths of the first complete frame in [p, end) and
+// points next past it, or returns Qundef if more input is needed.
+
+static VALUE fsevent_reader_parse_classic(struct fsevent_reader* reader,
+                                          const char* p, const char* end,
+                                          const char** next)
+{
+  const char* newline = memchr(p, '\n', (size_t)(end - p));
+
+  if (!newline) {
+    return Qundef;
+  }
+
+  VALUE paths = rb_ary_new();
+  const char* segment = p;
+  reader->roots = Qnil;
+
+  for (const char* c = p; c <= newline; c++) {
+    if (c == newline || *c == ':') {
+      rb_ary_push(paths, fsevent_reader_path(segment, (size_t)(c - segment)));
+      segment = c + 1;
+    }
+  }
+
+  // "a:b:\n" ends in an empty segment, which String#split never reported
+  while (RARRAY_LEN(paths) > 0 && RSTRING_LEN(rb_ary_entry(paths, -1)) == 0) {
+    rb_ary_pop(paths);
+  }
+
+  *next = newline + 1;
+  return paths;
+}
+
+static VALUE fsevent_reader_parse_niw(struct fsevent_reader* reader,
+                                      const char* p, const char* end,
+                                      const char** next, bool rooted)
+{
+  const char* terminator = NULL;
+
+  // a batch is "flags:id:path\n" lines, or "flags:id:rootLength:path\n" lines
+  // for niwroot, followed by an empty line
+  for (const char* line = p; line < end; ) {
+    const char* newline = memchr(line, '\n', (size_t)(end - line));
+    if (!newline) {
+      break;
+    }
+    if (newline == line) {
+      terminator = newline;
+      break;
+    }
+    line = newline + 1;
+  }
+
+  if (!terminator) {
+    return Qundef;
+  }
+
+  VALUE paths = rb_ary_new();
+  VALUE roots = rooted ? rb_ary_new() : Qnil;
+
+  for (const char* line = p; line < terminator; ) {
+    const char* newline = memchr(line, '\n', (size_t)(terminator - line));
+    const char* flags_end = memchr(line, ':', (size_t)(newline - line));
+    const char* id_end = flags_end ? memchr(flags_end + 1, ':', (size_t)(newline - flags_end - 1)) : NULL;
+    const char* path;
+    size_t root_length = 0;
+
+    if (!id_end) {
+      fsevent_reader_malformed(reader);
+    }
+    path = id_end + 1;
+    if (rooted) {
+      for (; path < newline && *path >= '0' && *path <= '9'; path++) {
+        root_length = root_length * 10 + (size_t)(*path - '0');
+      }
+      if (path == id_end + 1 || path == newline || *path != ':' ||
+          root_length > (size_t)(newline - path - 1)) {
+        fsevent_reader_malformed(reader);
+      }
+      path++;
+    }
+
+    // paths may contain ':', so everything after the last field belongs to them
+    rb_ary_push(paths, fsevent_reader_path(path, (size_t)(newline - path)));
+    if (rooted) {
+      rb_ary_push(roots, root_length ? fsevent_reader_path(path, root_length) : Qnil);
+    }
+    line = newline + 1;
+  }
+
+  reader->roots = roots;
+
+  *next = terminator + 1;
+  return paths;
+}
+
+struct fsevent_reader_value {
+  const char* payload;
+  size_t length;
+  char type;
+  const char* next;
+};
+
+// Decode the value starting at p: 1 on success, 0 if it runs past end
+static int fsevent_reader_value(struct fsevent_reader* reader, const char* p,
+                                const char* end, struct fsevent_reader_value* value)
+{
+  int ot = (reader->format == kFSEventReaderFormatOTNetstring);
+  size_t length = 0;
+  const char* c = p;
+
+  while (c < end && *c >= '0' && *c <= '9') {
+    if (c - p >= 19) {
+      fsevent_reader_malformed(reader);
+    }
+    length = length * 10 + (size_t)(*c++ - '0');
+  }
+  if (c == end) {
+    return 0;
+  }
+  if (c == p || (!ot && *c != ':')) {
+    fsevent_reader_malformed(reader);
+  }
+
+  // otnetstring leads with the type tag, tnetstring trails with it
+  if (ot) {
+    value->type = *c++;
+    if ((size_t)(end - c) < length) {
+      return 0;
+    }
+    value->payload = c;
+    value->next = c + length;
+  } else {
+    c++;
+    if ((size_t)(end - c) < length + 1) {
+      return 0;
+    }
+    value->payload = c;
+    value->type = c[length];
+    value->next = c + length + 1;
+  }
+
+  value->length = length;
+  return 1;
+}
+
+static int fsevent_reader_is_dict(struct fsevent_reader* reader, const struct fsevent_reader_value* value)
+{
+  return value->type == ((reader->format == kFSEventReaderFormatOTNetstring) ? '{' : '}');
+}
+
+static int fsevent_reader_is_list(struct fsevent_reader* reader, const struct fsevent_reader_value* value)
+{
+  return value->type == ((reader->format == kFSEventReaderFormatOTNetstring) ? '[' : ']');
+}
+
+static int fsevent_reader_is_key(const struct fsevent_reader_value* value, const char* key)
+{
+  size_t length = strlen(key);
+  return value->type == ',' && value->length == length && memcmp(value->payload, key, length) == 0;
+}
+
+// Visit the key/value pairs of a dict, returning the value for key if present
+static int fsevent_reader_lookup(struct fsevent_reader* reader,
+                                 const struct fsevent_reader_value* dict,
+                                 const char* key, struct fsevent_reader_value* found)
+{
+  const char* p = dict->payload;
+  const char* end = dict->payload + dict->length;
+  struct fsevent_reader_value k, v;
+
+  while (p < end) {
+    if (!fsevent_reader_value(reader, p, end, &k) ||
+        !fsevent_reader_value(reader, k.next, end, &v)) {
+      fsevent_reader_malformed(reader);
+    }
+    if (fsevent_reader_is_key(&k, key)) {
+      *found = v;
+      return 1;
+    }
+    p = v.next;
+  }
+
+  return 0;
+}
+
+static VALUE fsevent_reader_parse_tnetstring(struct fsevent_reader* reader,
+                                             const char* p, const char* end,
+                                             const char** next)
+{
+  struct fsevent_reader_value frame, events, event, path, root;
+
+  if (!fsevent_reader_value(reader, p, end, &frame)) {
+    return Qundef;
+  }
+  if (!fsevent_reader_is_dict(reader, &frame)) {
+    fsevent_reader_malformed(reader);
+  }
+
+  VALUE paths = rb_ary_new();
+  VALUE roots = rb_ary_new();
+
+  if (fsevent_reader_lookup(reader, &frame, "events", &events)) {
+    if (!fsevent_reader_is_list(reader, &events)) {
+      fsevent_reader_malformed(reader);
+    }
+
+    const char* e = events.payload;
+    const char* events_end = events.payload + events.length;
+
+    while (e < events_end) {
+      if (!fsevent_reader_value(reader, e, events_end, &event) ||
+          !fsevent_reader_is_dict(reader, &event)) {
+        fsevent_reader_malformed(reader);
+      }
+      if (fsevent_reader_lookup(reader, &event, "path", &path) && path.type == ',') {
+        rb_ary_push(paths, fsevent_reader_path(path.payload, path.length));
+        if (fsevent_reader_lookup(reader, &event, "root", &root) &&
+            root.type == ',' && root.length > 0) {
+          rb_ary_push(roots, fsevent_reader_path(root.payload, root.length));
+        } else {
+          rb_ary_push(roots, Qnil);
+        }
+      }
+      e = event.next;
+    }
+  }
+
+  reader->roots = roots;
+
+  // the watcher ends each frame with a newline
+  *next = frame.next;
+  if (*next < end && **next == '\n') {
+    (*next)++;
+  }
+
+  return paths;
+}
+
+static inline uint32_t fsevent_reader_u32(const char* bytes)
+{
+  const unsigned char* b = (const unsigned char*)bytes;
+  return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static VALUE fsevent_reader_parse_binary(struct fsevent_reader* reader,
+                                         const char* p, const char* end,
+                                         const char** next)
+{
+
+  // u32 count and u32 body size, then u32 flags, u64 id, u32 length and the
+  // path for every event
+  if (end - p < 8) {
+    return Qundef;
+  }
+
+  uint32_t count = fsevent_reader_u32(p);
+  uint32_t size = fsevent_reader_u32(p + 4);
+  const char* body = p + 8;
+
+  if ((size_t)(end - body) < size) {
+    return Qundef;
+  }
+
+  const char* body_end = body + size;
+  VALUE paths = rb_ary_new_capa((long)count);
+  reader->roots = Qnil;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (body_end - body < 16) {
+      fsevent_reader_malformed(reader);
+    }
+    uint32_t length = fsevent_reader_u32(body + 12);
+    body += 16;
+    if ((size_t)(body_end - body) < length) {
+      fsevent_reader_malformed(reader);
+    }
+    rb_ary_push(paths, fsevent_reader_path(body, length));
+    body += length;
+  }
+
+  *next = body_end;
+  return paths;
+}
+
+// The binary frame layout, but a path is sent in full only the first time,
+// after which it's only an id into reader->table; see output_encoder.c in
+// fsevent_watch for the details
+static VALUE fsevent_reader_parse_interned(struct fsevent_reader* reader,
+                                           const char* p, const char* end,
+                                           const char** next)
+{
+  if (end - p < 8) {
+    return Qundef;
+  }
+
+  uint32_t count = fsevent_reader_u32(p);
+  uint32_t size = fsevent_reader_u32(p + 4);
+  const char* body = p + 8;
+
+  if ((size_t)(end - body) < size) {
+    return Qundef;
+  }
+
+  if (NIL_P(reader->table) || (count & FSEVENT_INTERNED_RESET)) {
+    reader->table = rb_ary_new();
+  }
+  count &= ~FSEVENT_INTERNED_RESET;
+
+  const char* body_end = body + size;
+  VALUE table = reader->table;
+  VALUE paths = rb_ary_new_capa((long)count);
+  reader->roots = Qnil;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (body_end - body < 16) {
+      fsevent_reader_malformed(reader);
+    }
+    uint32_t ref = fsevent_reader_u32(body + 12);
+    body += 16;
+
+    if (!(ref & FSEVENT_INTERNED_NEW)) {
+      VALUE path = ref < (uint32_t)RARRAY_LEN(table) ? RARRAY_AREF(table, ref) : Qnil;
+      if (NIL_P(path)) {
+        fsevent_reader_malformed(reader);
+      }
+      rb_ary_push(paths, path);
+      continue;
+    }
+
+    if (body_end - body < 8) {
+      fsevent_reader_malformed(reader);
+    }
+    uint32_t dir = fsevent_reader_u32(body);
+    uint32_t length = fsevent_reader_u32(body + 4);
+    body += 8;
+    if ((size_t)(body_end - body) < length) {
+      fsevent_reader_malformed(reader);
+    }
+
+    VALUE path;
+    if (dir == FSEVENT_INTERNED_NONE) {
+      path = fsevent_reader_path(body, length);
+    } else if (!(dir & FSEVENT_INTERNED_NEW)) {
+      VALUE prefix = dir < (uint32_t)RARRAY_LEN(table) ? RARRAY_AREF(table, dir) : Qnil;
+      if (NIL_P(prefix)) {
+        fsevent_reader_malformed(reader);
+      }
+      VALUE joined = rb_str_buf_new(RSTRING_LEN(prefix) + (long)length);
+      rb_str_buf_cat(joined, RSTRING_PTR(prefix), RSTRING_LEN(prefix));
+      rb_str_buf_cat(joined, body, (long)length);
+      path = fsevent_reader_path(RSTRING_PTR(joined), (size_t)RSTRING_LEN(joined));
+    } else {
+      // the directory runs up to the last '/' before the path's final byte
+      uint32_t dir_length = 0;
+      for (uint32_t c = length > 1 ? length - 1 : 0; c > 0; c--) {
+        if (body[c - 1] == '/') {
+          dir_length = c;
+          break;
+        }
+      }
+      if (dir_length == 0) {
+        fsevent_reader_malformed(reader);
+      }
+      rb_ary_store(table, (long)(dir & ~FSEVENT_INTERNED_NEW),
+                   fsevent_reader_path(body, dir_length));
+      path = fsevent_reader_path(body, length);
+    }
+
+    rb_ary_store(table, (long)(ref & ~FSEVENT_INTERNED_NEW), path);
+    rb_ary_push(paths, path);
+    body += length;
+  }
+
+  *next = body_end;
+  return paths;
+}
+
+// The binary frame layout, sorted by path, with every path the number of
+// leading bytes it shares with the one before and the rest of it
+static VALUE fsevent_reader_parse_frontcoded(struct fsevent_reader* reader,
+                                             const char* p, const char* end,
+                                             const char** next)
+{
+  if (end - p < 8) {
+    return Qundef;
+  }
+
+  uint32_t count = fsevent_reader_u32(p);
+  uint32_t size = fsevent_reader_u32(p + 4);
+  const char* body = p + 8;
+
+  if ((size_t)(end - body) < size) {
+    return Qundef;
+  }
+
+  const char* body_end = body + size;
+  VALUE paths = rb_ary_new_capa((long)count);
+  // always holds the last path, for the next to share a prefix with
+  VALUE path = rb_str_buf_new(0);
+  reader->roots = Qnil;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (body_end - body < 20) {
+      fsevent_reader_malformed(reader);
+    }
+    uint32_t shared = fsevent_reader_u32(body + 12);
+    uint32_t length = fsevent_reader_u32(body + 16);
+    body += 20;
+    if ((size_t)(body_end - body) < length || shared > (uint32_t)RSTRING_LEN(path)) {
+      fsevent_reader_malformed(reader);
+    }
+    rb_str_set_len(path, (long)shared);
+    rb_str_buf_cat(path, body, (long)length);
+    rb_ary_push(paths, fsevent_reader_path(RSTRING_PTR(path), (size_t)RSTRING_LEN(path)));
+    body += length;
+  }
+
+  *next = body_end;
+  return paths;
+}
+
+static VALUE fsevent_reader_parse_frame(struct fsevent_reader* reader,
+                                        const char* p, const char* end,
+                                        const char** next)
+{
+  if (p == end) {
+    return Qundef;
+  }
+
+  switch (reader->format) {
+    case kFSEventReaderFormatNIW:
+      return fsevent_reader_parse_niw(reader, p, end, next, false);
+    case kFSEventReaderFormatNIWRoot:
+      return fsevent_reader_parse_niw(reader, p, end, next, true);
+    case kFSEventReaderFormatTNetstring:
+    case kFSEventReaderFormatOTNetstring:
+      return fsevent_reader_parse_tnetstring(reader, p, end, next);
+    case kFSEventReaderFormatBinary:
+      return fsevent_reader_parse_binary(reader, p, end, next);
+    case kFSEventReaderFormatInterned:
+      return fsevent_reader_parse_interned(reader, p, end, next);
+    case kFSEventReaderFormatFrontCoded:
+      return fsevent_reader_parse_frontcoded(reader, p, end, next);
+    case kFSEventReaderFormatClassic:
+    default:
+      return fsevent_reader_parse_classic(reader, p, end, next);
+  }
+}
+
+// Parse the frame in the ring record at tail, straight out of shared memory,
+// and hand the record back to the watcher
+static VALUE fsevent_reader_parse_ring(struct fsevent_reader* reader)
+{
+  struct fsevent_ring_header* header = (struct fsevent_ring_header*)reader->ring;
+  char* data = reader->ring + FSEVENT_RING_HEADER_SIZE;
+  uint64_t capacity = header->capacity;
+  uint64_t tail = header->tail;
+  uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+  uint32_t length;
+
+  if (memcmp(header->magic, FSEVENT_RING_MAGIC, sizeof(header->magic)) != 0 ||
+      capacity == 0 || capacity > reader->ring_size - FSEVENT_RING_HEADER_SIZE) {
+    rb_raise(rb_eRuntimeError, "fsevent_watch never set up its ring buffer");
+  }
+  if (head == tail) {
+    fsevent_reader_malformed(reader);
+  }
+
+  uint64_t offset = tail % capacity;
+  memcpy(&length, data + offset, sizeof(length));
+  if (length == FSEVENT_RING_WRAP) {
+    tail += capacity - offset;
+    offset = 0;
+    memcpy(&length, data, sizeof(length));
+  }
+  if (offset + 4 + length > capacity) {
+    fsevent_reader_malformed(reader);
+  }
+
+  const char* frame = data + offset + 4;
+  const char* next = NULL;
+  VALUE paths = fsevent_reader_parse_frame(reader, frame, frame + length, &next);
+  if (paths == Qundef) {
+    fsevent_reader_malformed(reader);
+  }
+
+  tail += (4 + (uint64_t)length + 7) & ~(uint64_t)7;
+  __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+  return paths;
+}
+
+static VALUE fsevent_reader_parse(struct fsevent_reader* reader)
+{
+  const char* p = reader->bytes + reader->start;
+  const char* end = reader->bytes + reader->length;
+  const char* next = NULL;
+
+  if (reader->ring && p < end) {
+    // a doorbell for every batch, in order, saying where it went
+    if (*p == 'r') {
+      reader->start++;
+      return fsevent_reader_parse_ring(reader);
+    } else if (*p != 'p') {
+      fsevent_reader_malformed(reader);
+    }
+    p++;
+  }
+
+  VALUE paths = fsevent_reader_parse_frame(reader, p, end, &next);
+  if (paths != Qundef) {
+    reader->start = (size_t)(next - reader->bytes);
+  }
+  return paths;
+}
+
+
+// ruby API
+
+/*
+ * call-seq:
+ *   NativeReader.shm_create(size) -> io
+ *
+ * Create an anonymous shared memory file of size bytes for fsevent_watch
+ * --transport=shm to lay its ring buffer out in. Hand it to the watcher as
+ * descriptor 3 (or whichever --shm-fd says) and to NativeReader.new.
+ */
+static VALUE fsevent_reader_s_shm_create(VALUE klass, VALUE size)
+{
+  long length = NUM2LONG(size);
+  int fd = -1;
+
+  if (length < FSEVENT_RING_HEADER_SIZE + 4096) {
+    rb_raise(rb_eArgError, "a ring buffer needs at least %d bytes",
+             FSEVENT_RING_HEADER_SIZE + 4096);
+  }
+
+#ifdef HAVE_MEMFD_CREATE
+  fd = memfd_create("rb-fsevent", MFD_CLOEXEC);
+#endif
+  if (fd < 0) {
+    // unlinked right away, so it's as anonymous as a memfd
+    char name[64];
+    static unsigned long counter = 0;
+    for (int attempt = 0; fd < 0 && attempt < 16; attempt++) {
+      snprintf(name, sizeof(name), "/rb-fsevent.%ld.%lu", (long)getpid(), counter++);
+      fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    if (fd < 0) {
+      rb_sys_fail("shm_open");
+    }
+    shm_unlink(name);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+
+  if (ftruncate(fd, (off_t)length) != 0) {
+    int error = errno;
+    close(fd);
+    rb_syserr_fail(error, "ftruncate");
+  }
+
+  (void)klass;
+  return rb_funcall(rb_cIO, rb_intern("for_fd"), 1, INT2NUM(fd));
+}
+
+/*
+ * call-seq:
+ *   NativeReader.new(io, format = 'classic', shm = nil)
+ *
+ * Read batches from io, the pipe of an fsevent_watch started with
+ * --format=format. With shm, a file from NativeReader.shm_create that the
+ * watcher was started with --transport=shm on, frames are parsed straight
+ * out of the ring buffer in it and the pipe only carries doorbells.
+ */
+static VALUE fsevent_reader_initialize(int argc, VALUE* argv, VALUE self)
+{
+  struct fsevent_reader* reader;
+  VALUE io, format, shm;
+
+  TypedData_Get_Struct(self, struct fsevent_reader, &fsevent_reader_type, reader);
+  rb_scan_args(argc, argv, "12", &io, &format, &shm);
+
+  const char* name = NIL_P(format) ? "classic" : StringValueCStr(format);
+
+  if (strcmp(name, "classic") == 0) {
+    reader->format = kFSEventReaderFormatClassic;
+  } else if (strcmp(name, "niw") == 0) {
+    reader->format = kFSEventReaderFormatNIW;
+  } else if (strcmp(name, "niwroot") == 0) {
+    reader->format = kFSEventReaderFormatNIWRoot;
+  } else if (strcmp(name, "tnetstring") == 0) {
+    reader->format = kFSEventReaderFormatTNetstring;
+  } else if (strcmp(name, "otnetstring") == 0) {
+    reader->format = kFSEventReaderFormatOTNetstring;
+  } else if (strcmp(name, "binary") == 0) {
+    reader->format = kFSEventReaderFormatBinary;
+  } else if (strcmp(name, "interned") == 0) {
+    reader->format = kFSEventReaderFormatInterned;
+  } else if (strcmp(name, "frontcoded") == 0) {
+    reader->format = kFSEventReaderFormatFrontCoded;
+  } else {
+    rb_raise(rb_eArgError, "unknown format: %s", name);
+  }
+
+  if (!NIL_P(shm)) {
+    struct stat st;
+    int fd = NUM2INT(rb_funcall(shm, id_fileno, 0));
+
+    if (fstat(fd, &st) != 0) {
+      rb_sys_fail("fstat");
+    }
+    if (st.st_size < FSEVENT_RING_HEADER_SIZE + 4096) {
+      rb_raise(rb_eArgError, "shm is too small for a ring buffer");
+    }
+
+    void* ring = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+      rb_sys_fail("mmap");
+    }
+    if (reader->ring) {
+      munmap(reader->ring, reader->ring_size);
+    }
+    reader->ring = ring;
+    reader->ring_size = (size_t)st.st_size;
+  }
+
+  reader->io = io;
+  reader->shm = shm;
+  return self;
+}
+
+/*
+ * call-seq:
+ *   next_batch -> array of paths or nil
+ *
+ * Block until the watcher's next batch arrives. Returns nil once the watcher
+ * has exited.
+ */
+static VALUE fsevent_reader_next_batch(VALUE self)
+{
+  struct fsevent_reader* reader = fsevent_reader_get(self);
+
+  for (;;) {
+    VALUE paths = fsevent_reader_parse(reader);
+    if (paths != Qundef) {
+      return paths;
+    }
+    if (reader->eof) {
+      return Qnil;
+    }
+    fsevent_reader_fill(reader);
+  }
+}
+
+/*
+ * call-seq:
+ *   roots -> array of roots or nil
+ *
+ * The watched root of every path in the last batch, or nil for formats that
+ * don't report one. A path outside every --root has a nil root.
+ */
+static VALUE fsevent_reader_roots(VALUE self)
+{
+  return fsevent_reader_get(self)->roots;
+}
+
+void Init_fsevent_native(void)
+{
+  id_fileno = rb_intern("fileno");
+#ifndef HAVE_RB_ENC_INTERNED_STR
+  id_uminus = rb_intern("-@");
+#endif
+
+  VALUE cFSEvent = rb_define_class("FSEvent", rb_cObject);
+  VALUE cNativeReader = rb_define_class_under(cFSEvent, "NativeReader", rb_cObject);
+
+  rb_define_alloc_func(cNativeReader, fsevent_reader_alloc);
+  rb_define_singleton_method(cNativeReader, "shm_create", fsevent_reader_s_shm_create, 1);
+  rb_define_method(cNativeReader, "initialize", fsevent_reader_initialize, -1);
+  rb_define_method(cNativeReader, "next_batch", fsevent_reader_next_batch, 0);
+  rb_define_method(cNativeReader, "roots", fsevent_reader_roots, 0);
+}
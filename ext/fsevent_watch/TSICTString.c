@@ -8,10 +8,6 @@
 #include "TSICTString.h"
 
 
-const char* const TNetstringTypes = ",#^!~}]Z";
-const char* const OTNetstringTypes = ",#^!~{[Z";
-const UInt8 TNetstringSeparator = ':';
-
 TSITStringFormat TSITStringDefaultFormat = kTSITStringFormatTNetstring;
 
 static const CFRange BeginningRange = {0,0};
@@ -71,6 +67,9 @@ static inline TStringIRep* TSICTStringCreateWithDataOfTypeAndFormat(CFDataRef da
     rep->type = type;
     rep->format = format;
     rep->length = calloc(10, sizeof(char));
+    TSITSTRING_ALLOCATED();
+    TSITSTRING_ALLOCATED();
+    TSITSTRING_COPIED(CFDataGetLength(data));
 
     CFIndex len = CFDataGetLength(rep->data);
     if (snprintf(rep->length, 10, "%lu", len)) {
@@ -89,6 +88,8 @@ static inline CFDataRef TSICTStringCreateDataFromIntermediateRepresentation(TStr
 
     size_t prefixLength = strlen(rep->length) + 1;
     CFDataReplaceBytes(buffer, BeginningRange, (const UInt8*)rep->length, (CFIndex)prefixLength);
+    // the copy, then the payload shifted along to make room for the prefix
+    TSITSTRING_COPIED(len + len + prefixLength);
 
     if (rep->format == kTSITStringFormatTNetstring) {
         const UInt8 ftag = (UInt8)TNetstringTypes[rep->type];
@@ -101,6 +102,7 @@ static inline CFDataRef TSICTStringCreateDataFromIntermediateRepresentation(TStr
 
     CFDataRef dataRep = CFDataCreateCopy(kCFAllocatorDefault, buffer);
     CFRelease(buffer);
+    TSITSTRING_COPIED(CFDataGetLength(dataRep));
 
     return dataRep;
 }
@@ -145,6 +147,7 @@ static inline void TSICTStringAppendObjectToMutableDataWithFormat(CFTypeRef obje
     TStringIRep* objRep = TSICTStringCreateWithObjectAndFormat(object, format);
     CFDataRef objData = TSICTStringCreateDataFromIntermediateRepresentation(objRep);
     CFDataAppendBytes(buffer, (CFDataGetBytePtr(objData)), CFDataGetLength(objData));
+    TSITSTRING_COPIED(CFDataGetLength(objData));
     CFRelease(objData);
     TSICTStringDestroy(objRep);
 
@@ -9,29 +9,9 @@
 #define TSICTString_H
 
 #include <CoreFoundation/CoreFoundation.h>
+#include "TSITString.h"
 
 
-typedef enum {
-    kTSITStringTagString   = 0,
-    kTSITStringTagNumber   = 1,
-    kTSITStringTagFloat    = 2,
-    kTSITStringTagBool     = 3,
-    kTSITStringTagNull     = 4,
-    kTSITStringTagDict     = 5,
-    kTSITStringTagList     = 6,
-    kTSITStringTagInvalid  = 7,
-} TSITStringTag;
-
-extern const char* const TNetstringTypes;
-extern const char* const OTNetstringTypes;
-extern const UInt8 TNetstringSeparator;
-
-typedef enum {
-    kTSITStringFormatDefault        = 0,
-    kTSITStringFormatOTNetstring    = 1,
-    kTSITStringFormatTNetstring     = 2,
-} TSITStringFormat;
-
 extern TSITStringFormat TSITStringDefaultFormat;
 
 typedef struct TSITStringIntermediate {
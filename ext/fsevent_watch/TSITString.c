@@ -0,0 +1,271 @@
+//
+//  TSITString.c
+//  TSITString
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "TSITString.h"
+
+
+const char* const TNetstringTypes = ",#^!~}]Z";
+const char* const OTNetstringTypes = ",#^!~{[Z";
+const unsigned char TNetstringSeparator = ':';
+
+#ifdef TSITSTRING_STATS
+unsigned long long TSITStringAllocations = 0;
+unsigned long long TSITStringBytesCopied = 0;
+#endif
+
+// room for the longest 64-bit length plus its separator (or type tag)
+static const size_t kTSITStringSlotWidth = 21;
+static const size_t kTSITStringInitialCapacity = 64 * 1024;
+
+
+void TSITStringWriterInit(TSITStringWriter* writer, TSITStringFormat format)
+{
+    memset(writer, 0, sizeof(TSITStringWriter));
+
+    writer->capacity = kTSITStringInitialCapacity;
+    writer->bytes = malloc(writer->capacity);
+    writer->openCapacity = 8;
+    writer->open = malloc(writer->openCapacity * sizeof(TSITStringContainer));
+    writer->gapCapacity = 256;
+    writer->gaps = malloc(writer->gapCapacity * sizeof(TSITStringGap));
+    TSITSTRING_ALLOCATED();
+    TSITSTRING_ALLOCATED();
+    TSITSTRING_ALLOCATED();
+
+    if (!writer->bytes || !writer->open || !writer->gaps) {
+        fprintf(stderr, "Unable to allocate TNetstring writer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    TSITStringWriterReset(writer, format);
+}
+
+void TSITStringWriterDestroy(TSITStringWriter* writer)
+{
+    free(writer->bytes);
+    free(writer->open);
+    free(writer->gaps);
+    memset(writer, 0, sizeof(TSITStringWriter));
+}
+
+void TSITStringWriterReset(TSITStringWriter* writer, TSITStringFormat format)
+{
+    if (format == kTSITStringFormatDefault) {
+        format = kTSITStringFormatTNetstring;
+    }
+
+    writer->format = format;
+    writer->length = 0;
+    writer->depth = 0;
+    writer->numGaps = 0;
+    writer->gapBytes = 0;
+}
+
+
+static inline void TSITStringWriterReserve(TSITStringWriter* writer, size_t needed)
+{
+    if (writer->length + needed <= writer->capacity) {
+        return;
+    }
+
+    while (writer->length + needed > writer->capacity) {
+        writer->capacity *= 2;
+    }
+
+    writer->bytes = realloc(writer->bytes, writer->capacity);
+    TSITSTRING_ALLOCATED();
+    TSITSTRING_COPIED(writer->length);
+    if (!writer->bytes) {
+        fprintf(stderr, "Unable to grow TNetstring writer to %zu bytes\n", writer->capacity);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Write the decimal digits of value so that they end at `end`, returning how
+// many were written
+static inline size_t TSITStringFormatDigits(char* end, unsigned long long value)
+{
+    char* p = end;
+    do {
+        *--p = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value);
+    return (size_t)(end - p);
+}
+
+static inline void TSITStringWriterAppendValue(TSITStringWriter* writer,
+                                               const char* bytes,
+                                               size_t length,
+                                               TSITStringTag type)
+{
+    TSITStringWriterReserve(writer, length + kTSITStringSlotWidth + 1);
+
+    char digits[20];
+    size_t numDigits = TSITStringFormatDigits(digits + sizeof(digits), length);
+    char* dst = writer->bytes + writer->length;
+
+    memcpy(dst, digits + sizeof(digits) - numDigits, numDigits);
+    dst += numDigits;
+    TSITSTRING_COPIED(numDigits + length);
+
+    if (writer->format == kTSITStringFormatTNetstring) {
+        *dst++ = (char)TNetstringSeparator;
+        memcpy(dst, bytes, length);
+        dst += length;
+        *dst++ = TNetstringTypes[type];
+    } else {
+        *dst++ = OTNetstringTypes[type];
+        memcpy(dst, bytes, length);
+        dst += length;
+    }
+
+    writer->length = (size_t)(dst - writer->bytes);
+}
+
+static inline void TSITStringWriterBegin(TSITStringWriter* writer, TSITStringTag type)
+{
+    if (writer->depth == writer->openCapacity) {
+        writer->openCapacity *= 2;
+        writer->open = realloc(writer->open, writer->openCapacity * sizeof(TSITStringContainer));
+        TSITSTRING_ALLOCATED();
+    }
+    if (writer->numGaps == writer->gapCapacity) {
+        writer->gapCapacity *= 2;
+        writer->gaps = realloc(writer->gaps, writer->gapCapacity * sizeof(TSITStringGap));
+        TSITSTRING_ALLOCATED();
+    }
+    if (!writer->open || !writer->gaps) {
+        fprintf(stderr, "Unable to grow TNetstring writer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    TSITStringWriterReserve(writer, kTSITStringSlotWidth);
+
+    TSITStringContainer* container = &writer->open[writer->depth++];
+    container->slot = writer->length;
+    container->gap = writer->numGaps;
+    container->gapBytes = writer->gapBytes;
+    container->type = type;
+
+    // gaps are recorded in the order they appear in the buffer
+    TSITStringGap* gap = &writer->gaps[writer->numGaps++];
+    gap->offset = writer->length;
+    gap->length = 0;
+
+    writer->length += kTSITStringSlotWidth;
+}
+
+void TSITStringWriterBeginDictionary(TSITStringWriter* writer)
+{
+    TSITStringWriterBegin(writer, kTSITStringTagDict);
+}
+
+void TSITStringWriterBeginList(TSITStringWriter* writer)
+{
+    TSITStringWriterBegin(writer, kTSITStringTagList);
+}
+
+void TSITStringWriterEnd(TSITStringWriter* writer)
+{
+    if (writer->depth == 0) {
+        return;
+    }
+
+    TSITStringContainer* container = &writer->open[--writer->depth];
+    size_t payloadStart = container->slot + kTSITStringSlotWidth;
+    size_t innerGaps = writer->gapBytes - container->gapBytes;
+    size_t payloadLength = writer->length - payloadStart - innerGaps;
+
+    // right-align the prefix in its slot, directly in front of the payload
+    char* slotEnd = writer->bytes + payloadStart;
+    if (writer->format == kTSITStringFormatTNetstring) {
+        *--slotEnd = (char)TNetstringSeparator;
+    } else {
+        *--slotEnd = OTNetstringTypes[container->type];
+    }
+    size_t prefixLength = TSITStringFormatDigits(slotEnd, payloadLength) + 1;
+
+    size_t unused = kTSITStringSlotWidth - prefixLength;
+    writer->gaps[container->gap].length = unused;
+    writer->gapBytes += unused;
+
+    if (writer->format == kTSITStringFormatTNetstring) {
+        TSITStringWriterReserve(writer, 1);
+        writer->bytes[writer->length++] = TNetstringTypes[container->type];
+    }
+}
+
+void TSITStringWriterAppendString(TSITStringWriter* writer, const char* bytes, size_t length)
+{
+    TSITStringWriterAppendValue(writer, bytes, length, kTSITStringTagString);
+}
+
+void TSITStringWriterAppendCString(TSITStringWriter* writer, const char* string)
+{
+    TSITStringWriterAppendValue(writer, string, strlen(string), kTSITStringTagString);
+}
+
+void TSITStringWriterAppendInteger(TSITStringWriter* writer, long long value)
+{
+    char digits[21];
+    char* end = digits + sizeof(digits);
+    unsigned long long magnitude = (value < 0) ? (0ULL - (unsigned long long)value)
+                                               : (unsigned long long)value;
+    size_t length = TSITStringFormatDigits(end, magnitude);
+
+    if (value < 0) {
+        length++;
+        *(end - length) = '-';
+    }
+
+    TSITStringWriterAppendValue(writer, end - length, length, kTSITStringTagNumber);
+}
+
+void TSITStringWriterAppendBool(TSITStringWriter* writer, bool value)
+{
+    if (value) {
+        TSITStringWriterAppendValue(writer, "true", 4, kTSITStringTagBool);
+    } else {
+        TSITStringWriterAppendValue(writer, "false", 5, kTSITStringTagBool);
+    }
+}
+
+void TSITStringWriterAppendNull(TSITStringWriter* writer)
+{
+    TSITStringWriterAppendValue(writer, "", 0, kTSITStringTagNull);
+}
+
+const char* TSITStringWriterFinish(TSITStringWriter* writer, size_t* length)
+{
+    while (writer->depth > 0) {
+        TSITStringWriterEnd(writer);
+    }
+
+    // one pass over the buffer, no matter how deeply containers were nested
+    if (writer->numGaps > 0) {
+        size_t dst = writer->gaps[0].offset;
+
+        for (size_t i = 0; i < writer->numGaps; i++) {
+            size_t src = writer->gaps[i].offset + writer->gaps[i].length;
+            size_t next = (i + 1 < writer->numGaps) ? writer->gaps[i + 1].offset
+                                                     : writer->length;
+            memmove(writer->bytes + dst, writer->bytes + src, next - src);
+            TSITSTRING_COPIED(next - src);
+            dst += next - src;
+        }
+
+        writer->length = dst;
+        writer->numGaps = 0;
+        writer->gapBytes = 0;
+    }
+
+    if (length) {
+        *length = writer->length;
+    }
+    return writer->bytes;
+}
@@ -0,0 +1,103 @@
+//
+//  TSITString.h
+//  TSITString
+//
+//  Plain C TNetstring/OTNetstring writer. Values are encoded straight into a
+//  single reusable buffer; containers reserve a slot for their length prefix
+//  which is back-patched once the container is closed, so nothing is ever
+//  prepended and nothing is allocated per value once the buffer has grown.
+//
+
+#ifndef TSITString_H
+#define TSITString_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+typedef enum {
+    kTSITStringTagString   = 0,
+    kTSITStringTagNumber   = 1,
+    kTSITStringTagFloat    = 2,
+    kTSITStringTagBool     = 3,
+    kTSITStringTagNull     = 4,
+    kTSITStringTagDict     = 5,
+    kTSITStringTagList     = 6,
+    kTSITStringTagInvalid  = 7,
+} TSITStringTag;
+
+#ifdef TSITSTRING_STATS
+// Running totals for benchmarks, only kept in builds with TSITSTRING_STATS:
+// heap allocations made by the encoders and bytes they copied or moved,
+// including buffer growth.
+extern unsigned long long TSITStringAllocations;
+extern unsigned long long TSITStringBytesCopied;
+#define TSITSTRING_ALLOCATED()  (TSITStringAllocations++)
+#define TSITSTRING_COPIED(n)    (TSITStringBytesCopied += (unsigned long long)(n))
+#else
+#define TSITSTRING_ALLOCATED()  ((void)0)
+#define TSITSTRING_COPIED(n)    ((void)0)
+#endif
+
+extern const char* const TNetstringTypes;
+extern const char* const OTNetstringTypes;
+extern const unsigned char TNetstringSeparator;
+
+typedef enum {
+    kTSITStringFormatDefault        = 0,
+    kTSITStringFormatOTNetstring    = 1,
+    kTSITStringFormatTNetstring     = 2,
+} TSITStringFormat;
+
+// unused bytes left in front of a back-patched length prefix
+typedef struct {
+    size_t              offset;
+    size_t              length;
+} TSITStringGap;
+
+typedef struct {
+    size_t              slot;
+    size_t              gap;
+    size_t              gapBytes;
+    TSITStringTag       type;
+} TSITStringContainer;
+
+typedef struct {
+    char*                   bytes;
+    size_t                  length;
+    size_t                  capacity;
+    TSITStringFormat        format;
+
+    TSITStringContainer*    open;
+    size_t                  depth;
+    size_t                  openCapacity;
+
+    TSITStringGap*          gaps;
+    size_t                  numGaps;
+    size_t                  gapCapacity;
+    size_t                  gapBytes;
+} TSITStringWriter;
+
+
+void TSITStringWriterInit(TSITStringWriter* writer, TSITStringFormat format);
+void TSITStringWriterDestroy(TSITStringWriter* writer);
+
+// Forget everything written so far, keeping all buffers for reuse
+void TSITStringWriterReset(TSITStringWriter* writer, TSITStringFormat format);
+
+void TSITStringWriterBeginDictionary(TSITStringWriter* writer);
+void TSITStringWriterBeginList(TSITStringWriter* writer);
+void TSITStringWriterEnd(TSITStringWriter* writer);
+
+void TSITStringWriterAppendString(TSITStringWriter* writer, const char* bytes, size_t length);
+void TSITStringWriterAppendCString(TSITStringWriter* writer, const char* string);
+void TSITStringWriterAppendInteger(TSITStringWriter* writer, long long value);
+void TSITStringWriterAppendBool(TSITStringWriter* writer, bool value);
+void TSITStringWriterAppendNull(TSITStringWriter* writer);
+
+// Close the gaps left by length slots and return the encoded bytes, which
+// stay valid until the next reset
+const char* TSITStringWriterFinish(TSITStringWriter* writer, size_t* length);
+
+
+#endif
@@ -0,0 +1,87 @@
+#include "arena.h"
+
+struct arena_chunk {
+  struct arena_chunk*   next;
+  size_t                size;
+  char                  data[];
+};
+
+void arena_init(struct arena* arena)
+{
+  memset(arena, 0, sizeof(struct arena));
+}
+
+void arena_free(struct arena* arena)
+{
+  struct arena_chunk* chunk = arena->first;
+  while (chunk) {
+    struct arena_chunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  memset(arena, 0, sizeof(struct arena));
+}
+
+// Move on to the first chunk after the current one with room for size bytes,
+// adding one at the end of the list if there is none. Each added chunk is at
+// least as large as all the others together, so there are never many.
+static void arena_next_chunk(struct arena* arena, size_t size)
+{
+  struct arena_chunk* last = arena->current;
+  struct arena_chunk* chunk = last ? last->next : arena->first;
+
+  while (chunk && chunk->size < size) {
+    last = chunk;
+    chunk = chunk->next;
+  }
+
+  if (!chunk) {
+    size_t chunkSize = arena->capacity > ARENA_CHUNK_SIZE ? arena->capacity : ARENA_CHUNK_SIZE;
+    if (chunkSize < size) {
+      chunkSize = size;
+    }
+
+    chunk = malloc(sizeof(struct arena_chunk) + chunkSize);
+    if (!chunk) {
+      fprintf(stderr, "Unable to allocate %zu bytes of batch arena\n", chunkSize);
+      exit(EXIT_FAILURE);
+    }
+    chunk->next = NULL;
+    chunk->size = chunkSize;
+    arena->capacity += chunkSize;
+
+    while (last && last->next) {
+      last = last->next;
+    }
+    if (last) {
+      last->next = chunk;
+    } else {
+      arena->first = chunk;
+    }
+  }
+
+  arena->current = chunk;
+  arena->next = chunk->data;
+  arena->end = chunk->data + chunk->size;
+}
+
+void* arena_alloc(struct arena* arena, size_t size)
+{
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+  if (!arena->next || (size_t)(arena->end - arena->next) < size) {
+    arena_next_chunk(arena, size);
+  }
+
+  void* bytes = arena->next;
+  arena->next += size;
+  return bytes;
+}
+
+char* arena_strndup(struct arena* arena, const char* string, size_t length)
+{
+  char* copy = arena_alloc(arena, length + 1);
+  memcpy(copy, string, length);
+  copy[length] = '\0';
+  return copy;
+}
@@ -0,0 +1,52 @@
+/**
+ * @headerfile arena.h
+ * Bump allocation for the temporaries of one batch
+ *
+ * Whatever a batch needs only until it has been written out (the roots of
+ * its events, the directories a rescan found, the events standing in for
+ * dropped ones) is carved out of large chunks by bumping a pointer, and all
+ * of it is given back at once by arena_reset, which just rewinds to the
+ * first chunk. Chunks are kept from one batch to the next, so once the
+ * arena has grown to fit the largest batch, batches don't allocate at all.
+ *
+ * An arena belongs to one thread: the stream callback and the writer thread
+ * each have their own.
+ */
+
+#ifndef fsevent_watch_arena_h
+#define fsevent_watch_arena_h
+
+#include "common.h"
+
+#define ARENA_CHUNK_SIZE    (64 * 1024)
+#define ARENA_ALIGNMENT     16
+
+struct arena_chunk;
+
+struct arena {
+  struct arena_chunk*   first;
+  struct arena_chunk*   current;
+  char*                 next;
+  char*                 end;
+  // of all chunks together
+  size_t                capacity;
+};
+
+void arena_init(struct arena* arena);
+void arena_free(struct arena* arena);
+
+// size bytes aligned to ARENA_ALIGNMENT, valid until the next arena_reset
+void* arena_alloc(struct arena* arena, size_t size);
+
+// A NUL terminated copy of the first length bytes of string
+char* arena_strndup(struct arena* arena, const char* string, size_t length);
+
+// Give back everything allocated since the last reset, in constant time
+static inline void arena_reset(struct arena* arena)
+{
+  arena->current = NULL;
+  arena->next = NULL;
+  arena->end = NULL;
+}
+
+#endif // fsevent_watch_arena_h
@@ -1,5 +1,6 @@
 #include <getopt.h>
 #include "cli.h"
+#include "content_hash.h"
 
 const char* cli_info_purpose = "A flexible command-line interface for the FSEvents API";
 const char* cli_info_usage = "Usage: fsevent_watch [OPTIONS]... [PATHS]...";
@@ -7,14 +8,64 @@ const char* cli_info_help[] = {
   "  -h, --help                you're looking at it",
   "  -V, --version             print version number and exit",
   "  -p, --show-plist          display the embedded Info.plist values",
+  "  -R, --root=path           watch a path with the --since-when, --latency,\n"
+  "                                           --no-defer, --debounce,\n"
+  "                                           --watch-root and --file-events\n"
+  "                                           given after it",
   "  -s, --since-when=EventID  fire historical events since ID",
+  "  -j, --journal=path        keep an event history in a file, so\n"
+  "                                           --since-when works without\n"
+  "                                           FSEvents too",
+  "  -S, --snapshot=path       keep the watched trees' state in a file,\n"
+  "                                           reporting what changed while\n"
+  "                                           not watching on startup",
+  "  -C, --crawl               crawl the watched trees on startup, so\n"
+  "                                           dropped events are rescanned\n"
+  "                                           into ordinary ones",
+  "  -T, --stats=seconds       also dump runtime statistics to stderr this\n"
+  "                                           often, as well as on SIGUSR1",
   "  -l, --latency=seconds     latency period (default='0.5')",
+  "  -a, --adaptive-latency=min,max\n"
+  "                                           latency period of min seconds\n"
+  "                                           while events are sparse,\n"
+  "                                           stretching toward max as they\n"
+  "                                           come faster",
   "  -n, --no-defer            enable no-defer latency modifier",
+  "  -b, --debounce            send the first event after a quiet latency\n"
+  "                                           period at once, and the rest\n"
+  "                                           once the latency period passes\n"
+  "                                           without another",
   "  -r, --watch-root          watch for when the root path has changed",
   // "  -i, --ignore-self         ignore current process",
   "  -F, --file-events         provide file level event data",
-  "  -f, --format=name         output format (classic, niw, \n"
-  "                                           tnetstring, otnetstring)",
+  "  -I, --include=glob        only report paths matching a glob (repeatable)",
+  "  -X, --exclude=glob        never report paths matching a glob (repeatable)",
+  "  -g, --gitignore           drop events for paths git would ignore",
+  "  -c, --coalesce            report each path once per batch, with its\n"
+  "                                           flags combined",
+  "  -H, --content-hash        drop modifications that left a file's\n"
+  "                                           contents as they were",
+  "      --content-hash-max=bytes\n"
+  "                                           largest file --content-hash\n"
+  "                                           reads (default='16777216')",
+  "  -f, --format=name         output format (classic, niw, niwroot,\n"
+  "                                           tnetstring, otnetstring,\n"
+  "                                           binary, interned,\n"
+  "                                           frontcoded)",
+  "  -t, --transport=name      how batches reach the reader (pipe, or shm\n"
+  "                                           through the ring buffer in\n"
+  "                                           the file open on --shm-fd)",
+  "      --shm-fd=fd           descriptor of the shared memory file\n"
+  "                                           (default='3')",
+  "  -O, --overflow=policy     what to do with batches once the reader has\n"
+  "                                           fallen too far behind (block,\n"
+  "                                           coalesce or drop;\n"
+  "                                           default='block')",
+  "  -d, --daemon=socket       serve subscriptions from many clients over a\n"
+  "                                           unix socket instead of watching\n"
+  "                                           paths given here",
+  "  -e, --event-source=name   where events come from (fsevents on macos,\n"
+  "                                           inotify or fanotify on linux)",
   0
 };
 
@@ -22,18 +73,75 @@ static void default_args (struct cli_info* args_info)
 {
   args_info->since_when_arg     = kFSEventStreamEventIdSinceNow;
   args_info->latency_arg        = 0.5;
+  args_info->adaptive_latency_given   = false;
+  args_info->adaptive_latency_min_arg = 0;
+  args_info->adaptive_latency_max_arg = 0;
   args_info->no_defer_flag      = false;
+  args_info->debounce_flag      = false;
   args_info->watch_root_flag    = false;
   args_info->ignore_self_flag   = false;
   args_info->file_events_flag   = false;
   args_info->mark_self_flag     = false;
+  args_info->coalesce_flag      = false;
+  args_info->gitignore_flag     = false;
+  args_info->crawl_flag         = false;
+  args_info->content_hash_flag  = false;
+  args_info->content_hash_max_arg = CONTENT_HASH_DEFAULT_MAX_SIZE;
+  args_info->stats_arg          = 0;
   args_info->format_arg         = kFSEventWatchOutputFormatClassic;
+  args_info->transport_arg      = kFSEventWatchTransportPipe;
+  args_info->overflow_arg       = kFSEventWatchOverflowBlock;
+  args_info->shm_fd_arg         = 3;
+#ifdef __APPLE__
+  args_info->event_source_arg   = kFSEventWatchEventSourceFSEvents;
+#else
+  args_info->event_source_arg   = kFSEventWatchEventSourceInotify;
+#endif
+}
+
+static void cli_append_arg (char*** args, unsigned* num, const char* arg)
+{
+  *args = (char**)realloc(*args, (*num + 1) * sizeof(char*));
+  if (!*args) {
+    fprintf(stderr, "Unable to allocate argument list\n");
+    exit(EXIT_FAILURE);
+  }
+  (*args)[(*num)++] = strdup(arg);
 }
 
 static void cli_parser_release (struct cli_info* args_info)
 {
   unsigned int i;
 
+  for (i=0; i < args_info->include_num; ++i) {
+    free(args_info->include_args[i]);
+  }
+  free(args_info->include_args);
+  args_info->include_args = 0;
+  args_info->include_num = 0;
+
+  for (i=0; i < args_info->exclude_num; ++i) {
+    free(args_info->exclude_args[i]);
+  }
+  free(args_info->exclude_args);
+  args_info->exclude_args = 0;
+  args_info->exclude_num = 0;
+
+  free(args_info->daemon_arg);
+  args_info->daemon_arg = 0;
+
+  free(args_info->journal_arg);
+  args_info->journal_arg = 0;
+  free(args_info->snapshot_arg);
+  args_info->snapshot_arg = 0;
+
+  for (i=0; i < args_info->root_num; ++i) {
+    free(args_info->root_args[i].path);
+  }
+  free(args_info->root_args);
+  args_info->root_args = 0;
+  args_info->root_num = 0;
+
   for (i=0; i < args_info->inputs_num; ++i) {
     free(args_info->inputs[i]);
   }
@@ -49,6 +157,15 @@ void cli_parser_init (struct cli_info* args_info)
 {
   default_args(args_info);
 
+  args_info->include_args = 0;
+  args_info->include_num = 0;
+  args_info->exclude_args = 0;
+  args_info->exclude_num = 0;
+  args_info->daemon_arg = 0;
+  args_info->journal_arg = 0;
+  args_info->snapshot_arg = 0;
+  args_info->root_args = 0;
+  args_info->root_num = 0;
   args_info->inputs = 0;
   args_info->inputs_num = 0;
 }
@@ -58,6 +175,7 @@ void cli_parser_free (struct cli_info* args_info)
   cli_parser_release(args_info);
 }
 
+#ifdef __APPLE__
 static void cli_print_info_dict (const void *key,
                                  const void *value,
                                  void *context)
@@ -84,6 +202,12 @@ void cli_show_plist (void)
   CFRelease(mainBundle);
   printf("\n");
 }
+#else
+void cli_show_plist (void)
+{
+  printf("No Info.plist is embedded outside of macOS\n\n");
+}
+#endif
 
 void cli_print_version (void)
 {
@@ -114,6 +238,30 @@ void cli_print_help (void)
   }
 }
 
+bool cli_parse_format (const char* name, enum FSEventWatchOutputFormat* format)
+{
+  if (strcmp(name, "classic") == 0) {
+    *format = kFSEventWatchOutputFormatClassic;
+  } else if (strcmp(name, "niw") == 0) {
+    *format = kFSEventWatchOutputFormatNIW;
+  } else if (strcmp(name, "niwroot") == 0) {
+    *format = kFSEventWatchOutputFormatNIWRoot;
+  } else if (strcmp(name, "tnetstring") == 0) {
+    *format = kFSEventWatchOutputFormatTNetstring;
+  } else if (strcmp(name, "otnetstring") == 0) {
+    *format = kFSEventWatchOutputFormatOTNetstring;
+  } else if (strcmp(name, "binary") == 0) {
+    *format = kFSEventWatchOutputFormatBinary;
+  } else if (strcmp(name, "interned") == 0) {
+    *format = kFSEventWatchOutputFormatInterned;
+  } else if (strcmp(name, "frontcoded") == 0) {
+    *format = kFSEventWatchOutputFormatFrontCoded;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 int cli_parser (int argc, const char** argv, struct cli_info* args_info)
 {
   static struct option longopts[] = {
@@ -122,56 +270,201 @@ int cli_parser (int argc, const char** argv, struct cli_info* args_info)
     { "show-plist",   no_argument,        NULL, 'p' },
     { "since-when",   required_argument,  NULL, 's' },
     { "latency",      required_argument,  NULL, 'l' },
+    { "adaptive-latency", required_argument, NULL, 'a' },
     { "no-defer",     no_argument,        NULL, 'n' },
+    { "debounce",     no_argument,        NULL, 'b' },
     { "watch-root",   no_argument,        NULL, 'r' },
     { "ignore-self",  no_argument,        NULL, 'i' },
     { "file-events",  no_argument,        NULL, 'F' },
     { "mark-self",    no_argument,        NULL, 'm' },
     { "format",       required_argument,  NULL, 'f' },
+    { "event-source", required_argument,  NULL, 'e' },
+    { "coalesce",     no_argument,        NULL, 'c' },
+    { "include",      required_argument,  NULL, 'I' },
+    { "exclude",      required_argument,  NULL, 'X' },
+    { "gitignore",    no_argument,        NULL, 'g' },
+    { "daemon",       required_argument,  NULL, 'd' },
+    { "root",         required_argument,  NULL, 'R' },
+    { "transport",    required_argument,  NULL, 't' },
+    { "shm-fd",       required_argument,  NULL, 'M' },
+    { "journal",      required_argument,  NULL, 'j' },
+    { "snapshot",     required_argument,  NULL, 'S' },
+    { "crawl",        no_argument,        NULL, 'C' },
+    { "stats",        required_argument,  NULL, 'T' },
+    { "overflow",     required_argument,  NULL, 'O' },
+    { "content-hash", no_argument,        NULL, 'H' },
+    { "content-hash-max", required_argument, NULL, 'K' },
     { 0, 0, 0, 0 }
   };
 
-  const char* shortopts = "hVps:l:nriFf:";
+  const char* shortopts = "hVps:l:a:nbriFf:e:cI:X:gd:R:t:j:S:CT:O:H";
 
   int c = -1;
+  // stream settings go to the latest --root, once there is one
+  struct cli_root* root = NULL;
 
   while ((c = getopt_long(argc, (char * const*)argv, shortopts, longopts, NULL)) != -1) {
     switch(c) {
     case 's': // since-when
-      args_info->since_when_arg = strtoull(optarg, NULL, 0);
+      if (root) {
+        root->since_when_given = true;
+        root->since_when_arg = strtoull(optarg, NULL, 0);
+      } else {
+        args_info->since_when_arg = strtoull(optarg, NULL, 0);
+      }
       break;
     case 'l': // latency
-      args_info->latency_arg = strtod(optarg, NULL);
+      if (root) {
+        root->latency_given = true;
+        root->latency_arg = strtod(optarg, NULL);
+      } else {
+        args_info->latency_arg = strtod(optarg, NULL);
+      }
       break;
+    case 'a': { // adaptive-latency
+      char* end = NULL;
+      args_info->adaptive_latency_min_arg = strtod(optarg, &end);
+      if (*end != ',' ||
+          (args_info->adaptive_latency_max_arg = strtod(end + 1, &end)) <= 0 ||
+          *end != '\0' || args_info->adaptive_latency_min_arg < 0 ||
+          args_info->adaptive_latency_min_arg > args_info->adaptive_latency_max_arg) {
+        fprintf(stderr, "--adaptive-latency wants min,max seconds with 0 <= min <= max "
+                        "and max > 0: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      args_info->adaptive_latency_given = true;
+      break;
+    }
     case 'n': // no-defer
-      args_info->no_defer_flag = true;
+      if (root) {
+        root->no_defer_flag = true;
+      } else {
+        args_info->no_defer_flag = true;
+      }
+      break;
+    case 'b': // debounce
+      if (root) {
+        root->debounce_flag = true;
+      } else {
+        args_info->debounce_flag = true;
+      }
       break;
     case 'r': // watch-root
-      args_info->watch_root_flag = true;
+      if (root) {
+        root->watch_root_flag = true;
+      } else {
+        args_info->watch_root_flag = true;
+      }
+      break;
+    case 'R': // root
+      args_info->root_args = (struct cli_root*)realloc(args_info->root_args,
+        (args_info->root_num + 1) * sizeof(struct cli_root));
+      if (!args_info->root_args) {
+        fprintf(stderr, "Unable to allocate root list\n");
+        exit(EXIT_FAILURE);
+      }
+      root = &args_info->root_args[args_info->root_num++];
+      memset(root, 0, sizeof(struct cli_root));
+      root->path = strdup(optarg);
       break;
     case 'i': // ignore-self
       args_info->ignore_self_flag = true;
       break;
     case 'F': // file-events
-      args_info->file_events_flag = true;
+      if (root) {
+        root->file_events_flag = true;
+      } else {
+        args_info->file_events_flag = true;
+      }
       break;
     case 'm': // mark-self
       args_info->mark_self_flag = true;
       break;
+    case 'c': // coalesce
+      args_info->coalesce_flag = true;
+      break;
+    case 'I': // include
+      cli_append_arg(&args_info->include_args, &args_info->include_num, optarg);
+      break;
+    case 'X': // exclude
+      cli_append_arg(&args_info->exclude_args, &args_info->exclude_num, optarg);
+      break;
+    case 'g': // gitignore
+      args_info->gitignore_flag = true;
+      break;
     case 'f': // format
-      if (strcmp(optarg, "classic") == 0) {
-        args_info->format_arg = kFSEventWatchOutputFormatClassic;
-      } else if (strcmp(optarg, "niw") == 0) {
-        args_info->format_arg = kFSEventWatchOutputFormatNIW;
-      } else if (strcmp(optarg, "tnetstring") == 0) {
-        args_info->format_arg = kFSEventWatchOutputFormatTNetstring;
-      } else if (strcmp(optarg, "otnetstring") == 0) {
-        args_info->format_arg = kFSEventWatchOutputFormatOTNetstring;
-      } else {
+      if (!cli_parse_format(optarg, &args_info->format_arg)) {
         fprintf(stderr, "Unknown output format: %s\n", optarg);
         exit(EXIT_FAILURE);
       }
       break;
+    case 't': // transport
+      if (strcmp(optarg, "pipe") == 0) {
+        args_info->transport_arg = kFSEventWatchTransportPipe;
+      } else if (strcmp(optarg, "shm") == 0) {
+        args_info->transport_arg = kFSEventWatchTransportShm;
+      } else {
+        fprintf(stderr, "Unknown transport: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'O': // overflow
+      if (strcmp(optarg, "block") == 0) {
+        args_info->overflow_arg = kFSEventWatchOverflowBlock;
+      } else if (strcmp(optarg, "coalesce") == 0) {
+        args_info->overflow_arg = kFSEventWatchOverflowCoalesce;
+      } else if (strcmp(optarg, "drop") == 0) {
+        args_info->overflow_arg = kFSEventWatchOverflowDrop;
+      } else {
+        fprintf(stderr, "Unknown overflow policy: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'M': // shm-fd
+      args_info->shm_fd_arg = (int)strtol(optarg, NULL, 10);
+      break;
+    case 'H': // content-hash
+      args_info->content_hash_flag = true;
+      break;
+    case 'K': // content-hash-max
+      args_info->content_hash_max_arg = strtoull(optarg, NULL, 0);
+      break;
+    case 'j': // journal
+      free(args_info->journal_arg);
+      args_info->journal_arg = strdup(optarg);
+      break;
+
+    case 'S': // snapshot
+      free(args_info->snapshot_arg);
+      args_info->snapshot_arg = strdup(optarg);
+      break;
+
+    case 'C': // crawl
+      args_info->crawl_flag = true;
+      break;
+
+    case 'T': // stats
+      args_info->stats_arg = strtod(optarg, NULL);
+      break;
+    case 'd': // daemon
+      free(args_info->daemon_arg);
+      args_info->daemon_arg = strdup(optarg);
+      break;
+    case 'e': // event-source
+#ifdef __APPLE__
+      if (strcmp(optarg, "fsevents") == 0) {
+        args_info->event_source_arg = kFSEventWatchEventSourceFSEvents;
+#else
+      if (strcmp(optarg, "inotify") == 0) {
+        args_info->event_source_arg = kFSEventWatchEventSourceInotify;
+      } else if (strcmp(optarg, "fanotify") == 0) {
+        args_info->event_source_arg = kFSEventWatchEventSourceFanotify;
+#endif
+      } else {
+        fprintf(stderr, "Unknown or unavailable event source: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
     case 'V': // version
       cli_print_version();
       exit(EXIT_SUCCESS);
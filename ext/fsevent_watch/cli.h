@@ -16,15 +16,55 @@
 #endif /* CLI_VERSION */
 
 
+// A --root and the stream settings given after it, which override the
+// defaults for that path alone
+struct cli_root {
+  char* path;
+  bool since_when_given;
+  UInt64 since_when_arg;
+  bool latency_given;
+  double latency_arg;
+  bool no_defer_flag;
+  bool debounce_flag;
+  bool watch_root_flag;
+  bool file_events_flag;
+};
+
 struct cli_info {
   UInt64 since_when_arg;
   double latency_arg;
+  bool adaptive_latency_given;
+  double adaptive_latency_min_arg;
+  double adaptive_latency_max_arg;
   bool no_defer_flag;
+  bool debounce_flag;
   bool watch_root_flag;
   bool ignore_self_flag;
   bool file_events_flag;
   bool mark_self_flag;
+  bool coalesce_flag;
+  bool gitignore_flag;
+  bool crawl_flag;
+  bool content_hash_flag;
+  UInt64 content_hash_max_arg;
+  double stats_arg;
   enum FSEventWatchOutputFormat format_arg;
+  enum FSEventWatchEventSource event_source_arg;
+  enum FSEventWatchTransport transport_arg;
+  enum FSEventWatchOverflow overflow_arg;
+  int shm_fd_arg;
+
+  char* daemon_arg;
+  char* journal_arg;
+  char* snapshot_arg;
+
+  char** include_args;
+  unsigned include_num;
+  char** exclude_args;
+  unsigned exclude_num;
+
+  struct cli_root* root_args;
+  unsigned root_num;
 
   char** inputs;
   unsigned inputs_num;
@@ -37,6 +77,9 @@ extern const char* cli_info_help[];
 void cli_print_help(void);
 void cli_print_version(void);
 
+// Look up an output format by its --format name
+bool cli_parse_format (const char* name, enum FSEventWatchOutputFormat* format);
+
 int cli_parser (int argc, const char** argv, struct cli_info* args_info);
 void cli_parser_init (struct cli_info* args_info);
 void cli_parser_free (struct cli_info* args_info);
@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include "coalesce.h"
+
+#define COALESCE_INITIAL_CAPACITY  256
+
+void coalesce_init(struct coalesce* coalesce)
+{
+  memset(coalesce, 0, sizeof(struct coalesce));
+}
+
+void coalesce_free(struct coalesce* coalesce)
+{
+  free(coalesce->slots);
+  event_list_free(&coalesce->events);
+  free(coalesce->lengths);
+  memset(coalesce, 0, sizeof(struct coalesce));
+}
+
+static void coalesce_reserve(struct coalesce* coalesce, size_t numEvents)
+{
+  if (event_list_reset(&coalesce->events, numEvents)) {
+    coalesce->lengths = realloc(coalesce->lengths, coalesce->events.capacity * sizeof(size_t));
+    if (!coalesce->lengths) {
+      fprintf(stderr, "Unable to grow coalesce buffers to %zu events\n", coalesce->events.capacity);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (numEvents * 2 > coalesce->num_slots || coalesce->generation == UINT32_MAX) {
+    size_t num_slots = coalesce->num_slots ? coalesce->num_slots : COALESCE_INITIAL_CAPACITY * 2;
+    while (num_slots < numEvents * 2) {
+      num_slots *= 2;
+    }
+
+    free(coalesce->slots);
+    coalesce->slots = calloc(num_slots, sizeof(struct coalesce_slot));
+    if (!coalesce->slots) {
+      fprintf(stderr, "Unable to allocate %zu coalesce slots\n", num_slots);
+      exit(EXIT_FAILURE);
+    }
+    coalesce->num_slots = num_slots;
+    // a zeroed slot belongs to no batch
+    coalesce->generation = 0;
+  }
+}
+
+size_t coalesce_batch(struct coalesce* coalesce,
+                      size_t numEvents,
+                      char** paths,
+                      const FSEventStreamEventFlags eventFlags[],
+                      const FSEventStreamEventId eventIds[])
+{
+  coalesce_reserve(coalesce, numEvents);
+
+  UInt32 generation = ++coalesce->generation;
+  size_t mask = coalesce->num_slots - 1;
+  struct event_list* events = &coalesce->events;
+
+  for (size_t i = 0; i < numEvents; i++) {
+    size_t length;
+    UInt64 hash = fnv1a_string(paths[i], &length);
+
+    size_t s = (size_t)hash & mask;
+    for (;;) {
+      struct coalesce_slot* slot = &coalesce->slots[s];
+
+      if (slot->generation != generation) {
+        slot->hash = hash;
+        slot->generation = generation;
+        slot->index = (UInt32)events->num_events;
+
+        coalesce->lengths[events->num_events] = length;
+        event_list_push(events, paths[i], eventFlags[i], eventIds[i]);
+        break;
+      }
+
+      size_t index = slot->index;
+      if (slot->hash == hash &&
+          coalesce->lengths[index] == length &&
+          memcmp(events->paths[index], paths[i], length) == 0) {
+        events->flags[index] |= eventFlags[i];
+        if (eventIds[i] > events->ids[index]) {
+          events->ids[index] = eventIds[i];
+        }
+        break;
+      }
+
+      s = (s + 1) & mask;
+    }
+  }
+
+  return events->num_events;
+}
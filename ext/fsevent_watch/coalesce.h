@@ -0,0 +1,48 @@
+/**
+ * @headerfile coalesce.h
+ * Collapse repeated paths within one callback batch
+ *
+ * A file that is written, chmodded and renamed inside one latency window
+ * shows up once per change. With --coalesce every path is reported once per
+ * batch, at the position of its first occurrence, with the flags of all its
+ * occurrences OR-ed together and the highest event id among them.
+ *
+ * Paths are looked up in an open-addressing table keyed on their bytes.
+ * Slots are stamped with the batch they were filled in, so the table never
+ * needs clearing and the cost of a batch stays linear in its size.
+ */
+
+#ifndef fsevent_watch_coalesce_h
+#define fsevent_watch_coalesce_h
+
+#include "common.h"
+#include "event_list.h"
+
+struct coalesce_slot {
+  UInt64  hash;
+  UInt32  generation;
+  UInt32  index;
+};
+
+struct coalesce {
+  struct coalesce_slot*     slots;
+  size_t                    num_slots;
+  UInt32                    generation;
+
+  struct event_list         events;
+  // of events.paths
+  size_t*                   lengths;
+};
+
+void coalesce_init(struct coalesce* coalesce);
+void coalesce_free(struct coalesce* coalesce);
+
+// Collapse a batch. The results are left in coalesce->events and stay valid
+// until the next call. Returns the number of unique paths.
+size_t coalesce_batch(struct coalesce* coalesce,
+                      size_t numEvents,
+                      char** paths,
+                      const FSEventStreamEventFlags eventFlags[],
+                      const FSEventStreamEventId eventIds[]);
+
+#endif // fsevent_watch_coalesce_h
@@ -1,22 +1,81 @@
 #ifndef fsevent_watch_common_h
 #define fsevent_watch_common_h
 
+#ifdef __APPLE__
 #include <CoreFoundation/CoreFoundation.h>
 #ifdef __OBJC__
 #import <Foundation/Foundation.h>
 #endif
 
 #include <CoreServices/CoreServices.h>
+#endif
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "compat.h"
 #include "defines.h"
-#include "TSICTString.h"
+#include "TSITString.h"
+
+// fsevent_watch's own stream flag for --debounce, beside FSEvents' NoDefer.
+// It's never passed on to FSEventStreamCreate.
+#define kFSEventWatchCreateFlagDebounce ((FSEventStreamCreateFlags)0x80000000U)
+
+// FNV-1a, which fsevent_watch hashes paths with. Its hash tables are all
+// open-addressed and kept at most half full, so probe sequences stay short.
+static inline UInt64 fnv1a(const void* bytes, size_t length)
+{
+  const unsigned char* c = bytes;
+  UInt64 hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ c[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// The same for a NUL-terminated string, measuring it on the way into length
+// unless that's NULL
+static inline UInt64 fnv1a_string(const char* string, size_t* length)
+{
+  const unsigned char* c = (const unsigned char*)string;
+  UInt64 hash = 14695981039346656037ULL;
+  for (; *c; c++) {
+    hash = (hash ^ *c) * 1099511628211ULL;
+  }
+  if (length) {
+    *length = (size_t)((const char*)c - string);
+  }
+  return hash;
+}
 
 enum FSEventWatchOutputFormat {
   kFSEventWatchOutputFormatClassic,
   kFSEventWatchOutputFormatNIW,
+  kFSEventWatchOutputFormatNIWRoot,
   kFSEventWatchOutputFormatTNetstring,
-  kFSEventWatchOutputFormatOTNetstring
+  kFSEventWatchOutputFormatOTNetstring,
+  kFSEventWatchOutputFormatBinary,
+  kFSEventWatchOutputFormatInterned,
+  kFSEventWatchOutputFormatFrontCoded
+};
+
+enum FSEventWatchTransport {
+  kFSEventWatchTransportPipe,
+  kFSEventWatchTransportShm
+};
+
+enum FSEventWatchEventSource {
+  kFSEventWatchEventSourceFSEvents,
+  kFSEventWatchEventSourceInotify,
+  kFSEventWatchEventSourceFanotify
+};
+
+enum FSEventWatchOverflow {
+  kFSEventWatchOverflowBlock,
+  kFSEventWatchOverflowCoalesce,
+  kFSEventWatchOverflowDrop
 };
 
 #endif /* fsevent_watch_common_h */
@@ -1,5 +1,7 @@
 #include "compat.h"
 
+#ifdef __APPLE__
+
 #if MAC_OS_X_VERSION_MAX_ALLOWED < 1060
 FSEventStreamCreateFlags  kFSEventStreamCreateFlagIgnoreSelf        = 0x00000008;
 #endif
@@ -23,3 +25,5 @@ FSEventStreamEventFlags   kFSEventStreamEventFlagItemIsSymlink      = 0x00040000
 FSEventStreamCreateFlags  kFSEventStreamCreateFlagMarkSelf          = 0x00000020;
 FSEventStreamEventFlags   kFSEventStreamEventFlagOwnEvent           = 0x00080000;
 #endif
+
+#endif // __APPLE__
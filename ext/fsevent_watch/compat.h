@@ -6,12 +6,18 @@
  * features present in later OS releases, we need to define any missing enum
  * constants not present in the older SDK. This allows us to safely defer
  * feature detection to runtime (and avoid recompilation).
+ *
+ * On platforms without CoreServices at all, the FSEventStream types and
+ * constants used throughout fsevent_watch are defined here with the same
+ * values Apple uses, so that every event source produces identical output.
  */
 
 
 #ifndef fsevent_watch_compat_h
 #define fsevent_watch_compat_h
 
+#ifdef __APPLE__
+
 #ifndef __CORESERVICES__
 #include <CoreServices/CoreServices.h>
 #endif // __CORESERVICES__
@@ -43,5 +49,71 @@ extern FSEventStreamCreateFlags kFSEventStreamCreateFlagMarkSelf;
 extern FSEventStreamEventFlags  kFSEventStreamEventFlagOwnEvent;
 #endif
 
+#else // __APPLE__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t   UInt8;
+typedef uint16_t  UInt16;
+typedef uint32_t  UInt32;
+typedef uint64_t  UInt64;
+typedef int32_t   SInt32;
+typedef int64_t   SInt64;
+typedef double    CFTimeInterval;
+
+typedef UInt32    FSEventStreamCreateFlags;
+typedef UInt32    FSEventStreamEventFlags;
+typedef UInt64    FSEventStreamEventId;
+
+typedef struct __FSEventStream*       FSEventStreamRef;
+typedef const struct __FSEventStream* ConstFSEventStreamRef;
+
+typedef void (*FSEventStreamCallback)(ConstFSEventStreamRef streamRef,
+                                      void* clientCallBackInfo,
+                                      size_t numEvents,
+                                      void* eventPaths,
+                                      const FSEventStreamEventFlags eventFlags[],
+                                      const FSEventStreamEventId eventIds[]);
+
+#define kFSEventStreamEventIdSinceNow ((FSEventStreamEventId)0xFFFFFFFFFFFFFFFFULL)
+
+enum {
+  kFSEventStreamCreateFlagNone              = 0x00000000,
+  kFSEventStreamCreateFlagUseCFTypes        = 0x00000001,
+  kFSEventStreamCreateFlagNoDefer           = 0x00000002,
+  kFSEventStreamCreateFlagWatchRoot         = 0x00000004,
+  kFSEventStreamCreateFlagIgnoreSelf        = 0x00000008,
+  kFSEventStreamCreateFlagFileEvents        = 0x00000010,
+  kFSEventStreamCreateFlagMarkSelf          = 0x00000020
+};
+
+enum {
+  kFSEventStreamEventFlagNone               = 0x00000000,
+  kFSEventStreamEventFlagMustScanSubDirs    = 0x00000001,
+  kFSEventStreamEventFlagUserDropped        = 0x00000002,
+  kFSEventStreamEventFlagKernelDropped      = 0x00000004,
+  kFSEventStreamEventFlagEventIdsWrapped    = 0x00000008,
+  kFSEventStreamEventFlagHistoryDone        = 0x00000010,
+  kFSEventStreamEventFlagRootChanged        = 0x00000020,
+  kFSEventStreamEventFlagMount              = 0x00000040,
+  kFSEventStreamEventFlagUnmount            = 0x00000080,
+  kFSEventStreamEventFlagItemCreated        = 0x00000100,
+  kFSEventStreamEventFlagItemRemoved        = 0x00000200,
+  kFSEventStreamEventFlagItemInodeMetaMod   = 0x00000400,
+  kFSEventStreamEventFlagItemRenamed        = 0x00000800,
+  kFSEventStreamEventFlagItemModified       = 0x00001000,
+  kFSEventStreamEventFlagItemFinderInfoMod  = 0x00002000,
+  kFSEventStreamEventFlagItemChangeOwner    = 0x00004000,
+  kFSEventStreamEventFlagItemXattrMod       = 0x00008000,
+  kFSEventStreamEventFlagItemIsFile         = 0x00010000,
+  kFSEventStreamEventFlagItemIsDir          = 0x00020000,
+  kFSEventStreamEventFlagItemIsSymlink      = 0x00040000,
+  kFSEventStreamEventFlagOwnEvent           = 0x00080000
+};
+
+#endif // __APPLE__
+
 
 #endif // fsevent_watch_compat_h
@@ -0,0 +1,540 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "content_hash.h"
+#include "event_list.h"
+
+#define CONTENT_HASH_INITIAL_CAPACITY  256
+
+#ifdef __APPLE__
+#define CONTENT_HASH_MTIME(st) ((st).st_mtimespec)
+#define CONTENT_HASH_CTIME(st) ((st).st_ctimespec)
+#else
+#define CONTENT_HASH_MTIME(st) ((st).st_mtim)
+#define CONTENT_HASH_CTIME(st) ((st).st_ctim)
+#endif
+
+// What the cache knows of an inode. ino 0 marks an empty slot.
+struct content_hash_entry {
+  UInt64  dev;
+  UInt64  ino;
+  UInt64  path_hash;    // of the path it was last seen at
+  UInt64  size;
+  SInt64  mtime;        // nanoseconds
+  SInt64  ctime;        // nanoseconds
+  SInt64  hashed_at;    // seconds, or -1 if the hash isn't known
+  UInt64  hash;
+};
+
+enum content_hash_result {
+  kContentHashSkipped,      // not a regular file we could read, or over the cap
+  kContentHashHashed,
+  kContentHashCached        // size, mtime and ctime say it's what was hashed
+};
+
+// A file a batch modified, hashed by whichever thread gets to it first
+struct content_hash_job {
+  const char*               path;
+  size_t                    event;
+  enum content_hash_result  result;
+  struct content_hash_entry entry;    // what the file is now
+};
+
+struct content_hash_thread {
+  struct content_hash*  hash;
+  pthread_t             thread;
+  unsigned long         generation;
+};
+
+struct content_hash {
+  size_t                      max_size;
+  int                         num_threads;
+  int                         started;
+  struct content_hash_thread* threads;
+
+  pthread_mutex_t             lock;
+  pthread_cond_t              start;    // a batch needs the threads
+  pthread_cond_t              idle;     // a thread is done with the batch
+  unsigned long               generation;
+  int                         active;
+  bool                        stopping;
+  atomic_size_t               next;     // the next job to take
+
+  // only ever changed between batches, so the threads read it unlocked
+  struct content_hash_entry*  entries;
+  size_t                      num_slots;
+  size_t                      num_entries;
+
+  struct content_hash_job*    jobs;
+  size_t                      num_jobs;
+  struct event_list           events;
+
+  UInt64                      unchanged;
+  UInt64                      bytes_hashed;
+};
+
+// where the thread hashing a mapped file goes back to if it faults
+static _Thread_local sigjmp_buf* content_hash_fault = NULL;
+
+static void content_hash_sigbus(int sig)
+{
+  if (content_hash_fault) {
+    siglongjmp(*content_hash_fault, 1);
+  }
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static void* content_hash_alloc(void* ptr, size_t size)
+{
+  ptr = realloc(ptr, size);
+  if (!ptr) {
+    fprintf(stderr, "Unable to allocate content hash cache\n");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+#define XXH64_PRIME1  11400714785074694791ULL
+#define XXH64_PRIME2  14029467366897019727ULL
+#define XXH64_PRIME3  1609587929392839161ULL
+#define XXH64_PRIME4  9650029242287828579ULL
+#define XXH64_PRIME5  2870177450012600261ULL
+
+static inline UInt64 xxh64_rotl(UInt64 x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline UInt64 xxh64_read64(const unsigned char* p)
+{
+  UInt64 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline UInt32 xxh64_read32(const unsigned char* p)
+{
+  UInt32 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline UInt64 xxh64_round(UInt64 acc, UInt64 input)
+{
+  acc += input * XXH64_PRIME2;
+  acc = xxh64_rotl(acc, 31);
+  return acc * XXH64_PRIME1;
+}
+
+static inline UInt64 xxh64_merge(UInt64 acc, UInt64 value)
+{
+  acc ^= xxh64_round(0, value);
+  return acc * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+UInt64 content_hash_xxh64(const void* data, size_t length)
+{
+  const unsigned char* p = data;
+  const unsigned char* end = p + length;
+  UInt64 h;
+
+  if (length >= 32) {
+    // four lanes with no dependency on each other, a stripe at a time
+    UInt64 v1 = XXH64_PRIME1 + XXH64_PRIME2;
+    UInt64 v2 = XXH64_PRIME2;
+    UInt64 v3 = 0;
+    UInt64 v4 = 0 - XXH64_PRIME1;
+    const unsigned char* limit = end - 32;
+    do {
+      v1 = xxh64_round(v1, xxh64_read64(p));
+      v2 = xxh64_round(v2, xxh64_read64(p + 8));
+      v3 = xxh64_round(v3, xxh64_read64(p + 16));
+      v4 = xxh64_round(v4, xxh64_read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = xxh64_rotl(v1, 1) + xxh64_rotl(v2, 7) + xxh64_rotl(v3, 12) + xxh64_rotl(v4, 18);
+    h = xxh64_merge(h, v1);
+    h = xxh64_merge(h, v2);
+    h = xxh64_merge(h, v3);
+    h = xxh64_merge(h, v4);
+  } else {
+    h = XXH64_PRIME5;
+  }
+
+  h += (UInt64)length;
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh64_round(0, xxh64_read64(p));
+    h = xxh64_rotl(h, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+  }
+  if (p + 4 <= end) {
+    h ^= (UInt64)xxh64_read32(p) * XXH64_PRIME1;
+    h = xxh64_rotl(h, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= (UInt64)*p * XXH64_PRIME5;
+    h = xxh64_rotl(h, 11) * XXH64_PRIME1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH64_PRIME2;
+  h ^= h >> 29;
+  h *= XXH64_PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+// The slot holding an inode, or the empty one it would go in
+static struct content_hash_entry* content_hash_slot(const struct content_hash* hash,
+                                                    UInt64 dev, UInt64 ino)
+{
+  UInt64 key = (ino ^ (dev * XXH64_PRIME2)) * XXH64_PRIME1;
+  size_t mask = hash->num_slots - 1;
+  size_t s = (size_t)(key >> 32) & mask;
+
+  for (;;) {
+    struct content_hash_entry* entry = &hash->entries[s];
+    if (entry->ino == 0 || (entry->ino == ino && entry->dev == dev)) {
+      return entry;
+    }
+    s = (s + 1) & mask;
+  }
+}
+
+static void content_hash_grow(struct content_hash* hash)
+{
+  // forget everything once the table holds as many files as it ever should
+  if (hash->num_entries * 2 < hash->num_slots) {
+    return;
+  }
+  if (hash->num_entries >= CONTENT_HASH_MAX_ENTRIES) {
+    memset(hash->entries, 0, hash->num_slots * sizeof(struct content_hash_entry));
+    hash->num_entries = 0;
+    return;
+  }
+
+  struct content_hash_entry* old = hash->entries;
+  size_t old_slots = hash->num_slots;
+
+  hash->num_slots = old_slots ? old_slots * 2 : CONTENT_HASH_INITIAL_CAPACITY * 2;
+  hash->entries = calloc(hash->num_slots, sizeof(struct content_hash_entry));
+  if (!hash->entries) {
+    fprintf(stderr, "Unable to allocate %zu content hash slots\n", hash->num_slots);
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < old_slots; i++) {
+    if (old[i].ino != 0) {
+      *content_hash_slot(hash, old[i].dev, old[i].ino) = old[i];
+    }
+  }
+  free(old);
+}
+
+// Stat and, unless the cache already knows them, hash a job's file
+static void content_hash_run(struct content_hash* hash, struct content_hash_job* job)
+{
+  job->result = kContentHashSkipped;
+  job->entry.ino = 0;
+
+  // nonblocking, so a fifo doesn't hold up the open
+  int fd = open(job->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_ino == 0) {
+    close(fd);
+    return;
+  }
+
+  struct content_hash_entry* now = &job->entry;
+  now->dev = (UInt64)st.st_dev;
+  now->ino = (UInt64)st.st_ino;
+  now->size = (UInt64)st.st_size;
+  now->mtime = (SInt64)CONTENT_HASH_MTIME(st).tv_sec * 1000000000 + CONTENT_HASH_MTIME(st).tv_nsec;
+  now->ctime = (SInt64)CONTENT_HASH_CTIME(st).tv_sec * 1000000000 + CONTENT_HASH_CTIME(st).tv_nsec;
+  now->hashed_at = -1;
+
+  if (now->size > hash->max_size) {
+    close(fd);
+    return;
+  }
+
+  // a write within the second the file was hashed could leave its times as
+  // they were, so only an older ctime vouches for the contents
+  const struct content_hash_entry* cached = content_hash_slot(hash, now->dev, now->ino);
+  if (cached->ino != 0 && cached->hashed_at >= 0 && cached->path_hash == now->path_hash &&
+      cached->size == now->size && cached->mtime == now->mtime && cached->ctime == now->ctime &&
+      now->ctime / 1000000000 < cached->hashed_at) {
+    now->hash = cached->hash;
+    now->hashed_at = cached->hashed_at;
+    job->result = kContentHashCached;
+    close(fd);
+    return;
+  }
+
+  struct timespec started;
+  clock_gettime(CLOCK_REALTIME, &started);
+
+  if (now->size == 0) {
+    now->hash = content_hash_xxh64(NULL, 0);
+  } else {
+    size_t size = (size_t)now->size;
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    sigjmp_buf fault;
+    if (sigsetjmp(fault, 1)) {
+      // truncated under us
+      content_hash_fault = NULL;
+      munmap(data, size);
+      close(fd);
+      return;
+    }
+    content_hash_fault = &fault;
+    now->hash = content_hash_xxh64(data, size);
+    content_hash_fault = NULL;
+
+    munmap(data, size);
+  }
+  close(fd);
+
+  now->hashed_at = (SInt64)started.tv_sec;
+  job->result = kContentHashHashed;
+}
+
+static void content_hash_work(struct content_hash* hash)
+{
+  size_t j;
+  while ((j = atomic_fetch_add(&hash->next, 1)) < hash->num_jobs) {
+    content_hash_run(hash, &hash->jobs[j]);
+  }
+}
+
+static void* content_hash_thread(void* info)
+{
+  struct content_hash_thread* thread = info;
+  struct content_hash* hash = thread->hash;
+
+  pthread_mutex_lock(&hash->lock);
+  for (;;) {
+    while (hash->generation == thread->generation && !hash->stopping) {
+      pthread_cond_wait(&hash->start, &hash->lock);
+    }
+    if (hash->stopping) {
+      break;
+    }
+    thread->generation = hash->generation;
+    pthread_mutex_unlock(&hash->lock);
+
+    content_hash_work(hash);
+
+    pthread_mutex_lock(&hash->lock);
+    if (--hash->active == 0) {
+      pthread_cond_broadcast(&hash->idle);
+    }
+  }
+  pthread_mutex_unlock(&hash->lock);
+
+  return NULL;
+}
+
+struct content_hash* content_hash_create(size_t maxSize, int numThreads)
+{
+  if (numThreads < 1) {
+    numThreads = 1;
+  } else if (numThreads > CONTENT_HASH_MAX_THREADS) {
+    numThreads = CONTENT_HASH_MAX_THREADS;
+  }
+
+  struct content_hash* hash = content_hash_alloc(NULL, sizeof(struct content_hash));
+  memset(hash, 0, sizeof(struct content_hash));
+  hash->max_size = maxSize;
+  hash->num_threads = numThreads;
+  hash->threads = content_hash_alloc(NULL, (size_t)numThreads * sizeof(struct content_hash_thread));
+  memset(hash->threads, 0, (size_t)numThreads * sizeof(struct content_hash_thread));
+  for (int i = 0; i < numThreads; i++) {
+    hash->threads[i].hash = hash;
+  }
+
+  pthread_mutex_init(&hash->lock, NULL);
+  pthread_cond_init(&hash->start, NULL);
+  pthread_cond_init(&hash->idle, NULL);
+  atomic_init(&hash->next, 0);
+
+  content_hash_grow(hash);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = content_hash_sigbus;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGBUS, &action, NULL);
+
+  return hash;
+}
+
+void content_hash_release(struct content_hash* hash)
+{
+  pthread_mutex_lock(&hash->lock);
+  hash->stopping = true;
+  pthread_cond_broadcast(&hash->start);
+  pthread_mutex_unlock(&hash->lock);
+
+  for (int i = 1; i <= hash->started; i++) {
+    pthread_join(hash->threads[i].thread, NULL);
+  }
+
+  pthread_mutex_destroy(&hash->lock);
+  pthread_cond_destroy(&hash->start);
+  pthread_cond_destroy(&hash->idle);
+  free(hash->threads);
+  free(hash->entries);
+  free(hash->jobs);
+  event_list_free(&hash->events);
+  free(hash);
+}
+
+static void content_hash_reserve(struct content_hash* hash, size_t numEvents)
+{
+  if (event_list_reset(&hash->events, numEvents)) {
+    hash->jobs = content_hash_alloc(hash->jobs,
+                                    hash->events.capacity * sizeof(struct content_hash_job));
+  }
+}
+
+// Hash every job, spreading them over the threads when there's more than one
+static void content_hash_run_jobs(struct content_hash* hash)
+{
+  atomic_store(&hash->next, 0);
+
+  if (hash->num_jobs < 2 || hash->num_threads < 2) {
+    content_hash_work(hash);
+    return;
+  }
+
+  pthread_mutex_lock(&hash->lock);
+  while (hash->started < hash->num_threads - 1) {
+    struct content_hash_thread* thread = &hash->threads[hash->started + 1];
+    thread->generation = hash->generation;
+    if (pthread_create(&thread->thread, NULL, content_hash_thread, thread) != 0) {
+      break;
+    }
+    hash->started++;
+  }
+  hash->generation++;
+  hash->active = hash->started;
+  pthread_cond_broadcast(&hash->start);
+  pthread_mutex_unlock(&hash->lock);
+
+  content_hash_work(hash);
+
+  pthread_mutex_lock(&hash->lock);
+  while (hash->active > 0) {
+    pthread_cond_wait(&hash->idle, &hash->lock);
+  }
+  pthread_mutex_unlock(&hash->lock);
+}
+
+size_t content_hash_batch(struct content_hash* hash,
+                          size_t numEvents,
+                          char** paths,
+                          const FSEventStreamEventFlags eventFlags[],
+                          const FSEventStreamEventId eventIds[],
+                          char*** outPaths,
+                          const FSEventStreamEventFlags** outFlags,
+                          const FSEventStreamEventId** outIds)
+{
+  content_hash_reserve(hash, numEvents);
+
+  // the flags are variables on older SDKs, so the masks are made here
+  FSEventStreamEventFlags notFile = kFSEventStreamEventFlagItemIsDir |
+                                    kFSEventStreamEventFlagItemIsSymlink |
+                                    kFSEventStreamEventFlagItemRemoved;
+  FSEventStreamEventFlags modification = kFSEventStreamEventFlagItemModified |
+                                         kFSEventStreamEventFlagItemInodeMetaMod |
+                                         kFSEventStreamEventFlagItemIsFile |
+                                         kFSEventStreamEventFlagOwnEvent;
+
+  hash->num_jobs = 0;
+  for (size_t i = 0; i < numEvents; i++) {
+    if ((eventFlags[i] & kFSEventStreamEventFlagItemModified) &&
+        (eventFlags[i] & kFSEventStreamEventFlagItemIsFile) &&
+        !(eventFlags[i] & notFile)) {
+      struct content_hash_job* job = &hash->jobs[hash->num_jobs++];
+      job->path = paths[i];
+      job->event = i;
+      job->entry.path_hash = fnv1a_string(paths[i], NULL);
+    }
+  }
+
+  content_hash_run_jobs(hash);
+
+  // the threads are done, so the cache can change again
+  size_t j = 0;
+  for (size_t i = 0; i < numEvents; i++) {
+    bool unchanged = false;
+
+    if (j < hash->num_jobs && hash->jobs[j].event == i) {
+      struct content_hash_job* job = &hash->jobs[j++];
+
+      if (job->result != kContentHashSkipped) {
+        content_hash_grow(hash);
+        struct content_hash_entry* entry = content_hash_slot(hash, job->entry.dev, job->entry.ino);
+        if (entry->ino == 0) {
+          hash->num_entries++;
+        } else {
+          unchanged = entry->hashed_at >= 0 && entry->path_hash == job->entry.path_hash &&
+                      entry->size == job->entry.size && entry->hash == job->entry.hash;
+        }
+        *entry = job->entry;
+
+        if (job->result == kContentHashHashed) {
+          hash->bytes_hashed += job->entry.size;
+        }
+      } else if (job->entry.ino != 0) {
+        // over the cap: whatever was hashed before is no longer the file
+        struct content_hash_entry* entry = content_hash_slot(hash, job->entry.dev, job->entry.ino);
+        if (entry->ino != 0) {
+          entry->hashed_at = -1;
+        }
+      }
+
+      unchanged = unchanged && (eventFlags[i] & ~modification) == 0;
+    }
+
+    if (unchanged) {
+      hash->unchanged++;
+      continue;
+    }
+    event_list_push(&hash->events, paths[i], eventFlags[i], eventIds[i]);
+  }
+
+  *outPaths = hash->events.paths;
+  *outFlags = hash->events.flags;
+  *outIds = hash->events.ids;
+  return hash->events.num_events;
+}
+
+UInt64 content_hash_unchanged(const struct content_hash* hash)
+{
+  return hash->unchanged;
+}
+
+UInt64 content_hash_bytes_hashed(const struct content_hash* hash)
+{
+  return hash->bytes_hashed;
+}
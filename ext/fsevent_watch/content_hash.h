@@ -0,0 +1,65 @@
+/**
+ * @headerfile content_hash.h
+ * --content-hash: drop modifications that left a file's contents as they were
+ *
+ * Editors and code generators often rewrite a file with exactly what it
+ * already held, and every such write is reported as a modification. With
+ * --content-hash each file event carrying ItemModified has its file hashed,
+ * and a cache keyed on (device, inode) keeps the size, mtime, ctime and
+ * 64-bit hash it had. An event that is nothing but a modification (and the
+ * inode change that comes with one) is dropped when the file's hash matches
+ * the one cached for it. Anything else about the event, a file seen for
+ * the first time, and files over the size cap always go through.
+ *
+ * Files are mmap()ed and hashed with XXH64, whose four independent lanes
+ * over 32 byte stripes keep the CPU's multipliers busy. A file whose size,
+ * mtime and ctime are still the cached ones, and whose ctime was already in
+ * the past when it was hashed, isn't read again. Files are hashed in
+ * parallel by up to CONTENT_HASH_MAX_THREADS threads, the caller's (the
+ * writer thread's) included, so a batch of many files doesn't take as long
+ * as hashing them one after another, and the event source is never kept
+ * waiting.
+ *
+ * A file that shrinks while it is being hashed raises SIGBUS on its pages
+ * past the new end; that is caught, and the event goes through.
+ */
+
+#ifndef fsevent_watch_content_hash_h
+#define fsevent_watch_content_hash_h
+
+#include "common.h"
+
+#define CONTENT_HASH_MAX_THREADS        4
+#define CONTENT_HASH_DEFAULT_MAX_SIZE   (16 * 1024 * 1024)
+#define CONTENT_HASH_MAX_ENTRIES        (1 << 20)
+
+struct content_hash;
+
+// A cache hashing files of up to maxSize bytes with up to numThreads
+// threads, the caller's included
+struct content_hash* content_hash_create(size_t maxSize, int numThreads);
+void content_hash_release(struct content_hash* hash);
+
+// Hash the files the batch modified, and drop the events of those that are
+// unchanged. The survivors are left in the arrays returned through
+// outPaths, outFlags and outIds, valid until the next call, and their
+// number is returned.
+size_t content_hash_batch(struct content_hash* hash,
+                          size_t numEvents,
+                          char** paths,
+                          const FSEventStreamEventFlags eventFlags[],
+                          const FSEventStreamEventId eventIds[],
+                          char*** outPaths,
+                          const FSEventStreamEventFlags** outFlags,
+                          const FSEventStreamEventId** outIds);
+
+// Events dropped so far
+UInt64 content_hash_unchanged(const struct content_hash* hash);
+
+// Bytes read and hashed so far
+UInt64 content_hash_bytes_hashed(const struct content_hash* hash);
+
+// XXH64 of length bytes, seed 0
+UInt64 content_hash_xxh64(const void* data, size_t length);
+
+#endif // fsevent_watch_content_hash_h
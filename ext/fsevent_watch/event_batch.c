@@ -0,0 +1,265 @@
+#include <time.h>
+#include "event_batch.h"
+#include "stats.h"
+
+#define EVENT_BATCH_INITIAL_CAPACITY  256
+#define EVENT_BATCH_INITIAL_BYTES     (EVENT_BATCH_INITIAL_CAPACITY * 64)
+
+void event_batch_init(struct event_batch* batch,
+                      FSEventStreamCallback callback,
+                      void* info,
+                      CFTimeInterval latency,
+                      FSEventStreamCreateFlags flags)
+{
+  memset(batch, 0, sizeof(struct event_batch));
+
+  batch->callback = callback;
+  batch->info = info;
+  batch->latency = latency;
+  batch->no_defer = (flags & kFSEventStreamCreateFlagNoDefer) != 0;
+  batch->debounce = (flags & kFSEventWatchCreateFlagDebounce) != 0;
+  batch->next_id = 1;
+  // the monotonic clock never goes negative, so the first event is never
+  // held back by a previous delivery, and always follows a quiet period
+  batch->last_flush = -latency;
+  batch->last_event = -latency;
+
+  batch->capacity = EVENT_BATCH_INITIAL_CAPACITY;
+  batch->offsets = malloc(batch->capacity * sizeof(size_t));
+  batch->flags = malloc(batch->capacity * sizeof(FSEventStreamEventFlags));
+  batch->ids = malloc(batch->capacity * sizeof(FSEventStreamEventId));
+  batch->times = malloc(batch->capacity * sizeof(double));
+  batch->paths = malloc(batch->capacity * sizeof(char*));
+
+  batch->bytes_cap = EVENT_BATCH_INITIAL_BYTES;
+  batch->bytes = malloc(batch->bytes_cap);
+
+  if (!batch->offsets || !batch->flags || !batch->ids || !batch->times || !batch->paths ||
+      !batch->bytes) {
+    fprintf(stderr, "Unable to allocate event batch\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void event_batch_free(struct event_batch* batch)
+{
+  free(batch->offsets);
+  free(batch->flags);
+  free(batch->ids);
+  free(batch->times);
+  free(batch->paths);
+  free(batch->bytes);
+  memset(batch, 0, sizeof(struct event_batch));
+}
+
+void event_batch_adapt(struct event_batch* batch, CFTimeInterval latency_max)
+{
+  batch->latency_max = latency_max > batch->latency ? latency_max : batch->latency;
+}
+
+double event_batch_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+static void event_batch_grow(struct event_batch* batch)
+{
+  batch->capacity *= 2;
+  batch->offsets = realloc(batch->offsets, batch->capacity * sizeof(size_t));
+  batch->flags = realloc(batch->flags, batch->capacity * sizeof(FSEventStreamEventFlags));
+  batch->ids = realloc(batch->ids, batch->capacity * sizeof(FSEventStreamEventId));
+  batch->times = realloc(batch->times, batch->capacity * sizeof(double));
+  batch->paths = realloc(batch->paths, batch->capacity * sizeof(char*));
+
+  if (!batch->offsets || !batch->flags || !batch->ids || !batch->times || !batch->paths) {
+    fprintf(stderr, "Unable to grow event batch to %zu events\n", batch->capacity);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void event_batch_reserve_bytes(struct event_batch* batch, size_t needed)
+{
+  if (batch->bytes_len + needed <= batch->bytes_cap) {
+    return;
+  }
+
+  while (batch->bytes_len + needed > batch->bytes_cap) {
+    batch->bytes_cap *= 2;
+  }
+
+  batch->bytes = realloc(batch->bytes, batch->bytes_cap);
+  if (!batch->bytes) {
+    fprintf(stderr, "Unable to grow event batch to %zu bytes\n", batch->bytes_cap);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void event_batch_push(struct event_batch* batch,
+                             const char* prefix, size_t prefix_len,
+                             char separator,
+                             const char* name, size_t name_len,
+                             FSEventStreamEventFlags flags,
+                             FSEventStreamEventId id,
+                             double now)
+{
+  if (batch->num_events == batch->capacity) {
+    event_batch_grow(batch);
+  }
+
+  size_t path_len = prefix_len + (separator ? 1 : 0) + name_len;
+  event_batch_reserve_bytes(batch, path_len + 1);
+
+  char* dst = batch->bytes + batch->bytes_len;
+  memcpy(dst, prefix, prefix_len);
+  dst += prefix_len;
+  if (separator) {
+    *dst++ = separator;
+  }
+  if (name_len) {
+    memcpy(dst, name, name_len);
+    dst += name_len;
+  }
+  *dst = '\0';
+
+  if (batch->num_events == 0) {
+    batch->window_start = now;
+    // the first event after a quiet period leads, and goes out at once
+    batch->leading = batch->debounce && now - batch->last_event >= event_batch_window(batch);
+  }
+
+  if (batch->latency_max > 0) {
+    // an exponentially decaying count, without pulling in libm for exp()
+    double period = EVENT_BATCH_RATE_PERIOD;
+    double since = now - batch->last_event;
+    batch->rate = batch->rate * period / (period + (since > 0 ? since : 0)) + 1.0 / period;
+  }
+  batch->last_event = now;
+
+  size_t i = batch->num_events++;
+  batch->offsets[i] = batch->bytes_len;
+  batch->flags[i] = flags;
+  batch->ids[i] = id;
+  batch->times[i] = now;
+  batch->bytes_len += path_len + 1;
+}
+
+void event_batch_append(struct event_batch* batch,
+                        const char* prefix, size_t prefix_len,
+                        char separator,
+                        const char* name, size_t name_len,
+                        FSEventStreamEventFlags flags,
+                        double now)
+{
+  event_batch_push(batch, prefix, prefix_len, separator, name, name_len, flags,
+                   batch->next_id++, now);
+}
+
+void event_batch_append_event(struct event_batch* batch,
+                              const char* path,
+                              FSEventStreamEventFlags flags,
+                              FSEventStreamEventId id,
+                              double now)
+{
+  event_batch_push(batch, path, strlen(path), 0, NULL, 0, flags, id, now);
+}
+
+const char* event_batch_last_path(struct event_batch* batch)
+{
+  if (batch->num_events == 0) {
+    return NULL;
+  }
+  return batch->bytes + batch->offsets[batch->num_events - 1];
+}
+
+CFTimeInterval event_batch_window(const struct event_batch* batch)
+{
+  double target = EVENT_BATCH_TARGET_BATCHES;
+
+  if (batch->latency_max <= 0 || batch->rate <= target) {
+    return batch->latency;
+  }
+
+  double stretch = (batch->rate - target) / (target * (EVENT_BATCH_RATE_SPAN - 1.0));
+  double window = batch->latency + (batch->latency_max - batch->latency) * (stretch < 1.0 ? stretch : 1.0);
+  if (window < 1.0 / target) {
+    window = 1.0 / target;
+  }
+  return window < batch->latency_max ? window : batch->latency_max;
+}
+
+// Without NoDefer the first event of a quiet period opens a window and the
+// whole window is delivered `latency` seconds later. With NoDefer that first
+// event goes out immediately, provided at least `latency` seconds have passed
+// since the previous delivery. With --debounce that first event goes out
+// immediately, and the events after it once `latency` seconds pass without
+// another, or EVENT_BATCH_DEBOUNCE_MAX_WINDOWS windows after the first of
+// them if they never stop.
+static double event_batch_due_time(struct event_batch* batch)
+{
+  double window = event_batch_window(batch);
+
+  if (batch->debounce) {
+    if (batch->leading) {
+      return batch->window_start;
+    }
+    double quiet = batch->last_event + window;
+    double longest = batch->window_start + EVENT_BATCH_DEBOUNCE_MAX_WINDOWS * window;
+    return quiet < longest ? quiet : longest;
+  }
+
+  if (batch->no_defer) {
+    double earliest = batch->last_flush + window;
+    return (batch->window_start > earliest) ? batch->window_start : earliest;
+  }
+  return batch->window_start + window;
+}
+
+int event_batch_timeout(struct event_batch* batch, double now)
+{
+  if (batch->num_events == 0) {
+    return -1;
+  }
+
+  double remaining = event_batch_due_time(batch) - now;
+  if (remaining <= 0) {
+    return 0;
+  }
+  // round up, so poll(2) never wakes just short of the deadline
+  return (int)(remaining * 1000.0) + 1;
+}
+
+void event_batch_flush_if_due(struct event_batch* batch, double now)
+{
+  if (batch->num_events > 0 && now >= event_batch_due_time(batch)) {
+    event_batch_flush(batch, now);
+  }
+}
+
+void event_batch_flush(struct event_batch* batch, double now)
+{
+  if (batch->num_events == 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < batch->num_events; i++) {
+    batch->paths[i] = batch->bytes + batch->offsets[i];
+  }
+  stats_arrivals(batch->times, batch->num_events);
+  if (batch->latency_max > 0) {
+    stats_adaptive(event_batch_window(batch), batch->latency, batch->rate);
+  }
+
+  batch->callback(NULL,
+                  batch->info,
+                  batch->num_events,
+                  batch->paths,
+                  batch->flags,
+                  batch->ids);
+
+  batch->num_events = 0;
+  batch->bytes_len = 0;
+  batch->leading = false;
+  batch->last_flush = now;
+}
@@ -0,0 +1,120 @@
+/**
+ * @headerfile event_batch.h
+ * Latency-window event batching for event sources other than FSEvents
+ *
+ * FSEvents collects events for `latency` seconds and hands them to the
+ * stream callback as one group. Kernel interfaces like inotify deliver
+ * events one at a time, so those event sources append into an event_batch
+ * and ask it when the current group is due. Paths are copied into a single
+ * growable byte buffer, so steady-state batching doesn't allocate.
+ *
+ * With --adaptive-latency the window follows the event rate, averaged over
+ * about EVENT_BATCH_RATE_PERIOD seconds. While events come no faster than
+ * EVENT_BATCH_TARGET_BATCHES a second, each group goes out after the
+ * shortest window. Above that the window is at least long enough to hold
+ * delivery to that many batches a second, and grows linearly to the longest
+ * window at EVENT_BATCH_RATE_SPAN times the rate.
+ *
+ * With --debounce (kFSEventWatchCreateFlagDebounce) the first event after
+ * `latency` seconds without any goes out on its own straight away, and the
+ * events that follow it are held until `latency` seconds pass without
+ * another, so a single save is reported at once and a burst of them after
+ * it in one trailing batch. Events that never let up still go out every
+ * EVENT_BATCH_DEBOUNCE_MAX_WINDOWS windows. FSEvents batches events itself,
+ * so on OS X a debounced stream hands them over as they come and they are
+ * batched here as well.
+ */
+
+#ifndef fsevent_watch_event_batch_h
+#define fsevent_watch_event_batch_h
+
+#include "common.h"
+
+#define EVENT_BATCH_TARGET_BATCHES  10.0
+#define EVENT_BATCH_RATE_PERIOD     1.0
+#define EVENT_BATCH_RATE_SPAN       100.0
+
+#define EVENT_BATCH_DEBOUNCE_MAX_WINDOWS  5.0
+
+struct event_batch {
+  FSEventStreamCallback     callback;
+  void*                     info;
+  CFTimeInterval            latency;
+  bool                      no_defer;
+  bool                      debounce;
+
+  // with --adaptive-latency, latency is the shortest window and this the
+  // longest; 0 for a fixed window
+  CFTimeInterval            latency_max;
+  // events per second, as of last_event
+  double                    rate;
+
+  FSEventStreamEventId      next_id;
+  size_t                    num_events;
+  size_t                    capacity;
+  size_t*                   offsets;
+  FSEventStreamEventFlags*  flags;
+  FSEventStreamEventId*     ids;
+  double*                   times;
+  char**                    paths;
+
+  char*                     bytes;
+  size_t                    bytes_len;
+  size_t                    bytes_cap;
+
+  double                    window_start;
+  double                    last_flush;
+  double                    last_event;
+  // the pending events lead after a quiet period, with --debounce
+  bool                      leading;
+};
+
+void event_batch_init(struct event_batch* batch,
+                      FSEventStreamCallback callback,
+                      void* info,
+                      CFTimeInterval latency,
+                      FSEventStreamCreateFlags flags);
+void event_batch_free(struct event_batch* batch);
+
+// Let the window range from the latency given to event_batch_init up to
+// latency_max as the event rate climbs
+void event_batch_adapt(struct event_batch* batch, CFTimeInterval latency_max);
+
+// Monotonic clock, in seconds, used for every batching decision
+double event_batch_now(void);
+
+// Append an event whose path is `prefix` + `separator` + `name`. Either of
+// `separator` and `name` may be 0/NULL, so callers can build "dir/name",
+// "dir/" or "dir" without first copying the pieces into a scratch buffer.
+void event_batch_append(struct event_batch* batch,
+                        const char* prefix, size_t prefix_len,
+                        char separator,
+                        const char* name, size_t name_len,
+                        FSEventStreamEventFlags flags,
+                        double now);
+
+// Append an event from an event source that has its own paths and ids,
+// FSEvents under --debounce
+void event_batch_append_event(struct event_batch* batch,
+                              const char* path,
+                              FSEventStreamEventFlags flags,
+                              FSEventStreamEventId id,
+                              double now);
+
+// Path of the most recently appended event, or NULL if the batch is empty
+const char* event_batch_last_path(struct event_batch* batch);
+
+// The window the pending batch is held for, at the current event rate
+CFTimeInterval event_batch_window(const struct event_batch* batch);
+
+// Milliseconds until the pending batch is due, suitable for poll(2), or -1
+// when there is nothing pending
+int event_batch_timeout(struct event_batch* batch, double now);
+
+// Deliver the pending batch through the stream callback if it is due
+void event_batch_flush_if_due(struct event_batch* batch, double now);
+
+// Deliver the pending batch through the stream callback unconditionally
+void event_batch_flush(struct event_batch* batch, double now);
+
+#endif // fsevent_watch_event_batch_h
@@ -0,0 +1,40 @@
+#include "event_list.h"
+
+#define EVENT_LIST_INITIAL_CAPACITY  256
+
+void event_list_init(struct event_list* list)
+{
+  memset(list, 0, sizeof(struct event_list));
+}
+
+void event_list_free(struct event_list* list)
+{
+  free(list->paths);
+  free(list->flags);
+  free(list->ids);
+  memset(list, 0, sizeof(struct event_list));
+}
+
+bool event_list_reset(struct event_list* list, size_t numEvents)
+{
+  list->num_events = 0;
+  if (numEvents <= list->capacity) {
+    return false;
+  }
+
+  size_t capacity = list->capacity ? list->capacity : EVENT_LIST_INITIAL_CAPACITY;
+  while (capacity < numEvents) {
+    capacity *= 2;
+  }
+
+  list->paths = realloc(list->paths, capacity * sizeof(char*));
+  list->flags = realloc(list->flags, capacity * sizeof(FSEventStreamEventFlags));
+  list->ids = realloc(list->ids, capacity * sizeof(FSEventStreamEventId));
+  list->capacity = capacity;
+
+  if (!list->paths || !list->flags || !list->ids) {
+    fprintf(stderr, "Unable to grow event buffers to %zu events\n", capacity);
+    exit(EXIT_FAILURE);
+  }
+  return true;
+}
@@ -0,0 +1,45 @@
+/**
+ * @headerfile event_list.h
+ * The events of a batch that make it through a filter
+ *
+ * --include/--exclude, --git-ignore, --coalesce and --content-hash each pass
+ * on only some of a batch's events, and hand the ones they pass on to the
+ * next stage as arrays of paths, flags and ids. Each keeps those arrays in
+ * an event_list, which grows to the largest batch it has seen and is reused
+ * from then on, so filtering doesn't allocate once it has warmed up. Paths
+ * are never copied; they point into the strings of the batch filtered.
+ */
+
+#ifndef fsevent_watch_event_list_h
+#define fsevent_watch_event_list_h
+
+#include "common.h"
+
+struct event_list {
+  size_t                    num_events;
+  size_t                    capacity;
+  char**                    paths;
+  FSEventStreamEventFlags*  flags;
+  FSEventStreamEventId*     ids;
+};
+
+void event_list_init(struct event_list* list);
+void event_list_free(struct event_list* list);
+
+// Make room for numEvents events, forgetting any the list holds. Returns
+// true if the arrays moved, for callers keeping arrays of their own beside
+// them to grow those to list->capacity too.
+bool event_list_reset(struct event_list* list, size_t numEvents);
+
+static inline void event_list_push(struct event_list* list,
+                                   char* path,
+                                   FSEventStreamEventFlags flags,
+                                   FSEventStreamEventId id)
+{
+  list->paths[list->num_events] = path;
+  list->flags[list->num_events] = flags;
+  list->ids[list->num_events] = id;
+  list->num_events++;
+}
+
+#endif // fsevent_watch_event_list_h
@@ -0,0 +1,762 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include "event_batch.h"
+#include "fanotify_stream.h"
+
+#define FANOTIFY_STREAM_BUFFER_SIZE   (256 * 1024)
+#define FANOTIFY_STREAM_EVENT_MAX     (4096)
+
+// directories whose paths are remembered; a miss costs open_by_handle_at(2)
+// plus a readlink(2), so this only needs to cover the active working set
+#define FANOTIFY_STREAM_CACHE_SIZE    (16 * 1024)
+#define FANOTIFY_STREAM_CACHE_BUCKETS (FANOTIFY_STREAM_CACHE_SIZE * 2)
+
+// fsid, handle type, handle length and the opaque handle itself
+#define FANOTIFY_STREAM_KEY_MAX       (sizeof(fsid_t) + 2 * sizeof(int) + MAX_HANDLE_SZ)
+
+#define FANOTIFY_STREAM_MASK          (FAN_CREATE | FAN_DELETE | FAN_MODIFY |    \
+                                       FAN_ATTRIB | FAN_MOVED_FROM |             \
+                                       FAN_MOVED_TO | FAN_DELETE_SELF |          \
+                                       FAN_MOVE_SELF | FAN_ONDIR)
+
+struct fanotify_cache_entry {
+  uint64_t        hash;
+  bool            stale;      // a directory above it moved since it was resolved
+  int32_t         chain;      // next entry in the same bucket
+  int32_t         newer;      // LRU neighbours
+  int32_t         older;
+  size_t          key_len;
+  unsigned char   key[FANOTIFY_STREAM_KEY_MAX];
+  char*           path;
+  size_t          len;        // 0 for "/", like the roots
+};
+
+struct fanotify_cache {
+  struct fanotify_cache_entry*  entries;
+  int32_t*                      buckets;
+  size_t                        used;
+  int32_t                       newest;
+  int32_t                       oldest;
+};
+
+struct fanotify_root {
+  char*   path;
+  size_t  len;
+};
+
+struct fanotify_mount {
+  fsid_t  fsid;
+  int     fd;     // for open_by_handle_at(2)
+};
+
+struct fanotify_stream {
+  int                       fd;
+  bool                      file_events;
+  bool                      watch_root;
+  bool                      ignore_self;
+  bool                      mark_self;
+  pid_t                     pid;
+
+  struct fanotify_root*     roots;
+  size_t                    num_roots;
+
+  struct fanotify_mount*    mounts;
+  size_t                    num_mounts;
+
+  struct fanotify_cache     cache;
+
+  char*                     buffer;
+  struct event_batch        batch;
+};
+
+static size_t fanotify_stream_path_len(const char* path)
+{
+  size_t len = strlen(path);
+  return (len == 1 && path[0] == '/') ? 0 : len;
+}
+
+static void fanotify_cache_init(struct fanotify_cache* cache)
+{
+  cache->entries = calloc(FANOTIFY_STREAM_CACHE_SIZE, sizeof(struct fanotify_cache_entry));
+  cache->buckets = malloc(FANOTIFY_STREAM_CACHE_BUCKETS * sizeof(int32_t));
+  if (!cache->entries || !cache->buckets) {
+    fprintf(stderr, "Unable to allocate fanotify path cache\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < FANOTIFY_STREAM_CACHE_BUCKETS; i++) {
+    cache->buckets[i] = -1;
+  }
+  cache->used = 0;
+  cache->newest = -1;
+  cache->oldest = -1;
+}
+
+static void fanotify_cache_free(struct fanotify_cache* cache)
+{
+  for (size_t i = 0; i < cache->used; i++) {
+    free(cache->entries[i].path);
+  }
+  free(cache->entries);
+  free(cache->buckets);
+}
+
+static void fanotify_cache_unlink_lru(struct fanotify_cache* cache, int32_t index)
+{
+  struct fanotify_cache_entry* entry = &cache->entries[index];
+
+  if (entry->newer >= 0) {
+    cache->entries[entry->newer].older = entry->older;
+  } else {
+    cache->newest = entry->older;
+  }
+  if (entry->older >= 0) {
+    cache->entries[entry->older].newer = entry->newer;
+  } else {
+    cache->oldest = entry->newer;
+  }
+}
+
+static void fanotify_cache_push_lru(struct fanotify_cache* cache, int32_t index)
+{
+  struct fanotify_cache_entry* entry = &cache->entries[index];
+
+  entry->newer = -1;
+  entry->older = cache->newest;
+  if (cache->newest >= 0) {
+    cache->entries[cache->newest].newer = index;
+  }
+  cache->newest = index;
+  if (cache->oldest < 0) {
+    cache->oldest = index;
+  }
+}
+
+static int32_t fanotify_cache_find(struct fanotify_cache* cache,
+                                   const unsigned char* key,
+                                   size_t key_len,
+                                   uint64_t hash)
+{
+  int32_t index = cache->buckets[hash % FANOTIFY_STREAM_CACHE_BUCKETS];
+
+  while (index >= 0) {
+    struct fanotify_cache_entry* entry = &cache->entries[index];
+    if (entry->hash == hash && entry->key_len == key_len &&
+        memcmp(entry->key, key, key_len) == 0) {
+      return index;
+    }
+    index = entry->chain;
+  }
+
+  return -1;
+}
+
+static void fanotify_cache_unchain(struct fanotify_cache* cache, int32_t index)
+{
+  int32_t* link = &cache->buckets[cache->entries[index].hash % FANOTIFY_STREAM_CACHE_BUCKETS];
+
+  while (*link >= 0) {
+    if (*link == index) {
+      *link = cache->entries[index].chain;
+      return;
+    }
+    link = &cache->entries[*link].chain;
+  }
+}
+
+static struct fanotify_cache_entry* fanotify_cache_insert(struct fanotify_cache* cache,
+                                                          const unsigned char* key,
+                                                          size_t key_len,
+                                                          uint64_t hash,
+                                                          const char* path,
+                                                          size_t path_len)
+{
+  int32_t index;
+
+  if (cache->used < FANOTIFY_STREAM_CACHE_SIZE) {
+    index = (int32_t)cache->used++;
+  } else {
+    index = cache->oldest;
+    fanotify_cache_unlink_lru(cache, index);
+    fanotify_cache_unchain(cache, index);
+    free(cache->entries[index].path);
+  }
+
+  struct fanotify_cache_entry* entry = &cache->entries[index];
+  entry->hash = hash;
+  entry->stale = false;
+  entry->key_len = key_len;
+  memcpy(entry->key, key, key_len);
+  entry->path = strndup(path, path_len);
+  if (!entry->path) {
+    fprintf(stderr, "Unable to allocate fanotify cached path: %.*s\n", (int)path_len, path);
+    exit(EXIT_FAILURE);
+  }
+  entry->len = (path_len == 1 && path[0] == '/') ? 0 : path_len;
+
+  size_t bucket = hash % FANOTIFY_STREAM_CACHE_BUCKETS;
+  entry->chain = cache->buckets[bucket];
+  cache->buckets[bucket] = index;
+  fanotify_cache_push_lru(cache, index);
+
+  return entry;
+}
+
+// Mark every cached path at or below prefix (+ "/" + name, if given) stale,
+// after the directory there moved. A scan of the whole cache is a few tens
+// of microseconds, where re-resolving every path would cost an
+// open_by_handle_at(2) and a readlink(2) each.
+static void fanotify_cache_invalidate(struct fanotify_cache* cache,
+                                      const char* prefix, size_t prefix_len,
+                                      const char* name, size_t name_len)
+{
+  char moved[PATH_MAX];
+  size_t moved_len = prefix_len;
+
+  if (prefix_len + 1 + name_len >= sizeof(moved)) {
+    for (size_t i = 0; i < cache->used; i++) {
+      cache->entries[i].stale = true;
+    }
+    return;
+  }
+  memcpy(moved, prefix, prefix_len);
+  if (name) {
+    moved[moved_len++] = '/';
+    memcpy(moved + moved_len, name, name_len);
+    moved_len += name_len;
+  }
+
+  for (size_t i = 0; i < cache->used; i++) {
+    struct fanotify_cache_entry* entry = &cache->entries[i];
+    if (entry->len >= moved_len && memcmp(entry->path, moved, moved_len) == 0 &&
+        (entry->len == moved_len || entry->path[moved_len] == '/')) {
+      entry->stale = true;
+    }
+  }
+}
+
+static int fanotify_stream_mount_fd(struct fanotify_stream* stream, const fsid_t* fsid)
+{
+  for (size_t i = 0; i < stream->num_mounts; i++) {
+    if (memcmp(&stream->mounts[i].fsid, fsid, sizeof(fsid_t)) == 0) {
+      return stream->mounts[i].fd;
+    }
+  }
+  return -1;
+}
+
+// Turn a directory file handle into its current path. Self events want the
+// name the directory had before it moved, so they may accept a stale entry.
+static struct fanotify_cache_entry* fanotify_stream_resolve(struct fanotify_stream* stream,
+                                                            const fsid_t* fsid,
+                                                            struct file_handle* handle,
+                                                            bool allow_stale)
+{
+  unsigned char key[FANOTIFY_STREAM_KEY_MAX];
+  size_t key_len = sizeof(fsid_t) + 2 * sizeof(int) + handle->handle_bytes;
+
+  if (handle->handle_bytes > MAX_HANDLE_SZ) {
+    return NULL;
+  }
+
+  memcpy(key, fsid, sizeof(fsid_t));
+  memcpy(key + sizeof(fsid_t), handle, 2 * sizeof(int) + handle->handle_bytes);
+
+  struct fanotify_cache* cache = &stream->cache;
+  uint64_t hash = fnv1a(key, key_len);
+  int32_t index = fanotify_cache_find(cache, key, key_len, hash);
+
+  if (index >= 0) {
+    struct fanotify_cache_entry* entry = &cache->entries[index];
+    if (allow_stale || !entry->stale) {
+      fanotify_cache_unlink_lru(cache, index);
+      fanotify_cache_push_lru(cache, index);
+      return entry;
+    }
+  }
+
+  int mount_fd = fanotify_stream_mount_fd(stream, fsid);
+  if (mount_fd < 0) {
+    return NULL;
+  }
+
+  int fd = open_by_handle_at(mount_fd, handle, O_PATH | O_CLOEXEC);
+  if (fd < 0) {
+    // deleted directories resolve to ESTALE; a stale cached path is still
+    // the best name we have for them
+    return (index >= 0) ? &cache->entries[index] : NULL;
+  }
+
+  char link[64];
+  char path[PATH_MAX];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t path_len = readlink(link, path, sizeof(path));
+
+  // a directory removed since the event was queued reads back as
+  // "/x/dir (deleted)", which must never be cached or reported; only an
+  // unlinked one, though, since a directory may really be named like that
+  static const char deleted[] = " (deleted)";
+  struct stat st;
+  if (path_len > (ssize_t)sizeof(deleted) - 1 &&
+      memcmp(path + path_len - (sizeof(deleted) - 1), deleted, sizeof(deleted) - 1) == 0 &&
+      fstat(fd, &st) == 0 && st.st_nlink == 0) {
+    close(fd);
+    return (index >= 0) ? &cache->entries[index] : NULL;
+  }
+  close(fd);
+
+  if (path_len <= 0 || path_len >= (ssize_t)sizeof(path) || path[0] != '/') {
+    return NULL;
+  }
+
+  if (index >= 0) {
+    struct fanotify_cache_entry* entry = &cache->entries[index];
+    free(entry->path);
+    entry->path = strndup(path, (size_t)path_len);
+    if (!entry->path) {
+      fprintf(stderr, "Unable to allocate fanotify cached path: %.*s\n", (int)path_len, path);
+      exit(EXIT_FAILURE);
+    }
+    entry->len = (path_len == 1) ? 0 : (size_t)path_len;
+    entry->stale = false;
+    fanotify_cache_unlink_lru(cache, index);
+    fanotify_cache_push_lru(cache, index);
+    return entry;
+  }
+
+  return fanotify_cache_insert(cache, key, key_len, hash, path, (size_t)path_len);
+}
+
+// Is dir (+ "/" + name, if given) at or below any root?
+static bool fanotify_stream_under_root(struct fanotify_stream* stream,
+                                       const char* dir, size_t dir_len,
+                                       const char* name, size_t name_len)
+{
+  size_t len = dir_len + (name ? 1 + name_len : 0);
+
+  for (size_t i = 0; i < stream->num_roots; i++) {
+    struct fanotify_root* root = &stream->roots[i];
+    if (len < root->len) {
+      continue;
+    }
+
+    if (root->len <= dir_len) {
+      if (memcmp(dir, root->path, root->len) == 0 &&
+          (root->len == len || (root->len == dir_len ? name != NULL : dir[root->len] == '/'))) {
+        return true;
+      }
+      continue;
+    }
+
+    // the root ends inside "/name"
+    size_t rest = root->len - dir_len - 1;
+    if (memcmp(dir, root->path, dir_len) == 0 && root->path[dir_len] == '/' &&
+        memcmp(name, root->path + dir_len + 1, rest) == 0 &&
+        (rest == name_len || name[rest] == '/')) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool fanotify_stream_is_root(struct fanotify_stream* stream,
+                                    const char* path, size_t len)
+{
+  for (size_t i = 0; i < stream->num_roots; i++) {
+    if (stream->roots[i].len == len && memcmp(stream->roots[i].path, path, len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static FSEventStreamEventFlags fanotify_stream_map_flags(uint64_t mask)
+{
+  FSEventStreamEventFlags flags = kFSEventStreamEventFlagNone;
+
+  if (mask & FAN_CREATE) {
+    flags |= kFSEventStreamEventFlagItemCreated;
+  }
+  if (mask & (FAN_DELETE | FAN_DELETE_SELF)) {
+    flags |= kFSEventStreamEventFlagItemRemoved;
+  }
+  if (mask & FAN_MODIFY) {
+    flags |= kFSEventStreamEventFlagItemModified;
+  }
+  if (mask & FAN_ATTRIB) {
+    flags |= kFSEventStreamEventFlagItemInodeMetaMod;
+  }
+  if (mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MOVE_SELF)) {
+    flags |= kFSEventStreamEventFlagItemRenamed;
+  }
+
+  if (mask & FAN_ONDIR) {
+    flags |= kFSEventStreamEventFlagItemIsDir;
+  } else {
+    flags |= kFSEventStreamEventFlagItemIsFile;
+  }
+
+  return flags;
+}
+
+static void fanotify_stream_handle_event(struct fanotify_stream* stream,
+                                         const struct fanotify_event_metadata* metadata,
+                                         double now)
+{
+  if (metadata->mask & FAN_Q_OVERFLOW) {
+    for (size_t i = 0; i < stream->num_roots; i++) {
+      struct fanotify_root* root = &stream->roots[i];
+      event_batch_append(&stream->batch, root->path, root->len, '/', NULL, 0,
+                         kFSEventStreamEventFlagMustScanSubDirs |
+                         kFSEventStreamEventFlagKernelDropped,
+                         now);
+    }
+    return;
+  }
+
+  FSEventStreamEventFlags own = kFSEventStreamEventFlagNone;
+  if (metadata->pid == stream->pid) {
+    if (stream->ignore_self) {
+      return;
+    }
+    if (stream->mark_self) {
+      own = kFSEventStreamEventFlagOwnEvent;
+    }
+  }
+
+  const char* ptr = (const char*)metadata + metadata->metadata_len;
+  const char* end = (const char*)metadata + metadata->event_len;
+
+  while (ptr + sizeof(struct fanotify_event_info_header) <= end) {
+    const struct fanotify_event_info_fid* fid = (const struct fanotify_event_info_fid*)ptr;
+    ptr += fid->hdr.len;
+
+    if (fid->hdr.len == 0) {
+      return;
+    }
+    if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME &&
+        fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID) {
+      continue;
+    }
+
+    struct file_handle* handle = (struct file_handle*)fid->handle;
+    const char* name = NULL;
+    size_t name_len = 0;
+
+    if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+      name = (const char*)(handle->f_handle + handle->handle_bytes);
+      name_len = strlen(name);
+      // events on a directory itself are reported against "."
+      if (name_len == 0 || (name_len == 1 && name[0] == '.')) {
+        name = NULL;
+        name_len = 0;
+      }
+    }
+
+    bool self = (metadata->mask & (FAN_DELETE_SELF | FAN_MOVE_SELF)) != 0;
+    struct fanotify_cache_entry* dir = fanotify_stream_resolve(stream,
+                                                               (const fsid_t*)&fid->fsid,
+                                                               handle,
+                                                               self);
+    if (dir == NULL) {
+      continue;
+    }
+
+    // paths below a moved directory are stale, the directory itself
+    // included, and so are any below one it replaced
+    if ((metadata->mask & FAN_ONDIR) && (metadata->mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MOVE_SELF))) {
+      fanotify_cache_invalidate(&stream->cache, dir->path, dir->len, name, name_len);
+    }
+
+    if (self) {
+      if (name == NULL && stream->watch_root && fanotify_stream_is_root(stream, dir->path, dir->len)) {
+        event_batch_append(&stream->batch, dir->path, dir->len,
+                           stream->file_events ? 0 : '/', NULL, 0,
+                           kFSEventStreamEventFlagRootChanged, now);
+      }
+      // otherwise already reported by the parent directory
+      continue;
+    }
+
+    if (stream->file_events) {
+      if (fanotify_stream_under_root(stream, dir->path, dir->len, name, name_len)) {
+        event_batch_append(&stream->batch, dir->path, dir->len,
+                           name ? '/' : 0, name, name_len,
+                           fanotify_stream_map_flags(metadata->mask) | own, now);
+      }
+      continue;
+    }
+
+    // directory level events name the directory, as FSEvents does
+    if (!fanotify_stream_under_root(stream, dir->path, dir->len, NULL, 0)) {
+      continue;
+    }
+    const char* last = event_batch_last_path(&stream->batch);
+    if (last && strncmp(last, dir->path, dir->len) == 0 &&
+        last[dir->len] == '/' && last[dir->len + 1] == '\0') {
+      continue;
+    }
+    event_batch_append(&stream->batch, dir->path, dir->len, '/', NULL, 0,
+                       own, now);
+  }
+}
+
+static bool fanotify_stream_drain(struct fanotify_stream* stream)
+{
+  for (;;) {
+    ssize_t len = read(stream->fd, stream->buffer, FANOTIFY_STREAM_BUFFER_SIZE);
+
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN);
+    }
+
+    double now = event_batch_now();
+    const struct fanotify_event_metadata* metadata =
+      (const struct fanotify_event_metadata*)stream->buffer;
+    ssize_t remaining = len;
+
+    while (FAN_EVENT_OK(metadata, remaining)) {
+      if (metadata->vers == FANOTIFY_METADATA_VERSION) {
+        fanotify_stream_handle_event(stream, metadata, now);
+      }
+      metadata = FAN_EVENT_NEXT(metadata, remaining);
+    }
+
+    event_batch_flush_if_due(&stream->batch, now);
+
+    if ((size_t)len < FANOTIFY_STREAM_BUFFER_SIZE - FANOTIFY_STREAM_EVENT_MAX) {
+      return true;
+    }
+  }
+}
+
+// Mark the filesystem holding `path`, or its nearest existing ancestor so
+// that roots which don't exist yet are seen once they're created
+static bool fanotify_stream_mark(struct fanotify_stream* stream, const char* path)
+{
+  char existing[PATH_MAX];
+  snprintf(existing, sizeof(existing), "%s", path);
+
+  int dir_fd;
+  while ((dir_fd = open(existing, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    char* slash = strrchr(existing, '/');
+    if (slash == NULL) {
+      return false;
+    }
+    if (slash == existing) {
+      if (existing[1] == '\0') {
+        return false;
+      }
+      slash[1] = '\0';
+    } else {
+      *slash = '\0';
+    }
+  }
+
+  struct statfs st;
+  if (fstatfs(dir_fd, &st) != 0) {
+    close(dir_fd);
+    return false;
+  }
+
+  if (fanotify_stream_mount_fd(stream, &st.f_fsid) >= 0) {
+    close(dir_fd);
+    return true;
+  }
+
+  if (fanotify_mark(stream->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                    FANOTIFY_STREAM_MASK, dir_fd, NULL) != 0) {
+    fprintf(stderr, "fanotify can't watch the filesystem holding %s: %s\n",
+            existing, strerror(errno));
+    close(dir_fd);
+    return false;
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "fanotify filesystem mark via: %s\n", existing);
+#endif
+
+  stream->mounts = realloc(stream->mounts, (stream->num_mounts + 1) * sizeof(struct fanotify_mount));
+  if (!stream->mounts) {
+    fprintf(stderr, "Unable to track %zu fanotify filesystems\n", stream->num_mounts + 1);
+    exit(EXIT_FAILURE);
+  }
+  stream->mounts[stream->num_mounts].fsid = st.f_fsid;
+  stream->mounts[stream->num_mounts].fd = dir_fd;
+  stream->num_mounts++;
+
+  return true;
+}
+
+// Remember each existing root's handle up front, so a root that is moved or
+// deleted can still be recognised by its original path
+static void fanotify_stream_seed_root(struct fanotify_stream* stream,
+                                      struct fanotify_root* root)
+{
+  union {
+    struct file_handle  handle;
+    char                bytes[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+  } fh;
+  int mount_id;
+  struct statfs st;
+
+  fh.handle.handle_bytes = MAX_HANDLE_SZ;
+  if (name_to_handle_at(AT_FDCWD, root->path, &fh.handle, &mount_id, 0) != 0 ||
+      statfs(root->path, &st) != 0) {
+    return;
+  }
+
+  unsigned char key[FANOTIFY_STREAM_KEY_MAX];
+  size_t key_len = sizeof(fsid_t) + 2 * sizeof(int) + fh.handle.handle_bytes;
+  memcpy(key, &st.f_fsid, sizeof(fsid_t));
+  memcpy(key + sizeof(fsid_t), &fh.handle, 2 * sizeof(int) + fh.handle.handle_bytes);
+
+  uint64_t hash = fnv1a(key, key_len);
+  if (fanotify_cache_find(&stream->cache, key, key_len, hash) < 0) {
+    fanotify_cache_insert(&stream->cache, key, key_len, hash,
+                          root->path, strlen(root->path));
+  }
+}
+
+struct fanotify_stream* fanotify_stream_create(FSEventStreamCallback callback,
+                                               void* info,
+                                               char** paths,
+                                               size_t numPaths,
+                                               CFTimeInterval latency,
+                                               FSEventStreamCreateFlags flags)
+{
+  struct fanotify_stream* stream = calloc(1, sizeof(struct fanotify_stream));
+  if (!stream) {
+    fprintf(stderr, "Unable to allocate fanotify stream\n");
+    exit(EXIT_FAILURE);
+  }
+
+  stream->fd = -1;
+  stream->file_events = (flags & kFSEventStreamCreateFlagFileEvents) != 0;
+  stream->watch_root = (flags & kFSEventStreamCreateFlagWatchRoot) != 0;
+  stream->ignore_self = (flags & kFSEventStreamCreateFlagIgnoreSelf) != 0;
+  stream->mark_self = (flags & kFSEventStreamCreateFlagMarkSelf) != 0;
+  stream->pid = getpid();
+
+  stream->num_roots = numPaths;
+  stream->roots = calloc(numPaths, sizeof(struct fanotify_root));
+  if (!stream->roots) {
+    fprintf(stderr, "Unable to allocate %zu fanotify roots\n", numPaths);
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < numPaths; i++) {
+    stream->roots[i].path = strdup(paths[i]);
+    if (!stream->roots[i].path) {
+      fprintf(stderr, "Unable to allocate fanotify root: %s\n", paths[i]);
+      exit(EXIT_FAILURE);
+    }
+    stream->roots[i].len = fanotify_stream_path_len(paths[i]);
+  }
+
+  fanotify_cache_init(&stream->cache);
+  stream->buffer = malloc(FANOTIFY_STREAM_BUFFER_SIZE);
+  if (!stream->buffer) {
+    fprintf(stderr, "Unable to allocate fanotify read buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  event_batch_init(&stream->batch, callback, info, latency, flags);
+
+  return stream;
+}
+
+void fanotify_stream_adapt_latency(struct fanotify_stream* stream, CFTimeInterval latency_max)
+{
+  event_batch_adapt(&stream->batch, latency_max);
+}
+
+bool fanotify_stream_start(struct fanotify_stream* stream)
+{
+  stream->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                             FAN_NONBLOCK | FAN_CLOEXEC,
+                             O_RDONLY | O_LARGEFILE);
+  if (stream->fd < 0) {
+    perror("fanotify_init");
+    return false;
+  }
+
+  bool marked = false;
+  for (size_t i = 0; i < stream->num_roots; i++) {
+    marked |= fanotify_stream_mark(stream, stream->roots[i].path);
+    fanotify_stream_seed_root(stream, &stream->roots[i]);
+  }
+
+  return marked;
+}
+
+int fanotify_stream_fd(const struct fanotify_stream* stream)
+{
+  return stream->fd;
+}
+
+int fanotify_stream_timeout(struct fanotify_stream* stream)
+{
+  return event_batch_timeout(&stream->batch, event_batch_now());
+}
+
+bool fanotify_stream_dispatch(struct fanotify_stream* stream, bool readable)
+{
+  if (readable && !fanotify_stream_drain(stream)) {
+    perror("read");
+    return false;
+  }
+
+  event_batch_flush_if_due(&stream->batch, event_batch_now());
+  return true;
+}
+
+void fanotify_stream_run(struct fanotify_stream* stream)
+{
+  struct pollfd pfd = { stream->fd, POLLIN, 0 };
+
+  for (;;) {
+    int ready = poll(&pfd, 1, fanotify_stream_timeout(stream));
+
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      return;
+    }
+
+    if (!fanotify_stream_dispatch(stream, ready > 0)) {
+      return;
+    }
+  }
+}
+
+void fanotify_stream_release(struct fanotify_stream* stream)
+{
+  if (stream->fd >= 0) {
+    close(stream->fd);
+  }
+
+  for (size_t i = 0; i < stream->num_mounts; i++) {
+    close(stream->mounts[i].fd);
+  }
+  free(stream->mounts);
+
+  for (size_t i = 0; i < stream->num_roots; i++) {
+    free(stream->roots[i].path);
+  }
+  free(stream->roots);
+
+  fanotify_cache_free(&stream->cache);
+  event_batch_free(&stream->batch);
+  free(stream->buffer);
+  free(stream);
+}
@@ -0,0 +1,48 @@
+/**
+ * @headerfile fanotify_stream.h
+ * fanotify(7) whole-filesystem event source
+ *
+ * Rather than one inotify watch per directory, each filesystem holding a
+ * root gets a single FAN_MARK_FILESYSTEM mark, so startup cost doesn't grow
+ * with the size of the tree. Events identify their directory by file handle
+ * (FAN_REPORT_DFID_NAME); handles are turned back into paths through an LRU
+ * cache and anything outside the requested roots is dropped.
+ *
+ * Requires Linux 5.9 or later and CAP_SYS_ADMIN.
+ */
+
+#ifndef fsevent_watch_fanotify_stream_h
+#define fsevent_watch_fanotify_stream_h
+
+#include "common.h"
+
+struct fanotify_stream;
+
+struct fanotify_stream* fanotify_stream_create(FSEventStreamCallback callback,
+                                               void* info,
+                                               char** paths,
+                                               size_t numPaths,
+                                               CFTimeInterval latency,
+                                               FSEventStreamCreateFlags flags);
+
+// Stretch the latency window up to latency_max as the event rate climbs, for
+// --adaptive-latency. Call before starting the stream.
+void fanotify_stream_adapt_latency(struct fanotify_stream* stream, CFTimeInterval latency_max);
+
+// Mark the filesystem of every root; false if fanotify is unusable
+bool fanotify_stream_start(struct fanotify_stream* stream);
+
+// Read and deliver events until an unrecoverable error occurs
+void fanotify_stream_run(struct fanotify_stream* stream);
+
+// For driving several streams from one poll(2) loop instead: wait for the
+// descriptor to become readable for at most the timeout, in milliseconds
+// (-1 when no batch is pending), then dispatch. Dispatch returns false on
+// an unrecoverable error.
+int fanotify_stream_fd(const struct fanotify_stream* stream);
+int fanotify_stream_timeout(struct fanotify_stream* stream);
+bool fanotify_stream_dispatch(struct fanotify_stream* stream, bool readable);
+
+void fanotify_stream_release(struct fanotify_stream* stream);
+
+#endif // fsevent_watch_fanotify_stream_h
@@ -0,0 +1,713 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "event_list.h"
+#include "git_ignore.h"
+
+#ifdef __APPLE__
+#define GIT_IGNORE_MTIME(st) ((st).st_mtimespec)
+#else
+#define GIT_IGNORE_MTIME(st) ((st).st_mtim)
+#endif
+
+struct git_ignore_pattern {
+  const char*   glob;
+  size_t        length;
+  bool          negate;
+  bool          dir_only;
+  bool          anchored;
+};
+
+// The patterns of one ignore file, pointing into its contents
+struct git_ignore_list {
+  char*                       text;
+  struct git_ignore_pattern*  patterns;
+  size_t                      num_patterns;
+
+  // identity of the file they were read from
+  bool                        exists;
+  dev_t                       dev;
+  ino_t                       ino;
+  off_t                       size;
+  struct timespec             mtime;
+};
+
+struct git_ignore_node {
+  char*                       name;
+  size_t                      name_len;
+  struct git_ignore_node*     children;
+  struct git_ignore_node*     next;
+
+  struct git_ignore_list      gitignore;
+  // .git/info/exclude, for worktree tops
+  struct git_ignore_list      exclude;
+  bool                        top;
+};
+
+struct git_ignore_source {
+  const struct git_ignore_list* list;
+  size_t                        offset;
+};
+
+struct git_ignore {
+  // the trie is rooted at "/"
+  struct git_ignore_node      root;
+  UInt64                      dropped;
+
+  // lists that apply along the path being checked
+  struct git_ignore_source*   sources;
+  size_t                      sources_cap;
+
+  struct event_list           events;
+
+  char                        scratch[PATH_MAX];
+};
+
+
+// Patterns
+
+static void git_ignore_list_clear(struct git_ignore_list* list)
+{
+  free(list->text);
+  free(list->patterns);
+  memset(list, 0, sizeof(struct git_ignore_list));
+}
+
+static bool git_ignore_list_is_current(const struct git_ignore_list* list, const char* file)
+{
+  struct stat st;
+  if (stat(file, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return !list->exists;
+  }
+  return list->exists &&
+         list->dev == st.st_dev &&
+         list->ino == st.st_ino &&
+         list->size == st.st_size &&
+         list->mtime.tv_sec == GIT_IGNORE_MTIME(st).tv_sec &&
+         list->mtime.tv_nsec == GIT_IGNORE_MTIME(st).tv_nsec;
+}
+
+static void git_ignore_list_push(struct git_ignore_list* list, size_t* capacity,
+                                 const struct git_ignore_pattern* pattern)
+{
+  if (list->num_patterns == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 16;
+    list->patterns = realloc(list->patterns, *capacity * sizeof(struct git_ignore_pattern));
+    if (!list->patterns) {
+      fprintf(stderr, "Unable to allocate ignore patterns\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  list->patterns[list->num_patterns++] = *pattern;
+}
+
+// (Re-)read an ignore file; a missing file leaves the list empty
+static void git_ignore_list_load(struct git_ignore_list* list, const char* file)
+{
+  git_ignore_list_clear(list);
+
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return;
+  }
+
+  list->text = malloc((size_t)st.st_size + 1);
+  if (!list->text) {
+    fprintf(stderr, "Unable to allocate %lld bytes for %s\n", (long long)st.st_size, file);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t length = 0;
+  while (length < (size_t)st.st_size) {
+    ssize_t n = read(fd, list->text + length, (size_t)st.st_size - length);
+    if (n <= 0) {
+      break;
+    }
+    length += (size_t)n;
+  }
+  close(fd);
+
+  list->text[length] = '\0';
+  list->exists = true;
+  list->dev = st.st_dev;
+  list->ino = st.st_ino;
+  list->size = st.st_size;
+  list->mtime = GIT_IGNORE_MTIME(st);
+
+  size_t capacity = 0;
+  char* line = list->text;
+  char* end = list->text + length;
+
+  while (line < end) {
+    char* newline = memchr(line, '\n', (size_t)(end - line));
+    char* next = newline ? newline + 1 : end;
+    size_t len = (size_t)((newline ? newline : end) - line);
+
+    if (len > 0 && line[len - 1] == '\r') {
+      len--;
+    }
+    // trailing spaces are dropped unless escaped
+    while (len > 0 && line[len - 1] == ' ' && !(len > 1 && line[len - 2] == '\\')) {
+      len--;
+    }
+
+    struct git_ignore_pattern pattern;
+    memset(&pattern, 0, sizeof(pattern));
+
+    if (len == 0 || line[0] == '#') {
+      line = next;
+      continue;
+    }
+    if (line[0] == '!') {
+      pattern.negate = true;
+      line++;
+      len--;
+    } else if (line[0] == '\\' && len > 1 && (line[1] == '#' || line[1] == '!')) {
+      line++;
+      len--;
+    }
+    if (len > 0 && line[len - 1] == '/') {
+      pattern.dir_only = true;
+      len--;
+    }
+    if (len > 0 && line[0] == '/') {
+      pattern.anchored = true;
+      line++;
+      len--;
+    } else {
+      pattern.anchored = memchr(line, '/', len) != NULL;
+    }
+
+    if (len > 0) {
+      pattern.glob = line;
+      pattern.length = len;
+      git_ignore_list_push(list, &capacity, &pattern);
+    }
+    line = next;
+  }
+}
+
+// wildmatch: '*' and '?' stop at '/', "**" doesn't, and "**/" may match
+// nothing at all
+static bool git_ignore_glob(const char* p, const char* pend, const char* t, const char* tend)
+{
+  while (p < pend) {
+    unsigned char c = (unsigned char)*p;
+
+    if (c == '*') {
+      if (p + 1 < pend && p[1] == '*') {
+        while (p < pend && *p == '*') {
+          p++;
+        }
+        if (p < pend && *p == '/') {
+          if (git_ignore_glob(p + 1, pend, t, tend)) {
+            return true;
+          }
+          for (const char* s = t; s < tend; s++) {
+            if (*s == '/' && git_ignore_glob(p + 1, pend, s + 1, tend)) {
+              return true;
+            }
+          }
+          return false;
+        }
+        for (const char* s = t; s <= tend; s++) {
+          if (git_ignore_glob(p, pend, s, tend)) {
+            return true;
+          }
+        }
+        return false;
+      }
+
+      p++;
+      for (const char* s = t; ; s++) {
+        if (git_ignore_glob(p, pend, s, tend)) {
+          return true;
+        }
+        if (s == tend || *s == '/') {
+          return false;
+        }
+      }
+    }
+
+    if (t == tend) {
+      return false;
+    }
+
+    unsigned char ch = (unsigned char)*t;
+
+    if (c == '?') {
+      if (ch == '/') {
+        return false;
+      }
+      p++;
+      t++;
+      continue;
+    }
+
+    if (c == '[') {
+      const char* q = p + 1;
+      bool negate = false;
+      bool matched = false;
+      bool closed = false;
+
+      if (q < pend && (*q == '!' || *q == '^')) {
+        negate = true;
+        q++;
+      }
+      for (const char* start = q; q < pend; q++) {
+        if (*q == ']' && q > start) {
+          closed = true;
+          break;
+        }
+        unsigned char lo = (unsigned char)*q;
+        if (lo == '\\' && q + 1 < pend) {
+          lo = (unsigned char)*++q;
+        }
+        unsigned char hi = lo;
+        if (q + 2 < pend && q[1] == '-' && q[2] != ']') {
+          q += 2;
+          hi = (unsigned char)*q;
+          if (hi == '\\' && q + 1 < pend) {
+            hi = (unsigned char)*++q;
+          }
+        }
+        if (ch >= lo && ch <= hi) {
+          matched = true;
+        }
+      }
+
+      if (closed) {
+        if (ch == '/' || matched == negate) {
+          return false;
+        }
+        p = q + 1;
+        t++;
+        continue;
+      }
+      // an unterminated class is a literal '['
+    }
+
+    if (c == '\\' && p + 1 < pend) {
+      c = (unsigned char)*++p;
+    }
+    if (ch != c) {
+      return false;
+    }
+    p++;
+    t++;
+  }
+
+  return t == tend;
+}
+
+// 1 if the last pattern to match ignores the path, 0 if it re-includes it,
+// -1 if none match
+static int git_ignore_list_match(const struct git_ignore_list* list,
+                                 const char* relative, size_t relative_len,
+                                 const char* base, size_t base_len,
+                                 bool is_dir)
+{
+  for (size_t i = list->num_patterns; i > 0; i--) {
+    const struct git_ignore_pattern* pattern = &list->patterns[i - 1];
+    if (pattern->dir_only && !is_dir) {
+      continue;
+    }
+
+    bool matched = pattern->anchored
+      ? git_ignore_glob(pattern->glob, pattern->glob + pattern->length,
+                        relative, relative + relative_len)
+      : git_ignore_glob(pattern->glob, pattern->glob + pattern->length,
+                        base, base + base_len);
+    if (matched) {
+      return pattern->negate ? 0 : 1;
+    }
+  }
+  return -1;
+}
+
+
+// Trie
+
+static struct git_ignore_node* git_ignore_child(struct git_ignore_node* node,
+                                                const char* name, size_t name_len,
+                                                bool create)
+{
+  for (struct git_ignore_node* child = node->children; child; child = child->next) {
+    if (child->name_len == name_len && memcmp(child->name, name, name_len) == 0) {
+      return child;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+
+  struct git_ignore_node* child = calloc(1, sizeof(struct git_ignore_node));
+  if (!child || !(child->name = malloc(name_len + 1))) {
+    fprintf(stderr, "Unable to allocate ignore trie\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(child->name, name, name_len);
+  child->name[name_len] = '\0';
+  child->name_len = name_len;
+  child->next = node->children;
+  node->children = child;
+  return child;
+}
+
+static struct git_ignore_node* git_ignore_node(struct git_ignore* ignore,
+                                               const char* dir, size_t length,
+                                               bool create)
+{
+  struct git_ignore_node* node = &ignore->root;
+  size_t start = 0;
+
+  while (node && start < length) {
+    while (start < length && dir[start] == '/') {
+      start++;
+    }
+    size_t end = start;
+    while (end < length && dir[end] != '/') {
+      end++;
+    }
+    if (end > start) {
+      node = git_ignore_child(node, dir + start, end - start, create);
+    }
+    start = end;
+  }
+  return node;
+}
+
+static void git_ignore_node_free(struct git_ignore_node* node)
+{
+  struct git_ignore_node* child = node->children;
+  while (child) {
+    struct git_ignore_node* next = child->next;
+    git_ignore_node_free(child);
+    free(child->name);
+    free(child);
+    child = next;
+  }
+  git_ignore_list_clear(&node->gitignore);
+  git_ignore_list_clear(&node->exclude);
+}
+
+// Path of a file in dir, in the scratch buffer; false if it won't fit
+static bool git_ignore_file(struct git_ignore* ignore, const char* dir, size_t length,
+                            const char* name)
+{
+  while (length > 0 && dir[length - 1] == '/') {
+    length--;
+  }
+  int written = snprintf(ignore->scratch, sizeof(ignore->scratch), "%.*s/%s",
+                         (int)length, dir, name);
+  return written > 0 && (size_t)written < sizeof(ignore->scratch);
+}
+
+// Load dir/.gitignore, only growing the trie if there is one
+static void git_ignore_load_dir(struct git_ignore* ignore, const char* dir, size_t length)
+{
+  if (!git_ignore_file(ignore, dir, length, ".gitignore")) {
+    return;
+  }
+
+  struct git_ignore_node* node = git_ignore_node(ignore, dir, length, false);
+  if (!node && access(ignore->scratch, F_OK) != 0) {
+    return;
+  }
+  if (!node) {
+    node = git_ignore_node(ignore, dir, length, true);
+  }
+  git_ignore_list_load(&node->gitignore, ignore->scratch);
+}
+
+
+// Matching
+
+static void git_ignore_push_source(struct git_ignore* ignore, size_t* num_sources,
+                                   const struct git_ignore_list* list, size_t offset)
+{
+  if (*num_sources == ignore->sources_cap) {
+    ignore->sources_cap = ignore->sources_cap ? ignore->sources_cap * 2 : 16;
+    ignore->sources = realloc(ignore->sources,
+                              ignore->sources_cap * sizeof(struct git_ignore_source));
+    if (!ignore->sources) {
+      fprintf(stderr, "Unable to allocate ignore trie\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  ignore->sources[*num_sources].list = list;
+  ignore->sources[*num_sources].offset = offset;
+  (*num_sources)++;
+}
+
+bool git_ignore_ignored(struct git_ignore* ignore, const char* path, bool is_dir)
+{
+  size_t length = strlen(path);
+  while (length > 1 && path[length - 1] == '/') {
+    length--;
+    is_dir = true;
+  }
+
+  const struct git_ignore_node* node = &ignore->root;
+  const struct git_ignore_list* exclude = NULL;
+  size_t exclude_offset = 0;
+  size_t num_sources = 0;
+
+  if (node->gitignore.num_patterns) {
+    git_ignore_push_source(ignore, &num_sources, &node->gitignore, 1);
+  }
+
+  size_t start = 1;
+  while (start < length) {
+    size_t end = start;
+    while (end < length && path[end] != '/') {
+      end++;
+    }
+    size_t name_len = end - start;
+
+    if (name_len == 4 && memcmp(path + start, ".git", 4) == 0) {
+      return true;
+    }
+
+    // a directory that is ignored takes everything below it along, so each
+    // component is checked in turn: deeper .gitignore files first, and
+    // .git/info/exclude last
+    if (name_len > 0) {
+      bool component_is_dir = (end < length) || is_dir;
+      int decision = -1;
+
+      for (size_t s = num_sources; s > 0 && decision < 0; s--) {
+        const struct git_ignore_source* source = &ignore->sources[s - 1];
+        decision = git_ignore_list_match(source->list,
+                                         path + source->offset, end - source->offset,
+                                         path + start, name_len,
+                                         component_is_dir);
+      }
+      if (decision < 0 && exclude) {
+        decision = git_ignore_list_match(exclude,
+                                         path + exclude_offset, end - exclude_offset,
+                                         path + start, name_len,
+                                         component_is_dir);
+      }
+      if (decision == 1) {
+        return true;
+      }
+
+      if (node) {
+        node = git_ignore_child((struct git_ignore_node*)node, path + start, name_len, false);
+      }
+      if (node && node->gitignore.num_patterns) {
+        git_ignore_push_source(ignore, &num_sources, &node->gitignore, end + 1);
+      }
+      if (node && node->top) {
+        exclude = &node->exclude;
+        exclude_offset = end + 1;
+      }
+    }
+
+    start = end + 1;
+  }
+
+  return false;
+}
+
+
+// Maintenance
+
+static bool git_ignore_has_suffix(const char* path, size_t length, const char* suffix)
+{
+  size_t suffix_len = strlen(suffix);
+  return length >= suffix_len && memcmp(path + length - suffix_len, suffix, suffix_len) == 0;
+}
+
+// Re-read whichever ignore file an event touched
+static void git_ignore_update(struct git_ignore* ignore, const char* path,
+                              FSEventStreamEventFlags flags)
+{
+  size_t length = strlen(path);
+  bool is_dir = (flags & kFSEventStreamEventFlagItemIsDir) != 0;
+  while (length > 1 && path[length - 1] == '/') {
+    length--;
+    is_dir = true;
+  }
+
+  if (git_ignore_has_suffix(path, length, "/.gitignore")) {
+    size_t dir_len = length - strlen("/.gitignore");
+    struct git_ignore_node* node = git_ignore_node(ignore, path, dir_len, true);
+    if (git_ignore_file(ignore, path, dir_len, ".gitignore")) {
+      git_ignore_list_load(&node->gitignore, ignore->scratch);
+    }
+  } else if (git_ignore_has_suffix(path, length, "/.git/info/exclude")) {
+    size_t dir_len = length - strlen("/.git/info/exclude");
+    struct git_ignore_node* node = git_ignore_node(ignore, path, dir_len, true);
+    if (git_ignore_file(ignore, path, dir_len, ".git/info/exclude")) {
+      node->top = true;
+      git_ignore_list_load(&node->exclude, ignore->scratch);
+    }
+  } else if (is_dir) {
+    // directory level events don't say which file changed
+    struct git_ignore_node* node = git_ignore_node(ignore, path, length, false);
+    if (git_ignore_file(ignore, path, length, ".gitignore") &&
+        !git_ignore_list_is_current(node ? &node->gitignore : &(struct git_ignore_list){0},
+                                    ignore->scratch)) {
+      git_ignore_load_dir(ignore, path, length);
+    }
+  }
+}
+
+// Load the .gitignore of every directory below dir that isn't ignored
+static void git_ignore_walk(struct git_ignore* ignore, char* dir, size_t length)
+{
+  DIR* handle = opendir(length ? dir : "/");
+  if (!handle) {
+    return;
+  }
+
+  struct dirent* entry;
+  while ((entry = readdir(handle))) {
+    const char* name = entry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, ".git") == 0) {
+      continue;
+    }
+
+    size_t name_len = strlen(name);
+    if (length + 1 + name_len >= PATH_MAX) {
+      continue;
+    }
+    dir[length] = '/';
+    memcpy(dir + length + 1, name, name_len + 1);
+    size_t child_len = length + 1 + name_len;
+
+    bool is_dir = (entry->d_type == DT_DIR);
+    if (entry->d_type == DT_UNKNOWN) {
+      struct stat st;
+      is_dir = (lstat(dir, &st) == 0 && S_ISDIR(st.st_mode));
+    }
+
+    if (is_dir && !git_ignore_ignored(ignore, dir, true)) {
+      git_ignore_load_dir(ignore, dir, child_len);
+      git_ignore_walk(ignore, dir, child_len);
+    }
+  }
+
+  dir[length] = '\0';
+  closedir(handle);
+}
+
+
+struct git_ignore* git_ignore_create(void)
+{
+  struct git_ignore* ignore = calloc(1, sizeof(struct git_ignore));
+  if (!ignore) {
+    fprintf(stderr, "Unable to allocate ignore trie\n");
+    exit(EXIT_FAILURE);
+  }
+  return ignore;
+}
+
+void git_ignore_release(struct git_ignore* ignore)
+{
+  git_ignore_node_free(&ignore->root);
+  free(ignore->sources);
+  event_list_free(&ignore->events);
+  free(ignore);
+}
+
+void git_ignore_add_root(struct git_ignore* ignore, const char* root)
+{
+  char dir[PATH_MAX];
+  size_t root_len = strlen(root);
+  while (root_len > 1 && root[root_len - 1] == '/') {
+    root_len--;
+  }
+  if (root_len >= sizeof(dir)) {
+    return;
+  }
+
+  // the worktree top is the nearest directory holding a .git
+  memcpy(dir, root, root_len);
+  dir[root_len] = '\0';
+  size_t top_len = root_len;
+  bool found = false;
+
+  for (;;) {
+    struct stat st;
+    if (git_ignore_file(ignore, dir, top_len, ".git") && lstat(ignore->scratch, &st) == 0) {
+      found = true;
+      if (S_ISDIR(st.st_mode)) {
+        struct git_ignore_node* node = git_ignore_node(ignore, dir, top_len, true);
+        node->top = true;
+        git_ignore_file(ignore, dir, top_len, ".git/info/exclude");
+        git_ignore_list_load(&node->exclude, ignore->scratch);
+      }
+      break;
+    }
+    if (top_len <= 1) {
+      break;
+    }
+    while (top_len > 0 && dir[top_len - 1] != '/') {
+      top_len--;
+    }
+    while (top_len > 1 && dir[top_len - 1] == '/') {
+      top_len--;
+    }
+    dir[top_len] = '\0';
+  }
+
+  if (!found) {
+    top_len = root_len;
+  }
+
+  // every .gitignore from the top down to the root...
+  memcpy(dir, root, root_len);
+  dir[root_len] = '\0';
+  for (size_t end = top_len; end <= root_len; end++) {
+    if (end == root_len || dir[end] == '/') {
+      git_ignore_load_dir(ignore, dir, end ? end : 1);
+    }
+  }
+
+  // ...and below it
+  git_ignore_walk(ignore, dir, (root_len == 1) ? 0 : root_len);
+}
+
+size_t git_ignore_batch(struct git_ignore* ignore,
+                        size_t numEvents,
+                        char** paths,
+                        const FSEventStreamEventFlags eventFlags[],
+                        const FSEventStreamEventId eventIds[],
+                        char*** outPaths,
+                        const FSEventStreamEventFlags** outFlags,
+                        const FSEventStreamEventId** outIds)
+{
+  for (size_t i = 0; i < numEvents; i++) {
+    git_ignore_update(ignore, paths[i], eventFlags[i]);
+  }
+
+  event_list_reset(&ignore->events, numEvents);
+  for (size_t i = 0; i < numEvents; i++) {
+    bool is_dir = (eventFlags[i] & kFSEventStreamEventFlagItemIsDir) != 0;
+    if (!git_ignore_ignored(ignore, paths[i], is_dir)) {
+      event_list_push(&ignore->events, paths[i], eventFlags[i], eventIds[i]);
+    }
+  }
+
+  size_t count = ignore->events.num_events;
+  ignore->dropped += numEvents - count;
+
+  *outPaths = ignore->events.paths;
+  *outFlags = ignore->events.flags;
+  *outIds = ignore->events.ids;
+  return count;
+}
+
+UInt64 git_ignore_dropped(const struct git_ignore* ignore)
+{
+  return ignore->dropped;
+}
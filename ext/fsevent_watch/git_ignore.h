@@ -0,0 +1,48 @@
+/**
+ * @headerfile git_ignore.h
+ * --gitignore filtering of event paths
+ *
+ * Each watched root's worktree (the nearest ancestor holding a .git) has its
+ * .git/info/exclude and every .gitignore between it and the root, as well as
+ * every .gitignore below the root outside ignored directories, loaded into a
+ * trie of directories. A node only exists for directories holding ignore
+ * files and their ancestors, so deciding whether a path is ignored walks its
+ * components once and only consults the patterns of directories along the
+ * way, deepest first, with git's precedence rules.
+ *
+ * An event that touches an ignore file re-parses that one file, so the trie
+ * keeps up with edits, checkouts and new directories without a rescan.
+ * Events inside .git directories are always dropped.
+ */
+
+#ifndef fsevent_watch_git_ignore_h
+#define fsevent_watch_git_ignore_h
+
+#include "common.h"
+
+struct git_ignore;
+
+struct git_ignore* git_ignore_create(void);
+void git_ignore_release(struct git_ignore* ignore);
+
+// Load the ignore files that apply at and below a watched root
+void git_ignore_add_root(struct git_ignore* ignore, const char* root);
+
+bool git_ignore_ignored(struct git_ignore* ignore, const char* path, bool is_dir);
+
+// Re-parse any ignore file the batch touched, then drop ignored events. The
+// survivors are left in the arrays returned through outPaths, outFlags and
+// outIds, valid until the next call, and their number is returned.
+size_t git_ignore_batch(struct git_ignore* ignore,
+                        size_t numEvents,
+                        char** paths,
+                        const FSEventStreamEventFlags eventFlags[],
+                        const FSEventStreamEventId eventIds[],
+                        char*** outPaths,
+                        const FSEventStreamEventFlags** outFlags,
+                        const FSEventStreamEventId** outIds);
+
+// Events dropped so far
+UInt64 git_ignore_dropped(const struct git_ignore* ignore);
+
+#endif // fsevent_watch_git_ignore_h
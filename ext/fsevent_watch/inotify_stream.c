@@ -0,0 +1,659 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "event_batch.h"
+#include "inotify_stream.h"
+
+// Large enough that a checkout touching tens of thousands of files is drained
+// in a handful of read(2) calls rather than one syscall per event.
+#define INOTIFY_STREAM_BUFFER_SIZE  (256 * 1024)
+#define INOTIFY_STREAM_EVENT_MAX    (sizeof(struct inotify_event) + NAME_MAX + 1)
+
+#define INOTIFY_STREAM_WATCH_MASK   (IN_CREATE | IN_DELETE | IN_MODIFY |      \
+                                     IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | \
+                                     IN_DELETE_SELF | IN_MOVE_SELF |           \
+                                     IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define INOTIFY_STREAM_PENDING_MASK (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+
+struct inotify_watch {
+  char*   path;     // NULL if the slot is unused
+  size_t  len;      // 0 for "/", so that joining never produces "//"
+  bool    is_dir;
+  bool    pending;  // existing ancestor of a root that doesn't exist yet
+};
+
+struct inotify_root {
+  char*   path;
+  size_t  len;
+  int     wd;       // -1 while the root doesn't exist
+};
+
+struct inotify_stream {
+  int                       fd;
+  bool                      file_events;
+  bool                      watch_root;
+  bool                      watch_limit_warned;
+
+  struct inotify_root*      roots;
+  size_t                    num_roots;
+
+  // watch descriptors are small, increasing integers, so index by them
+  struct inotify_watch*     watches;
+  size_t                    watches_cap;
+
+  char*                     buffer;
+  struct event_batch        batch;
+};
+
+static size_t inotify_stream_path_len(const char* path)
+{
+  size_t len = strlen(path);
+  return (len == 1 && path[0] == '/') ? 0 : len;
+}
+
+static struct inotify_watch* inotify_stream_lookup(struct inotify_stream* stream, int wd)
+{
+  if (wd < 0 || (size_t)wd >= stream->watches_cap || stream->watches[wd].path == NULL) {
+    return NULL;
+  }
+  return &stream->watches[wd];
+}
+
+static void inotify_stream_forget(struct inotify_stream* stream, int wd)
+{
+  struct inotify_watch* watch = inotify_stream_lookup(stream, wd);
+  if (watch) {
+    free(watch->path);
+    memset(watch, 0, sizeof(struct inotify_watch));
+  }
+
+  for (size_t i = 0; i < stream->num_roots; i++) {
+    if (stream->roots[i].wd == wd) {
+      stream->roots[i].wd = -1;
+    }
+  }
+}
+
+static int inotify_stream_add_watch(struct inotify_stream* stream,
+                                    const char* path,
+                                    bool is_dir,
+                                    bool pending)
+{
+  uint32_t mask = pending ? INOTIFY_STREAM_PENDING_MASK : INOTIFY_STREAM_WATCH_MASK;
+  if (is_dir) {
+    mask |= IN_ONLYDIR;
+  }
+
+  int wd = inotify_add_watch(stream->fd, path, mask);
+  if (wd < 0) {
+    if (errno == ENOSPC && !stream->watch_limit_warned) {
+      fprintf(stderr, "inotify watch limit reached (see fs.inotify.max_user_watches); "
+                      "some directories are not being watched\n");
+      stream->watch_limit_warned = true;
+    }
+    return -1;
+  }
+
+  if ((size_t)wd >= stream->watches_cap) {
+    size_t cap = stream->watches_cap ? stream->watches_cap : 1024;
+    while ((size_t)wd >= cap) {
+      cap *= 2;
+    }
+    stream->watches = realloc(stream->watches, cap * sizeof(struct inotify_watch));
+    if (!stream->watches) {
+      fprintf(stderr, "Unable to track %zu inotify watches\n", cap);
+      exit(EXIT_FAILURE);
+    }
+    memset(&stream->watches[stream->watches_cap], 0,
+           (cap - stream->watches_cap) * sizeof(struct inotify_watch));
+    stream->watches_cap = cap;
+  }
+
+  // the same inode reached through another path keeps its first name
+  struct inotify_watch* watch = &stream->watches[wd];
+  if (watch->path == NULL) {
+    watch->path = strdup(path);
+    if (!watch->path) {
+      fprintf(stderr, "Unable to allocate inotify watch path: %s\n", path);
+      exit(EXIT_FAILURE);
+    }
+    watch->len = inotify_stream_path_len(path);
+    watch->is_dir = is_dir;
+    watch->pending = pending;
+  } else if (watch->pending && !pending) {
+    watch->pending = false;
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "inotify watch %d%s: %s\n", wd, pending ? " (pending)" : "", path);
+#endif
+
+  return wd;
+}
+
+static bool inotify_stream_is_dir(int dirfd, const char* name, unsigned char d_type)
+{
+  if (d_type != DT_UNKNOWN) {
+    return d_type == DT_DIR;
+  }
+
+  struct stat st;
+  if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+    return false;
+  }
+  return S_ISDIR(st.st_mode);
+}
+
+// Watch `path` and every directory below it. When `emit_created` is set the
+// tree is new, so anything found inside it was created before its watch
+// existed and is reported as a synthetic event.
+static int inotify_stream_add_tree(struct inotify_stream* stream,
+                                   const char* path,
+                                   bool emit_created,
+                                   double now)
+{
+  size_t stack_len = 0;
+  size_t stack_cap = 64;
+  char** stack = malloc(stack_cap * sizeof(char*));
+  int top_wd = -1;
+  bool top = true;
+
+  if (!stack || !(stack[stack_len++] = strdup(path))) {
+    fprintf(stderr, "Unable to allocate directory stack for %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  while (stack_len > 0) {
+    char* dir = stack[--stack_len];
+    size_t dir_len = inotify_stream_path_len(dir);
+
+    int wd = inotify_stream_add_watch(stream, dir, true, false);
+    if (top) {
+      top_wd = wd;
+      top = false;
+    }
+
+    DIR* dp = (wd < 0) ? NULL : opendir(dir);
+    if (dp == NULL) {
+      free(dir);
+      continue;
+    }
+
+    bool reported_dir = false;
+    struct dirent* entry;
+
+    while ((entry = readdir(dp)) != NULL) {
+      const char* name = entry->d_name;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+
+      size_t name_len = strlen(name);
+      bool is_dir = inotify_stream_is_dir(dirfd(dp), name, entry->d_type);
+
+      if (emit_created) {
+        if (stream->file_events) {
+          event_batch_append(&stream->batch, dir, dir_len, '/', name, name_len,
+                             kFSEventStreamEventFlagItemCreated |
+                             (is_dir ? kFSEventStreamEventFlagItemIsDir
+                                     : kFSEventStreamEventFlagItemIsFile),
+                             now);
+        } else if (!reported_dir) {
+          event_batch_append(&stream->batch, dir, dir_len, '/', NULL, 0,
+                             kFSEventStreamEventFlagNone, now);
+          reported_dir = true;
+        }
+      }
+
+      if (is_dir) {
+        if (stack_len == stack_cap) {
+          stack_cap *= 2;
+          stack = realloc(stack, stack_cap * sizeof(char*));
+          if (!stack) {
+            fprintf(stderr, "Unable to grow directory stack to %zu entries\n", stack_cap);
+            exit(EXIT_FAILURE);
+          }
+        }
+        char* child = malloc(dir_len + name_len + 2);
+        if (!child) {
+          fprintf(stderr, "Unable to allocate path below %s\n", dir);
+          exit(EXIT_FAILURE);
+        }
+        memcpy(child, dir, dir_len);
+        child[dir_len] = '/';
+        memcpy(child + dir_len + 1, name, name_len + 1);
+        stack[stack_len++] = child;
+      }
+    }
+
+    closedir(dp);
+    free(dir);
+  }
+
+  free(stack);
+  return top_wd;
+}
+
+// Drop every watch at or below `path`, for directories moved out from under us
+static void inotify_stream_remove_tree(struct inotify_stream* stream,
+                                       const char* path,
+                                       size_t len)
+{
+  for (size_t wd = 0; wd < stream->watches_cap; wd++) {
+    struct inotify_watch* watch = &stream->watches[wd];
+    if (watch->path == NULL || watch->pending || watch->len < len) {
+      continue;
+    }
+    if (memcmp(watch->path, path, len) != 0) {
+      continue;
+    }
+    if (watch->len == len || watch->path[len] == '/') {
+      inotify_rm_watch(stream->fd, (int)wd);
+      inotify_stream_forget(stream, (int)wd);
+    }
+  }
+}
+
+static bool inotify_stream_path_under_root(struct inotify_stream* stream,
+                                           const char* path,
+                                           size_t len)
+{
+  for (size_t i = 0; i < stream->num_roots; i++) {
+    struct inotify_root* root = &stream->roots[i];
+    if (root->wd < 0 || len < root->len) {
+      continue;
+    }
+    if (memcmp(path, root->path, root->len) == 0 &&
+        (len == root->len || path[root->len] == '/')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Watch a root if it exists, otherwise watch its nearest existing ancestor so
+// that we notice when it's created, the same way FSEvents does.
+static void inotify_stream_arm_root(struct inotify_stream* stream,
+                                    struct inotify_root* root,
+                                    double now,
+                                    bool emit_created)
+{
+  struct stat st;
+
+  if (stat(root->path, &st) == 0) {
+    if (S_ISDIR(st.st_mode)) {
+      root->wd = inotify_stream_add_tree(stream, root->path, emit_created, now);
+    } else {
+      root->wd = inotify_stream_add_watch(stream, root->path, false, false);
+    }
+    if (root->wd >= 0) {
+      return;
+    }
+  }
+
+  char ancestor[PATH_MAX];
+  snprintf(ancestor, sizeof(ancestor), "%s", root->path);
+
+  for (;;) {
+    char* slash = strrchr(ancestor, '/');
+    if (slash == NULL) {
+      return;
+    }
+    if (slash == ancestor) {
+      slash[1] = '\0';
+    } else {
+      *slash = '\0';
+    }
+
+    if (stat(ancestor, &st) == 0 && S_ISDIR(st.st_mode)) {
+      // nested roots already see the creation through their own watches
+      if (!inotify_stream_path_under_root(stream, ancestor, inotify_stream_path_len(ancestor))) {
+        inotify_stream_add_watch(stream, ancestor, true, true);
+      }
+      return;
+    }
+
+    if (slash == ancestor) {
+      return;
+    }
+  }
+}
+
+static void inotify_stream_handle_pending(struct inotify_stream* stream,
+                                          struct inotify_watch* watch,
+                                          const struct inotify_event* event,
+                                          double now)
+{
+  if (!(event->mask & IN_ISDIR) || event->len == 0) {
+    return;
+  }
+
+  char child[PATH_MAX];
+  int child_len = snprintf(child, sizeof(child), "%.*s/%s",
+                           (int)watch->len, watch->path, event->name);
+  if (child_len < 0 || (size_t)child_len >= sizeof(child)) {
+    return;
+  }
+
+  for (size_t i = 0; i < stream->num_roots; i++) {
+    struct inotify_root* root = &stream->roots[i];
+    if (root->wd >= 0 || root->len < (size_t)child_len) {
+      continue;
+    }
+    if (memcmp(root->path, child, (size_t)child_len) != 0) {
+      continue;
+    }
+
+    if (root->len == (size_t)child_len) {
+      inotify_stream_arm_root(stream, root, now, true);
+      FSEventStreamEventFlags flags = kFSEventStreamEventFlagNone;
+      if (stream->file_events) {
+        flags = kFSEventStreamEventFlagItemCreated | kFSEventStreamEventFlagItemIsDir;
+      }
+      event_batch_append(&stream->batch, root->path, root->len,
+                         stream->file_events ? 0 : '/', NULL, 0, flags, now);
+    } else if (root->path[child_len] == '/') {
+      inotify_stream_add_watch(stream, child, true, true);
+    }
+  }
+}
+
+static FSEventStreamEventFlags inotify_stream_map_flags(uint32_t mask)
+{
+  FSEventStreamEventFlags flags = kFSEventStreamEventFlagNone;
+
+  if (mask & IN_CREATE) {
+    flags |= kFSEventStreamEventFlagItemCreated;
+  }
+  if (mask & IN_DELETE) {
+    flags |= kFSEventStreamEventFlagItemRemoved;
+  }
+  if (mask & IN_MODIFY) {
+    flags |= kFSEventStreamEventFlagItemModified;
+  }
+  if (mask & IN_ATTRIB) {
+    flags |= kFSEventStreamEventFlagItemInodeMetaMod;
+  }
+  if (mask & (IN_MOVED_FROM | IN_MOVED_TO)) {
+    flags |= kFSEventStreamEventFlagItemRenamed;
+  }
+
+  if (mask & IN_ISDIR) {
+    flags |= kFSEventStreamEventFlagItemIsDir;
+  } else {
+    flags |= kFSEventStreamEventFlagItemIsFile;
+  }
+
+  return flags;
+}
+
+static void inotify_stream_handle_root_changed(struct inotify_stream* stream,
+                                               int wd,
+                                               FSEventStreamEventFlags flags,
+                                               double now)
+{
+  for (size_t i = 0; i < stream->num_roots; i++) {
+    struct inotify_root* root = &stream->roots[i];
+    if (root->wd != wd) {
+      continue;
+    }
+
+    if (flags == kFSEventStreamEventFlagRootChanged && !stream->watch_root) {
+      flags = kFSEventStreamEventFlagNone;
+    }
+    if (flags != kFSEventStreamEventFlagNone) {
+      event_batch_append(&stream->batch, root->path, root->len,
+                         stream->file_events ? 0 : '/', NULL, 0, flags, now);
+    }
+
+    inotify_stream_remove_tree(stream, root->path, root->len);
+    inotify_stream_arm_root(stream, root, now, false);
+  }
+}
+
+static void inotify_stream_handle_event(struct inotify_stream* stream,
+                                        const struct inotify_event* event,
+                                        double now)
+{
+  // whatever was created while events were dropped has no watch yet, so walk
+  // every root again; the consumer rescans them, so nothing is synthesized
+  if (event->mask & IN_Q_OVERFLOW) {
+    for (size_t i = 0; i < stream->num_roots; i++) {
+      struct inotify_root* root = &stream->roots[i];
+      event_batch_append(&stream->batch, root->path, root->len,
+                         stream->file_events ? 0 : '/', NULL, 0,
+                         kFSEventStreamEventFlagMustScanSubDirs |
+                         kFSEventStreamEventFlagKernelDropped,
+                         now);
+      inotify_stream_arm_root(stream, root, now, false);
+    }
+    return;
+  }
+
+  struct inotify_watch* watch = inotify_stream_lookup(stream, event->wd);
+  if (watch == NULL) {
+    return;
+  }
+
+  if (event->mask & IN_IGNORED) {
+    inotify_stream_forget(stream, event->wd);
+    return;
+  }
+
+  if (watch->pending) {
+    inotify_stream_handle_pending(stream, watch, event, now);
+    return;
+  }
+
+  if (event->mask & IN_UNMOUNT) {
+    inotify_stream_handle_root_changed(stream, event->wd, kFSEventStreamEventFlagUnmount, now);
+    return;
+  }
+
+  // a subdirectory's own removal was already reported by its parent
+  if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+    inotify_stream_handle_root_changed(stream, event->wd, kFSEventStreamEventFlagRootChanged, now);
+    return;
+  }
+
+  const char* name = (event->len > 0) ? event->name : NULL;
+  size_t name_len = name ? strlen(name) : 0;
+
+  if (name && (event->mask & IN_ISDIR)) {
+    char child[PATH_MAX];
+    int child_len = snprintf(child, sizeof(child), "%.*s/%s",
+                             (int)watch->len, watch->path, name);
+    if (child_len > 0 && (size_t)child_len < sizeof(child)) {
+      if (event->mask & IN_MOVED_FROM) {
+        inotify_stream_remove_tree(stream, child, (size_t)child_len);
+      } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        inotify_stream_add_tree(stream, child, (event->mask & IN_CREATE) != 0, now);
+      }
+      // the watch table may have been reallocated while adding watches
+      watch = inotify_stream_lookup(stream, event->wd);
+      if (watch == NULL) {
+        return;
+      }
+    }
+  }
+
+  if (stream->file_events) {
+    event_batch_append(&stream->batch, watch->path, watch->len,
+                       name ? '/' : 0, name, name_len,
+                       inotify_stream_map_flags(event->mask), now);
+    return;
+  }
+
+  // directory level events name the directory, as FSEvents does, and only
+  // need to be reported once per batch
+  const char* last = event_batch_last_path(&stream->batch);
+  if (last && strncmp(last, watch->path, watch->len) == 0 &&
+      last[watch->len] == '/' && last[watch->len + 1] == '\0') {
+    return;
+  }
+  event_batch_append(&stream->batch, watch->path, watch->len,
+                     watch->is_dir ? '/' : 0, NULL, 0,
+                     kFSEventStreamEventFlagNone, now);
+}
+
+// Drain the inotify fd. Each read(2) returns as many queued events as fit in
+// the buffer; a short read means the queue is empty, saving the final EAGAIN.
+static bool inotify_stream_drain(struct inotify_stream* stream)
+{
+  for (;;) {
+    ssize_t len = read(stream->fd, stream->buffer, INOTIFY_STREAM_BUFFER_SIZE);
+
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN);
+    }
+
+    double now = event_batch_now();
+    const char* ptr = stream->buffer;
+    const char* end = stream->buffer + len;
+
+    while (ptr < end) {
+      const struct inotify_event* event = (const struct inotify_event*)ptr;
+      inotify_stream_handle_event(stream, event, now);
+      ptr += sizeof(struct inotify_event) + event->len;
+    }
+
+    event_batch_flush_if_due(&stream->batch, now);
+
+    if ((size_t)len < INOTIFY_STREAM_BUFFER_SIZE - INOTIFY_STREAM_EVENT_MAX) {
+      return true;
+    }
+  }
+}
+
+struct inotify_stream* inotify_stream_create(FSEventStreamCallback callback,
+                                             void* info,
+                                             char** paths,
+                                             size_t numPaths,
+                                             CFTimeInterval latency,
+                                             FSEventStreamCreateFlags flags)
+{
+  struct inotify_stream* stream = calloc(1, sizeof(struct inotify_stream));
+  if (!stream) {
+    fprintf(stderr, "Unable to allocate inotify stream\n");
+    exit(EXIT_FAILURE);
+  }
+
+  stream->fd = -1;
+  stream->file_events = (flags & kFSEventStreamCreateFlagFileEvents) != 0;
+  stream->watch_root = (flags & kFSEventStreamCreateFlagWatchRoot) != 0;
+
+  stream->num_roots = numPaths;
+  stream->roots = calloc(numPaths, sizeof(struct inotify_root));
+  if (!stream->roots) {
+    fprintf(stderr, "Unable to allocate %zu inotify roots\n", numPaths);
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < numPaths; i++) {
+    stream->roots[i].path = strdup(paths[i]);
+    if (!stream->roots[i].path) {
+      fprintf(stderr, "Unable to allocate inotify root: %s\n", paths[i]);
+      exit(EXIT_FAILURE);
+    }
+    stream->roots[i].len = inotify_stream_path_len(paths[i]);
+    stream->roots[i].wd = -1;
+  }
+
+  stream->buffer = malloc(INOTIFY_STREAM_BUFFER_SIZE);
+  if (!stream->buffer) {
+    fprintf(stderr, "Unable to allocate inotify read buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  event_batch_init(&stream->batch, callback, info, latency, flags);
+
+  return stream;
+}
+
+void inotify_stream_adapt_latency(struct inotify_stream* stream, CFTimeInterval latency_max)
+{
+  event_batch_adapt(&stream->batch, latency_max);
+}
+
+bool inotify_stream_start(struct inotify_stream* stream)
+{
+  stream->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (stream->fd < 0) {
+    perror("inotify_init1");
+    return false;
+  }
+
+  double now = event_batch_now();
+  for (size_t i = 0; i < stream->num_roots; i++) {
+    inotify_stream_arm_root(stream, &stream->roots[i], now, false);
+  }
+
+  return true;
+}
+
+int inotify_stream_fd(const struct inotify_stream* stream)
+{
+  return stream->fd;
+}
+
+int inotify_stream_timeout(struct inotify_stream* stream)
+{
+  return event_batch_timeout(&stream->batch, event_batch_now());
+}
+
+bool inotify_stream_dispatch(struct inotify_stream* stream, bool readable)
+{
+  if (readable && !inotify_stream_drain(stream)) {
+    perror("read");
+    return false;
+  }
+
+  event_batch_flush_if_due(&stream->batch, event_batch_now());
+  return true;
+}
+
+void inotify_stream_run(struct inotify_stream* stream)
+{
+  struct pollfd pfd = { stream->fd, POLLIN, 0 };
+
+  for (;;) {
+    int ready = poll(&pfd, 1, inotify_stream_timeout(stream));
+
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      return;
+    }
+
+    if (!inotify_stream_dispatch(stream, ready > 0)) {
+      return;
+    }
+  }
+}
+
+void inotify_stream_release(struct inotify_stream* stream)
+{
+  if (stream->fd >= 0) {
+    close(stream->fd);
+  }
+
+  for (size_t wd = 0; wd < stream->watches_cap; wd++) {
+    free(stream->watches[wd].path);
+  }
+  free(stream->watches);
+
+  for (size_t i = 0; i < stream->num_roots; i++) {
+    free(stream->roots[i].path);
+  }
+  free(stream->roots);
+
+  event_batch_free(&stream->batch);
+  free(stream->buffer);
+  free(stream);
+}
@@ -0,0 +1,46 @@
+/**
+ * @headerfile inotify_stream.h
+ * inotify(7) event source
+ *
+ * Mirrors the FSEventStream lifecycle (create, start, run, release) so that
+ * main.c can drive the same callback and output formats on Linux. Every
+ * directory under each root gets its own watch; new directories are picked
+ * up as they appear and IN_* masks are translated to the matching
+ * kFSEventStreamEventFlag* bits.
+ */
+
+#ifndef fsevent_watch_inotify_stream_h
+#define fsevent_watch_inotify_stream_h
+
+#include "common.h"
+
+struct inotify_stream;
+
+struct inotify_stream* inotify_stream_create(FSEventStreamCallback callback,
+                                             void* info,
+                                             char** paths,
+                                             size_t numPaths,
+                                             CFTimeInterval latency,
+                                             FSEventStreamCreateFlags flags);
+
+// Stretch the latency window up to latency_max as the event rate climbs, for
+// --adaptive-latency. Call before starting the stream.
+void inotify_stream_adapt_latency(struct inotify_stream* stream, CFTimeInterval latency_max);
+
+// Register watches for every root; false if inotify itself is unusable
+bool inotify_stream_start(struct inotify_stream* stream);
+
+// Read and deliver events until an unrecoverable error occurs
+void inotify_stream_run(struct inotify_stream* stream);
+
+// For driving several streams from one poll(2) loop instead: wait for the
+// descriptor to become readable for at most the timeout, in milliseconds
+// (-1 when no batch is pending), then dispatch. Dispatch returns false on
+// an unrecoverable error.
+int inotify_stream_fd(const struct inotify_stream* stream);
+int inotify_stream_timeout(struct inotify_stream* stream);
+bool inotify_stream_dispatch(struct inotify_stream* stream, bool readable);
+
+void inotify_stream_release(struct inotify_stream* stream);
+
+#endif // fsevent_watch_inotify_stream_h
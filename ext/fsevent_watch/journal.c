@@ -0,0 +1,508 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define JOURNAL_ALIGN(n)            (((n) + 7) & ~(UInt64)7)
+#define JOURNAL_RECORD_SIZE(len)    JOURNAL_ALIGN(16 + (UInt64)(len) + 1)
+#define JOURNAL_INITIAL_CAPACITY    (1024 * 1024)
+
+struct journal_header {
+  char      magic[8];
+  UInt64    length;
+  UInt64    last_id;
+  char      reserved[40];
+};
+
+struct journal_record {
+  UInt64    id;
+  UInt32    flags;
+  UInt32    length;
+  char      path[];
+};
+
+struct journal_checkpoint {
+  UInt64    id;
+  UInt64    offset;
+};
+
+struct journal {
+  int                           fd;
+  int                           index_fd;
+  UInt64                        max_bytes;
+
+  struct journal_header*        header;
+  char*                         records;
+  size_t                        mapped;
+  UInt64                        capacity;
+
+  struct journal_checkpoint*    checkpoints;
+  size_t                        num_checkpoints;
+  size_t                        checkpoints_capacity;
+
+  FSEventStreamEventId          first_id;
+
+  // reused for every appended batch and replayed chunk
+  FSEventStreamEventId*         ids;
+  char**                        paths;
+  FSEventStreamEventFlags*      flags;
+  size_t                        scratch_capacity;
+};
+
+static inline struct journal_record* journal_record_at(const struct journal* journal,
+                                                       UInt64 offset)
+{
+  return (struct journal_record*)(journal->records + offset);
+}
+
+static void journal_scratch(struct journal* journal, size_t count)
+{
+  if (count <= journal->scratch_capacity) {
+    return;
+  }
+
+  size_t capacity = journal->scratch_capacity ? journal->scratch_capacity : 256;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  journal->ids = realloc(journal->ids, capacity * sizeof(FSEventStreamEventId));
+  journal->paths = realloc(journal->paths, capacity * sizeof(char*));
+  journal->flags = realloc(journal->flags, capacity * sizeof(FSEventStreamEventFlags));
+  if (!journal->ids || !journal->paths || !journal->flags) {
+    fprintf(stderr, "Unable to allocate journal buffers\n");
+    exit(EXIT_FAILURE);
+  }
+  journal->scratch_capacity = capacity;
+}
+
+static bool journal_map(struct journal* journal, size_t size)
+{
+  if (journal->header) {
+    munmap(journal->header, journal->mapped);
+    journal->header = NULL;
+  }
+
+  void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+
+  journal->header = base;
+  journal->records = (char*)base + JOURNAL_HEADER_SIZE;
+  journal->mapped = size;
+  journal->capacity = size - JOURNAL_HEADER_SIZE;
+  return true;
+}
+
+static bool journal_grow(struct journal* journal, UInt64 needed)
+{
+  UInt64 capacity = journal->capacity;
+  while (capacity < needed) {
+    capacity *= 2;
+  }
+  if (capacity > journal->max_bytes && needed <= journal->max_bytes) {
+    capacity = journal->max_bytes;
+  }
+
+  size_t size = (size_t)(JOURNAL_HEADER_SIZE + capacity);
+  if (ftruncate(journal->fd, (off_t)size) != 0) {
+    return false;
+  }
+  return journal_map(journal, size);
+}
+
+static bool journal_write_all(int fd, const void* bytes, size_t length, off_t offset)
+{
+  const char* p = bytes;
+
+  while (length > 0) {
+    ssize_t written = pwrite(fd, p, length, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += written;
+    length -= (size_t)written;
+    offset += written;
+  }
+  return true;
+}
+
+static void journal_add_checkpoint(struct journal* journal, FSEventStreamEventId id, UInt64 offset)
+{
+  if (journal->num_checkpoints == journal->checkpoints_capacity) {
+    size_t capacity = journal->checkpoints_capacity ? journal->checkpoints_capacity * 2 : 64;
+    journal->checkpoints = realloc(journal->checkpoints,
+                                   capacity * sizeof(struct journal_checkpoint));
+    if (!journal->checkpoints) {
+      fprintf(stderr, "Unable to allocate journal index\n");
+      exit(EXIT_FAILURE);
+    }
+    journal->checkpoints_capacity = capacity;
+  }
+
+  journal->checkpoints[journal->num_checkpoints].id = id;
+  journal->checkpoints[journal->num_checkpoints].offset = offset;
+  journal->num_checkpoints++;
+}
+
+// A checkpoint goes on the first record at least an interval past the last
+static inline bool journal_checkpoint_due(const struct journal* journal, UInt64 offset)
+{
+  return journal->num_checkpoints == 0 ||
+         offset >= journal->checkpoints[journal->num_checkpoints - 1].offset + JOURNAL_CHECKPOINT_BYTES;
+}
+
+static bool journal_write_index(struct journal* journal)
+{
+  if (ftruncate(journal->index_fd, 0) != 0) {
+    return false;
+  }
+  return journal_write_all(journal->index_fd, journal->checkpoints,
+                           journal->num_checkpoints * sizeof(struct journal_checkpoint), 0);
+}
+
+// Walk the records from offset, checkpointing them, and cut off whatever
+// follows the last one that's whole
+static void journal_scan(struct journal* journal, UInt64 offset)
+{
+  UInt64 length = journal->header->length;
+  FSEventStreamEventId lastId = 0;
+
+  while (length - offset >= sizeof(struct journal_record)) {
+    struct journal_record* record = journal_record_at(journal, offset);
+    UInt64 size = JOURNAL_RECORD_SIZE(record->length);
+
+    if (size > length - offset || record->path[record->length] != '\0' || record->id <= lastId) {
+      break;
+    }
+
+    if (journal_checkpoint_due(journal, offset)) {
+      journal_add_checkpoint(journal, record->id, offset);
+    }
+    lastId = record->id;
+    offset += size;
+  }
+
+  journal->header->length = offset;
+  if (lastId > journal->header->last_id) {
+    journal->header->last_id = lastId;
+  }
+}
+
+// Keep the checkpoints that agree with the records, and rebuild the rest
+static bool journal_load_index(struct journal* journal)
+{
+  struct stat st;
+  if (fstat(journal->index_fd, &st) != 0) {
+    return false;
+  }
+
+  size_t stored = (size_t)st.st_size / sizeof(struct journal_checkpoint);
+  UInt64 length = journal->header->length;
+
+  for (size_t i = 0; i < stored; i++) {
+    struct journal_checkpoint checkpoint;
+    off_t at = (off_t)(i * sizeof(struct journal_checkpoint));
+
+    if (pread(journal->index_fd, &checkpoint, sizeof(checkpoint), at) != sizeof(checkpoint)) {
+      break;
+    }
+    if (checkpoint.offset % 8 != 0 ||
+        length < sizeof(struct journal_record) ||
+        checkpoint.offset > length - sizeof(struct journal_record) ||
+        !journal_checkpoint_due(journal, checkpoint.offset) ||
+        (i == 0 && checkpoint.offset != 0) ||
+        journal_record_at(journal, checkpoint.offset)->id != checkpoint.id) {
+      break;
+    }
+    journal_add_checkpoint(journal, checkpoint.id, checkpoint.offset);
+  }
+
+  size_t valid = journal->num_checkpoints;
+  UInt64 from = 0;
+  if (valid > 0) {
+    // the scan picks the last checkpoint up again
+    from = journal->checkpoints[--journal->num_checkpoints].offset;
+  }
+  journal_scan(journal, from);
+
+  journal->first_id = journal->header->length > 0 ? journal_record_at(journal, 0)->id
+                                                  : journal->header->last_id + 1;
+
+  if (valid == stored && journal->num_checkpoints == valid &&
+      (size_t)st.st_size == stored * sizeof(struct journal_checkpoint)) {
+    return true;
+  }
+  return journal_write_index(journal);
+}
+
+// Drop the records before cut, which is a checkpoint or the end of the
+// records. A crash before the new length is committed loses what was being
+// kept as well, but never leaves half moved records behind.
+static bool journal_compact(struct journal* journal, UInt64 cut)
+{
+  UInt64 length = journal->header->length;
+
+  journal->header->length = 0;
+  memmove(journal->records, journal->records + cut, (size_t)(length - cut));
+  journal->header->length = length - cut;
+
+  size_t kept = 0;
+  for (size_t i = 0; i < journal->num_checkpoints; i++) {
+    if (journal->checkpoints[i].offset >= cut) {
+      journal->checkpoints[kept].id = journal->checkpoints[i].id;
+      journal->checkpoints[kept].offset = journal->checkpoints[i].offset - cut;
+      kept++;
+    }
+  }
+  journal->num_checkpoints = kept;
+
+  journal->first_id = journal->header->length > 0 ? journal_record_at(journal, 0)->id
+                                                  : journal->header->last_id + 1;
+
+  return journal_write_index(journal);
+}
+
+// Make room for bytes more of records, dropping the oldest ones once the
+// journal is at its limit
+static bool journal_reserve(struct journal* journal, UInt64 bytes)
+{
+  UInt64 length = journal->header->length;
+
+  if (bytes > journal->max_bytes) {
+    errno = EFBIG;
+    return false;
+  }
+
+  if (length + bytes > journal->max_bytes) {
+    UInt64 keep = journal->max_bytes / 2;
+    if (keep > journal->max_bytes - bytes) {
+      keep = journal->max_bytes - bytes;
+    }
+
+    UInt64 cut = length;
+    for (size_t i = 0; i < journal->num_checkpoints; i++) {
+      if (length - journal->checkpoints[i].offset <= keep) {
+        cut = journal->checkpoints[i].offset;
+        break;
+      }
+    }
+
+    if (!journal_compact(journal, cut)) {
+      return false;
+    }
+    length = journal->header->length;
+  }
+
+  if (length + bytes > journal->capacity) {
+    return journal_grow(journal, length + bytes);
+  }
+  return true;
+}
+
+struct journal* journal_open(const char* path, size_t maxBytes)
+{
+  struct journal* journal = calloc(1, sizeof(struct journal));
+  if (!journal) {
+    return NULL;
+  }
+
+  journal->fd = -1;
+  journal->index_fd = -1;
+  journal->max_bytes = maxBytes;
+
+  char indexPath[PATH_MAX];
+  if ((size_t)snprintf(indexPath, sizeof(indexPath), "%s.idx", path) >= sizeof(indexPath)) {
+    errno = ENAMETOOLONG;
+    goto fail;
+  }
+
+  journal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (journal->fd < 0) {
+    goto fail;
+  }
+
+  // one writer per journal, or ids would be handed out twice
+  if (flock(journal->fd, LOCK_EX | LOCK_NB) != 0) {
+    goto fail;
+  }
+
+  struct stat st;
+  if (fstat(journal->fd, &st) != 0) {
+    goto fail;
+  }
+
+  bool created = st.st_size == 0;
+  size_t size = (size_t)st.st_size;
+  if (created) {
+    size = JOURNAL_HEADER_SIZE + JOURNAL_INITIAL_CAPACITY;
+    if (ftruncate(journal->fd, (off_t)size) != 0) {
+      goto fail;
+    }
+  } else if (size < JOURNAL_HEADER_SIZE + sizeof(struct journal_record)) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  if (!journal_map(journal, size)) {
+    goto fail;
+  }
+
+  if (created) {
+    journal->header->length = 0;
+    journal->header->last_id = 0;
+    memcpy(journal->header->magic, JOURNAL_MAGIC, sizeof(journal->header->magic));
+  } else if (memcmp(journal->header->magic, JOURNAL_MAGIC, sizeof(journal->header->magic)) != 0 ||
+             journal->header->length > journal->capacity) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  journal->index_fd = open(indexPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (journal->index_fd < 0 || !journal_load_index(journal)) {
+    goto fail;
+  }
+
+  return journal;
+
+fail:
+  {
+    int error = errno;
+    journal_close(journal);
+    errno = error;
+  }
+  return NULL;
+}
+
+void journal_close(struct journal* journal)
+{
+  if (journal->header) {
+    munmap(journal->header, journal->mapped);
+  }
+  if (journal->fd >= 0) {
+    close(journal->fd);
+  }
+  if (journal->index_fd >= 0) {
+    close(journal->index_fd);
+  }
+  free(journal->checkpoints);
+  free(journal->ids);
+  free(journal->paths);
+  free(journal->flags);
+  free(journal);
+}
+
+FSEventStreamEventId journal_first_id(const struct journal* journal)
+{
+  return journal->first_id;
+}
+
+FSEventStreamEventId journal_last_id(const struct journal* journal)
+{
+  return journal->header->last_id;
+}
+
+const FSEventStreamEventId* journal_append(struct journal* journal,
+                                           size_t numEvents,
+                                           char** paths,
+                                           const FSEventStreamEventFlags flags[])
+{
+  UInt64 needed = 0;
+  for (size_t i = 0; i < numEvents; i++) {
+    needed += JOURNAL_RECORD_SIZE(strlen(paths[i]));
+  }
+
+  if (!journal_reserve(journal, needed)) {
+    return NULL;
+  }
+  journal_scratch(journal, numEvents);
+
+  UInt64 offset = journal->header->length;
+  FSEventStreamEventId id = journal->header->last_id;
+  size_t numCheckpoints = journal->num_checkpoints;
+
+  for (size_t i = 0; i < numEvents; i++) {
+    struct journal_record* record = journal_record_at(journal, offset);
+    size_t length = strlen(paths[i]);
+    UInt64 size = JOURNAL_RECORD_SIZE(length);
+
+    record->id = ++id;
+    record->flags = flags[i];
+    record->length = (UInt32)length;
+    memcpy(record->path, paths[i], length);
+    memset(record->path + length, 0, (size_t)(size - sizeof(struct journal_record) - length));
+
+    if (journal_checkpoint_due(journal, offset)) {
+      journal_add_checkpoint(journal, id, offset);
+    }
+    journal->ids[i] = id;
+    offset += size;
+  }
+
+  journal->header->last_id = id;
+  journal->header->length = offset;
+
+  if (journal->num_checkpoints > numCheckpoints) {
+    size_t added = journal->num_checkpoints - numCheckpoints;
+    if (!journal_write_all(journal->index_fd, &journal->checkpoints[numCheckpoints],
+                           added * sizeof(struct journal_checkpoint),
+                           (off_t)(numCheckpoints * sizeof(struct journal_checkpoint)))) {
+      return NULL;
+    }
+  }
+
+  return journal->ids;
+}
+
+void journal_replay(struct journal* journal,
+                    FSEventStreamEventId sinceWhen,
+                    journal_replay_callback callback,
+                    void* info)
+{
+  UInt64 length = journal->header->length;
+
+  // start from the last checkpoint at or before sinceWhen, the records after
+  // it up to the next one are the only ones that need skipping
+  size_t low = 0;
+  size_t high = journal->num_checkpoints;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (journal->checkpoints[middle].id <= sinceWhen) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  UInt64 offset = low > 0 ? journal->checkpoints[low - 1].offset : 0;
+
+  journal_scratch(journal, JOURNAL_REPLAY_CHUNK);
+
+  size_t count = 0;
+  while (offset < length) {
+    struct journal_record* record = journal_record_at(journal, offset);
+    offset += JOURNAL_RECORD_SIZE(record->length);
+
+    if (record->id <= sinceWhen) {
+      continue;
+    }
+
+    journal->paths[count] = record->path;
+    journal->flags[count] = record->flags;
+    journal->ids[count] = record->id;
+    if (++count == JOURNAL_REPLAY_CHUNK) {
+      callback(info, count, journal->paths, journal->flags, journal->ids);
+      count = 0;
+    }
+  }
+
+  if (count > 0) {
+    callback(info, count, journal->paths, journal->flags, journal->ids);
+  }
+}
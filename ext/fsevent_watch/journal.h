@@ -0,0 +1,84 @@
+/**
+ * @headerfile journal.h
+ * --journal: a persistent event history for event sources other than FSEvents
+ *
+ * FSEvents keeps its own history, which is what lets --since-when replay the
+ * changes made while nothing was watching. inotify and fanotify forget
+ * everything the moment fsevent_watch exits, so with --journal=PATH every
+ * batch they deliver is appended to a file first, and the ids it is given
+ * there replace the event source's own. Ids keep counting up across
+ * restarts, so the last id a reader saw is a valid --since-when next time.
+ *
+ * PATH is memory mapped and grown as records are appended:
+ *
+ *   0    magic "FSWJRNL1"
+ *   8    u64 bytes of records committed
+ *   16   u64 highest id ever handed out
+ *   64   records
+ *
+ * A record is a u64 id, u32 flags, u32 path length and the NUL terminated
+ * path, padded to 8 bytes, so replayed paths are used where they lie in the
+ * mapping. The committed length is only updated once a batch's records are
+ * written, and anything past it is ignored when the journal is reopened.
+ *
+ * Every JOURNAL_CHECKPOINT_BYTES of records, the id and offset of the record
+ * starting there is appended to PATH.idx. --since-when binary searches those
+ * checkpoints and scans at most one interval of records to find where replay
+ * starts. The index is checked against the records, and rebuilt from them
+ * where it falls short, every time the journal is opened.
+ *
+ * Once the records reach the size limit, the oldest half is dropped at a
+ * checkpoint. A caller asked for history from before the oldest record
+ * left can tell its reader to rescan instead.
+ */
+
+#ifndef fsevent_watch_journal_h
+#define fsevent_watch_journal_h
+
+#include "common.h"
+
+#define JOURNAL_MAGIC               "FSWJRNL1"
+#define JOURNAL_HEADER_SIZE         64
+#define JOURNAL_CHECKPOINT_BYTES    (64 * 1024)
+#define JOURNAL_DEFAULT_MAX_BYTES   (256 * 1024 * 1024)
+
+// replay hands out records this many at a time
+#define JOURNAL_REPLAY_CHUNK        4096
+
+struct journal;
+
+// Receives a chunk of replayed records. The arrays belong to the journal and
+// may be reordered or overwritten by the callee, the paths may not.
+typedef void (*journal_replay_callback)(void* info,
+                                        size_t numEvents,
+                                        char** paths,
+                                        FSEventStreamEventFlags flags[],
+                                        FSEventStreamEventId ids[]);
+
+// Open or create the journal at path, keeping at most maxBytes of records.
+// Returns NULL with errno set when it can't be, including EWOULDBLOCK when
+// another process has it open.
+struct journal* journal_open(const char* path, size_t maxBytes);
+void journal_close(struct journal* journal);
+
+// Oldest id still recorded, and the newest id handed out. When the journal
+// is empty the first is one past the second.
+FSEventStreamEventId journal_first_id(const struct journal* journal);
+FSEventStreamEventId journal_last_id(const struct journal* journal);
+
+// Record a batch and return the ids it was given, valid until the next
+// append, or NULL with errno set if it couldn't be written
+const FSEventStreamEventId* journal_append(struct journal* journal,
+                                           size_t numEvents,
+                                           char** paths,
+                                           const FSEventStreamEventFlags flags[]);
+
+// Hand every record with an id greater than sinceWhen to callback, oldest
+// first. Records before journal_first_id have been dropped to keep the
+// journal within its size, so asking for those replays less than asked for.
+void journal_replay(struct journal* journal,
+                    FSEventStreamEventId sinceWhen,
+                    journal_replay_callback callback,
+                    void* info);
+
+#endif // fsevent_watch_journal_h
@@ -1,53 +1,184 @@
 #include "common.h"
+#include "arena.h"
 #include "cli.h"
+#include "coalesce.h"
+#include "content_hash.h"
+#include "git_ignore.h"
+#include "journal.h"
+#include "output_encoder.h"
+#include "path_filter.h"
+#include "shm_ring.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "watch_daemon.h"
+#include "write_queue.h"
+#include <errno.h>
+#include <pthread.h>
+#ifdef __APPLE__
 #include "FSEventsFix.h"
+#include "event_batch.h"
+#else
+#include <poll.h>
+#include "fanotify_stream.h"
+#include "inotify_stream.h"
+#endif
 
-// TODO: set on fire. cli.{h,c} handle both parsing and defaults, so there's
-//       no need to set those here. also, in order to scope metadata by path,
-//       each stream will need its own configuration... so this won't work as
-//       a global any more. In the end the goal is to make the output format
-//       able to declare not just that something happened and what flags were
-//       attached, but what path it was watching that caused those events (so
-//       that the path itself can be used for routing that information to the
-//       relevant callback).
-//
-// Structure for storing metadata parsed from the commandline
-static struct {
+// A watched path, and the settings of the stream watching it
+struct watch_root {
+  char*                           path;
   FSEventStreamEventId            sinceWhen;
   CFTimeInterval                  latency;
+  // with --adaptive-latency, latency is the shortest window and this the
+  // longest; 0 for a fixed window
+  CFTimeInterval                  latencyMax;
   FSEventStreamCreateFlags        flags;
-  CFMutableArrayRef               paths;
+};
+
+// Roots with identical settings, which share one stream. Paths are kept
+// longest first, so the first that prefixes an event's path is its root.
+struct root_group {
+  FSEventStreamEventId            sinceWhen;
+  CFTimeInterval                  latency;
+  CFTimeInterval                  latencyMax;
+  FSEventStreamCreateFlags        flags;
+  char**                          paths;
+  size_t*                         lengths;
+  size_t                          numPaths;
+};
+
+// Structure for storing metadata parsed from the commandline
+static struct {
+  struct watch_root*              roots;
+  size_t                          numRoots;
+  struct root_group*              groups;
+  size_t                          numGroups;
   enum FSEventWatchOutputFormat   format;
+  enum FSEventWatchEventSource    eventSource;
+  bool                            coalesce;
+  bool                            gitignore;
+  bool                            crawl;
+  bool                            contentHash;
+  UInt64                          contentHashMax;
+  char*                           daemonSocket;
+  enum FSEventWatchTransport      transport;
+  enum FSEventWatchOverflow       overflow;
+  int                             shmFd;
+  char*                           journalPath;
+  char*                           snapshotPath;
+  double                          statsInterval;
 } config = {
-  (UInt64) kFSEventStreamEventIdSinceNow,
-  (double) 0.3,
-  (CFOptionFlags) kFSEventStreamCreateFlagNone,
   NULL,
-  kFSEventWatchOutputFormatClassic
+  0,
+  NULL,
+  0,
+  kFSEventWatchOutputFormatClassic,
+  kFSEventWatchEventSourceFSEvents,
+  false,
+  false,
+  false,
+  false,
+  0,
+  NULL,
+  kFSEventWatchTransportPipe,
+  kFSEventWatchOverflowBlock,
+  -1,
+  NULL,
+  NULL,
+  0
 };
 
+// --include/--exclude globs, compiled once the commandline is parsed
+static struct path_filter filter;
+
+// ignore files of the watched worktrees when --gitignore is given
+static struct git_ignore* ignore;
+
+// reused for every batch when --coalesce is given
+static struct coalesce coalescer;
+
+// the file hashes of --content-hash
+static struct content_hash* hasher;
+
+// reused for every batch, so steady state encoding doesn't allocate
+static struct output_encoder encoder;
+
+// where batches go with --transport=shm
+static struct shm_ring ring;
+
+// batches on their way to the writer thread
+static struct write_queue* queue;
+
+// temporaries of the batch being written, and of the snapshot scan the
+// main thread makes on startup
+static struct arena writer_arena;
+static struct arena startup_arena;
+
+// event history of event sources that keep none, with --journal
+static struct journal* journal;
+
+// state of the watched trees, kept between runs with --snapshot and in
+// memory with --crawl. The main thread scans it on startup, before the
+// streams deliver anything; the writer thread owns it from then on.
+static struct snapshot* snapshot;
+
+// the paths of a batch the snapshot refreshes, each once
+static struct coalesce snapshot_paths;
+
 // Prototypes
-static void         append_path(const char* path);
+static void         append_path(const char* path,
+                                const struct watch_root* settings);
+static void         append_resolved_path(const char* path,
+                                         const struct watch_root* settings);
 static inline void  parse_cli_settings(int argc, const char* argv[]);
+static void         group_roots(void);
+static void         deliver(const struct root_group* group,
+                            size_t numEvents,
+                            char** paths,
+                            const FSEventStreamEventFlags eventFlags[],
+                            const FSEventStreamEventId eventIds[]);
+static void         update_snapshot(const struct root_group* group,
+                                    size_t numEvents,
+                                    char** paths,
+                                    const FSEventStreamEventFlags eventFlags[],
+                                    const FSEventStreamEventId eventIds[]);
+static void*        writer_thread(void* info);
 static void         callback(FSEventStreamRef streamRef,
                              void* clientCallBackInfo,
                              size_t numEvents,
                              void* eventPaths,
                              const FSEventStreamEventFlags eventFlags[],
                              const FSEventStreamEventId eventIds[]);
+#ifdef __APPLE__
 static bool needs_fsevents_fix = false;
+#endif
+
+// Store a fully resolved path in the CLI settings structure
+static void append_resolved_path(const char* path,
+                                 const struct watch_root* settings)
+{
+  config.roots = realloc(config.roots, (config.numRoots + 1) * sizeof(struct watch_root));
+  if (!config.roots) {
+    fprintf(stderr, "Unable to allocate root list\n");
+    exit(EXIT_FAILURE);
+  }
+
+  struct watch_root* root = &config.roots[config.numRoots++];
+  *root = *settings;
+  root->path = strdup(path);
+}
 
 // Resolve a path and append it to the CLI settings structure
 // The FSEvents API will, internally, resolve paths using a similar scheme.
 // Performing this ahead of time makes things less confusing, IMHO.
-static void append_path(const char* path)
+static void append_path(const char* path,
+                        const struct watch_root* settings)
 {
 #ifdef DEBUG
   fprintf(stderr, "\n");
   fprintf(stderr, "append_path called for: %s\n", path);
 #endif
 
-#if MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
+#if defined(__APPLE__) && MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
 
 #ifdef DEBUG
   fprintf(stderr, "compiled against 10.6+, using CFURLCreateFileReferenceURL\n");
@@ -129,21 +260,23 @@ static void append_path(const char* path)
   CFStringRef cfPath = CFURLCopyFileSystemPath(placeholder, kCFURLPOSIXPathStyle);
   CFRelease(placeholder);
 
-  char cPath[PATH_MAX];
-  if (CFStringGetCString(cfPath, cPath, PATH_MAX, kCFStringEncodingUTF8)) {
+  CFIndex cPathSize = CFStringGetMaximumSizeOfFileSystemRepresentation(cfPath);
+  char* cPath = malloc((size_t)cPathSize);
+  if (CFStringGetFileSystemRepresentation(cfPath, cPath, cPathSize)) {
     FSEventsFixRepairStatus status = FSEventsFixRepairIfNeeded(cPath);
     if (status == FSEventsFixRepairStatusFailed) {
       needs_fsevents_fix = true;
     }
+    append_resolved_path(cPath, settings);
   }
 
-  CFArrayAppendValue(config.paths, cfPath);
+  free(cPath);
   CFRelease(cfPath);
 
 #else
 
 #ifdef DEBUG
-  fprintf(stderr, "compiled against 10.5, using realpath()\n");
+  fprintf(stderr, "compiled against 10.5 or without CoreFoundation, using realpath()\n");
 #endif
 
   char fullPath[PATH_MAX + 1];
@@ -164,12 +297,12 @@ static void append_path(const char* path)
 #endif
       len = strlen(fullPath);
       fullPath[len] = '/';
-      strlcpy(&fullPath[len + 1], path, sizeof(fullPath) - (len + 1));
+      snprintf(&fullPath[len + 1], sizeof(fullPath) - (len + 1), "%s", path);
     } else {
 #ifdef DEBUG
       fprintf(stderr, "  assuming path does not YET exist\n");
 #endif
-      strlcpy(fullPath, path, sizeof(fullPath));
+      snprintf(fullPath, sizeof(fullPath), "%s", path);
     }
   }
 
@@ -178,11 +311,7 @@ static void append_path(const char* path)
   fprintf(stderr, "\n");
 #endif
 
-  CFStringRef pathRef = CFStringCreateWithCString(kCFAllocatorDefault,
-                                                  fullPath,
-                                                  kCFStringEncodingUTF8);
-  CFArrayAppendValue(config.paths, pathRef);
-  CFRelease(pathRef);
+  append_resolved_path(fullPath, settings);
 
 #endif
 }
@@ -190,6 +319,7 @@ static void append_path(const char* path)
 // Parse commandline settings
 static inline void parse_cli_settings(int argc, const char* argv[])
 {
+#ifdef __APPLE__
   // runtime os version detection
   SInt32 osMajorVersion, osMinorVersion;
   if (!(Gestalt(gestaltSystemVersionMajor, &osMajorVersion) == noErr)) {
@@ -203,6 +333,7 @@ static inline void parse_cli_settings(int argc, const char* argv[])
     fprintf(stderr, "The FSEvents API is unavailable on this version of macos!\n");
     exit(EXIT_FAILURE);
   }
+#endif
 
   struct cli_info args_info;
   cli_parser_init(&args_info);
@@ -211,194 +342,342 @@ static inline void parse_cli_settings(int argc, const char* argv[])
     exit(EXIT_FAILURE);
   }
 
-  config.paths = CFArrayCreateMutable(NULL,
-                                      (CFIndex)0,
-                                      &kCFTypeArrayCallBacks);
+  struct watch_root defaults = {
+    NULL,
+    args_info.since_when_arg,
+    args_info.latency_arg,
+    0,
+    kFSEventStreamCreateFlagNone
+  };
+
+  if (args_info.adaptive_latency_given) {
+    defaults.latency = args_info.adaptive_latency_min_arg;
+    defaults.latencyMax = args_info.adaptive_latency_max_arg;
+  }
 
-  config.sinceWhen = args_info.since_when_arg;
-  config.latency = args_info.latency_arg;
   config.format = args_info.format_arg;
+  config.eventSource = args_info.event_source_arg;
+  config.coalesce = args_info.coalesce_flag;
+  config.gitignore = args_info.gitignore_flag;
+  config.crawl = args_info.crawl_flag;
+  config.contentHash = args_info.content_hash_flag;
+  config.contentHashMax = args_info.content_hash_max_arg;
+  config.statsInterval = args_info.stats_arg;
+  if (args_info.daemon_arg) {
+    config.daemonSocket = strdup(args_info.daemon_arg);
+  }
+  config.transport = args_info.transport_arg;
+  config.overflow = args_info.overflow_arg;
+  config.shmFd = args_info.shm_fd_arg;
+#ifdef __APPLE__
+  if (args_info.journal_arg) {
+    fprintf(stderr, "FSEvents keeps its own event history, ignoring --journal\n");
+  }
+#else
+  if (args_info.journal_arg) {
+    config.journalPath = strdup(args_info.journal_arg);
+  }
+#endif
+  if (args_info.snapshot_arg) {
+    config.snapshotPath = strdup(args_info.snapshot_arg);
+  }
+
+  path_filter_init(&filter);
+  for (unsigned int i = 0; i < args_info.include_num; i++) {
+    if (!path_filter_add(&filter, args_info.include_args[i], false)) {
+      fprintf(stderr, "Invalid --include glob: %s\n", args_info.include_args[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (unsigned int i = 0; i < args_info.exclude_num; i++) {
+    if (!path_filter_add(&filter, args_info.exclude_args[i], true)) {
+      fprintf(stderr, "Invalid --exclude glob: %s\n", args_info.exclude_args[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  path_filter_compile(&filter);
 
   if (args_info.no_defer_flag) {
-    config.flags |= kFSEventStreamCreateFlagNoDefer;
+    defaults.flags |= kFSEventStreamCreateFlagNoDefer;
+  }
+  if (args_info.debounce_flag) {
+    defaults.flags |= kFSEventWatchCreateFlagDebounce;
   }
   if (args_info.watch_root_flag) {
-    config.flags |= kFSEventStreamCreateFlagWatchRoot;
+    defaults.flags |= kFSEventStreamCreateFlagWatchRoot;
   }
 
+#ifdef __APPLE__
+  bool fileEventsAvailable = (osMajorVersion == 10) & (osMinorVersion >= 7);
+
   if (args_info.ignore_self_flag) {
     if ((osMajorVersion == 10) & (osMinorVersion >= 6)) {
-      config.flags |= kFSEventStreamCreateFlagIgnoreSelf;
+      defaults.flags |= kFSEventStreamCreateFlagIgnoreSelf;
     } else {
       fprintf(stderr, "MacOSX 10.6 or later is required for --ignore-self\n");
       exit(EXIT_FAILURE);
     }
   }
 
-  if (args_info.file_events_flag) {
-    if ((osMajorVersion == 10) & (osMinorVersion >= 7)) {
-      config.flags |= kFSEventStreamCreateFlagFileEvents;
+  if (args_info.mark_self_flag) {
+    if ((osMajorVersion == 10) & (osMinorVersion >= 9)) {
+      defaults.flags |= kFSEventStreamCreateFlagMarkSelf;
     } else {
-      fprintf(stderr, "MacOSX 10.7 or later required for --file-events\n");
+      fprintf(stderr, "MacOSX 10.9 or later required for --mark-self\n");
       exit(EXIT_FAILURE);
     }
   }
+#else
+  bool fileEventsAvailable = true;
 
-  if (args_info.mark_self_flag) {
-    if ((osMajorVersion == 10) & (osMinorVersion >= 9)) {
-      config.flags |= kFSEventStreamCreateFlagMarkSelf;
-    } else {
-      fprintf(stderr, "MacOSX 10.9 or later required for --mark-self\n");
+  if (args_info.ignore_self_flag || args_info.mark_self_flag) {
+    if (config.eventSource != kFSEventWatchEventSourceFanotify) {
+      fprintf(stderr, "inotify cannot tell which process caused an event, "
+                      "--ignore-self and --mark-self require --event-source=fanotify\n");
       exit(EXIT_FAILURE);
     }
+    if (args_info.ignore_self_flag) {
+      defaults.flags |= kFSEventStreamCreateFlagIgnoreSelf;
+    }
+    if (args_info.mark_self_flag) {
+      defaults.flags |= kFSEventStreamCreateFlagMarkSelf;
+    }
+  }
+#endif
+
+  bool fileEvents = args_info.file_events_flag;
+  for (unsigned int i = 0; i < args_info.root_num; i++) {
+    fileEvents |= args_info.root_args[i].file_events_flag;
+  }
+  if (fileEvents && !fileEventsAvailable) {
+    fprintf(stderr, "MacOSX 10.7 or later required for --file-events\n");
+    exit(EXIT_FAILURE);
+  }
+  if (args_info.file_events_flag) {
+    defaults.flags |= kFSEventStreamCreateFlagFileEvents;
   }
 
-  if (args_info.inputs_num == 0) {
-    append_path(".");
+  if (args_info.inputs_num == 0 && args_info.root_num == 0) {
+    append_path(".", &defaults);
   } else {
     for (unsigned int i=0; i < args_info.inputs_num; ++i) {
-      append_path(args_info.inputs[i]);
+      append_path(args_info.inputs[i], &defaults);
     }
   }
 
+  // each --root starts from the defaults and overrides what was given after it
+  for (unsigned int i = 0; i < args_info.root_num; i++) {
+    const struct cli_root* arg = &args_info.root_args[i];
+    struct watch_root settings = defaults;
+
+    if (arg->since_when_given) {
+      settings.sinceWhen = arg->since_when_arg;
+    }
+    if (arg->latency_given) {
+      settings.latency = arg->latency_arg;
+      settings.latencyMax = 0;
+    }
+    if (arg->no_defer_flag) {
+      settings.flags |= kFSEventStreamCreateFlagNoDefer;
+    }
+    if (arg->debounce_flag) {
+      settings.flags |= kFSEventWatchCreateFlagDebounce;
+    }
+    if (arg->watch_root_flag) {
+      settings.flags |= kFSEventStreamCreateFlagWatchRoot;
+    }
+    if (arg->file_events_flag) {
+      settings.flags |= kFSEventStreamCreateFlagFileEvents;
+    }
+
+    append_path(arg->path, &settings);
+  }
+
   cli_parser_free(&args_info);
 
+#ifndef __APPLE__
+  for (size_t i = 0; i < config.numRoots && !config.journalPath; i++) {
+    if (config.roots[i].sinceWhen != kFSEventStreamEventIdSinceNow) {
+      fprintf(stderr, "only FSEvents keeps an event history without --journal, "
+                      "ignoring --since-when\n");
+      config.roots[i].sinceWhen = kFSEventStreamEventIdSinceNow;
+    }
+  }
+#endif
+
+  group_roots();
+
 #ifdef DEBUG
-  fprintf(stderr, "config.sinceWhen    %llu\n", config.sinceWhen);
-  fprintf(stderr, "config.latency      %f\n", config.latency);
+  fprintf(stderr, "config.coalesce     %s\n", config.coalesce ? "true" : "false");
+  fprintf(stderr, "config.gitignore    %s\n", config.gitignore ? "true" : "false");
+  fprintf(stderr, "config.crawl        %s\n", config.crawl ? "true" : "false");
+  fprintf(stderr, "config.contentHash  %s, up to %llu bytes\n",
+          config.contentHash ? "true" : "false", (unsigned long long)config.contentHashMax);
+  fprintf(stderr, "config.stats        %f\n", config.statsInterval);
+  fprintf(stderr, "config.transport    %s\n",
+          config.transport == kFSEventWatchTransportShm ? "shm" : "pipe");
+  fprintf(stderr, "config.overflow     %s\n",
+          config.overflow == kFSEventWatchOverflowCoalesce ? "coalesce" :
+          config.overflow == kFSEventWatchOverflowDrop ? "drop" : "block");
+  fprintf(stderr, "config.journal      %s\n", config.journalPath ? config.journalPath : "none");
+  fprintf(stderr, "config.snapshot     %s\n", config.snapshotPath ? config.snapshotPath : "none");
+  fprintf(stderr, "config.filter       %zu globs, %zu states\n",
+          filter.num_starts, filter.num_states);
+
+  for (size_t g = 0; g < config.numGroups; g++) {
+    const struct root_group* group = &config.groups[g];
+
+    fprintf(stderr, "config.groups[%zu]\n", g);
+    fprintf(stderr, "  sinceWhen         %llu\n", (unsigned long long)group->sinceWhen);
+    fprintf(stderr, "  latency           %f\n", group->latency);
+    if (group->latencyMax > 0) {
+      fprintf(stderr, "  latencyMax        %f\n", group->latencyMax);
+    }
 
 // STFU clang
 #if defined(__LP64__)
-  fprintf(stderr, "config.flags        %#.8x\n", config.flags);
+    fprintf(stderr, "  flags             %#.8x\n", group->flags);
 #else
-  fprintf(stderr, "config.flags        %#.8lx\n", config.flags);
+    fprintf(stderr, "  flags             %#.8lx\n", group->flags);
 #endif
 
-  FLAG_CHECK_STDERR(config.flags, kFSEventStreamCreateFlagUseCFTypes,
-                    "  Using CF instead of C types");
-  FLAG_CHECK_STDERR(config.flags, kFSEventStreamCreateFlagNoDefer,
-                    "  NoDefer latency modifier enabled");
-  FLAG_CHECK_STDERR(config.flags, kFSEventStreamCreateFlagWatchRoot,
-                    "  WatchRoot notifications enabled");
-  FLAG_CHECK_STDERR(config.flags, kFSEventStreamCreateFlagIgnoreSelf,
-                    "  IgnoreSelf enabled");
-  FLAG_CHECK_STDERR(config.flags, kFSEventStreamCreateFlagFileEvents,
-                    "  FileEvents enabled");
-
-  fprintf(stderr, "config.paths\n");
-
-  long numpaths = CFArrayGetCount(config.paths);
-
-  for (long i = 0; i < numpaths; i++) {
-    char path[PATH_MAX];
-    CFStringGetCString(CFArrayGetValueAtIndex(config.paths, i),
-                       path,
-                       PATH_MAX,
-                       kCFStringEncodingUTF8);
-    fprintf(stderr, "  %s\n", path);
+    FLAG_CHECK_STDERR(group->flags, kFSEventStreamCreateFlagUseCFTypes,
+                      "    Using CF instead of C types");
+    FLAG_CHECK_STDERR(group->flags, kFSEventStreamCreateFlagNoDefer,
+                      "    NoDefer latency modifier enabled");
+    FLAG_CHECK_STDERR(group->flags, kFSEventWatchCreateFlagDebounce,
+                      "    Debounce latency modifier enabled");
+    FLAG_CHECK_STDERR(group->flags, kFSEventStreamCreateFlagWatchRoot,
+                      "    WatchRoot notifications enabled");
+    FLAG_CHECK_STDERR(group->flags, kFSEventStreamCreateFlagIgnoreSelf,
+                      "    IgnoreSelf enabled");
+    FLAG_CHECK_STDERR(group->flags, kFSEventStreamCreateFlagFileEvents,
+                      "    FileEvents enabled");
+
+    fprintf(stderr, "  paths\n");
+    for (size_t i = 0; i < group->numPaths; i++) {
+      fprintf(stderr, "    %s\n", group->paths[i]);
+    }
   }
 
   fprintf(stderr, "\n");
 #endif
 }
 
-// original output format for rb-fsevent
-static void classic_output_format(size_t numEvents,
-                                  char** paths)
+// Gather roots with identical settings into the groups streams are made for
+static void group_roots(void)
 {
-  for (size_t i = 0; i < numEvents; i++) {
-    fprintf(stdout, "%s:", paths[i]);
+  for (size_t i = 0; i < config.numRoots; i++) {
+    const struct watch_root* root = &config.roots[i];
+    struct root_group* group = NULL;
+
+    for (size_t g = 0; g < config.numGroups; g++) {
+      if (config.groups[g].sinceWhen == root->sinceWhen &&
+          config.groups[g].latency == root->latency &&
+          config.groups[g].latencyMax == root->latencyMax &&
+          config.groups[g].flags == root->flags) {
+        group = &config.groups[g];
+        break;
+      }
+    }
+
+    if (!group) {
+      config.groups = realloc(config.groups, (config.numGroups + 1) * sizeof(struct root_group));
+      if (!config.groups) {
+        fprintf(stderr, "Unable to allocate stream groups\n");
+        exit(EXIT_FAILURE);
+      }
+      group = &config.groups[config.numGroups++];
+      memset(group, 0, sizeof(struct root_group));
+      group->sinceWhen = root->sinceWhen;
+      group->latency = root->latency;
+      group->latencyMax = root->latencyMax;
+      group->flags = root->flags;
+    }
+
+    // insertion keeps longer paths in front
+    size_t length = strlen(root->path);
+    group->paths = realloc(group->paths, (group->numPaths + 1) * sizeof(char*));
+    group->lengths = realloc(group->lengths, (group->numPaths + 1) * sizeof(size_t));
+    if (!group->paths || !group->lengths) {
+      fprintf(stderr, "Unable to allocate stream groups\n");
+      exit(EXIT_FAILURE);
+    }
+
+    size_t at = group->numPaths++;
+    while (at > 0 && group->lengths[at - 1] < length) {
+      group->paths[at] = group->paths[at - 1];
+      group->lengths[at] = group->lengths[at - 1];
+      at--;
+    }
+    group->paths[at] = root->path;
+    group->lengths[at] = length;
   }
-  fprintf(stdout, "\n");
 }
 
-// output format used in the Yoshimasa Niwa branch of rb-fsevent
-static void niw_output_format(size_t numEvents,
-                              char** paths,
-                              const FSEventStreamEventFlags eventFlags[],
-                              const FSEventStreamEventId eventIds[])
+// The group's root a path is under. Roots may nest, so the longest match
+// wins.
+static const char* find_root(const struct root_group* group, const char* path)
 {
-  for (size_t i = 0; i < numEvents; i++) {
-    fprintf(stdout, "%lu:%llu:%s\n",
-            (unsigned long)eventFlags[i],
-            (unsigned long long)eventIds[i],
-            paths[i]);
+  for (size_t r = 0; r < group->numPaths; r++) {
+    const char* root = group->paths[r];
+    size_t length = group->lengths[r];
+    if (strncmp(path, root, length) == 0 &&
+        (path[length] == '/' || path[length] == '\0' || root[length - 1] == '/')) {
+      return root;
+    }
   }
-  fprintf(stdout, "\n");
+  return NULL;
 }
 
-static void tstring_output_format(size_t numEvents,
-                                  char** paths,
-                                  const FSEventStreamEventFlags eventFlags[],
-                                  const FSEventStreamEventId eventIds[],
-                                  TSITStringFormat format)
+// Which of the group's roots each event is under
+static const char* const* tag_roots(const struct root_group* group,
+                                    size_t numEvents,
+                                    char** paths)
 {
-  CFMutableArrayRef events = CFArrayCreateMutable(kCFAllocatorDefault,
-                             0, &kCFTypeArrayCallBacks);
+  const char** event_roots = arena_alloc(&writer_arena, numEvents * sizeof(const char*));
 
   for (size_t i = 0; i < numEvents; i++) {
-    CFMutableDictionaryRef event = CFDictionaryCreateMutable(kCFAllocatorDefault,
-                                   0,
-                                   &kCFTypeDictionaryKeyCallBacks,
-                                   &kCFTypeDictionaryValueCallBacks);
-
-    CFStringRef path = CFStringCreateWithBytes(kCFAllocatorDefault,
-                       (const UInt8*)paths[i],
-                       (CFIndex)strlen(paths[i]),
-                       kCFStringEncodingUTF8,
-                       false);
-    CFDictionarySetValue(event, CFSTR("path"), path);
-
-    CFNumberRef flags = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &eventFlags[i]);
-    CFDictionarySetValue(event, CFSTR("flags"), flags);
-
-    CFNumberRef ident = CFNumberCreate(kCFAllocatorDefault, kCFNumberLongLongType, &eventIds[i]);
-    CFDictionarySetValue(event, CFSTR("id"), ident);
-
-    CFArrayAppendValue(events, event);
-
-    CFRelease(event);
-    CFRelease(path);
-    CFRelease(flags);
-    CFRelease(ident);
+    const char* root = find_root(group, paths[i]);
+    event_roots[i] = root ? root : "";
   }
 
-  CFMutableDictionaryRef meta = CFDictionaryCreateMutable(kCFAllocatorDefault,
-                                0,
-                                &kCFTypeDictionaryKeyCallBacks,
-                                &kCFTypeDictionaryValueCallBacks);
-  CFDictionarySetValue(meta, CFSTR("events"), events);
+  return event_roots;
+}
 
-  CFNumberRef num = CFNumberCreate(kCFAllocatorDefault, kCFNumberCFIndexType, &numEvents);
-  CFDictionarySetValue(meta, CFSTR("numEvents"), num);
+// Put a frame in the ring and ring the doorbell, or send it down the pipe
+// behind a 'p' when the reader has fallen too far behind for it to fit
+static int write_shm_batch(const char* bytes, size_t length)
+{
+  if (shm_ring_push(&ring, bytes, length)) {
+    return output_encoder_write(STDOUT_FILENO, "r", 1);
+  }
 
-  CFDataRef data = TSICTStringCreateRenderedDataFromObjectWithFormat(meta, format);
-  fprintf(stdout, "%s", CFDataGetBytePtr(data));
+#ifdef DEBUG
+  fprintf(stderr, "  ring full, sending %zu bytes through the pipe\n", length);
+#endif
 
-  CFRelease(events);
-  CFRelease(num);
-  CFRelease(meta);
-  CFRelease(data);
+  struct iovec iov[2] = {{"p", 1}, {(void*)bytes, length}};
+  return output_encoder_writev(STDOUT_FILENO, iov, 2);
 }
 
-static void callback(__attribute__((unused)) FSEventStreamRef streamRef,
-                     __attribute__((unused)) void* clientCallBackInfo,
-                     size_t numEvents,
-                     void* eventPaths,
-                     const FSEventStreamEventFlags eventFlags[],
-                     const FSEventStreamEventId eventIds[])
+// Run a batch through --gitignore, the filters, --coalesce and
+// --content-hash, and write out whatever is left. Only ever called on the
+// writer thread.
+static void write_out(const struct root_group* group,
+                      size_t numEvents,
+                      char** paths,
+                      const FSEventStreamEventFlags eventFlags[],
+                      const FSEventStreamEventId eventIds[])
 {
-  char** paths = eventPaths;
-
-
 #ifdef DEBUG
   fprintf(stderr, "\n");
   fprintf(stderr, "FSEventStreamCallback fired!\n");
-  fprintf(stderr, "  numEvents: %lu\n", numEvents);
+  fprintf(stderr, "  numEvents: %zu\n", numEvents);
 
   for (size_t i = 0; i < numEvents; i++) {
     fprintf(stderr, "\n");
-    fprintf(stderr, "  event ID: %llu\n", eventIds[i]);
+    fprintf(stderr, "  event ID: %llu\n", (unsigned long long)eventIds[i]);
 
 // STFU clang
 #if defined(__LP64__)
@@ -453,55 +732,814 @@ static void callback(__attribute__((unused)) FSEventStreamRef streamRef,
   fprintf(stderr, "\n");
 #endif
 
-  if (config.format == kFSEventWatchOutputFormatClassic) {
-    classic_output_format(numEvents, paths);
-  } else if (config.format == kFSEventWatchOutputFormatNIW) {
-    niw_output_format(numEvents, paths, eventFlags, eventIds);
-  } else if (config.format == kFSEventWatchOutputFormatTNetstring) {
-    tstring_output_format(numEvents, paths, eventFlags, eventIds,
-                          kTSITStringFormatTNetstring);
-  } else if (config.format == kFSEventWatchOutputFormatOTNetstring) {
-    tstring_output_format(numEvents, paths, eventFlags, eventIds,
-                          kTSITStringFormatOTNetstring);
+  // neither ignored nor filtered events ever reach a formatter
+  if (ignore) {
+    size_t before = numEvents;
+    numEvents = git_ignore_batch(ignore, numEvents, paths, eventFlags, eventIds,
+                                 &paths, &eventFlags, &eventIds);
+    stats_add(&stats.events_filtered, before - numEvents);
+
+#ifdef DEBUG
+    fprintf(stderr, "  events ignored so far: %llu\n",
+            (unsigned long long)git_ignore_dropped(ignore));
+#endif
+
+    if (numEvents == 0) {
+      return;
+    }
+  }
+
+  if (filter.num_starts > 0) {
+    size_t before = numEvents;
+    numEvents = path_filter_batch(&filter, numEvents, paths, eventFlags, eventIds);
+    stats_add(&stats.events_filtered, before - numEvents);
+    paths = filter.events.paths;
+    eventFlags = filter.events.flags;
+    eventIds = filter.events.ids;
+
+#ifdef DEBUG
+    fprintf(stderr, "  events filtered so far: %llu\n", (unsigned long long)filter.filtered);
+#endif
+
+    if (numEvents == 0) {
+      return;
+    }
+  }
+
+  if (config.coalesce) {
+    size_t before = numEvents;
+    numEvents = coalesce_batch(&coalescer, numEvents, paths, eventFlags, eventIds);
+    stats_add(&stats.events_coalesced, before - numEvents);
+    paths = coalescer.events.paths;
+    eventFlags = coalescer.events.flags;
+    eventIds = coalescer.events.ids;
   }
 
-  fflush(stdout);
+  // after --coalesce, so a file written several times is hashed once
+  if (hasher) {
+    size_t before = numEvents;
+    numEvents = content_hash_batch(hasher, numEvents, paths, eventFlags, eventIds,
+                                   &paths, &eventFlags, &eventIds);
+    stats_add(&stats.events_unchanged, before - numEvents);
+
+#ifdef DEBUG
+    fprintf(stderr, "  unchanged events so far: %llu, %llu bytes hashed\n",
+            (unsigned long long)content_hash_unchanged(hasher),
+            (unsigned long long)content_hash_bytes_hashed(hasher));
+#endif
+
+    if (numEvents == 0) {
+      return;
+    }
+  }
+
+  // only niwroot and tnetstring output name the root
+  const char* const* roots = NULL;
+  if (config.format == kFSEventWatchOutputFormatNIWRoot ||
+      config.format == kFSEventWatchOutputFormatTNetstring ||
+      config.format == kFSEventWatchOutputFormatOTNetstring) {
+    roots = tag_roots(group, numEvents, paths);
+  }
+
+  UInt64 started = stats_now();
+  size_t length;
+  const char* bytes = output_encoder_encode(&encoder, config.format, numEvents,
+                                            paths, eventFlags, eventIds, roots, &length);
+  UInt64 encoded = stats_now();
+  int calls;
+  if (config.transport == kFSEventWatchTransportShm) {
+    calls = write_shm_batch(bytes, length);
+  } else {
+    calls = output_encoder_write(STDOUT_FILENO, bytes, length);
+  }
+  if (calls < 0) {
+    fprintf(stderr, "Unable to write output: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  stats_add(&stats.encode_ns, encoded - started);
+  stats_add(&stats.write_ns, stats_now() - encoded);
+  stats_add(&stats.events_emitted, numEvents);
+  stats_add(&stats.batches, 1);
+  stats_add(&stats.writes, (UInt64)calls);
+  stats_add(&stats.bytes_written, length);
+  stats_max(&stats.max_batch, numEvents);
+
+#ifdef DEBUG
+  fprintf(stderr, "  write syscalls: %d for this batch, %llu over %llu batches\n",
+          calls, (unsigned long long)atomic_load(&stats.writes),
+          (unsigned long long)atomic_load(&stats.batches));
+#endif
 }
 
-int main(int argc, const char* argv[])
+// A UserDropped|MustScanSubDirs event on each of the group's roots, in place
+// of the batches --overflow dropped. Live ones held events the snapshot never
+// saw, so it rescans the roots too.
+static void write_rescan(const struct root_group* group, bool live)
 {
-  parse_cli_settings(argc, argv);
+  char** paths = arena_alloc(&writer_arena, group->numPaths * sizeof(char*));
+  FSEventStreamEventFlags* flags = arena_alloc(&writer_arena,
+                                               group->numPaths * sizeof(FSEventStreamEventFlags));
+  FSEventStreamEventId* ids = arena_alloc(&writer_arena,
+                                          group->numPaths * sizeof(FSEventStreamEventId));
+
+  for (size_t r = 0; r < group->numPaths; r++) {
+    paths[r] = group->paths[r];
+    flags[r] = kFSEventStreamEventFlagUserDropped | kFSEventStreamEventFlagMustScanSubDirs;
+    ids[r] = 0;
+  }
+  write_out(group, group->numPaths, paths, flags, ids);
+
+  if (snapshot && live) {
+    update_snapshot(group, group->numPaths, paths, flags, ids);
+  }
+}
+
+// Write batches out as the stream callback and the rest queue them, until
+// the queue is closed and empty, and keep the snapshot up to date with what
+// the streams delivered
+static void* writer_thread(__attribute__((unused)) void* info)
+{
+  struct write_batch* batch;
+
+  while ((batch = write_queue_pop(queue))) {
+    if (batch->rescan) {
+      write_rescan(batch->info, batch->live);
+    } else {
+      write_out(batch->info, batch->num_events, batch->paths, batch->flags, batch->ids);
+      stats_delivered(batch->times, batch->num_events);
+      if (snapshot && batch->live) {
+        update_snapshot(batch->info, batch->num_events, batch->paths, batch->flags, batch->ids);
+      }
+    }
+    write_queue_done(queue);
+    arena_reset(&writer_arena);
+  }
+
+  return NULL;
+}
+
+// Hand a batch to the writer thread, which owns everything from the filters
+// on, so the event source never waits on the reader of the output
+static void deliver(const struct root_group* group,
+                    size_t numEvents,
+                    char** paths,
+                    const FSEventStreamEventFlags eventFlags[],
+                    const FSEventStreamEventId eventIds[])
+{
+  write_queue_push(queue, (void*)group, false, numEvents, paths, eventFlags, eventIds, NULL);
+}
+
+// Changes a snapshot scan found, in the form the group's stream reports them:
+// the directories they're in, unless it asked for --file-events. They go to
+// send, deliver on startup and write_out on the writer thread.
+static void deliver_changes(const struct root_group* group,
+                            struct arena* arena,
+                            void (*send)(const struct root_group* group,
+                                         size_t numEvents,
+                                         char** paths,
+                                         const FSEventStreamEventFlags eventFlags[],
+                                         const FSEventStreamEventId eventIds[]),
+                            size_t numChanges,
+                            char** paths,
+                            const FSEventStreamEventFlags flags[])
+{
+  if (numChanges == 0) {
+    return;
+  }
+
+  FSEventStreamEventId* ids = arena_alloc(arena, numChanges * sizeof(FSEventStreamEventId));
+  memset(ids, 0, numChanges * sizeof(FSEventStreamEventId));
+
+  if (group->flags & kFSEventStreamCreateFlagFileEvents) {
+    send(group, numChanges, paths, flags, ids);
+    return;
+  }
+
+  char** dirs = arena_alloc(arena, numChanges * sizeof(char*));
+  FSEventStreamEventFlags* dirFlags = arena_alloc(arena,
+                                                  numChanges * sizeof(FSEventStreamEventFlags));
+  memset(dirFlags, 0, numChanges * sizeof(FSEventStreamEventFlags));
+
+  size_t numDirs = 0;
+  for (size_t i = 0; i < numChanges; i++) {
+    const char* slash = strrchr(paths[i], '/');
+    size_t length = slash ? (size_t)(slash - paths[i]) + 1 : 0;
+    if (length == 0 ||
+        (numDirs > 0 && strlen(dirs[numDirs - 1]) == length &&
+         strncmp(dirs[numDirs - 1], paths[i], length) == 0)) {
+      continue;
+    }
+    dirs[numDirs] = arena_strndup(arena, paths[i], length);
+    numDirs++;
+  }
+
+  send(group, numDirs, dirs, dirFlags, ids);
+}
+
+static void flush_snapshot(void)
+{
+  if (!snapshot_flush(snapshot)) {
+    fprintf(stderr, "Unable to write to the snapshot: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Bring the snapshot up to date with a batch the stream delivered, once the
+// writer thread has written it out. Dropped events cost a rescan, whose
+// findings go out as events of their own; every other event only refreshes
+// what it names, which the batch already reported. Each path is scanned once
+// however often the batch names it, and rescans go first, so those refreshes
+// can't take in the changes that were dropped before the rescan gets to
+// report them.
+static void update_snapshot(const struct root_group* group,
+                            size_t numEvents,
+                            char** paths,
+                            const FSEventStreamEventFlags eventFlags[],
+                            const FSEventStreamEventId eventIds[])
+{
+  const FSEventStreamEventFlags rescan = kFSEventStreamEventFlagMustScanSubDirs |
+                                         kFSEventStreamEventFlagUserDropped |
+                                         kFSEventStreamEventFlagKernelDropped;
+  size_t numChanges;
+  char** changes;
+  const FSEventStreamEventFlags* flags;
+
+  numEvents = coalesce_batch(&snapshot_paths, numEvents, paths, eventFlags, eventIds);
+  paths = snapshot_paths.events.paths;
+  eventFlags = snapshot_paths.events.flags;
+
+  for (size_t i = 0; i < numEvents; i++) {
+    if (eventFlags[i] & rescan) {
+      snapshot_scan(snapshot, paths[i], true, &numChanges, &changes, &flags);
+      deliver_changes(group, &writer_arena, write_out, numChanges, changes, flags);
+    }
+  }
+
+  for (size_t i = 0; i < numEvents; i++) {
+    if (!(eventFlags[i] & rescan)) {
+      snapshot_scan(snapshot, paths[i], false, &numChanges, &changes, &flags);
+    }
+  }
+
+  flush_snapshot();
+}
+
+// Report what changed below each root since the snapshot last saw it. Roots
+// the snapshot didn't know, which with --crawl alone is all of them, are
+// only recorded, since everything under them would be new.
+static void scan_snapshot(void)
+{
+  for (size_t g = 0; g < config.numGroups; g++) {
+    const struct root_group* group = &config.groups[g];
+
+    for (size_t r = 0; r < group->numPaths; r++) {
+      bool known = snapshot_has(snapshot, group->paths[r]);
+      size_t numChanges;
+      char** changes;
+      const FSEventStreamEventFlags* flags;
+
+      snapshot_scan(snapshot, group->paths[r], true, &numChanges, &changes, &flags);
+      if (known) {
+        deliver_changes(group, &startup_arena, deliver, numChanges, changes, flags);
+      }
+      arena_reset(&startup_arena);
+    }
+  }
+
+  if (!snapshot_save(snapshot)) {
+    fprintf(stderr, "Unable to write snapshot %s: %s\n", config.snapshotPath, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Leave out of the snapshot whatever --exclude leaves out of the output. With
+// --include, a directory that matches nothing may still hold paths that do.
+static bool snapshot_prune(const char* path)
+{
+  return !filter.has_includes && !path_filter_keep(&filter, path);
+}
+
+static void callback(__attribute__((unused)) FSEventStreamRef streamRef,
+                     void* clientCallBackInfo,
+                     size_t numEvents,
+                     void* eventPaths,
+                     const FSEventStreamEventFlags eventFlags[],
+                     const FSEventStreamEventId eventIds[])
+{
+  char** paths = eventPaths;
+  const double* times = stats_take_arrivals(numEvents);
+
+  stats_add(&stats.events_received, numEvents);
+  for (size_t i = 0; i < numEvents; i++) {
+    if (eventFlags[i] & (kFSEventStreamEventFlagMustScanSubDirs |
+                         kFSEventStreamEventFlagUserDropped |
+                         kFSEventStreamEventFlagKernelDropped)) {
+      stats_add(&stats.events_dropped, 1);
+    }
+  }
+
+  // everything the event source saw is journaled, whatever this run reports
+  if (journal) {
+    eventIds = journal_append(journal, numEvents, paths, eventFlags);
+    if (!eventIds) {
+      fprintf(stderr, "Unable to write to the journal: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  write_queue_push(queue, clientCallBackInfo, true, numEvents, paths, eventFlags, eventIds, times);
+}
+
+#ifdef __APPLE__
+// With --debounce FSEvents hands events over as they come, and they are
+// batched the way they are on Linux, with a run loop timer set for when the
+// pending batch is due
+struct debounce_stream {
+  struct event_batch        batch;
+  CFRunLoopTimerRef         timer;
+};
+
+static void debounce_schedule(struct debounce_stream* debounce)
+{
+  int timeout = event_batch_timeout(&debounce->batch, event_batch_now());
+  // the timer repeats, so it's never invalidated, and is parked far ahead
+  // while nothing is pending
+  CFAbsoluteTime fire = CFAbsoluteTimeGetCurrent() + (timeout < 0 ? 1e9 : timeout / 1000.0);
+  CFRunLoopTimerSetNextFireDate(debounce->timer, fire);
+}
+
+static void debounce_callback(__attribute__((unused)) ConstFSEventStreamRef streamRef,
+                              void* clientCallBackInfo,
+                              size_t numEvents,
+                              void* eventPaths,
+                              const FSEventStreamEventFlags eventFlags[],
+                              const FSEventStreamEventId eventIds[])
+{
+  struct debounce_stream* debounce = clientCallBackInfo;
+  char** paths = eventPaths;
+  double now = event_batch_now();
+
+  for (size_t i = 0; i < numEvents; i++) {
+    event_batch_append_event(&debounce->batch, paths[i], eventFlags[i], eventIds[i], now);
+  }
+  event_batch_flush_if_due(&debounce->batch, now);
+  debounce_schedule(debounce);
+}
+
+static void debounce_timer(__attribute__((unused)) CFRunLoopTimerRef timer, void* info)
+{
+  struct debounce_stream* debounce = info;
+  event_batch_flush_if_due(&debounce->batch, event_batch_now());
+  debounce_schedule(debounce);
+}
 
+static int run_fsevents_streams(void)
+{
   if (needs_fsevents_fix) {
     FSEventsFixEnable();
   }
 
-  FSEventStreamContext context = {0, NULL, NULL, NULL, NULL};
-  FSEventStreamRef stream;
-  stream = FSEventStreamCreate(kCFAllocatorDefault,
-                               (FSEventStreamCallback)&callback,
-                               &context,
-                               config.paths,
-                               config.sinceWhen,
-                               config.latency,
-                               config.flags);
+  FSEventStreamRef* streams = calloc(config.numGroups, sizeof(FSEventStreamRef));
+  struct debounce_stream* debounced = calloc(config.numGroups, sizeof(struct debounce_stream));
+  if (!streams || !debounced) {
+    fprintf(stderr, "Unable to allocate streams\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t g = 0; g < config.numGroups; g++) {
+    struct root_group* group = &config.groups[g];
+
+    CFMutableArrayRef paths = CFArrayCreateMutable(NULL,
+                                                   (CFIndex)group->numPaths,
+                                                   &kCFTypeArrayCallBacks);
+    for (size_t i = 0; i < group->numPaths; i++) {
+      CFStringRef pathRef = CFStringCreateWithFileSystemRepresentation(kCFAllocatorDefault,
+                                                                       group->paths[i]);
+      CFArrayAppendValue(paths, pathRef);
+      CFRelease(pathRef);
+    }
+
+    CFTimeInterval latency = group->latency;
+    FSEventStreamCreateFlags flags = group->flags & ~kFSEventWatchCreateFlagDebounce;
+    FSEventStreamCallback streamCallback = (FSEventStreamCallback)&callback;
+    FSEventStreamContext context = {0, group, NULL, NULL, NULL};
+
+    if (group->flags & kFSEventWatchCreateFlagDebounce) {
+      struct debounce_stream* debounce = &debounced[g];
+      event_batch_init(&debounce->batch, (FSEventStreamCallback)&callback, group,
+                       group->latency, group->flags);
+      if (group->latencyMax > 0) {
+        event_batch_adapt(&debounce->batch, group->latencyMax);
+      }
+      CFRunLoopTimerContext timerContext = {0, debounce, NULL, NULL, NULL};
+      debounce->timer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+                                             CFAbsoluteTimeGetCurrent() + 1e9, 1e9,
+                                             0, 0, debounce_timer, &timerContext);
+      CFRunLoopAddTimer(CFRunLoopGetCurrent(), debounce->timer, kCFRunLoopDefaultMode);
+
+      latency = 0;
+      flags &= ~kFSEventStreamCreateFlagNoDefer;
+      streamCallback = (FSEventStreamCallback)&debounce_callback;
+      context.info = debounce;
+    } else if (group->latencyMax > 0) {
+      // a stream's latency is fixed once it's created, so the nearest
+      // FSEvents comes to --adaptive-latency is NoDefer: the first event of
+      // a quiet period straight away, and the longest window while they
+      // keep coming
+      latency = group->latencyMax;
+      flags |= kFSEventStreamCreateFlagNoDefer;
+    }
+
+    streams[g] = FSEventStreamCreate(kCFAllocatorDefault,
+                                     streamCallback,
+                                     &context,
+                                     paths,
+                                     group->sinceWhen,
+                                     latency,
+                                     flags);
+    CFRelease(paths);
 
 #ifdef DEBUG
-  FSEventStreamShow(stream);
-  fprintf(stderr, "\n");
+    FSEventStreamShow(streams[g]);
+    fprintf(stderr, "\n");
 #endif
+  }
 
   if (needs_fsevents_fix) {
     FSEventsFixDisable();
   }
 
-  FSEventStreamScheduleWithRunLoop(stream,
-                                   CFRunLoopGetCurrent(),
-                                   kCFRunLoopDefaultMode);
-  FSEventStreamStart(stream);
+  for (size_t g = 0; g < config.numGroups; g++) {
+    FSEventStreamScheduleWithRunLoop(streams[g],
+                                     CFRunLoopGetCurrent(),
+                                     kCFRunLoopDefaultMode);
+    FSEventStreamStart(streams[g]);
+  }
+
+  // changes made while nothing was watching go out ahead of any made since
+  if (snapshot) {
+    scan_snapshot();
+  }
+
   CFRunLoopRun();
-  FSEventStreamFlushSync(stream);
-  FSEventStreamStop(stream);
+  for (size_t g = 0; g < config.numGroups; g++) {
+    FSEventStreamFlushSync(streams[g]);
+    FSEventStreamStop(streams[g]);
+    if (debounced[g].timer) {
+      event_batch_flush(&debounced[g].batch, event_batch_now());
+      CFRunLoopTimerInvalidate(debounced[g].timer);
+      CFRelease(debounced[g].timer);
+      event_batch_free(&debounced[g].batch);
+    }
+  }
 
   return 0;
 }
+#else
+// A stream per group, from whichever event source was asked for
+struct linux_stream {
+  struct inotify_stream*    inotify;
+  struct fanotify_stream*   fanotify;
+};
+
+static bool linux_stream_start(struct linux_stream* stream, struct root_group* group)
+{
+  if (config.eventSource == kFSEventWatchEventSourceFanotify) {
+    stream->fanotify = fanotify_stream_create((FSEventStreamCallback)&callback,
+                                              group,
+                                              group->paths,
+                                              group->numPaths,
+                                              group->latency,
+                                              group->flags);
+    if (group->latencyMax > 0) {
+      fanotify_stream_adapt_latency(stream->fanotify, group->latencyMax);
+    }
+    return fanotify_stream_start(stream->fanotify);
+  }
+
+  stream->inotify = inotify_stream_create((FSEventStreamCallback)&callback,
+                                          group,
+                                          group->paths,
+                                          group->numPaths,
+                                          group->latency,
+                                          group->flags);
+  if (group->latencyMax > 0) {
+    inotify_stream_adapt_latency(stream->inotify, group->latencyMax);
+  }
+  return inotify_stream_start(stream->inotify);
+}
+
+static void linux_stream_release(struct linux_stream* stream)
+{
+  if (stream->inotify) {
+    inotify_stream_release(stream->inotify);
+  }
+  if (stream->fanotify) {
+    fanotify_stream_release(stream->fanotify);
+  }
+}
+
+// Records of a replayed chunk that go to one group, reused for every chunk
+static char** replay_paths = NULL;
+static FSEventStreamEventFlags* replay_flags = NULL;
+static FSEventStreamEventId* replay_ids = NULL;
+
+// Hand each group that asked for history its part of a chunk of the journal
+static void replay_chunk(__attribute__((unused)) void* info,
+                         size_t numEvents,
+                         char** paths,
+                         FSEventStreamEventFlags flags[],
+                         FSEventStreamEventId ids[])
+{
+  for (size_t g = 0; g < config.numGroups; g++) {
+    const struct root_group* group = &config.groups[g];
+    size_t count = 0;
+
+    if (group->sinceWhen == kFSEventStreamEventIdSinceNow) {
+      continue;
+    }
+
+    for (size_t i = 0; i < numEvents; i++) {
+      if (ids[i] > group->sinceWhen && find_root(group, paths[i])) {
+        replay_paths[count] = paths[i];
+        replay_flags[count] = flags[i];
+        replay_ids[count] = ids[i];
+        count++;
+      }
+    }
+
+    if (count > 0) {
+      deliver(group, count, replay_paths, replay_flags, replay_ids);
+    }
+  }
+}
+
+// An event on each of the group's roots, for where its history starts or ends
+static void deliver_marker(const struct root_group* group,
+                           FSEventStreamEventFlags flags,
+                           FSEventStreamEventId id)
+{
+  for (size_t r = 0; r < group->numPaths; r++) {
+    replay_paths[r] = group->paths[r];
+    replay_flags[r] = flags;
+    replay_ids[r] = id;
+  }
+  deliver(group, group->numPaths, replay_paths, replay_flags, replay_ids);
+}
+
+// Replay the journal to the groups given a --since-when, before any live event
+// reaches them. A group asking for history the journal has already dropped
+// is told to rescan its roots first, and like FSEvents every group gets a
+// HistoryDone event once its history is through.
+static void replay_journal(void)
+{
+  FSEventStreamEventId sinceWhen = kFSEventStreamEventIdSinceNow;
+  size_t capacity = JOURNAL_REPLAY_CHUNK;
+
+  for (size_t g = 0; g < config.numGroups; g++) {
+    if (config.groups[g].sinceWhen < sinceWhen) {
+      sinceWhen = config.groups[g].sinceWhen;
+    }
+    if (config.groups[g].numPaths > capacity) {
+      capacity = config.groups[g].numPaths;
+    }
+  }
+
+  if (sinceWhen == kFSEventStreamEventIdSinceNow) {
+    return;
+  }
+
+  replay_paths = malloc(capacity * sizeof(char*));
+  replay_flags = malloc(capacity * sizeof(FSEventStreamEventFlags));
+  replay_ids = malloc(capacity * sizeof(FSEventStreamEventId));
+  if (!replay_paths || !replay_flags || !replay_ids) {
+    fprintf(stderr, "Unable to allocate %zu replayed events\n", capacity);
+    exit(EXIT_FAILURE);
+  }
+
+  FSEventStreamEventId firstId = journal_first_id(journal);
+  for (size_t g = 0; g < config.numGroups; g++) {
+    const struct root_group* group = &config.groups[g];
+    if (group->sinceWhen != kFSEventStreamEventIdSinceNow && group->sinceWhen + 1 < firstId) {
+      deliver_marker(group, kFSEventStreamEventFlagMustScanSubDirs, firstId - 1);
+    }
+  }
+
+  journal_replay(journal, sinceWhen, replay_chunk, NULL);
+
+  for (size_t g = 0; g < config.numGroups; g++) {
+    const struct root_group* group = &config.groups[g];
+    if (group->sinceWhen != kFSEventStreamEventIdSinceNow) {
+      deliver_marker(group, kFSEventStreamEventFlagHistoryDone, journal_last_id(journal));
+    }
+  }
+
+  free(replay_paths);
+  free(replay_flags);
+  free(replay_ids);
+}
+
+static int run_linux_streams(void)
+{
+  struct linux_stream* streams = calloc(config.numGroups, sizeof(struct linux_stream));
+  struct pollfd* fds = calloc(config.numGroups, sizeof(struct pollfd));
+
+  if (!streams || !fds) {
+    fprintf(stderr, "Unable to allocate %zu streams\n", config.numGroups);
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t g = 0; g < config.numGroups; g++) {
+    if (!linux_stream_start(&streams[g], &config.groups[g])) {
+      goto done;
+    }
+  }
+
+  // history goes out ahead of whatever happens from here on, which the
+  // streams are already queueing
+  if (journal) {
+    replay_journal();
+  }
+  if (snapshot) {
+    scan_snapshot();
+  }
+
+  // the common case of a single stream needs no poll loop of its own
+  if (config.numGroups == 1) {
+    if (streams[0].inotify) {
+      inotify_stream_run(streams[0].inotify);
+    } else {
+      fanotify_stream_run(streams[0].fanotify);
+    }
+    goto done;
+  }
+
+  for (;;) {
+    int timeout = -1;
+
+    for (size_t g = 0; g < config.numGroups; g++) {
+      int stream_timeout;
+      if (streams[g].inotify) {
+        fds[g].fd = inotify_stream_fd(streams[g].inotify);
+        stream_timeout = inotify_stream_timeout(streams[g].inotify);
+      } else {
+        fds[g].fd = fanotify_stream_fd(streams[g].fanotify);
+        stream_timeout = fanotify_stream_timeout(streams[g].fanotify);
+      }
+      fds[g].events = POLLIN;
+      if (stream_timeout >= 0 && (timeout < 0 || stream_timeout < timeout)) {
+        timeout = stream_timeout;
+      }
+    }
+
+    int ready = poll(fds, config.numGroups, timeout);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      goto done;
+    }
+
+    for (size_t g = 0; g < config.numGroups; g++) {
+      bool readable = (fds[g].revents & POLLIN) != 0;
+      bool ok = streams[g].inotify ? inotify_stream_dispatch(streams[g].inotify, readable)
+                                   : fanotify_stream_dispatch(streams[g].fanotify, readable);
+      if (!ok) {
+        goto done;
+      }
+    }
+  }
+
+done:
+  for (size_t g = 0; g < config.numGroups; g++) {
+    linux_stream_release(&streams[g]);
+  }
+  free(streams);
+  free(fds);
+  return EXIT_FAILURE;
+}
+#endif
+
+int main(int argc, const char* argv[])
+{
+  parse_cli_settings(argc, argv);
+
+  // subscribers bring their own paths and options
+  if (config.daemonSocket) {
+    if (config.transport != kFSEventWatchTransportPipe) {
+      fprintf(stderr, "--daemon always answers over its socket, not --transport\n");
+      exit(EXIT_FAILURE);
+    }
+    if (config.journalPath) {
+      fprintf(stderr, "--journal records a single watch, not --daemon\n");
+      exit(EXIT_FAILURE);
+    }
+    if (config.snapshotPath || config.crawl) {
+      fprintf(stderr, "--snapshot and --crawl record a single watch, not --daemon\n");
+      exit(EXIT_FAILURE);
+    }
+    if (config.contentHash) {
+      fprintf(stderr, "--content-hash filters a single watch, not --daemon\n");
+      exit(EXIT_FAILURE);
+    }
+    if (config.coalesce || config.gitignore || filter.num_starts > 0) {
+      fprintf(stderr, "--coalesce, --gitignore, --include and --exclude filter a single watch, "
+                      "not --daemon\n");
+      exit(EXIT_FAILURE);
+    }
+    if (config.overflow != kFSEventWatchOverflowBlock) {
+      fprintf(stderr, "--daemon writes to every subscriber itself, ignoring --overflow\n");
+    }
+    return watch_daemon_run(config.daemonSocket, config.eventSource);
+  }
+
+  if (!stats_start(config.statsInterval)) {
+    fprintf(stderr, "Unable to start the statistics thread: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  output_encoder_init(&encoder);
+  arena_init(&writer_arena);
+  arena_init(&startup_arena);
+
+  if (config.transport == kFSEventWatchTransportShm &&
+      !shm_ring_open(&ring, config.shmFd)) {
+    fprintf(stderr, "Unable to map a ring buffer from descriptor %d: %s\n",
+            config.shmFd, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (config.journalPath) {
+    journal = journal_open(config.journalPath, JOURNAL_DEFAULT_MAX_BYTES);
+    if (!journal && errno == EWOULDBLOCK) {
+      fprintf(stderr, "Journal %s is in use by another fsevent_watch\n", config.journalPath);
+      exit(EXIT_FAILURE);
+    }
+    if (!journal) {
+      fprintf(stderr, "Unable to open journal %s: %s\n", config.journalPath, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (config.snapshotPath || config.crawl) {
+    char** roots = malloc(config.numRoots * sizeof(char*));
+    if (!roots) {
+      fprintf(stderr, "Unable to allocate %zu roots\n", config.numRoots);
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < config.numRoots; i++) {
+      roots[i] = config.roots[i].path;
+    }
+
+    snapshot = snapshot_open(config.snapshotPath, roots, config.numRoots,
+                             filter.num_starts > 0 ? snapshot_prune : NULL);
+    if (!snapshot && errno == EWOULDBLOCK) {
+      fprintf(stderr, "Snapshot %s is in use by another fsevent_watch\n", config.snapshotPath);
+      exit(EXIT_FAILURE);
+    }
+    if (!snapshot) {
+      fprintf(stderr, "Unable to open snapshot %s: %s\n", config.snapshotPath, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    coalesce_init(&snapshot_paths);
+  }
+
+  if (config.coalesce) {
+    coalesce_init(&coalescer);
+  }
+
+  if (config.contentHash) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    hasher = content_hash_create((size_t)config.contentHashMax,
+                                 cpus < 1 ? 1 : (int)(cpus < CONTENT_HASH_MAX_THREADS ? cpus : CONTENT_HASH_MAX_THREADS));
+  }
+
+  if (config.gitignore) {
+    ignore = git_ignore_create();
+    for (size_t i = 0; i < config.numRoots; i++) {
+      git_ignore_add_root(ignore, config.roots[i].path);
+    }
+  }
+
+  // everything from the filters on happens on the writer thread, which is
+  // let finish whatever was queued before exiting
+  queue = write_queue_create(WRITE_QUEUE_DEFAULT_CAPACITY, config.overflow);
+  pthread_t writer;
+  int error = pthread_create(&writer, NULL, writer_thread, NULL);
+  if (error != 0) {
+    fprintf(stderr, "Unable to start the writer thread: %s\n", strerror(error));
+    exit(EXIT_FAILURE);
+  }
+
+#ifdef __APPLE__
+  int status = run_fsevents_streams();
+#else
+  int status = run_linux_streams();
+#endif
+
+  write_queue_close(queue);
+  pthread_join(writer, NULL);
+  return status;
+}
@@ -0,0 +1,447 @@
+#include "output_encoder.h"
+
+#include <errno.h>
+#include <poll.h>
+
+#define OUTPUT_ENCODER_INITIAL_CAPACITY  (64 * 1024)
+
+void output_encoder_init(struct output_encoder* encoder)
+{
+  memset(encoder, 0, sizeof(struct output_encoder));
+}
+
+void output_encoder_free(struct output_encoder* encoder)
+{
+  free(encoder->bytes);
+  if (encoder->writer_ready) {
+    TSITStringWriterDestroy(&encoder->writer);
+  }
+  path_table_free(&encoder->paths);
+  free(encoder->sorted);
+  memset(encoder, 0, sizeof(struct output_encoder));
+}
+
+static char* output_encoder_reserve(struct output_encoder* encoder, size_t length)
+{
+  if (encoder->length + length > encoder->capacity) {
+    size_t capacity = encoder->capacity ? encoder->capacity : OUTPUT_ENCODER_INITIAL_CAPACITY;
+    while (capacity < encoder->length + length) {
+      capacity *= 2;
+    }
+    encoder->bytes = realloc(encoder->bytes, capacity);
+    if (!encoder->bytes) {
+      fprintf(stderr, "Unable to allocate %zu bytes of output\n", capacity);
+      exit(EXIT_FAILURE);
+    }
+    encoder->capacity = capacity;
+  }
+  return encoder->bytes + encoder->length;
+}
+
+static inline void output_encoder_append(struct output_encoder* encoder,
+                                         const char* bytes, size_t length)
+{
+  memcpy(output_encoder_reserve(encoder, length), bytes, length);
+  encoder->length += length;
+}
+
+static inline void output_encoder_append_byte(struct output_encoder* encoder, char c)
+{
+  *output_encoder_reserve(encoder, 1) = c;
+  encoder->length++;
+}
+
+static void output_encoder_append_decimal(struct output_encoder* encoder,
+                                          unsigned long long value)
+{
+  char digits[20];
+  size_t n = 0;
+  do {
+    digits[sizeof(digits) - ++n] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value);
+  output_encoder_append(encoder, digits + sizeof(digits) - n, n);
+}
+
+// original output format for rb-fsevent
+static void classic_output_format(struct output_encoder* encoder,
+                                  size_t numEvents,
+                                  char** paths)
+{
+  for (size_t i = 0; i < numEvents; i++) {
+    output_encoder_append(encoder, paths[i], strlen(paths[i]));
+    output_encoder_append_byte(encoder, ':');
+  }
+  output_encoder_append_byte(encoder, '\n');
+}
+
+// output format used in the Yoshimasa Niwa branch of rb-fsevent. niwroot
+// puts the length of the root's prefix of the path ahead of it as a fourth
+// field.
+static void niw_output_format(struct output_encoder* encoder,
+                              size_t numEvents,
+                              char** paths,
+                              const FSEventStreamEventFlags eventFlags[],
+                              const FSEventStreamEventId eventIds[],
+                              bool rooted,
+                              const char* const eventRoots[])
+{
+  for (size_t i = 0; i < numEvents; i++) {
+    output_encoder_append_decimal(encoder, (unsigned long long)eventFlags[i]);
+    output_encoder_append_byte(encoder, ':');
+    output_encoder_append_decimal(encoder, (unsigned long long)eventIds[i]);
+    output_encoder_append_byte(encoder, ':');
+    if (rooted) {
+      output_encoder_append_decimal(encoder, eventRoots ? strlen(eventRoots[i]) : 0);
+      output_encoder_append_byte(encoder, ':');
+    }
+    output_encoder_append(encoder, paths[i], strlen(paths[i]));
+    output_encoder_append_byte(encoder, '\n');
+  }
+  output_encoder_append_byte(encoder, '\n');
+}
+
+static const char* tstring_output_format(struct output_encoder* encoder,
+                                         size_t numEvents,
+                                         char** paths,
+                                         const FSEventStreamEventFlags eventFlags[],
+                                         const FSEventStreamEventId eventIds[],
+                                         const char* const eventRoots[],
+                                         TSITStringFormat format,
+                                         size_t* length)
+{
+  if (!encoder->writer_ready) {
+    TSITStringWriterInit(&encoder->writer, format);
+    encoder->writer_ready = true;
+  } else {
+    TSITStringWriterReset(&encoder->writer, format);
+  }
+
+  TSITStringWriter* writer = &encoder->writer;
+
+  TSITStringWriterBeginDictionary(writer);
+
+  TSITStringWriterAppendString(writer, "events", 6);
+  TSITStringWriterBeginList(writer);
+  for (size_t i = 0; i < numEvents; i++) {
+    TSITStringWriterBeginDictionary(writer);
+    TSITStringWriterAppendString(writer, "path", 4);
+    TSITStringWriterAppendCString(writer, paths[i]);
+    if (eventRoots) {
+      TSITStringWriterAppendString(writer, "root", 4);
+      TSITStringWriterAppendCString(writer, eventRoots[i]);
+    }
+    TSITStringWriterAppendString(writer, "flags", 5);
+    TSITStringWriterAppendInteger(writer, (int)eventFlags[i]);
+    TSITStringWriterAppendString(writer, "id", 2);
+    TSITStringWriterAppendInteger(writer, (long long)eventIds[i]);
+    TSITStringWriterEnd(writer);
+  }
+  TSITStringWriterEnd(writer);
+
+  TSITStringWriterAppendString(writer, "numEvents", 9);
+  TSITStringWriterAppendInteger(writer, (long long)numEvents);
+
+  TSITStringWriterEnd(writer);
+
+  return TSITStringWriterFinish(writer, length);
+}
+
+static inline char* binary_put_u32(char* dst, UInt32 value)
+{
+  for (int i = 0; i < 4; i++) {
+    *dst++ = (char)((value >> (8 * i)) & 0xff);
+  }
+  return dst;
+}
+
+static inline char* binary_put_u64(char* dst, UInt64 value)
+{
+  for (int i = 0; i < 8; i++) {
+    *dst++ = (char)((value >> (8 * i)) & 0xff);
+  }
+  return dst;
+}
+
+// Little-endian frames: a header of u32 event count and u32 byte length of
+// the rest of the frame, then per event u32 flags, u64 id, u32 path length
+// and the path bytes, unterminated.
+static void binary_output_format(struct output_encoder* encoder,
+                                 size_t numEvents,
+                                 char** paths,
+                                 const FSEventStreamEventFlags eventFlags[],
+                                 const FSEventStreamEventId eventIds[])
+{
+  static const size_t kHeaderSize = 8;
+  static const size_t kEventSize = 4 + 8 + 4;
+
+  size_t bodySize = 0;
+  for (size_t i = 0; i < numEvents; i++) {
+    bodySize += kEventSize + strlen(paths[i]);
+  }
+
+  char* dst = output_encoder_reserve(encoder, kHeaderSize + bodySize);
+  dst = binary_put_u32(dst, (UInt32)numEvents);
+  dst = binary_put_u32(dst, (UInt32)bodySize);
+
+  for (size_t i = 0; i < numEvents; i++) {
+    size_t length = strlen(paths[i]);
+    dst = binary_put_u32(dst, (UInt32)eventFlags[i]);
+    dst = binary_put_u64(dst, (UInt64)eventIds[i]);
+    dst = binary_put_u32(dst, (UInt32)length);
+    memcpy(dst, paths[i], length);
+    dst += length;
+  }
+
+  encoder->length += kHeaderSize + bodySize;
+}
+
+// Binary frames whose paths are sent in full only the first time. The header
+// is a u32 event count, with INTERNED_RESET set when the reader must forget
+// every path it was sent before this frame, and a u32 byte length for the
+// rest of the frame. Every event is a u32 of flags, a u64 id and a u32 path:
+// the id of a path already sent, or, with INTERNED_NEW set, the id this
+// new path gets. A new path goes on with a u32 dir, a u32 length and that
+// many bytes. dir is the id of a path already sent that the new one starts
+// with, followed by the rest of it; INTERNED_NONE, followed by all of it; or
+// with INTERNED_NEW set the id the new path's directory gets, followed by
+// all of it. A directory runs up to and including the last '/' before the
+// path's final byte, so /a/b/ is in /a/ and may itself be the directory of
+// /a/b/c. Ids are handed out from 0 in the order paths are first sent.
+#define INTERNED_RESET  0x80000000U
+#define INTERNED_NEW    0x80000000U
+#define INTERNED_NONE   0xffffffffU
+// encode_frames builds with a small table, so the reader specs see resets
+#ifndef INTERNED_MAX
+#define INTERNED_MAX    (1U << 20)
+#endif
+
+static void interned_output_format(struct output_encoder* encoder,
+                                   size_t numEvents,
+                                   char** paths,
+                                   const FSEventStreamEventFlags eventFlags[],
+                                   const FSEventStreamEventId eventIds[])
+{
+  static const size_t kHeaderSize = 8;
+  struct path_table* table = &encoder->paths;
+  UInt32 count = (UInt32)numEvents;
+
+  // a batch adds at most a path and a directory per event
+  if (table->num_paths + 2 * numEvents > INTERNED_MAX) {
+    path_table_clear(table);
+    count |= INTERNED_RESET;
+  }
+
+  output_encoder_reserve(encoder, kHeaderSize);
+  encoder->length += kHeaderSize;
+
+  for (size_t i = 0; i < numEvents; i++) {
+    const char* path = paths[i];
+    size_t length = strlen(path);
+    UInt32 id = path_table_find(table, path, length);
+
+    if (id != PATH_TABLE_NONE) {
+      char* dst = output_encoder_reserve(encoder, 16);
+      dst = binary_put_u32(dst, (UInt32)eventFlags[i]);
+      dst = binary_put_u64(dst, (UInt64)eventIds[i]);
+      binary_put_u32(dst, id);
+      encoder->length += 16;
+      continue;
+    }
+
+    size_t dirLength = 0;
+    for (size_t c = length > 1 ? length - 1 : 0; c > 0; c--) {
+      if (path[c - 1] == '/') {
+        dirLength = c;
+        break;
+      }
+    }
+
+    UInt32 dir = INTERNED_NONE;
+    const char* rest = path;
+    if (dirLength > 0) {
+      dir = path_table_find(table, path, dirLength);
+      if (dir != PATH_TABLE_NONE) {
+        rest = path + dirLength;
+      } else {
+        dir = path_table_add(table, path, dirLength) | INTERNED_NEW;
+      }
+    }
+    id = path_table_add(table, path, length);
+
+    size_t restLength = length - (size_t)(rest - path);
+    char* dst = output_encoder_reserve(encoder, 24 + restLength);
+    dst = binary_put_u32(dst, (UInt32)eventFlags[i]);
+    dst = binary_put_u64(dst, (UInt64)eventIds[i]);
+    dst = binary_put_u32(dst, id | INTERNED_NEW);
+    dst = binary_put_u32(dst, dir);
+    dst = binary_put_u32(dst, (UInt32)restLength);
+    memcpy(dst, rest, restLength);
+    encoder->length += 24 + restLength;
+  }
+
+  char* header = encoder->bytes;
+  header = binary_put_u32(header, count);
+  binary_put_u32(header, (UInt32)(encoder->length - kHeaderSize));
+}
+
+// Binary frames with the batch sorted by path, every path given as the
+// number of leading bytes it shares with the one before and the rest of it,
+// the way sorted string tables store keys. The header is the same as
+// binary's; every event is a u32 of flags, a u64 id, a u32 shared length, a
+// u32 suffix length and the suffix bytes. Events on the same path stay in
+// the order they came in.
+struct output_encoder_sorted {
+  const char*  path;
+  size_t       length;
+  size_t       index;
+};
+
+static int output_encoder_sorted_compare(const void* a, const void* b)
+{
+  const struct output_encoder_sorted* x = a;
+  const struct output_encoder_sorted* y = b;
+  int order = strcmp(x->path, y->path);
+  if (order == 0) {
+    order = (x->index > y->index) - (x->index < y->index);
+  }
+  return order;
+}
+
+static void front_coded_output_format(struct output_encoder* encoder,
+                                      size_t numEvents,
+                                      char** paths,
+                                      const FSEventStreamEventFlags eventFlags[],
+                                      const FSEventStreamEventId eventIds[])
+{
+  static const size_t kHeaderSize = 8;
+
+  if (numEvents > encoder->sorted_capacity) {
+    encoder->sorted = realloc(encoder->sorted, numEvents * sizeof(struct output_encoder_sorted));
+    if (!encoder->sorted) {
+      fprintf(stderr, "Unable to allocate %zu sorted events\n", numEvents);
+      exit(EXIT_FAILURE);
+    }
+    encoder->sorted_capacity = numEvents;
+  }
+
+  struct output_encoder_sorted* sorted = encoder->sorted;
+  for (size_t i = 0; i < numEvents; i++) {
+    sorted[i].path = paths[i];
+    sorted[i].length = strlen(paths[i]);
+    sorted[i].index = i;
+  }
+  qsort(sorted, numEvents, sizeof(struct output_encoder_sorted), output_encoder_sorted_compare);
+
+  binary_put_u32(output_encoder_reserve(encoder, kHeaderSize), (UInt32)numEvents);
+  encoder->length += kHeaderSize;
+
+  const char* previous = "";
+  size_t previousLength = 0;
+  for (size_t i = 0; i < numEvents; i++) {
+    const char* path = sorted[i].path;
+    size_t length = sorted[i].length;
+    size_t limit = length < previousLength ? length : previousLength;
+    size_t shared = 0;
+    while (shared < limit && path[shared] == previous[shared]) {
+      shared++;
+    }
+
+    size_t suffixLength = length - shared;
+    size_t index = sorted[i].index;
+    char* dst = output_encoder_reserve(encoder, 20 + suffixLength);
+    dst = binary_put_u32(dst, (UInt32)eventFlags[index]);
+    dst = binary_put_u64(dst, (UInt64)eventIds[index]);
+    dst = binary_put_u32(dst, (UInt32)shared);
+    dst = binary_put_u32(dst, (UInt32)suffixLength);
+    memcpy(dst, path + shared, suffixLength);
+    encoder->length += 20 + suffixLength;
+
+    previous = path;
+    previousLength = length;
+  }
+
+  binary_put_u32(encoder->bytes + 4, (UInt32)(encoder->length - kHeaderSize));
+}
+
+const char* output_encoder_encode(struct output_encoder* encoder,
+                                  enum FSEventWatchOutputFormat format,
+                                  size_t numEvents,
+                                  char** paths,
+                                  const FSEventStreamEventFlags eventFlags[],
+                                  const FSEventStreamEventId eventIds[],
+                                  const char* const eventRoots[],
+                                  size_t* length)
+{
+  encoder->length = 0;
+
+  if (format == kFSEventWatchOutputFormatTNetstring) {
+    return tstring_output_format(encoder, numEvents, paths, eventFlags, eventIds,
+                                 eventRoots, kTSITStringFormatTNetstring, length);
+  } else if (format == kFSEventWatchOutputFormatOTNetstring) {
+    return tstring_output_format(encoder, numEvents, paths, eventFlags, eventIds,
+                                 eventRoots, kTSITStringFormatOTNetstring, length);
+  } else if (format == kFSEventWatchOutputFormatNIW) {
+    niw_output_format(encoder, numEvents, paths, eventFlags, eventIds, false, NULL);
+  } else if (format == kFSEventWatchOutputFormatNIWRoot) {
+    niw_output_format(encoder, numEvents, paths, eventFlags, eventIds, true, eventRoots);
+  } else if (format == kFSEventWatchOutputFormatBinary) {
+    binary_output_format(encoder, numEvents, paths, eventFlags, eventIds);
+  } else if (format == kFSEventWatchOutputFormatInterned) {
+    interned_output_format(encoder, numEvents, paths, eventFlags, eventIds);
+  } else if (format == kFSEventWatchOutputFormatFrontCoded) {
+    front_coded_output_format(encoder, numEvents, paths, eventFlags, eventIds);
+  } else {
+    classic_output_format(encoder, numEvents, paths);
+  }
+
+  *length = encoder->length;
+  return encoder->bytes;
+}
+
+int output_encoder_write(int fd, const char* bytes, size_t length)
+{
+  struct iovec iov = {(void*)bytes, length};
+  return output_encoder_writev(fd, &iov, 1);
+}
+
+int output_encoder_writev(int fd, struct iovec* iov, int count)
+{
+  int calls = 0;
+
+  while (count > 0 && iov->iov_len == 0) {
+    iov++;
+    count--;
+  }
+
+  while (count > 0) {
+    ssize_t written = writev(fd, iov, count);
+    calls++;
+
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // somebody handed us a non-blocking descriptor
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        poll(&pfd, 1, -1);
+        continue;
+      }
+      return -1;
+    }
+
+    size_t remaining = (size_t)written;
+    while (count > 0 && remaining >= iov->iov_len) {
+      remaining -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + remaining;
+      iov->iov_len -= remaining;
+    }
+  }
+
+  return calls;
+}
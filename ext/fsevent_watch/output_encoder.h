@@ -0,0 +1,61 @@
+/**
+ * @headerfile output_encoder.h
+ * Encoding of callback batches in each --format
+ *
+ * Every format is encoded into a buffer that is reused from one batch to the
+ * next, so steady state encoding doesn't allocate and one encoded batch can
+ * be written to stdout, or to every daemon subscriber that asked for the same
+ * format, without encoding it again. Because a batch is encoded contiguously
+ * it also leaves in one write(2), rather than an fprintf per event and
+ * whatever writes stdio breaks that up into.
+ */
+
+#ifndef fsevent_watch_output_encoder_h
+#define fsevent_watch_output_encoder_h
+
+#include "common.h"
+#include "path_table.h"
+
+#include <sys/uio.h>
+
+struct output_encoder {
+  char*             bytes;
+  size_t            length;
+  size_t            capacity;
+
+  TSITStringWriter  writer;
+  bool              writer_ready;
+
+  // every path interned output has sent so far
+  struct path_table paths;
+
+  // the order front-coded output sorts a batch into
+  struct output_encoder_sorted* sorted;
+  size_t            sorted_capacity;
+};
+
+void output_encoder_init(struct output_encoder* encoder);
+void output_encoder_free(struct output_encoder* encoder);
+
+// Encode a batch, returning bytes that stay valid until the next call.
+// eventRoots, which may be NULL, names the watched root of every event for
+// the formats that report it; each must be a prefix of its event's path.
+const char* output_encoder_encode(struct output_encoder* encoder,
+                                  enum FSEventWatchOutputFormat format,
+                                  size_t numEvents,
+                                  char** paths,
+                                  const FSEventStreamEventFlags eventFlags[],
+                                  const FSEventStreamEventId eventIds[],
+                                  const char* const eventRoots[],
+                                  size_t* length);
+
+// Write all of an encoded batch to fd, which takes a single write(2) unless
+// the reader falls behind. Returns the number of write calls made, or -1
+// with errno set.
+int output_encoder_write(int fd, const char* bytes, size_t length);
+
+// The same for several buffers gathered into one writev(2). iov is updated
+// in place as it's written.
+int output_encoder_writev(int fd, struct iovec* iov, int count);
+
+#endif // fsevent_watch_output_encoder_h
@@ -0,0 +1,473 @@
+#include <stdint.h>
+#include "path_filter.h"
+
+#define PATH_FILTER_MAX_STATES  65536
+
+enum {
+  kPathFilterAcceptInclude = 1 << 0,
+  kPathFilterAcceptExclude = 1 << 1
+};
+
+// NFA position. Consuming one of `bytes` leads to `target`, and the
+// `epsilon` positions are reachable without consuming anything. Epsilon
+// moves only ever go forward.
+struct path_filter_position {
+  UInt64  bytes[4];
+  UInt32  target;
+  UInt32  epsilon[2];
+  UInt8   accept;
+};
+
+#define PATH_FILTER_NONE  UINT32_MAX
+
+static inline void byteset_add(UInt64* set, unsigned int c)
+{
+  set[c >> 6] |= 1ULL << (c & 63);
+}
+
+static inline void byteset_remove(UInt64* set, unsigned int c)
+{
+  set[c >> 6] &= ~(1ULL << (c & 63));
+}
+
+static inline bool byteset_has(const UInt64* set, unsigned int c)
+{
+  return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+void path_filter_init(struct path_filter* filter)
+{
+  memset(filter, 0, sizeof(struct path_filter));
+  filter->sinks[0] = PATH_FILTER_NONE;
+  filter->sinks[1] = PATH_FILTER_NONE;
+}
+
+void path_filter_free(struct path_filter* filter)
+{
+  free(filter->positions);
+  free(filter->starts);
+  free(filter->next);
+  free(filter->accept);
+  event_list_free(&filter->events);
+  memset(filter, 0, sizeof(struct path_filter));
+}
+
+// Append a position consuming `set`, if given, into the one after it
+static UInt32 path_filter_push(struct path_filter* filter, const UInt64 set[4])
+{
+  if (filter->num_positions == filter->positions_cap) {
+    filter->positions_cap = filter->positions_cap ? filter->positions_cap * 2 : 64;
+    filter->positions = realloc(filter->positions,
+                                filter->positions_cap * sizeof(struct path_filter_position));
+    if (!filter->positions) {
+      fprintf(stderr, "Unable to allocate path filter\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  UInt32 i = (UInt32)filter->num_positions++;
+  struct path_filter_position* position = &filter->positions[i];
+  memset(position, 0, sizeof(struct path_filter_position));
+  if (set) {
+    memcpy(position->bytes, set, sizeof(position->bytes));
+  }
+  position->target = i + 1;
+  position->epsilon[0] = PATH_FILTER_NONE;
+  position->epsilon[1] = PATH_FILTER_NONE;
+  return i;
+}
+
+static UInt32 path_filter_push_byte(struct path_filter* filter, unsigned char c)
+{
+  UInt64 set[4] = {0, 0, 0, 0};
+  byteset_add(set, c);
+  return path_filter_push(filter, set);
+}
+
+// A run of `set` bytes, possibly empty
+static UInt32 path_filter_push_loop(struct path_filter* filter, const UInt64 set[4])
+{
+  UInt32 i = path_filter_push(filter, set);
+  filter->positions[i].target = i;
+  filter->positions[i].epsilon[0] = i + 1;
+  return i;
+}
+
+bool path_filter_add(struct path_filter* filter, const char* glob, bool exclude)
+{
+  static const UInt64 any[4] = {~0ULL, ~0ULL, ~0ULL, ~0ULL};
+  UInt64 component[4] = {~0ULL, ~0ULL, ~0ULL, ~0ULL};
+  byteset_remove(component, '/');
+
+  // "dir/" means the same as "dir"
+  size_t length = strlen(glob);
+  while (length > 1 && glob[length - 1] == '/') {
+    length--;
+  }
+  if (length == 0) {
+    return false;
+  }
+
+  // A match covers everything below it too. All globs of a kind share one
+  // sink for that, so which of them matched never multiplies DFA states.
+  int kind = exclude ? 1 : 0;
+  UInt8 accept = exclude ? kPathFilterAcceptExclude : kPathFilterAcceptInclude;
+  if (filter->sinks[kind] == PATH_FILTER_NONE) {
+    UInt32 sink = path_filter_push(filter, any);
+    filter->positions[sink].target = sink;
+    filter->positions[sink].accept = accept;
+    filter->sinks[kind] = sink;
+  }
+
+  size_t first = filter->num_positions;
+
+  // unanchored globs may start at any component
+  if (glob[0] != '/') {
+    path_filter_push_loop(filter, any);
+    path_filter_push_byte(filter, '/');
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)glob[i];
+
+    if (c == '*' && i + 1 < length && glob[i + 1] == '*') {
+      while (i + 1 < length && glob[i + 1] == '*') {
+        i++;
+      }
+      if (i + 1 < length && glob[i + 1] == '/') {
+        // "**/" is either nothing at all, or anything up to a '/'
+        UInt32 split = path_filter_push(filter, NULL);
+        filter->positions[split].epsilon[0] = split + 1;
+        filter->positions[split].epsilon[1] = split + 3;
+        path_filter_push_loop(filter, any);
+        path_filter_push_byte(filter, '/');
+        i++;
+      } else {
+        path_filter_push_loop(filter, any);
+      }
+    } else if (c == '*') {
+      path_filter_push_loop(filter, component);
+    } else if (c == '?') {
+      path_filter_push(filter, component);
+    } else if (c == '[') {
+      UInt64 set[4] = {0, 0, 0, 0};
+      size_t j = i + 1;
+      bool negate = false;
+      bool closed = false;
+
+      if (j < length && (glob[j] == '!' || glob[j] == '^')) {
+        negate = true;
+        j++;
+      }
+
+      for (size_t start = j; j < length; j++) {
+        unsigned char lo = (unsigned char)glob[j];
+        if (lo == ']' && j > start) {
+          closed = true;
+          break;
+        }
+        if (lo == '\\' && j + 1 < length) {
+          lo = (unsigned char)glob[++j];
+        }
+
+        unsigned char hi = lo;
+        if (j + 2 < length && glob[j + 1] == '-' && glob[j + 2] != ']') {
+          j += 2;
+          hi = (unsigned char)glob[j];
+          if (hi == '\\' && j + 1 < length) {
+            hi = (unsigned char)glob[++j];
+          }
+        }
+
+        for (unsigned int b = lo; b <= hi; b++) {
+          byteset_add(set, b);
+        }
+      }
+
+      if (!closed) {
+        filter->num_positions = first;
+        return false;
+      }
+
+      if (negate) {
+        for (int k = 0; k < 4; k++) {
+          set[k] = ~set[k];
+        }
+      }
+      byteset_remove(set, '/');
+      path_filter_push(filter, set);
+      i = j;
+    } else {
+      if (c == '\\' && i + 1 < length) {
+        c = (unsigned char)glob[++i];
+      }
+      path_filter_push_byte(filter, c);
+    }
+  }
+
+  // accept here, and anywhere below here
+  UInt32 end = path_filter_push_byte(filter, '/');
+  filter->positions[end].target = filter->sinks[kind];
+  filter->positions[end].accept = accept;
+
+  filter->starts = realloc(filter->starts, (filter->num_starts + 1) * sizeof(UInt32));
+  if (!filter->starts) {
+    fprintf(stderr, "Unable to allocate path filter\n");
+    exit(EXIT_FAILURE);
+  }
+  filter->starts[filter->num_starts++] = (UInt32)first;
+
+  if (!exclude) {
+    filter->has_includes = true;
+  }
+  return true;
+}
+
+
+// Subset construction. Each DFA state is the set of NFA positions that could
+// be current, stored as a bitset of `words` UInt64s.
+
+struct path_filter_builder {
+  struct path_filter* filter;
+  size_t              words;
+  UInt64*             sets;
+  size_t              sets_cap;
+  UInt32*             table;
+  size_t              table_cap;
+};
+
+static inline bool bitset_has(const UInt64* set, size_t i)
+{
+  return (set[i >> 6] >> (i & 63)) & 1;
+}
+
+static inline void bitset_add(UInt64* set, size_t i)
+{
+  set[i >> 6] |= 1ULL << (i & 63);
+}
+
+// Epsilon moves only ever go forward, so one sweep finds the closure
+static void path_filter_closure(const struct path_filter* filter, UInt64* set)
+{
+  for (size_t i = 0; i < filter->num_positions; i++) {
+    if (!bitset_has(set, i)) {
+      continue;
+    }
+    for (int e = 0; e < 2; e++) {
+      UInt32 epsilon = filter->positions[i].epsilon[e];
+      if (epsilon != PATH_FILTER_NONE) {
+        bitset_add(set, epsilon);
+      }
+    }
+  }
+}
+
+static UInt64 path_filter_hash(const UInt64* set, size_t words)
+{
+  UInt64 hash = fnv1a(set, words * sizeof(UInt64));
+  return hash ^ (hash >> 29);
+}
+
+static void path_filter_rehash(struct path_filter_builder* builder)
+{
+  struct path_filter* filter = builder->filter;
+
+  free(builder->table);
+  builder->table_cap = builder->table_cap ? builder->table_cap * 2 : 256;
+  builder->table = malloc(builder->table_cap * sizeof(UInt32));
+  if (!builder->table) {
+    fprintf(stderr, "Unable to allocate path filter\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(builder->table, 0xff, builder->table_cap * sizeof(UInt32));
+
+  size_t mask = builder->table_cap - 1;
+  for (size_t s = 0; s < filter->num_states; s++) {
+    size_t slot = (size_t)path_filter_hash(builder->sets + s * builder->words, builder->words) & mask;
+    while (builder->table[slot] != UINT32_MAX) {
+      slot = (slot + 1) & mask;
+    }
+    builder->table[slot] = (UInt32)s;
+  }
+}
+
+// DFA state for `set`, creating it if it's new
+static UInt32 path_filter_intern(struct path_filter_builder* builder, const UInt64* set)
+{
+  struct path_filter* filter = builder->filter;
+  size_t words = builder->words;
+  size_t mask = builder->table_cap - 1;
+  size_t slot = (size_t)path_filter_hash(set, words) & mask;
+
+  while (builder->table[slot] != UINT32_MAX) {
+    UInt32 s = builder->table[slot];
+    if (memcmp(builder->sets + s * words, set, words * sizeof(UInt64)) == 0) {
+      return s;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  if (filter->num_states == PATH_FILTER_MAX_STATES) {
+    fprintf(stderr, "Too many --include/--exclude globs to combine\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (filter->num_states == builder->sets_cap) {
+    builder->sets_cap *= 2;
+    builder->sets = realloc(builder->sets, builder->sets_cap * words * sizeof(UInt64));
+    filter->next = realloc(filter->next, builder->sets_cap * filter->num_classes * sizeof(UInt32));
+    filter->accept = realloc(filter->accept, builder->sets_cap);
+    if (!builder->sets || !filter->next || !filter->accept) {
+      fprintf(stderr, "Unable to allocate path filter\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  UInt32 s = (UInt32)filter->num_states++;
+  memcpy(builder->sets + s * words, set, words * sizeof(UInt64));
+
+  UInt8 accept = 0;
+  for (size_t i = 0; i < filter->num_positions; i++) {
+    if (bitset_has(set, i)) {
+      accept |= filter->positions[i].accept;
+    }
+  }
+  filter->accept[s] = accept;
+
+  builder->table[slot] = s;
+  if (filter->num_states * 2 > builder->table_cap) {
+    path_filter_rehash(builder);
+  }
+  return s;
+}
+
+void path_filter_compile(struct path_filter* filter)
+{
+  if (filter->num_starts == 0) {
+    return;
+  }
+
+  size_t words = (filter->num_positions + 63) / 64;
+  UInt64* columns = calloc(256 * words, sizeof(UInt64));
+  UInt64* set = malloc(words * sizeof(UInt64));
+  unsigned int representatives[256];
+
+  if (!columns || !set) {
+    fprintf(stderr, "Unable to allocate path filter\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // bytes that every position treats alike share a column of the DFA
+  for (unsigned int b = 0; b < 256; b++) {
+    for (size_t i = 0; i < filter->num_positions; i++) {
+      const struct path_filter_position* position = &filter->positions[i];
+      if (byteset_has(position->bytes, b)) {
+        bitset_add(columns + b * words, i);
+      }
+    }
+
+    size_t c = 0;
+    while (c < filter->num_classes &&
+           memcmp(columns + b * words, columns + representatives[c] * words,
+                  words * sizeof(UInt64)) != 0) {
+      c++;
+    }
+    if (c == filter->num_classes) {
+      representatives[filter->num_classes++] = b;
+    }
+    filter->classes[b] = (UInt8)c;
+  }
+
+  struct path_filter_builder builder;
+  memset(&builder, 0, sizeof(builder));
+  builder.filter = filter;
+  builder.words = words;
+  builder.sets_cap = 64;
+  builder.sets = malloc(builder.sets_cap * words * sizeof(UInt64));
+  filter->next = malloc(builder.sets_cap * filter->num_classes * sizeof(UInt32));
+  filter->accept = malloc(builder.sets_cap);
+  if (!builder.sets || !filter->next || !filter->accept) {
+    fprintf(stderr, "Unable to allocate path filter\n");
+    exit(EXIT_FAILURE);
+  }
+  path_filter_rehash(&builder);
+
+  memset(set, 0, words * sizeof(UInt64));
+  for (size_t i = 0; i < filter->num_starts; i++) {
+    bitset_add(set, filter->starts[i]);
+  }
+  path_filter_closure(filter, set);
+  filter->start = path_filter_intern(&builder, set);
+
+  // states are appended as they're discovered, so this visits all of them
+  for (size_t s = 0; s < filter->num_states; s++) {
+    for (size_t c = 0; c < filter->num_classes; c++) {
+      unsigned int b = representatives[c];
+      const UInt64* from = builder.sets + s * words;
+
+      memset(set, 0, words * sizeof(UInt64));
+      for (size_t i = 0; i < filter->num_positions; i++) {
+        const struct path_filter_position* position = &filter->positions[i];
+        if (bitset_has(from, i) && byteset_has(position->bytes, b)) {
+          bitset_add(set, position->target);
+        }
+      }
+      path_filter_closure(filter, set);
+
+      UInt32 to = path_filter_intern(&builder, set);
+      filter->next[s * filter->num_classes + c] = to;
+    }
+  }
+
+  // store row offsets rather than state numbers, saving a multiply per byte
+  for (size_t i = 0; i < filter->num_states * filter->num_classes; i++) {
+    filter->next[i] *= (UInt32)filter->num_classes;
+  }
+  filter->start *= (UInt32)filter->num_classes;
+
+  free(builder.sets);
+  free(builder.table);
+  free(columns);
+  free(set);
+
+  // the NFA isn't needed any more
+  free(filter->positions);
+  filter->positions = NULL;
+  filter->num_positions = 0;
+  filter->positions_cap = 0;
+}
+
+bool path_filter_keep(const struct path_filter* filter, const char* path)
+{
+  const UInt32* next = filter->next;
+  const UInt8* classes = filter->classes;
+  UInt32 row = filter->start;
+
+  for (const unsigned char* c = (const unsigned char*)path; *c; c++) {
+    row = next[row + classes[*c]];
+  }
+
+  UInt8 accept = filter->accept[row / filter->num_classes];
+  if (accept & kPathFilterAcceptExclude) {
+    return false;
+  }
+  return !filter->has_includes || (accept & kPathFilterAcceptInclude);
+}
+
+size_t path_filter_batch(struct path_filter* filter,
+                         size_t numEvents,
+                         char** paths,
+                         const FSEventStreamEventFlags eventFlags[],
+                         const FSEventStreamEventId eventIds[])
+{
+  event_list_reset(&filter->events, numEvents);
+  for (size_t i = 0; i < numEvents; i++) {
+    if (path_filter_keep(filter, paths[i])) {
+      event_list_push(&filter->events, paths[i], eventFlags[i], eventIds[i]);
+    }
+  }
+
+  size_t count = filter->events.num_events;
+  filter->filtered += numEvents - count;
+  return count;
+}
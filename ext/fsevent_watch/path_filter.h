@@ -0,0 +1,70 @@
+/**
+ * @headerfile path_filter.h
+ * --include/--exclude glob filtering of event paths
+ *
+ * Globs support `*` and `?` (never matching '/'), `**` (matching anything,
+ * with `**` followed by '/' also matching nothing at all), `[...]` classes
+ * and backslash escapes. A glob that doesn't start with '/' may match
+ * starting at any path component, and a match also covers everything below
+ * it, so `node_modules` drops /src/app/node_modules/left-pad/index.js.
+ *
+ * Every glob is compiled into one DFA over byte equivalence classes before
+ * the stream starts, so deciding whether to keep an event costs one table
+ * lookup per byte of its path however many globs were given. When there are
+ * include globs an event must match one of them, and an event matching any
+ * exclude glob is always dropped.
+ */
+
+#ifndef fsevent_watch_path_filter_h
+#define fsevent_watch_path_filter_h
+
+#include "common.h"
+#include "event_list.h"
+
+struct path_filter_position;
+
+struct path_filter {
+  // globs, as NFA positions, until path_filter_compile
+  struct path_filter_position*  positions;
+  size_t                        num_positions;
+  size_t                        positions_cap;
+  UInt32*                       starts;
+  size_t                        num_starts;
+  UInt32                        sinks[2];
+  bool                          has_includes;
+
+  // DFA
+  UInt8                         classes[256];
+  size_t                        num_classes;
+  UInt32*                       next;
+  UInt8*                        accept;
+  size_t                        num_states;
+  UInt32                        start;
+
+  // events dropped so far
+  UInt64                        filtered;
+
+  struct event_list             events;
+};
+
+void path_filter_init(struct path_filter* filter);
+void path_filter_free(struct path_filter* filter);
+
+// Add a glob; false if it can't be parsed
+bool path_filter_add(struct path_filter* filter, const char* glob, bool exclude);
+
+// Build the DFA; no globs may be added afterwards
+void path_filter_compile(struct path_filter* filter);
+
+bool path_filter_keep(const struct path_filter* filter, const char* path);
+
+// Drop filtered events from a batch. The survivors are left in
+// filter->events, valid until the next call, and their number
+// is returned.
+size_t path_filter_batch(struct path_filter* filter,
+                         size_t numEvents,
+                         char** paths,
+                         const FSEventStreamEventFlags eventFlags[],
+                         const FSEventStreamEventId eventIds[]);
+
+#endif // fsevent_watch_path_filter_h
@@ -0,0 +1,113 @@
+#include "path_table.h"
+
+#define PATH_TABLE_INITIAL_CAPACITY  1024
+
+void path_table_init(struct path_table* table)
+{
+  memset(table, 0, sizeof(struct path_table));
+}
+
+void path_table_free(struct path_table* table)
+{
+  free(table->slots);
+  free(table->offsets);
+  free(table->lengths);
+  free(table->bytes);
+  memset(table, 0, sizeof(struct path_table));
+}
+
+void path_table_clear(struct path_table* table)
+{
+  if (table->slots) {
+    memset(table->slots, 0, table->num_slots * sizeof(struct path_table_slot));
+  }
+  table->num_paths = 0;
+  table->bytes_len = 0;
+}
+
+UInt32 path_table_find(const struct path_table* table, const char* path, size_t length)
+{
+  if (table->num_paths == 0) {
+    return PATH_TABLE_NONE;
+  }
+
+  UInt64 hash = fnv1a(path, length);
+  size_t mask = table->num_slots - 1;
+
+  for (size_t s = (size_t)hash & mask;; s = (s + 1) & mask) {
+    const struct path_table_slot* slot = &table->slots[s];
+    if (slot->id == 0) {
+      return PATH_TABLE_NONE;
+    }
+
+    UInt32 id = slot->id - 1;
+    if (slot->hash == hash && table->lengths[id] == length &&
+        memcmp(table->bytes + table->offsets[id], path, length) == 0) {
+      return id;
+    }
+  }
+}
+
+static void path_table_insert(struct path_table* table, UInt64 hash, UInt32 id)
+{
+  size_t mask = table->num_slots - 1;
+  size_t s = (size_t)hash & mask;
+  while (table->slots[s].id != 0) {
+    s = (s + 1) & mask;
+  }
+  table->slots[s].hash = hash;
+  table->slots[s].id = id + 1;
+}
+
+static void path_table_grow(struct path_table* table)
+{
+  size_t capacity = table->capacity ? table->capacity * 2 : PATH_TABLE_INITIAL_CAPACITY;
+
+  table->offsets = realloc(table->offsets, capacity * sizeof(size_t));
+  table->lengths = realloc(table->lengths, capacity * sizeof(size_t));
+  free(table->slots);
+  table->num_slots = capacity * 2;
+  table->slots = calloc(table->num_slots, sizeof(struct path_table_slot));
+
+  if (!table->offsets || !table->lengths || !table->slots) {
+    fprintf(stderr, "Unable to grow the path table to %zu paths\n", capacity);
+    exit(EXIT_FAILURE);
+  }
+  table->capacity = capacity;
+
+  for (size_t id = 0; id < table->num_paths; id++) {
+    path_table_insert(table,
+                      fnv1a(table->bytes + table->offsets[id], table->lengths[id]),
+                      (UInt32)id);
+  }
+}
+
+UInt32 path_table_add(struct path_table* table, const char* path, size_t length)
+{
+  if (table->num_paths == table->capacity) {
+    path_table_grow(table);
+  }
+
+  if (table->bytes_len + length + 1 > table->bytes_cap) {
+    size_t capacity = table->bytes_cap ? table->bytes_cap : PATH_TABLE_INITIAL_CAPACITY * 64;
+    while (table->bytes_len + length + 1 > capacity) {
+      capacity *= 2;
+    }
+    table->bytes = realloc(table->bytes, capacity);
+    if (!table->bytes) {
+      fprintf(stderr, "Unable to grow the path table to %zu bytes\n", capacity);
+      exit(EXIT_FAILURE);
+    }
+    table->bytes_cap = capacity;
+  }
+
+  UInt32 id = (UInt32)table->num_paths++;
+  table->offsets[id] = table->bytes_len;
+  table->lengths[id] = length;
+  memcpy(table->bytes + table->bytes_len, path, length);
+  table->bytes[table->bytes_len + length] = '\0';
+  table->bytes_len += length + 1;
+
+  path_table_insert(table, fnv1a(path, length), id);
+  return id;
+}
@@ -0,0 +1,54 @@
+/**
+ * @headerfile path_table.h
+ * Small integer ids for the paths an output stream has already carried
+ *
+ * The interned output format sends every path in full only the first time
+ * and its id from then on, and the reader keeps the same table to look the
+ * ids up in. Ids are handed out densely from 0 in the order paths are added,
+ * so both sides agree on them without ever sending a table.
+ *
+ * Paths live in one growable byte buffer and are found through an
+ * open-addressing table of their hashes, so adding and looking them up
+ * doesn't allocate once the buffers have grown.
+ */
+
+#ifndef fsevent_watch_path_table_h
+#define fsevent_watch_path_table_h
+
+#include "common.h"
+
+#define PATH_TABLE_NONE   0xffffffffU
+
+struct path_table_slot {
+  UInt64  hash;
+  // id + 1, or 0 for an empty slot
+  UInt32  id;
+};
+
+struct path_table {
+  struct path_table_slot*   slots;
+  size_t                    num_slots;
+
+  size_t                    num_paths;
+  size_t                    capacity;
+  size_t*                   offsets;
+  size_t*                   lengths;
+
+  char*                     bytes;
+  size_t                    bytes_len;
+  size_t                    bytes_cap;
+};
+
+void path_table_init(struct path_table* table);
+void path_table_free(struct path_table* table);
+
+// Forget every path, keeping the buffers
+void path_table_clear(struct path_table* table);
+
+// The id of the first length bytes of path, or PATH_TABLE_NONE
+UInt32 path_table_find(const struct path_table* table, const char* path, size_t length);
+
+// Give a path that isn't in the table the next id, and return it
+UInt32 path_table_add(struct path_table* table, const char* path, size_t length);
+
+#endif // fsevent_watch_path_table_h
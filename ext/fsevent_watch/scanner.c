@@ -0,0 +1,609 @@
+#include "scanner.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define SCANNER_READ_BUFFER   (64 * 1024)
+
+#ifdef __linux__
+// What getdents64() fills its buffer with, which glibc only declares lately
+struct scanner_dirent64 {
+  UInt64          d_ino;
+  SInt64          d_off;
+  unsigned short  d_reclen;
+  unsigned char   d_type;
+  char            d_name[];
+};
+#endif
+
+// A directory's fd, held open until every subdirectory queued from it has
+// been opened relative to it
+struct scanner_handle {
+  int           fd;
+  atomic_int    refs;
+};
+
+struct scanner_task {
+  char*                   path;
+  size_t                  length;
+  size_t                  name;       // where the last component of path starts
+  UInt32                  tag;
+  struct scanner_handle*  parent;
+};
+
+struct scanner_worker {
+  struct scanner*         scanner;
+  pthread_t               thread;
+  unsigned long           generation;
+
+  // queued directories: the owner pushes and pops at the tail, other
+  // threads steal from the head
+  pthread_mutex_t         lock;
+  struct scanner_task*    tasks;
+  size_t                  head;
+  size_t                  tail;
+  size_t                  capacity;
+  atomic_size_t           size;
+
+  // directories this thread read during the current walk
+  struct scanner_dir**    dirs;
+  size_t                  num_dirs;
+  size_t                  dirs_capacity;
+
+  // reused for every directory this thread reads
+  struct scanner_task*    children;
+  size_t                  num_children;
+  size_t                  children_capacity;
+  const char**            names;
+  size_t                  names_capacity;
+  struct scanner_handle*  handle;
+  char*                   buffer;
+  char                    path[PATH_MAX];
+};
+
+struct scanner {
+  struct scanner_callbacks  callbacks;
+  int                       num_threads;
+  int                       started;
+  struct scanner_worker*    workers;
+
+  pthread_mutex_t           lock;
+  pthread_cond_t            start;      // a walk needs the threads
+  pthread_cond_t            wake;       // directories were queued, or the walk is done
+  pthread_cond_t            idle;       // a thread is done with the walk
+  unsigned long             generation;
+  int                       active;
+  bool                      stopping;
+  atomic_size_t             pending;    // directories queued or being read
+  atomic_int                sleepers;
+
+  struct scanner_dir**      result;
+  size_t                    num_result;
+  size_t                    result_capacity;
+};
+
+static void* scanner_alloc(void* ptr, size_t size)
+{
+  ptr = realloc(ptr, size);
+  if (!ptr) {
+    fprintf(stderr, "Unable to allocate scanner\n");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+static void scanner_handle_release(struct scanner_handle* handle)
+{
+  if (atomic_fetch_sub(&handle->refs, 1) == 1) {
+    close(handle->fd);
+    free(handle);
+  }
+}
+
+static struct scanner_dir* scanner_dir_create(const char* path, size_t length, UInt32 tag)
+{
+  struct scanner_dir* dir = scanner_alloc(NULL, sizeof(struct scanner_dir));
+  memset(dir, 0, sizeof(struct scanner_dir));
+  dir->path = scanner_alloc(NULL, length + 1);
+  memcpy(dir->path, path, length);
+  dir->path[length] = '\0';
+  dir->length = length;
+  dir->tag = tag;
+  return dir;
+}
+
+static void scanner_dir_free(struct scanner_dir* dir)
+{
+  free(dir->path);
+  free(dir->entries);
+  free(dir->names);
+  free(dir);
+}
+
+static void scanner_dir_add(struct scanner_dir* dir, const char* name, size_t nameLength,
+                            const struct stat* st)
+{
+  if (dir->num_entries == dir->entries_capacity) {
+    dir->entries_capacity = dir->entries_capacity ? dir->entries_capacity * 2 : 16;
+    dir->entries = scanner_alloc(dir->entries,
+                                 dir->entries_capacity * sizeof(struct scanner_entry));
+  }
+  if (dir->names_length + nameLength + 1 > dir->names_capacity) {
+    size_t capacity = dir->names_capacity ? dir->names_capacity : 256;
+    while (capacity < dir->names_length + nameLength + 1) {
+      capacity *= 2;
+    }
+    dir->names = scanner_alloc(dir->names, capacity);
+    dir->names_capacity = capacity;
+  }
+
+  struct scanner_entry* entry = &dir->entries[dir->num_entries++];
+  entry->name = dir->names_length;
+  scanner_stat_from(&entry->st, st);
+  memcpy(dir->names + dir->names_length, name, nameLength + 1);
+  dir->names_length += nameLength + 1;
+}
+
+// Queue directories on a thread's own deque
+static void scanner_push(struct scanner_worker* worker, struct scanner_task* tasks, size_t count)
+{
+  struct scanner* scanner = worker->scanner;
+
+  atomic_fetch_add(&scanner->pending, count);
+
+  pthread_mutex_lock(&worker->lock);
+  if (worker->tail + count > worker->capacity) {
+    size_t used = worker->tail - worker->head;
+    memmove(worker->tasks, worker->tasks + worker->head, used * sizeof(struct scanner_task));
+    worker->head = 0;
+    worker->tail = used;
+    if (used + count > worker->capacity) {
+      while (worker->capacity < used + count) {
+        worker->capacity = worker->capacity ? worker->capacity * 2 : 64;
+      }
+      worker->tasks = scanner_alloc(worker->tasks, worker->capacity * sizeof(struct scanner_task));
+    }
+  }
+  memcpy(worker->tasks + worker->tail, tasks, count * sizeof(struct scanner_task));
+  worker->tail += count;
+  atomic_store(&worker->size, worker->tail - worker->head);
+  pthread_mutex_unlock(&worker->lock);
+
+  if (atomic_load(&scanner->sleepers) > 0) {
+    pthread_mutex_lock(&scanner->lock);
+    pthread_cond_broadcast(&scanner->wake);
+    pthread_mutex_unlock(&scanner->lock);
+  }
+}
+
+static bool scanner_take(struct scanner_worker* worker, struct scanner_task* task, bool steal)
+{
+  if (atomic_load(&worker->size) == 0) {
+    return false;
+  }
+
+  pthread_mutex_lock(&worker->lock);
+  bool found = worker->tail > worker->head;
+  if (found) {
+    *task = steal ? worker->tasks[worker->head++] : worker->tasks[--worker->tail];
+    if (worker->head == worker->tail) {
+      worker->head = worker->tail = 0;
+    }
+    atomic_store(&worker->size, worker->tail - worker->head);
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return found;
+}
+
+// The newest directory this thread queued, or else the oldest of another's
+static bool scanner_next(struct scanner_worker* worker, struct scanner_task* task)
+{
+  struct scanner* scanner = worker->scanner;
+
+  if (scanner_take(worker, task, false)) {
+    return true;
+  }
+
+  int self = (int)(worker - scanner->workers);
+  for (int i = 1; i <= scanner->started; i++) {
+    if (scanner_take(&scanner->workers[(self + i) % (scanner->started + 1)], task, true)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool scanner_has_work(const struct scanner* scanner)
+{
+  for (int i = 0; i <= scanner->started; i++) {
+    if (atomic_load(&scanner->workers[i].size) > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Append "dir/name" to the thread's path buffer, or return 0 if too long
+static size_t scanner_join(struct scanner_worker* worker, const char* dir, size_t length,
+                           const char* name, size_t nameLength)
+{
+  size_t separator = (length == 1 && dir[0] == '/') ? 0 : 1;
+  if (length + separator + nameLength >= PATH_MAX) {
+    return 0;
+  }
+  memcpy(worker->path, dir, length);
+  worker->path[length] = '/';
+  memcpy(worker->path + length + separator, name, nameLength);
+  worker->path[length + separator + nameLength] = '\0';
+  return length + separator + nameLength;
+}
+
+// Stat one entry of a directory being read, and queue it if it's a
+// directory the caller wants walked too
+static void scanner_visit(struct scanner_worker* worker, struct scanner_dir* dir, int fd,
+                          const char* name, size_t nameLength)
+{
+  const struct scanner_callbacks* callbacks = &worker->scanner->callbacks;
+  struct stat st;
+
+  size_t length = scanner_join(worker, dir->path, dir->length, name, nameLength);
+  if (!length || fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+    return;
+  }
+  if (callbacks->prune && callbacks->prune(callbacks->info, worker->path)) {
+    return;
+  }
+
+  scanner_dir_add(dir, name, nameLength, &st);
+
+  UInt32 tag;
+  if (!S_ISDIR(st.st_mode) || !callbacks->descend(callbacks->info, worker->path, length, &tag)) {
+    return;
+  }
+
+  if (!worker->handle) {
+    worker->handle = scanner_alloc(NULL, sizeof(struct scanner_handle));
+    worker->handle->fd = fd;
+    atomic_init(&worker->handle->refs, 1);
+  }
+  atomic_fetch_add(&worker->handle->refs, 1);
+
+  if (worker->num_children == worker->children_capacity) {
+    worker->children_capacity = worker->children_capacity ? worker->children_capacity * 2 : 16;
+    worker->children = scanner_alloc(worker->children,
+                                     worker->children_capacity * sizeof(struct scanner_task));
+  }
+  struct scanner_task* child = &worker->children[worker->num_children++];
+  child->path = scanner_alloc(NULL, length + 1);
+  memcpy(child->path, worker->path, length + 1);
+  child->length = length;
+  child->name = length - nameLength;
+  child->tag = tag;
+  child->parent = worker->handle;
+}
+
+static inline bool scanner_is_dots(const char* name)
+{
+  return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+static void scanner_read_names(struct scanner_worker* worker, struct scanner_dir* dir, int fd)
+{
+#ifdef __linux__
+  if (!worker->buffer) {
+    worker->buffer = scanner_alloc(NULL, SCANNER_READ_BUFFER);
+  }
+
+  for (;;) {
+    long n = syscall(SYS_getdents64, fd, worker->buffer, SCANNER_READ_BUFFER);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n < 0 && dir->num_entries == 0) {
+        dir->state = kScannerDirUnreadable;
+      }
+      return;
+    }
+
+    for (long offset = 0; offset < n;) {
+      const struct scanner_dirent64* entry = (const void*)(worker->buffer + offset);
+      offset += entry->d_reclen;
+      if (!scanner_is_dots(entry->d_name)) {
+        scanner_visit(worker, dir, fd, entry->d_name, strlen(entry->d_name));
+      }
+    }
+  }
+#else
+  // readdir() would take fd over, and it's still needed for the entries
+  int copy = dup(fd);
+  DIR* stream = copy >= 0 ? fdopendir(copy) : NULL;
+  if (!stream) {
+    if (copy >= 0) {
+      close(copy);
+    }
+    dir->state = kScannerDirUnreadable;
+    return;
+  }
+
+  struct dirent* entry;
+  while ((entry = readdir(stream)) != NULL) {
+    if (!scanner_is_dots(entry->d_name)) {
+      scanner_visit(worker, dir, fd, entry->d_name, strlen(entry->d_name));
+    }
+  }
+  closedir(stream);
+#endif
+}
+
+static void scanner_read(struct scanner_worker* worker, struct scanner_task* task)
+{
+  const struct scanner_callbacks* callbacks = &worker->scanner->callbacks;
+  struct scanner_dir* dir = scanner_dir_create(task->path, task->length, task->tag);
+  struct stat st;
+  int fd;
+
+  if (task->parent) {
+    fd = openat(task->parent->fd, task->path + task->name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  } else {
+    fd = open(task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+  int error = errno;
+  if (task->parent) {
+    scanner_handle_release(task->parent);
+  }
+  free(task->path);
+
+  if (fd >= 0 && fstat(fd, &st) != 0) {
+    error = errno;
+    close(fd);
+    fd = -1;
+  }
+
+  if (fd < 0) {
+    dir->state = (error == ENOENT || error == ENOTDIR || error == ELOOP) ? kScannerDirGone
+                                                                        : kScannerDirUnreadable;
+  } else {
+    scanner_stat_from(&dir->st, &st);
+    worker->handle = NULL;
+    worker->num_children = 0;
+
+    size_t numNames = SIZE_MAX;
+    if (callbacks->cached) {
+      numNames = callbacks->cached(callbacks->info, dir->tag, &dir->st,
+                                   worker->names, worker->names_capacity);
+      if (numNames != SIZE_MAX && numNames > worker->names_capacity) {
+        worker->names_capacity = numNames;
+        worker->names = scanner_alloc(worker->names, numNames * sizeof(const char*));
+        numNames = callbacks->cached(callbacks->info, dir->tag, &dir->st,
+                                     worker->names, worker->names_capacity);
+      }
+    }
+
+    if (numNames == SIZE_MAX) {
+      scanner_read_names(worker, dir, fd);
+    } else {
+      for (size_t i = 0; i < numNames; i++) {
+        scanner_visit(worker, dir, fd, worker->names[i], strlen(worker->names[i]));
+      }
+    }
+
+    if (worker->handle) {
+      scanner_handle_release(worker->handle);
+    } else {
+      close(fd);
+    }
+
+    if (worker->num_children > 0) {
+      scanner_push(worker, worker->children, worker->num_children);
+    }
+  }
+
+  if (worker->num_dirs == worker->dirs_capacity) {
+    worker->dirs_capacity = worker->dirs_capacity ? worker->dirs_capacity * 2 : 64;
+    worker->dirs = scanner_alloc(worker->dirs, worker->dirs_capacity * sizeof(struct scanner_dir*));
+  }
+  worker->dirs[worker->num_dirs++] = dir;
+}
+
+// Read directories until the walk has none left
+static void scanner_work(struct scanner_worker* worker)
+{
+  struct scanner* scanner = worker->scanner;
+  struct scanner_task task;
+
+  for (;;) {
+    if (scanner_next(worker, &task)) {
+      scanner_read(worker, &task);
+      if (atomic_fetch_sub(&scanner->pending, 1) == 1) {
+        pthread_mutex_lock(&scanner->lock);
+        pthread_cond_broadcast(&scanner->wake);
+        pthread_mutex_unlock(&scanner->lock);
+      }
+      continue;
+    }
+
+    if (atomic_load(&scanner->pending) == 0) {
+      return;
+    }
+
+    // everything queued is being read; wait for more, or for the end
+    pthread_mutex_lock(&scanner->lock);
+    atomic_fetch_add(&scanner->sleepers, 1);
+    if (atomic_load(&scanner->pending) > 0 && !scanner_has_work(scanner)) {
+      pthread_cond_wait(&scanner->wake, &scanner->lock);
+    }
+    atomic_fetch_sub(&scanner->sleepers, 1);
+    pthread_mutex_unlock(&scanner->lock);
+  }
+}
+
+static void* scanner_thread(void* info)
+{
+  struct scanner_worker* worker = info;
+  struct scanner* scanner = worker->scanner;
+
+  pthread_mutex_lock(&scanner->lock);
+  for (;;) {
+    while (scanner->generation == worker->generation && !scanner->stopping) {
+      pthread_cond_wait(&scanner->start, &scanner->lock);
+    }
+    if (scanner->stopping) {
+      break;
+    }
+    worker->generation = scanner->generation;
+    pthread_mutex_unlock(&scanner->lock);
+
+    scanner_work(worker);
+
+    pthread_mutex_lock(&scanner->lock);
+    if (--scanner->active == 0) {
+      pthread_cond_broadcast(&scanner->idle);
+    }
+  }
+  pthread_mutex_unlock(&scanner->lock);
+
+  return NULL;
+}
+
+static int scanner_compare_dirs(const void* a, const void* b)
+{
+  return strcmp((*(struct scanner_dir* const*)a)->path, (*(struct scanner_dir* const*)b)->path);
+}
+
+struct scanner* scanner_create(int numThreads, const struct scanner_callbacks* callbacks)
+{
+  if (numThreads < 1) {
+    numThreads = 1;
+  } else if (numThreads > SCANNER_MAX_THREADS) {
+    numThreads = SCANNER_MAX_THREADS;
+  }
+
+  struct scanner* scanner = scanner_alloc(NULL, sizeof(struct scanner));
+  memset(scanner, 0, sizeof(struct scanner));
+  scanner->callbacks = *callbacks;
+  scanner->num_threads = numThreads;
+  scanner->workers = scanner_alloc(NULL, (size_t)numThreads * sizeof(struct scanner_worker));
+  memset(scanner->workers, 0, (size_t)numThreads * sizeof(struct scanner_worker));
+  for (int i = 0; i < numThreads; i++) {
+    scanner->workers[i].scanner = scanner;
+    pthread_mutex_init(&scanner->workers[i].lock, NULL);
+    atomic_init(&scanner->workers[i].size, 0);
+  }
+
+  pthread_mutex_init(&scanner->lock, NULL);
+  pthread_cond_init(&scanner->start, NULL);
+  pthread_cond_init(&scanner->wake, NULL);
+  pthread_cond_init(&scanner->idle, NULL);
+  atomic_init(&scanner->pending, 0);
+  atomic_init(&scanner->sleepers, 0);
+
+  return scanner;
+}
+
+static void scanner_clear(struct scanner* scanner)
+{
+  for (size_t i = 0; i < scanner->num_result; i++) {
+    scanner_dir_free(scanner->result[i]);
+  }
+  scanner->num_result = 0;
+}
+
+void scanner_release(struct scanner* scanner)
+{
+  pthread_mutex_lock(&scanner->lock);
+  scanner->stopping = true;
+  pthread_cond_broadcast(&scanner->start);
+  pthread_mutex_unlock(&scanner->lock);
+
+  for (int i = 1; i <= scanner->started; i++) {
+    pthread_join(scanner->workers[i].thread, NULL);
+  }
+
+  for (int i = 0; i < scanner->num_threads; i++) {
+    struct scanner_worker* worker = &scanner->workers[i];
+    pthread_mutex_destroy(&worker->lock);
+    free(worker->tasks);
+    free(worker->dirs);
+    free(worker->children);
+    free(worker->names);
+    free(worker->buffer);
+  }
+
+  scanner_clear(scanner);
+  pthread_mutex_destroy(&scanner->lock);
+  pthread_cond_destroy(&scanner->start);
+  pthread_cond_destroy(&scanner->wake);
+  pthread_cond_destroy(&scanner->idle);
+  free(scanner->result);
+  free(scanner->workers);
+  free(scanner);
+}
+
+struct scanner_dir* const* scanner_scan(struct scanner* scanner,
+                                        const char* path,
+                                        UInt32 tag,
+                                        bool parallel,
+                                        size_t* numDirs)
+{
+  scanner_clear(scanner);
+
+  size_t length = strlen(path);
+  struct scanner_task root = {scanner_alloc(NULL, length + 1), length, 0, tag, NULL};
+  memcpy(root.path, path, length + 1);
+  scanner_push(&scanner->workers[0], &root, 1);
+
+  // a single directory isn't worth waking threads for
+  if (parallel && scanner->num_threads > 1) {
+    pthread_mutex_lock(&scanner->lock);
+    while (scanner->started < scanner->num_threads - 1) {
+      struct scanner_worker* worker = &scanner->workers[scanner->started + 1];
+      worker->generation = scanner->generation;
+      if (pthread_create(&worker->thread, NULL, scanner_thread, worker) != 0) {
+        break;
+      }
+      scanner->started++;
+    }
+    scanner->generation++;
+    scanner->active = scanner->started;
+    pthread_cond_broadcast(&scanner->start);
+    pthread_mutex_unlock(&scanner->lock);
+
+    scanner_work(&scanner->workers[0]);
+
+    pthread_mutex_lock(&scanner->lock);
+    while (scanner->active > 0) {
+      pthread_cond_wait(&scanner->idle, &scanner->lock);
+    }
+    pthread_mutex_unlock(&scanner->lock);
+  } else {
+    scanner_work(&scanner->workers[0]);
+  }
+
+  for (int i = 0; i <= scanner->started; i++) {
+    struct scanner_worker* worker = &scanner->workers[i];
+    if (scanner->num_result + worker->num_dirs > scanner->result_capacity) {
+      while (scanner->result_capacity < scanner->num_result + worker->num_dirs) {
+        scanner->result_capacity = scanner->result_capacity ? scanner->result_capacity * 2 : 64;
+      }
+      scanner->result = scanner_alloc(scanner->result,
+                                      scanner->result_capacity * sizeof(struct scanner_dir*));
+    }
+    memcpy(scanner->result + scanner->num_result, worker->dirs,
+           worker->num_dirs * sizeof(struct scanner_dir*));
+    scanner->num_result += worker->num_dirs;
+    worker->num_dirs = 0;
+  }
+
+  qsort(scanner->result, scanner->num_result, sizeof(struct scanner_dir*), scanner_compare_dirs);
+
+  *numDirs = scanner->num_result;
+  return scanner->result;
+}
@@ -0,0 +1,109 @@
+/**
+ * @headerfile scanner.h
+ * Parallel directory walks for --snapshot and --crawl
+ *
+ * A walk reads a directory, stats each of its entries and, for each
+ * subdirectory its caller wants, queues another directory to read. Each
+ * thread keeps its own deque of those: it takes the newest directory it
+ * queued itself, so walks stay depth first and close to the directory fds
+ * they still hold, and when it runs dry it steals the oldest directory from
+ * another thread's deque, which tends to be the top of a large subtree.
+ *
+ * Subdirectories are opened with openat() relative to their parent's fd,
+ * and entries stat()ed with fstatat() relative to their directory's, so no
+ * path is looked up from the root more than once. On Linux directories are
+ * read with getdents64() into a buffer per thread, elsewhere with readdir().
+ *
+ * A walk's callbacks are called from every thread at once, so they must not
+ * change anything they or the caller read while the walk is running.
+ */
+
+#ifndef fsevent_watch_scanner_h
+#define fsevent_watch_scanner_h
+
+#include "common.h"
+
+#include <sys/stat.h>
+
+#define SCANNER_MAX_THREADS   8
+
+// What a walk records of a directory entry
+struct scanner_stat {
+  UInt64    ino;
+  UInt64    size;
+  SInt64    mtime;        // nanoseconds
+  UInt32    mode;
+};
+
+struct scanner_entry {
+  size_t                name;     // offset of the NUL terminated name in names
+  struct scanner_stat   st;
+};
+
+enum scanner_dir_state {
+  kScannerDirRead,
+  kScannerDirGone,              // removed or replaced before it could be read
+  kScannerDirUnreadable
+};
+
+// A directory's entries, as the walk found them
+struct scanner_dir {
+  char*                   path;
+  size_t                  length;
+  UInt32                  tag;
+  enum scanner_dir_state  state;
+  struct scanner_stat     st;
+  struct scanner_entry*   entries;
+  size_t                  num_entries;
+  size_t                  entries_capacity;
+  char*                   names;
+  size_t                  names_length;
+  size_t                  names_capacity;
+};
+
+struct scanner_callbacks {
+  void*   info;
+
+  // Whether path, and everything below it, is left out. Optional.
+  bool    (*prune)(void* info, const char* path);
+
+  // The names of the entries of the directory tagged tag, if they are known
+  // without reading it: up to capacity of them are stored in names, and
+  // their number returned. SIZE_MAX reads the directory instead. Optional.
+  size_t  (*cached)(void* info, UInt32 tag, const struct scanner_stat* st,
+                    const char** names, size_t capacity);
+
+  // Whether to walk a subdirectory that was found, and what to tag it with
+  bool    (*descend)(void* info, const char* path, size_t length, UInt32* tag);
+};
+
+struct scanner;
+
+// A scanner walking with up to numThreads threads, the caller's included
+struct scanner* scanner_create(int numThreads, const struct scanner_callbacks* callbacks);
+void scanner_release(struct scanner* scanner);
+
+// Walk the directory at path, tagged tag, and whatever descend asks for
+// below it. Threads other than the caller's only join in when parallel is
+// set, and are only started the first time it is. Returns every directory
+// read, sorted by path, so a parent always comes before its children; they
+// are valid until the next walk.
+struct scanner_dir* const* scanner_scan(struct scanner* scanner,
+                                        const char* path,
+                                        UInt32 tag,
+                                        bool parallel,
+                                        size_t* numDirs);
+
+static inline void scanner_stat_from(struct scanner_stat* to, const struct stat* st)
+{
+  to->ino = (UInt64)st->st_ino;
+  to->size = (UInt64)st->st_size;
+#ifdef __APPLE__
+  to->mtime = (SInt64)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+  to->mtime = (SInt64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+  to->mode = (UInt32)st->st_mode;
+}
+
+#endif // fsevent_watch_scanner_h
@@ -0,0 +1,81 @@
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHM_RING_ALIGN(n)  (((n) + 7) & ~(UInt64)7)
+
+bool shm_ring_open(struct shm_ring* ring, int fd)
+{
+  struct stat st;
+
+  memset(ring, 0, sizeof(struct shm_ring));
+
+  if (fstat(fd, &st) != 0) {
+    return false;
+  }
+  if (st.st_size < SHM_RING_HEADER_SIZE + 4096) {
+    errno = EINVAL;
+    return false;
+  }
+
+  void* base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+
+  ring->size = (size_t)st.st_size;
+  ring->header = base;
+  ring->data = (char*)base + SHM_RING_HEADER_SIZE;
+  ring->capacity = ((UInt64)st.st_size - SHM_RING_HEADER_SIZE) & ~(UInt64)7;
+  ring->head = 0;
+
+  // the reader looks at nothing before the first doorbell
+  ring->header->capacity = ring->capacity;
+  ring->header->head = 0;
+  ring->header->tail = 0;
+  memcpy(ring->header->magic, SHM_RING_MAGIC, sizeof(ring->header->magic));
+
+  return true;
+}
+
+void shm_ring_close(struct shm_ring* ring)
+{
+  if (ring->header) {
+    munmap(ring->header, ring->size);
+  }
+  memset(ring, 0, sizeof(struct shm_ring));
+}
+
+bool shm_ring_push(struct shm_ring* ring, const char* bytes, size_t length)
+{
+  if (length >= SHM_RING_WRAP) {
+    return false;
+  }
+
+  UInt64 tail = __atomic_load_n(&ring->header->tail, __ATOMIC_ACQUIRE);
+  UInt64 used = ring->head - tail;
+  UInt64 needed = SHM_RING_ALIGN(4 + (UInt64)length);
+  UInt64 offset = ring->head % ring->capacity;
+  UInt64 skipped = (offset + needed > ring->capacity) ? ring->capacity - offset : 0;
+
+  if (needed + skipped > ring->capacity - used) {
+    return false;
+  }
+
+  if (skipped) {
+    UInt32 wrap = SHM_RING_WRAP;
+    memcpy(ring->data + offset, &wrap, sizeof(wrap));
+    ring->head += skipped;
+    offset = 0;
+  }
+
+  UInt32 frameLength = (UInt32)length;
+  memcpy(ring->data + offset, &frameLength, sizeof(frameLength));
+  memcpy(ring->data + offset + 4, bytes, length);
+  ring->head += needed;
+
+  __atomic_store_n(&ring->header->head, ring->head, __ATOMIC_RELEASE);
+  return true;
+}
@@ -0,0 +1,70 @@
+/**
+ * @headerfile shm_ring.h
+ * --transport=shm: batches through a shared memory ring instead of the pipe
+ *
+ * The reader creates a shared memory file (a memfd on linux, an unlinked
+ * POSIX shared memory object elsewhere), sizes it, and hands it to
+ * fsevent_watch as an inherited descriptor. fsevent_watch lays a single
+ * producer, single consumer ring out in it and, for every batch, appends the
+ * encoded frame and writes one doorbell byte to stdout:
+ *
+ *   'r'  the next record in the ring holds the next frame
+ *   'p'  the next frame follows on the pipe, because the ring was too full
+ *        (or the frame too big) to take it
+ *
+ * Frames are consumed in doorbell order, so batches keep their order across
+ * both paths, and only a byte per batch crosses the kernel as long as the
+ * reader keeps up.
+ *
+ * The file starts with a 192 byte header, every field in host byte order:
+ *
+ *   0    magic "FSWRING1"
+ *   8    u64 capacity of the data area
+ *   64   u64 head, bytes ever appended (written by fsevent_watch)
+ *   128  u64 tail, bytes ever consumed (written by the reader)
+ *   192  data
+ *
+ * Records are a u32 frame length and the frame, padded to 8 bytes, at
+ * offset head % capacity of the data area. A record never wraps: when one
+ * wouldn't fit before the end of the data area, a u32 0xffffffff marks the
+ * rest of it as skipped and the record starts over at offset 0. head is
+ * published with release semantics after the record is written, and the
+ * reader publishes tail the same way once it's done with a record.
+ */
+
+#ifndef fsevent_watch_shm_ring_h
+#define fsevent_watch_shm_ring_h
+
+#include "common.h"
+
+#define SHM_RING_MAGIC        "FSWRING1"
+#define SHM_RING_HEADER_SIZE  192
+#define SHM_RING_WRAP         0xffffffffU
+
+struct shm_ring_header {
+  char      magic[8];
+  UInt64    capacity;
+  char      reserved0[48];
+  UInt64    head;
+  char      reserved1[56];
+  UInt64    tail;
+  char      reserved2[56];
+};
+
+struct shm_ring {
+  struct shm_ring_header*   header;
+  char*                     data;
+  UInt64                    capacity;
+  UInt64                    head;
+  size_t                    size;
+};
+
+// Map the shared memory file open on fd and lay an empty ring out in it
+bool shm_ring_open(struct shm_ring* ring, int fd);
+void shm_ring_close(struct shm_ring* ring);
+
+// Append a frame, or return false without touching the ring if there isn't
+// room for it
+bool shm_ring_push(struct shm_ring* ring, const char* bytes, size_t length);
+
+#endif // fsevent_watch_shm_ring_h
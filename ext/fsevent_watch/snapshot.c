@@ -0,0 +1,860 @@
+#include "snapshot.h"
+
+#include "scanner.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <time.h>
+
+#define SNAPSHOT_NONE             0xffffffffU
+#define SNAPSHOT_LISTED           0x01
+#define SNAPSHOT_RECORD_SIZE      6
+#define SNAPSHOT_STAT_SIZE        28
+#define SNAPSHOT_COMPACT_BYTES    (1024 * 1024)
+
+// An entry, linked to its parent and siblings and chained into the table
+struct snapshot_node {
+  char*                 path;
+  UInt32                length;
+  UInt32                generation;
+  UInt64                hash;
+  UInt32                hash_next;
+  UInt32                parent;
+  UInt32                first_child;
+  UInt32                next_sibling;
+  UInt32                prev_sibling;
+  UInt8                 flags;
+  struct scanner_stat   st;
+};
+
+struct snapshot {
+  char*                       path;
+  int                         fd;
+  int                         lock_fd;
+  char**                      roots;
+  size_t                      num_roots;
+  snapshot_prune_callback     prune;
+  struct scanner*             scanner;
+  bool                        recursive;
+
+  struct snapshot_node*       nodes;
+  size_t                      num_nodes;
+  size_t                      nodes_cap;
+  UInt32                      free_nodes;
+  UInt32*                     buckets;
+  size_t                      num_buckets;
+  size_t                      live_nodes;
+  UInt32                      generation;
+  SInt64                      scan_started;
+
+  // records waiting to be appended, and the path of the last one written
+  char*                       log;
+  size_t                      log_len;
+  size_t                      log_cap;
+  char                        last_path[PATH_MAX];
+  size_t                      last_length;
+  UInt64                      base_bytes;
+  UInt64                      log_bytes;
+
+  // differences found by the last scan
+  char**                      paths;
+  FSEventStreamEventFlags*    flags;
+  size_t                      num_changes;
+  size_t                      changes_cap;
+};
+
+static void* snapshot_alloc(void* ptr, size_t size)
+{
+  ptr = realloc(ptr, size);
+  if (!ptr) {
+    fprintf(stderr, "Unable to allocate snapshot\n");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+static inline FSEventStreamEventFlags snapshot_type(UInt32 mode)
+{
+  if (S_ISDIR(mode)) {
+    return kFSEventStreamEventFlagItemIsDir;
+  }
+  if (S_ISLNK(mode)) {
+    return kFSEventStreamEventFlagItemIsSymlink;
+  }
+  return kFSEventStreamEventFlagItemIsFile;
+}
+
+// Append "dir/name" to a buffer of PATH_MAX bytes, or return 0 if too long
+static size_t snapshot_join(char* buffer, const char* dir, size_t length,
+                            const char* name, size_t nameLength)
+{
+  size_t separator = (length == 1 && dir[0] == '/') ? 0 : 1;
+  if (length + separator + nameLength >= PATH_MAX) {
+    return 0;
+  }
+  memcpy(buffer, dir, length);
+  buffer[length] = '/';
+  memcpy(buffer + length + separator, name, nameLength);
+  buffer[length + separator + nameLength] = '\0';
+  return length + separator + nameLength;
+}
+
+static UInt32 snapshot_lookup(const struct snapshot* snapshot, const char* path, size_t length)
+{
+  if (!snapshot->num_buckets) {
+    return SNAPSHOT_NONE;
+  }
+
+  UInt64 hash = fnv1a(path, length);
+  UInt32 index = snapshot->buckets[hash & (snapshot->num_buckets - 1)];
+  while (index != SNAPSHOT_NONE) {
+    const struct snapshot_node* node = &snapshot->nodes[index];
+    if (node->hash == hash && node->length == length && memcmp(node->path, path, length) == 0) {
+      return index;
+    }
+    index = node->hash_next;
+  }
+  return SNAPSHOT_NONE;
+}
+
+static void snapshot_rehash(struct snapshot* snapshot)
+{
+  size_t num_buckets = snapshot->num_buckets ? snapshot->num_buckets * 2 : 1024;
+
+  snapshot->buckets = snapshot_alloc(snapshot->buckets, num_buckets * sizeof(UInt32));
+  memset(snapshot->buckets, 0xff, num_buckets * sizeof(UInt32));
+  snapshot->num_buckets = num_buckets;
+
+  for (UInt32 i = 0; i < snapshot->num_nodes; i++) {
+    struct snapshot_node* node = &snapshot->nodes[i];
+    if (node->path) {
+      UInt32* bucket = &snapshot->buckets[node->hash & (num_buckets - 1)];
+      node->hash_next = *bucket;
+      *bucket = i;
+    }
+  }
+}
+
+static UInt32 snapshot_insert(struct snapshot* snapshot, const char* path, size_t length,
+                              UInt32 parent, const struct scanner_stat* st, UInt8 flags)
+{
+  UInt32 index;
+
+  if (snapshot->free_nodes != SNAPSHOT_NONE) {
+    index = snapshot->free_nodes;
+    snapshot->free_nodes = snapshot->nodes[index].next_sibling;
+  } else {
+    if (snapshot->num_nodes == snapshot->nodes_cap) {
+      snapshot->nodes_cap = snapshot->nodes_cap ? snapshot->nodes_cap * 2 : 1024;
+      snapshot->nodes = snapshot_alloc(snapshot->nodes,
+                                       snapshot->nodes_cap * sizeof(struct snapshot_node));
+    }
+    index = (UInt32)snapshot->num_nodes++;
+  }
+
+  struct snapshot_node* node = &snapshot->nodes[index];
+  node->path = snapshot_alloc(NULL, length + 1);
+  memcpy(node->path, path, length);
+  node->path[length] = '\0';
+  node->length = (UInt32)length;
+  node->generation = 0;
+  node->hash = fnv1a(path, length);
+  node->parent = parent;
+  node->first_child = SNAPSHOT_NONE;
+  node->prev_sibling = SNAPSHOT_NONE;
+  node->next_sibling = SNAPSHOT_NONE;
+  node->flags = flags;
+  node->st = *st;
+
+  if (parent != SNAPSHOT_NONE) {
+    struct snapshot_node* up = &snapshot->nodes[parent];
+    node->next_sibling = up->first_child;
+    if (up->first_child != SNAPSHOT_NONE) {
+      snapshot->nodes[up->first_child].prev_sibling = index;
+    }
+    up->first_child = index;
+  }
+
+  if (++snapshot->live_nodes > snapshot->num_buckets) {
+    snapshot_rehash(snapshot);
+  } else {
+    UInt32* bucket = &snapshot->buckets[node->hash & (snapshot->num_buckets - 1)];
+    node->hash_next = *bucket;
+    *bucket = index;
+  }
+
+  return index;
+}
+
+static void snapshot_add_change(struct snapshot* snapshot, const char* path,
+                                FSEventStreamEventFlags flags)
+{
+  if (snapshot->num_changes == snapshot->changes_cap) {
+    snapshot->changes_cap = snapshot->changes_cap ? snapshot->changes_cap * 2 : 256;
+    snapshot->paths = snapshot_alloc(snapshot->paths, snapshot->changes_cap * sizeof(char*));
+    snapshot->flags = snapshot_alloc(snapshot->flags,
+                                     snapshot->changes_cap * sizeof(FSEventStreamEventFlags));
+  }
+  snapshot->paths[snapshot->num_changes] = strdup(path);
+  snapshot->flags[snapshot->num_changes] = flags;
+  snapshot->num_changes++;
+}
+
+static void snapshot_clear_changes(struct snapshot* snapshot)
+{
+  for (size_t i = 0; i < snapshot->num_changes; i++) {
+    free(snapshot->paths[i]);
+  }
+  snapshot->num_changes = 0;
+}
+
+// Queue a record for the next append, front coded against the last one
+static void snapshot_record(struct snapshot* snapshot, char type, const struct snapshot_node* node)
+{
+  if (!snapshot->path) {
+    return;
+  }
+
+  size_t shared = 0;
+  size_t limit = node->length < snapshot->last_length ? node->length : snapshot->last_length;
+  while (shared < limit && shared < 0xffff && node->path[shared] == snapshot->last_path[shared]) {
+    shared++;
+  }
+  UInt16 prefix = (UInt16)shared;
+  UInt16 suffix = (UInt16)(node->length - shared);
+
+  size_t needed = snapshot->log_len + SNAPSHOT_RECORD_SIZE + suffix + SNAPSHOT_STAT_SIZE;
+  if (needed > snapshot->log_cap) {
+    size_t capacity = snapshot->log_cap ? snapshot->log_cap : 65536;
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+    snapshot->log = snapshot_alloc(snapshot->log, capacity);
+    snapshot->log_cap = capacity;
+  }
+
+  char* p = snapshot->log + snapshot->log_len;
+  *p++ = type;
+  *p++ = (char)node->flags;
+  memcpy(p, &prefix, 2);
+  memcpy(p + 2, &suffix, 2);
+  memcpy(p + 4, node->path + shared, suffix);
+  p += 4 + suffix;
+
+  if (type == 'U') {
+    memcpy(p, &node->st.ino, 8);
+    memcpy(p + 8, &node->st.size, 8);
+    memcpy(p + 16, &node->st.mtime, 8);
+    memcpy(p + 24, &node->st.mode, 4);
+    p += SNAPSHOT_STAT_SIZE;
+  }
+
+  snapshot->log_len = (size_t)(p - snapshot->log);
+  memcpy(snapshot->last_path + shared, node->path + shared, suffix);
+  snapshot->last_length = node->length;
+}
+
+static void snapshot_unlink(struct snapshot* snapshot, UInt32 index)
+{
+  struct snapshot_node* node = &snapshot->nodes[index];
+
+  if (node->prev_sibling != SNAPSHOT_NONE) {
+    snapshot->nodes[node->prev_sibling].next_sibling = node->next_sibling;
+  } else if (node->parent != SNAPSHOT_NONE) {
+    snapshot->nodes[node->parent].first_child = node->next_sibling;
+  }
+  if (node->next_sibling != SNAPSHOT_NONE) {
+    snapshot->nodes[node->next_sibling].prev_sibling = node->prev_sibling;
+  }
+
+  UInt32* link = &snapshot->buckets[node->hash & (snapshot->num_buckets - 1)];
+  while (*link != index) {
+    link = &snapshot->nodes[*link].hash_next;
+  }
+  *link = node->hash_next;
+}
+
+static void snapshot_free_node(struct snapshot* snapshot, UInt32 index, bool report)
+{
+  struct snapshot_node* node = &snapshot->nodes[index];
+
+  while (node->first_child != SNAPSHOT_NONE) {
+    UInt32 child = node->first_child;
+    node->first_child = snapshot->nodes[child].next_sibling;
+    snapshot_free_node(snapshot, child, report);
+    node = &snapshot->nodes[index];
+  }
+
+  if (report) {
+    snapshot_add_change(snapshot, node->path,
+                        kFSEventStreamEventFlagItemRemoved | snapshot_type(node->st.mode));
+  }
+
+  free(node->path);
+  node->path = NULL;
+  node->next_sibling = snapshot->free_nodes;
+  snapshot->free_nodes = index;
+  snapshot->live_nodes--;
+}
+
+// Drop an entry and everything below it
+static void snapshot_remove(struct snapshot* snapshot, UInt32 index, bool report)
+{
+  if (report) {
+    snapshot_record(snapshot, 'D', &snapshot->nodes[index]);
+  }
+  snapshot_unlink(snapshot, index);
+  snapshot_free_node(snapshot, index, report);
+}
+
+static void snapshot_remove_children(struct snapshot* snapshot, UInt32 index, bool report)
+{
+  while (snapshot->nodes[index].first_child != SNAPSHOT_NONE) {
+    snapshot_remove(snapshot, snapshot->nodes[index].first_child, report);
+  }
+}
+
+static bool snapshot_is_root(const struct snapshot* snapshot, const char* path, size_t length)
+{
+  for (size_t i = 0; i < snapshot->num_roots; i++) {
+    if (strlen(snapshot->roots[i]) == length && memcmp(snapshot->roots[i], path, length) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static size_t snapshot_dirname(const char* path, size_t length)
+{
+  while (length > 1 && path[length - 1] != '/') {
+    length--;
+  }
+  return length > 1 ? length - 1 : length;
+}
+
+// Apply a 'U' record read back from disk
+static void snapshot_load_entry(struct snapshot* snapshot, const char* path, size_t length,
+                                const struct scanner_stat* st, UInt8 flags)
+{
+  UInt32 index = snapshot_lookup(snapshot, path, length);
+  if (index != SNAPSHOT_NONE) {
+    snapshot->nodes[index].st = *st;
+    snapshot->nodes[index].flags = flags;
+    return;
+  }
+
+  UInt32 parent = SNAPSHOT_NONE;
+  if (length > 1) {
+    parent = snapshot_lookup(snapshot, path, snapshot_dirname(path, length));
+  }
+  // entries below what is no longer watched are left behind
+  if (parent != SNAPSHOT_NONE || snapshot_is_root(snapshot, path, length)) {
+    snapshot_insert(snapshot, path, length, parent, st, flags);
+  }
+}
+
+// Returns the number of records read, or 0 if the file ends in a partial one
+static size_t snapshot_load(struct snapshot* snapshot, const char* bytes, size_t length)
+{
+  size_t numRecords = 0;
+  const char* p = bytes + sizeof(SNAPSHOT_MAGIC) - 1;
+  const char* end = bytes + length;
+  char path[PATH_MAX];
+  size_t pathLength = 0;
+
+  while (end - p >= SNAPSHOT_RECORD_SIZE) {
+    char type = p[0];
+    UInt8 flags = (UInt8)p[1];
+    UInt16 shared, suffix;
+    memcpy(&shared, p + 2, 2);
+    memcpy(&suffix, p + 4, 2);
+
+    size_t size = SNAPSHOT_RECORD_SIZE + suffix + (type == 'U' ? SNAPSHOT_STAT_SIZE : 0);
+    if ((type != 'U' && type != 'D') || shared > pathLength ||
+        (size_t)shared + suffix >= PATH_MAX || (size_t)(end - p) < size) {
+      break;
+    }
+
+    memcpy(path + shared, p + SNAPSHOT_RECORD_SIZE, suffix);
+    pathLength = (size_t)shared + suffix;
+    path[pathLength] = '\0';
+
+    if (type == 'U') {
+      const char* q = p + SNAPSHOT_RECORD_SIZE + suffix;
+      struct scanner_stat st;
+      memcpy(&st.ino, q, 8);
+      memcpy(&st.size, q + 8, 8);
+      memcpy(&st.mtime, q + 16, 8);
+      memcpy(&st.mode, q + 24, 4);
+      snapshot_load_entry(snapshot, path, pathLength, &st, flags);
+    } else {
+      UInt32 index = snapshot_lookup(snapshot, path, pathLength);
+      if (index != SNAPSHOT_NONE) {
+        snapshot_unlink(snapshot, index);
+        snapshot_free_node(snapshot, index, false);
+      }
+    }
+
+    p += size;
+    numRecords++;
+  }
+
+  memcpy(snapshot->last_path, path, pathLength);
+  snapshot->last_length = pathLength;
+  return p == end ? numRecords : 0;
+}
+
+// Scanner callbacks, called from its threads while the tree is only read
+
+static bool snapshot_scanner_prune(void* info, const char* path)
+{
+  const struct snapshot* snapshot = info;
+  return snapshot->prune(path);
+}
+
+// A directory whose inode and mtime are the ones recorded when it was read
+// still has the entries recorded for it
+static size_t snapshot_scanner_cached(void* info, UInt32 tag, const struct scanner_stat* st,
+                                      const char** names, size_t capacity)
+{
+  const struct snapshot* snapshot = info;
+  if (tag == SNAPSHOT_NONE) {
+    return SIZE_MAX;
+  }
+
+  const struct snapshot_node* node = &snapshot->nodes[tag];
+  if (!(node->flags & SNAPSHOT_LISTED) || node->st.ino != st->ino || node->st.mtime != st->mtime) {
+    return SIZE_MAX;
+  }
+
+  size_t offset = node->length == 1 ? 1 : node->length + 1;
+  size_t count = 0;
+  for (UInt32 c = node->first_child; c != SNAPSHOT_NONE; c = snapshot->nodes[c].next_sibling) {
+    if (count < capacity) {
+      names[count] = snapshot->nodes[c].path + offset;
+    }
+    count++;
+  }
+  return count;
+}
+
+// Every directory below a recursive scan, and otherwise the ones whose
+// entries aren't all recorded yet
+static bool snapshot_scanner_descend(void* info, const char* path, size_t length, UInt32* tag)
+{
+  const struct snapshot* snapshot = info;
+  *tag = snapshot_lookup(snapshot, path, length);
+  return snapshot->recursive || *tag == SNAPSHOT_NONE ||
+         !(snapshot->nodes[*tag].flags & SNAPSHOT_LISTED);
+}
+
+// Bring a directory's entries in line with what a walk found in it. Parents
+// are applied before their children, so new directories are in the tree by
+// the time their own entries come up.
+static void snapshot_apply(struct snapshot* snapshot, const struct scanner_dir* dir)
+{
+  UInt32 index = snapshot_lookup(snapshot, dir->path, dir->length);
+  if (index == SNAPSHOT_NONE || dir->state == kScannerDirUnreadable) {
+    return;
+  }
+
+  if (dir->state == kScannerDirGone) {
+    snapshot_remove_children(snapshot, index, true);
+    return;
+  }
+
+  UInt32 generation = ++snapshot->generation;
+  char path[PATH_MAX];
+
+  for (size_t i = 0; i < dir->num_entries; i++) {
+    const struct scanner_entry* entry = &dir->entries[i];
+    const char* name = dir->names + entry->name;
+    size_t length = snapshot_join(path, dir->path, dir->length, name, strlen(name));
+    UInt32 child = snapshot_lookup(snapshot, path, length);
+    FSEventStreamEventFlags type = snapshot_type(entry->st.mode);
+
+    if (child == SNAPSHOT_NONE) {
+      child = snapshot_insert(snapshot, path, length, index, &entry->st, 0);
+      snapshot_add_change(snapshot, path, kFSEventStreamEventFlagItemCreated | type);
+      snapshot_record(snapshot, 'U', &snapshot->nodes[child]);
+    } else {
+      struct snapshot_node* node = &snapshot->nodes[child];
+
+      if (node->st.ino != entry->st.ino || snapshot_type(node->st.mode) != type) {
+        // replaced by something else under the same name
+        snapshot_remove_children(snapshot, child, true);
+        node = &snapshot->nodes[child];
+        node->st = entry->st;
+        node->flags = 0;
+        snapshot_add_change(snapshot, path, kFSEventStreamEventFlagItemRemoved |
+                                            kFSEventStreamEventFlagItemCreated | type);
+        snapshot_record(snapshot, 'U', node);
+      } else if (node->st.size != entry->st.size || node->st.mtime != entry->st.mtime ||
+                 node->st.mode != entry->st.mode) {
+        // a directory's own mtime changes with its entries, which speak for themselves
+        if (!S_ISDIR(entry->st.mode) || node->st.mode != entry->st.mode) {
+          snapshot_add_change(snapshot, path, kFSEventStreamEventFlagItemModified | type);
+        }
+        node->st = entry->st;
+        snapshot_record(snapshot, 'U', node);
+      }
+    }
+
+    snapshot->nodes[child].generation = generation;
+  }
+
+  UInt32 child = snapshot->nodes[index].first_child;
+  while (child != SNAPSHOT_NONE) {
+    UInt32 next = snapshot->nodes[child].next_sibling;
+    if (snapshot->nodes[child].generation != generation) {
+      snapshot_remove(snapshot, child, true);
+    }
+    child = next;
+  }
+
+  // a directory changed in the same second it was read may change again
+  // without its mtime moving
+  struct snapshot_node* node = &snapshot->nodes[index];
+  UInt8 flags = dir->st.mtime < snapshot->scan_started - 1000000000LL ? SNAPSHOT_LISTED : 0;
+  if (node->flags != flags) {
+    node->flags = flags;
+    snapshot_record(snapshot, 'U', node);
+  }
+}
+
+static bool snapshot_write_all(int fd, const char* bytes, size_t length)
+{
+  while (length > 0) {
+    ssize_t written = write(fd, bytes, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += written;
+    length -= (size_t)written;
+  }
+  return true;
+}
+
+bool snapshot_flush(struct snapshot* snapshot)
+{
+  if (!snapshot->path || snapshot->log_len == 0) {
+    return true;
+  }
+
+  bool written = snapshot_write_all(snapshot->fd, snapshot->log, snapshot->log_len);
+  snapshot->log_bytes += snapshot->log_len;
+  snapshot->log_len = 0;
+  if (!written) {
+    return false;
+  }
+
+  if (snapshot->log_bytes > SNAPSHOT_COMPACT_BYTES && snapshot->log_bytes > snapshot->base_bytes) {
+    return snapshot_save(snapshot);
+  }
+  return true;
+}
+
+static void snapshot_walk(struct snapshot* snapshot, const char* path, UInt32 node, bool recursive)
+{
+  size_t numDirs;
+  snapshot->recursive = recursive;
+  struct scanner_dir* const* dirs = scanner_scan(snapshot->scanner, path, node, recursive, &numDirs);
+
+  for (size_t i = 0; i < numDirs; i++) {
+    snapshot_apply(snapshot, dirs[i]);
+  }
+}
+
+
+void snapshot_scan(struct snapshot* snapshot,
+                   const char* path,
+                   bool recursive,
+                   size_t* numChanges,
+                   char*** paths,
+                   const FSEventStreamEventFlags** flags)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  snapshot->scan_started = (SInt64)now.tv_sec * 1000000000 + now.tv_nsec;
+
+  snapshot_clear_changes(snapshot);
+  *numChanges = 0;
+  *paths = snapshot->paths;
+  *flags = snapshot->flags;
+
+  size_t length = strlen(path);
+  if (length == 0 || length >= PATH_MAX) {
+    return;
+  }
+  while (length > 1 && path[length - 1] == '/') {
+    length--;
+  }
+
+  // a path the snapshot doesn't know yet turns up among its parent's entries
+  char* dir = snapshot_alloc(NULL, length + 1);
+  memcpy(dir, path, length);
+  dir[length] = '\0';
+  UInt32 index = snapshot_lookup(snapshot, dir, length);
+  while (index == SNAPSHOT_NONE && !snapshot_is_root(snapshot, dir, length)) {
+    if (length == 1) {
+      free(dir);
+      return;
+    }
+    length = snapshot_dirname(dir, length);
+    dir[length] = '\0';
+    index = snapshot_lookup(snapshot, dir, length);
+  }
+
+  struct stat st;
+  if (lstat(dir, &st) != 0) {
+    if (index != SNAPSHOT_NONE) {
+      if (snapshot->nodes[index].parent == SNAPSHOT_NONE) {
+        snapshot_remove_children(snapshot, index, true);
+      } else {
+        snapshot_remove(snapshot, index, true);
+      }
+    }
+  } else {
+    struct scanner_stat current;
+    scanner_stat_from(&current, &st);
+
+    if (index == SNAPSHOT_NONE) {
+      index = snapshot_insert(snapshot, dir, length, SNAPSHOT_NONE, &current, 0);
+      snapshot_record(snapshot, 'U', &snapshot->nodes[index]);
+    } else if (memcmp(&snapshot->nodes[index].st, &current, sizeof(current)) != 0) {
+      if (!S_ISDIR(st.st_mode)) {
+        snapshot_add_change(snapshot, dir, kFSEventStreamEventFlagItemModified |
+                                           snapshot_type(current.mode));
+      }
+      snapshot->nodes[index].st = current;
+      snapshot_record(snapshot, 'U', &snapshot->nodes[index]);
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      snapshot_walk(snapshot, dir, index, recursive);
+    } else {
+      snapshot_remove_children(snapshot, index, true);
+    }
+  }
+  free(dir);
+
+  *numChanges = snapshot->num_changes;
+  *paths = snapshot->paths;
+  *flags = snapshot->flags;
+}
+
+// qsort has no portable way to pass the node array along
+static const struct snapshot_node* snapshot_sort_nodes;
+
+static int snapshot_compare_children(const void* a, const void* b)
+{
+  return strcmp(snapshot_sort_nodes[*(const UInt32*)a].path,
+                snapshot_sort_nodes[*(const UInt32*)b].path);
+}
+
+// Records for an entry and everything below it, children sorted by name
+static void snapshot_save_node(struct snapshot* snapshot, UInt32 index)
+{
+  snapshot_record(snapshot, 'U', &snapshot->nodes[index]);
+
+  size_t count = 0;
+  for (UInt32 c = snapshot->nodes[index].first_child; c != SNAPSHOT_NONE;
+       c = snapshot->nodes[c].next_sibling) {
+    count++;
+  }
+  if (count == 0) {
+    return;
+  }
+
+  UInt32* children = snapshot_alloc(NULL, count * sizeof(UInt32));
+  count = 0;
+  for (UInt32 c = snapshot->nodes[index].first_child; c != SNAPSHOT_NONE;
+       c = snapshot->nodes[c].next_sibling) {
+    children[count++] = c;
+  }
+  snapshot_sort_nodes = snapshot->nodes;
+  qsort(children, count, sizeof(UInt32), snapshot_compare_children);
+
+  for (size_t i = 0; i < count; i++) {
+    snapshot_save_node(snapshot, children[i]);
+  }
+  free(children);
+}
+
+bool snapshot_save(struct snapshot* snapshot)
+{
+  if (!snapshot->path) {
+    return true;
+  }
+
+  char temporary[PATH_MAX];
+  if ((size_t)snprintf(temporary, sizeof(temporary), "%s.tmp", snapshot->path) >= sizeof(temporary)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+
+  snapshot->log_len = 0;
+  snapshot->last_length = 0;
+  for (UInt32 i = 0; i < snapshot->num_nodes; i++) {
+    if (snapshot->nodes[i].path && snapshot->nodes[i].parent == SNAPSHOT_NONE) {
+      snapshot_save_node(snapshot, i);
+    }
+  }
+
+  int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  bool written = snapshot_write_all(fd, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1) &&
+                 snapshot_write_all(fd, snapshot->log, snapshot->log_len);
+  if (!written || rename(temporary, snapshot->path) != 0) {
+    int error = errno;
+    close(fd);
+    unlink(temporary);
+    snapshot->log_len = 0;
+    errno = error;
+    return false;
+  }
+
+  // the rest of this run's changes are appended to the new file
+  if (snapshot->fd >= 0) {
+    close(snapshot->fd);
+  }
+  snapshot->fd = fd;
+  snapshot->base_bytes = sizeof(SNAPSHOT_MAGIC) - 1 + snapshot->log_len;
+  snapshot->log_bytes = 0;
+  snapshot->log_len = 0;
+  return true;
+}
+
+struct snapshot* snapshot_open(const char* path,
+                               char** roots,
+                               size_t numRoots,
+                               snapshot_prune_callback prune)
+{
+  struct snapshot* snapshot = calloc(1, sizeof(struct snapshot));
+  if (!snapshot) {
+    return NULL;
+  }
+
+  snapshot->fd = -1;
+  snapshot->lock_fd = -1;
+  snapshot->free_nodes = SNAPSHOT_NONE;
+  snapshot->prune = prune;
+  snapshot->roots = roots;
+  snapshot->num_roots = numRoots;
+
+  struct scanner_callbacks callbacks = {
+    snapshot,
+    prune ? snapshot_scanner_prune : NULL,
+    snapshot_scanner_cached,
+    snapshot_scanner_descend
+  };
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  snapshot->scanner = scanner_create(cpus < 1 ? 1 : (int)(cpus < SCANNER_MAX_THREADS ? cpus : SCANNER_MAX_THREADS),
+                                     &callbacks);
+
+  if (!path) {
+    return snapshot;
+  }
+  snapshot->path = strdup(path);
+
+  // the snapshot is replaced when it's compacted, so the lock lives beside it
+  char lockPath[PATH_MAX];
+  if ((size_t)snprintf(lockPath, sizeof(lockPath), "%s.lock", path) >= sizeof(lockPath)) {
+    errno = ENAMETOOLONG;
+    goto fail;
+  }
+  snapshot->lock_fd = open(lockPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (snapshot->lock_fd < 0 || flock(snapshot->lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    goto fail;
+  }
+
+  snapshot->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (snapshot->fd < 0) {
+    goto fail;
+  }
+
+  struct stat st;
+  if (fstat(snapshot->fd, &st) != 0) {
+    goto fail;
+  }
+
+  size_t length = (size_t)st.st_size;
+  char* bytes = length ? malloc(length) : NULL;
+  size_t got = 0;
+  while (bytes && got < length) {
+    ssize_t n = pread(snapshot->fd, bytes + got, length - got, (off_t)got);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    got += (size_t)n;
+  }
+
+  // anything but a snapshot is started over, and one ending in a partial
+  // record, or holding more changes than entries, is compacted
+  bool valid = got == length && length >= sizeof(SNAPSHOT_MAGIC) - 1 &&
+               memcmp(bytes, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1) == 0;
+  size_t numRecords = 0;
+  if (valid) {
+    numRecords = snapshot_load(snapshot, bytes, length);
+  }
+  free(bytes);
+
+  if (!valid || (length > sizeof(SNAPSHOT_MAGIC) - 1 && numRecords == 0) ||
+      numRecords > 2 * snapshot->live_nodes + 1024) {
+    if (!snapshot_save(snapshot)) {
+      goto fail;
+    }
+  } else {
+    snapshot->base_bytes = length;
+  }
+
+  return snapshot;
+
+fail:
+  {
+    int error = errno;
+    snapshot_close(snapshot);
+    errno = error;
+  }
+  return NULL;
+}
+
+void snapshot_close(struct snapshot* snapshot)
+{
+  if (snapshot->fd >= 0) {
+    close(snapshot->fd);
+  }
+  if (snapshot->lock_fd >= 0) {
+    close(snapshot->lock_fd);
+  }
+  scanner_release(snapshot->scanner);
+  for (size_t i = 0; i < snapshot->num_nodes; i++) {
+    free(snapshot->nodes[i].path);
+  }
+  snapshot_clear_changes(snapshot);
+  free(snapshot->nodes);
+  free(snapshot->buckets);
+  free(snapshot->log);
+  free(snapshot->paths);
+  free(snapshot->flags);
+  free(snapshot->path);
+  free(snapshot);
+}
+
+bool snapshot_has(const struct snapshot* snapshot, const char* path)
+{
+  size_t length = strlen(path);
+  while (length > 1 && path[length - 1] == '/') {
+    length--;
+  }
+  return snapshot_lookup(snapshot, path, length) != SNAPSHOT_NONE;
+}
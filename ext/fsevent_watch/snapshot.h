@@ -0,0 +1,88 @@
+/**
+ * @headerfile snapshot.h
+ * --snapshot and --crawl: the state of the watched trees, kept on disk
+ * between runs or just in memory
+ *
+ * Whatever changed while fsevent_watch wasn't running, or while the event
+ * source was dropping events, would otherwise cost every reader a rescan of
+ * its own. With --snapshot=PATH the (path, inode, size, mtime) of everything
+ * under the roots is kept in memory and in PATH. Scanning a path diffs the
+ * tree below it against what the snapshot holds, updates the snapshot, and
+ * reports each difference as an item created, removed or modified event.
+ *
+ * With --crawl alone the same happens without PATH, so only dropped events
+ * are caught up on.
+ *
+ * Directories are walked by the scanner's threads (see scanner.h). A
+ * directory whose inode and mtime are the ones recorded still has the
+ * entries recorded for it, so it isn't read again; its entries are still
+ * stat()ed, since writing a file doesn't touch its directory's mtime.
+ * Directories modified within a second of being read are always read again
+ * next time, so a change landing in the same mtime tick as a scan can't be
+ * missed.
+ *
+ * PATH starts with the magic "FSWSNAP1", followed by records:
+ *
+ *   u8   'U' (an entry and its stat) or 'D' (an entry and everything below
+ *        it is gone)
+ *   u8   flags, 1 when a directory's entries are all recorded
+ *   u16  bytes of the previous record's path this one shares
+ *   u16  bytes of path that follow
+ *        the rest of the path
+ *   'U' records go on with u64 inode, u64 size, s64 mtime in nanoseconds
+ *   and u32 mode
+ *
+ * every field in host byte order. Compaction writes every entry, parents
+ * first and sorted within directories, so shared prefixes keep it small. The
+ * changes found by later scans are held until snapshot_flush appends them
+ * with a single write, and it is compacted again once they outgrow it. A
+ * truncated record at the end of PATH is dropped when it's next opened, so a
+ * killed fsevent_watch loses at most the changes it hadn't flushed.
+ */
+
+#ifndef fsevent_watch_snapshot_h
+#define fsevent_watch_snapshot_h
+
+#include "common.h"
+
+#define SNAPSHOT_MAGIC        "FSWSNAP1"
+
+struct snapshot;
+
+// Whether a path, and everything below it, is left out of the snapshot
+typedef bool (*snapshot_prune_callback)(const char* path);
+
+// Load the snapshot at path, or start an empty one, keeping the entries
+// below roots. A NULL path keeps the snapshot in memory only, for --crawl.
+// Returns NULL with errno set when it can't be used, including EWOULDBLOCK
+// when another process has it open.
+struct snapshot* snapshot_open(const char* path,
+                               char** roots,
+                               size_t numRoots,
+                               snapshot_prune_callback prune);
+void snapshot_close(struct snapshot* snapshot);
+
+// Whether path was in the snapshot, so scanning it reports real differences
+// rather than the whole tree
+bool snapshot_has(const struct snapshot* snapshot, const char* path);
+
+// Diff path against the snapshot and bring the snapshot up to date: the
+// whole tree below it when recursive, otherwise the directory's entries and
+// any directories that are new. The differences are left in paths and flags,
+// valid until the next scan.
+void snapshot_scan(struct snapshot* snapshot,
+                   const char* path,
+                   bool recursive,
+                   size_t* numChanges,
+                   char*** paths,
+                   const FSEventStreamEventFlags** flags);
+
+// Append the changes of the scans since the last flush to PATH, compacting
+// it when they've grown larger than it. False, with errno set, if they
+// couldn't be written.
+bool snapshot_flush(struct snapshot* snapshot);
+
+// Rewrite PATH from the snapshot in memory, dropping the appended changes
+bool snapshot_save(struct snapshot* snapshot);
+
+#endif // fsevent_watch_snapshot_h
@@ -0,0 +1,223 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+struct stats stats;
+
+static UInt64 stats_started;
+static int stats_pipe[2] = {-1, -1};
+static int stats_interval_ms = -1;
+
+// what stats_arrivals was last told, for stats_take_arrivals
+static const double* stats_times = NULL;
+static size_t stats_num_times = 0;
+
+UInt64 stats_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (UInt64)ts.tv_sec * 1000000000 + (UInt64)ts.tv_nsec;
+}
+
+void stats_arrivals(const double* times, size_t numEvents)
+{
+  stats_times = times;
+  stats_num_times = numEvents;
+}
+
+static void stats_record_latency(UInt64 latency_us)
+{
+  int bucket = 0;
+  while (bucket < STATS_HISTOGRAM_BUCKETS - 1 && latency_us >= (2ULL << bucket)) {
+    bucket++;
+  }
+  stats_add(&stats.latency[bucket], 1);
+  stats_max(&stats.max_latency_us, latency_us);
+}
+
+const double* stats_take_arrivals(size_t numEvents)
+{
+  const double* times = stats_num_times == numEvents ? stats_times : NULL;
+  stats_times = NULL;
+  stats_num_times = 0;
+  return times;
+}
+
+void stats_adaptive(double window, double shortest, double rate)
+{
+  stats_add(window > shortest ? &stats.adaptive_stretched : &stats.adaptive_immediate, 1);
+  atomic_store_explicit(&stats.adaptive_window_us, (UInt64)(window * 1e6), memory_order_relaxed);
+  atomic_store_explicit(&stats.adaptive_rate, (UInt64)rate, memory_order_relaxed);
+}
+
+void stats_delivered(const double* times, size_t numEvents)
+{
+  double now = (double)stats_now() / 1e9;
+
+  for (size_t i = 0; i < numEvents; i++) {
+    double latency = now - times[i];
+    stats_record_latency(latency > 0 ? (UInt64)(latency * 1e6) : 0);
+  }
+}
+
+// Smallest bucket bound that at least fraction of the events fall below,
+// or the largest latency seen if that's lower
+static UInt64 stats_percentile(const UInt64* buckets, UInt64 total, double fraction, UInt64 max)
+{
+  UInt64 seen = 0;
+  for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+    seen += buckets[i];
+    if (total > 0 && (double)seen >= fraction * (double)total) {
+      return (2ULL << i) < max ? (2ULL << i) : max;
+    }
+  }
+  return 0;
+}
+
+#define STATS_LOAD(name) \
+  ((unsigned long long)atomic_load_explicit(&stats.name, memory_order_relaxed))
+
+void stats_dump(int fd)
+{
+  char line[2048];
+  UInt64 buckets[STATS_HISTOGRAM_BUCKETS];
+  UInt64 total = 0;
+  UInt64 max = atomic_load_explicit(&stats.max_latency_us, memory_order_relaxed);
+  int used = 0;
+
+  for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+    buckets[i] = atomic_load_explicit(&stats.latency[i], memory_order_relaxed);
+    total += buckets[i];
+    if (buckets[i]) {
+      used = i + 1;
+    }
+  }
+
+  int length = snprintf(line, sizeof(line),
+                        "{\"uptime_s\":%.3f,\"events_received\":%llu,\"events_emitted\":%llu,"
+                        "\"events_filtered\":%llu,\"events_coalesced\":%llu,\"events_unchanged\":%llu,"
+                        "\"events_dropped\":%llu,\"events_overflowed\":%llu,\"batches\":%llu,"
+                        "\"writes\":%llu,\"bytes_written\":%llu,\"encode_ms\":%.3f,"
+                        "\"write_ms\":%.3f,\"max_batch\":%llu,\"max_queued\":%llu,"
+                        "\"adaptive\":{\"immediate\":%llu,\"stretched\":%llu,\"window_ms\":%.1f,"
+                        "\"rate\":%llu},\"latency_us\":{\"p50\":%llu,\"p90\":%llu,"
+                        "\"p99\":%llu,\"max\":%llu,\"buckets\":[",
+                        (double)(stats_now() - stats_started) / 1e9,
+                        STATS_LOAD(events_received), STATS_LOAD(events_emitted),
+                        STATS_LOAD(events_filtered), STATS_LOAD(events_coalesced),
+                        STATS_LOAD(events_unchanged),
+                        STATS_LOAD(events_dropped), STATS_LOAD(events_overflowed),
+                        STATS_LOAD(batches), STATS_LOAD(writes), STATS_LOAD(bytes_written),
+                        (double)STATS_LOAD(encode_ns) / 1e6, (double)STATS_LOAD(write_ns) / 1e6,
+                        STATS_LOAD(max_batch), STATS_LOAD(max_queued),
+                        STATS_LOAD(adaptive_immediate), STATS_LOAD(adaptive_stretched),
+                        (double)STATS_LOAD(adaptive_window_us) / 1e3, STATS_LOAD(adaptive_rate),
+                        (unsigned long long)stats_percentile(buckets, total, 0.5, max),
+                        (unsigned long long)stats_percentile(buckets, total, 0.9, max),
+                        (unsigned long long)stats_percentile(buckets, total, 0.99, max),
+                        (unsigned long long)max);
+
+  for (int i = 0; i < used && length < (int)sizeof(line); i++) {
+    length += snprintf(line + length, sizeof(line) - (size_t)length, "%s%llu",
+                       i ? "," : "", (unsigned long long)buckets[i]);
+  }
+  if (length < (int)sizeof(line)) {
+    length += snprintf(line + length, sizeof(line) - (size_t)length, "]}}\n");
+  }
+  if (length > (int)sizeof(line)) {
+    length = (int)sizeof(line);
+  }
+
+  // one write, so the line doesn't interleave with other stderr output
+  while (write(fd, line, (size_t)length) < 0 && errno == EINTR) {
+  }
+}
+
+static void stats_signal(__attribute__((unused)) int sig)
+{
+  int saved = errno;
+  char byte = 0;
+  if (write(stats_pipe[1], &byte, 1) < 0) {
+    // the pipe is full, so a dump is already on its way
+  }
+  errno = saved;
+}
+
+static void* stats_thread(__attribute__((unused)) void* info)
+{
+  sigset_t usr1;
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
+
+  struct pollfd pfd = {stats_pipe[0], POLLIN, 0};
+  UInt64 next = stats_now() + (UInt64)stats_interval_ms * 1000000;
+
+  for (;;) {
+    int timeout = -1;
+    if (stats_interval_ms > 0) {
+      UInt64 now = stats_now();
+      timeout = next > now ? (int)((next - now) / 1000000) + 1 : 0;
+    }
+
+    int ready = poll(&pfd, 1, timeout);
+    if (ready < 0 && errno != EINTR) {
+      return NULL;
+    }
+
+    if (ready > 0) {
+      char bytes[64];
+      while (read(stats_pipe[0], bytes, sizeof(bytes)) > 0) {
+      }
+      stats_dump(STDERR_FILENO);
+    } else if (ready == 0) {
+      stats_dump(STDERR_FILENO);
+      next += (UInt64)stats_interval_ms * 1000000;
+    }
+  }
+}
+
+bool stats_start(double interval)
+{
+  stats_started = stats_now();
+  stats_interval_ms = interval > 0 ? (int)(interval * 1000) : 0;
+  if (interval > 0 && stats_interval_ms == 0) {
+    stats_interval_ms = 1;
+  }
+
+  if (pipe(stats_pipe) != 0) {
+    return false;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(stats_pipe[i], F_SETFL, O_NONBLOCK);
+    fcntl(stats_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  // every thread started from here on inherits the blocked signal, leaving
+  // it to the statistics thread
+  sigset_t usr1;
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stats_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGUSR1, &action, NULL) != 0) {
+    return false;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, stats_thread, NULL) != 0) {
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
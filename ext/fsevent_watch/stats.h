@@ -0,0 +1,99 @@
+/**
+ * @headerfile stats.h
+ * Runtime statistics, dumped on SIGUSR1 and every --stats seconds
+ *
+ * Counters are updated where the events pass through, with relaxed atomic
+ * adds, and read by a thread of their own that does nothing but wait for
+ * SIGUSR1 or the --stats interval and write them to stderr as one line of
+ * JSON:
+ *
+ *   {"uptime_s":12.5,"events_received":1200,"events_emitted":950,...,
+ *    "latency_us":{"p50":...,"p99":...,"max":...,"buckets":[...]}}
+ *
+ * The latency histogram covers each event from the moment fsevent_watch
+ * read it from the kernel to the moment the writer thread wrote its batch
+ * out, so it includes the --latency window and any time spent queued.
+ * FSEvents only hands events over once that window is through, so on OS X
+ * it covers the time from the stream callback on. Bucket i counts
+ * latencies below 2^(i+1) microseconds.
+ *
+ * SIGUSR1 is only ever handled by the statistics thread, so it never
+ * interrupts the event loop.
+ */
+
+#ifndef fsevent_watch_stats_h
+#define fsevent_watch_stats_h
+
+#include "common.h"
+
+#include <stdatomic.h>
+
+#define STATS_HISTOGRAM_BUCKETS   32
+
+struct stats {
+  atomic_uint_fast64_t    events_received;
+  atomic_uint_fast64_t    events_emitted;
+  atomic_uint_fast64_t    events_filtered;
+  atomic_uint_fast64_t    events_coalesced;
+  atomic_uint_fast64_t    events_unchanged;   // dropped by --content-hash
+  atomic_uint_fast64_t    events_dropped;     // MustScanSubDirs or *Dropped set
+  atomic_uint_fast64_t    events_overflowed;  // --overflow coalesced or dropped
+  atomic_uint_fast64_t    batches;
+  atomic_uint_fast64_t    writes;
+  atomic_uint_fast64_t    bytes_written;
+  atomic_uint_fast64_t    encode_ns;
+  atomic_uint_fast64_t    write_ns;
+  atomic_uint_fast64_t    max_batch;
+  atomic_uint_fast64_t    max_queued;
+  // --adaptive-latency batches sent after the shortest window, and after a
+  // longer one, and the window and event rate of the last
+  atomic_uint_fast64_t    adaptive_immediate;
+  atomic_uint_fast64_t    adaptive_stretched;
+  atomic_uint_fast64_t    adaptive_window_us;
+  atomic_uint_fast64_t    adaptive_rate;
+  atomic_uint_fast64_t    latency[STATS_HISTOGRAM_BUCKETS];
+  atomic_uint_fast64_t    max_latency_us;
+};
+
+extern struct stats stats;
+
+static inline void stats_add(atomic_uint_fast64_t* counter, UInt64 n)
+{
+  atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static inline void stats_max(atomic_uint_fast64_t* counter, UInt64 n)
+{
+  // each of these is only ever raised by one thread, so no CAS loop
+  if (n > atomic_load_explicit(counter, memory_order_relaxed)) {
+    atomic_store_explicit(counter, n, memory_order_relaxed);
+  }
+}
+
+// Monotonic clock, in nanoseconds
+UInt64 stats_now(void);
+
+// When each event of the batch about to reach the stream callback was read,
+// in event_batch_now() seconds
+void stats_arrivals(const double* times, size_t numEvents);
+
+// What stats_arrivals said about the batch the stream callback got, or NULL
+// if the event source didn't say, in which case it read the batch just now
+const double* stats_take_arrivals(size_t numEvents);
+
+// Record what --adaptive-latency chose for a batch about to be delivered:
+// its window, the shortest there is, and the event rate that led to it
+void stats_adaptive(double window, double shortest, double rate);
+
+// Record the latency of every event of a batch just written out, given when
+// each was read
+void stats_delivered(const double* times, size_t numEvents);
+
+// Start the thread dumping statistics on SIGUSR1, and every interval
+// seconds unless it's 0. Must be called before any other thread is started.
+bool stats_start(double interval);
+
+// Write the statistics to fd as one line of JSON
+void stats_dump(int fd);
+
+#endif // fsevent_watch_stats_h
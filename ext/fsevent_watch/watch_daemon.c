@@ -0,0 +1,860 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "cli.h"
+#include "output_encoder.h"
+#include "watch_daemon.h"
+#ifndef __APPLE__
+#include <poll.h>
+#include "fanotify_stream.h"
+#include "inotify_stream.h"
+#endif
+
+#define WATCH_DAEMON_MAX_REQUEST  (64 * 1024)
+#define WATCH_DAEMON_MAX_PENDING  (16 * 1024 * 1024)
+#define WATCH_DAEMON_NUM_FORMATS  (kFSEventWatchOutputFormatFrontCoded + 1)
+
+struct watch_daemon_client;
+
+// One event stream, shared by every subscription to the same root with the
+// same flags and latency
+struct watch_daemon_watch {
+  char*                         root;
+  FSEventStreamCreateFlags      flags;
+  CFTimeInterval                latency;
+#ifdef __APPLE__
+  FSEventStreamRef              stream;
+#else
+  struct inotify_stream*        inotify;
+  struct fanotify_stream*       fanotify;
+#endif
+  // the event source failed, so the watch only waits for its subscribers
+  // to go
+  bool                          broken;
+
+  struct watch_daemon_client**  subscribers;
+  size_t                        num_subscribers;
+  size_t                        subscribers_cap;
+
+  struct watch_daemon_watch*    next;
+};
+
+struct watch_daemon_client {
+  int                           fd;
+#ifdef __APPLE__
+  CFFileDescriptorRef           source;
+#endif
+  bool                          subscribed;
+  // hung up, or dropped; freed at the next sweep
+  bool                          dead;
+  enum FSEventWatchOutputFormat format;
+
+  char*                         request;
+  size_t                        request_len;
+  size_t                        request_cap;
+
+  struct watch_daemon_watch**   watches;
+  size_t                        num_watches;
+
+  // output the client hasn't read yet
+  char*                         pending;
+  size_t                        pending_len;
+  size_t                        pending_cap;
+
+  struct watch_daemon_client*   next;
+};
+
+static struct {
+  const char*                   path;
+  int                           fd;
+  enum FSEventWatchEventSource  event_source;
+  struct watch_daemon_watch*    watches;
+  struct watch_daemon_client*   clients;
+  struct output_encoder         encoder;
+  const char**                  roots;
+  size_t                        roots_capacity;
+} server;
+
+
+// Clients
+
+static void watch_daemon_drop(struct watch_daemon_client* client)
+{
+  if (!client->dead) {
+    client->dead = true;
+    // wakes the event loop up for the sweep, wherever this was called from
+    shutdown(client->fd, SHUT_RDWR);
+  }
+}
+
+static void watch_daemon_watch_writable(struct watch_daemon_client* client);
+
+static void watch_daemon_send(struct watch_daemon_client* client,
+                              const char* bytes, size_t length)
+{
+  if (client->dead) {
+    return;
+  }
+
+  // anything already pending has to go out first
+  while (client->pending_len == 0 && length > 0) {
+    ssize_t written = write(client->fd, bytes, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        watch_daemon_drop(client);
+        return;
+      }
+      break;
+    }
+    bytes += written;
+    length -= (size_t)written;
+  }
+
+  if (length == 0) {
+    return;
+  }
+
+  if (client->pending_len + length > WATCH_DAEMON_MAX_PENDING) {
+    fprintf(stderr, "dropping a client with %zu unread bytes\n", client->pending_len);
+    watch_daemon_drop(client);
+    return;
+  }
+
+  if (client->pending_len + length > client->pending_cap) {
+    size_t capacity = client->pending_cap ? client->pending_cap : 64 * 1024;
+    while (capacity < client->pending_len + length) {
+      capacity *= 2;
+    }
+    client->pending = realloc(client->pending, capacity);
+    if (!client->pending) {
+      fprintf(stderr, "Unable to allocate %zu bytes of client output\n", capacity);
+      exit(EXIT_FAILURE);
+    }
+    client->pending_cap = capacity;
+  }
+
+  memcpy(client->pending + client->pending_len, bytes, length);
+  client->pending_len += length;
+  watch_daemon_watch_writable(client);
+}
+
+static void watch_daemon_flush(struct watch_daemon_client* client)
+{
+  size_t sent = 0;
+
+  while (sent < client->pending_len) {
+    ssize_t written = write(client->fd, client->pending + sent, client->pending_len - sent);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        watch_daemon_drop(client);
+        return;
+      }
+      break;
+    }
+    sent += (size_t)written;
+  }
+
+  memmove(client->pending, client->pending + sent, client->pending_len - sent);
+  client->pending_len -= sent;
+}
+
+static void watch_daemon_callback(__attribute__((unused)) FSEventStreamRef streamRef,
+                                  void* clientCallBackInfo,
+                                  size_t numEvents,
+                                  void* eventPaths,
+                                  const FSEventStreamEventFlags eventFlags[],
+                                  const FSEventStreamEventId eventIds[])
+{
+  struct watch_daemon_watch* watch = clientCallBackInfo;
+  char** paths = eventPaths;
+
+  // every event of a watch is under its one root
+  if (numEvents > server.roots_capacity) {
+    server.roots_capacity = numEvents * 2;
+    server.roots = realloc(server.roots, server.roots_capacity * sizeof(const char*));
+    if (!server.roots) {
+      fprintf(stderr, "Unable to allocate %zu event roots\n", server.roots_capacity);
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (size_t i = 0; i < numEvents; i++) {
+    server.roots[i] = watch->root;
+  }
+
+  // encode once per format, however many subscribers share it
+  for (int format = 0; format < WATCH_DAEMON_NUM_FORMATS; format++) {
+    const char* bytes = NULL;
+    size_t length = 0;
+
+    for (size_t i = 0; i < watch->num_subscribers; i++) {
+      struct watch_daemon_client* client = watch->subscribers[i];
+      if (client->format != (enum FSEventWatchOutputFormat)format || client->dead) {
+        continue;
+      }
+      if (!bytes) {
+        bytes = output_encoder_encode(&server.encoder, client->format, numEvents,
+                                      paths, eventFlags, eventIds, server.roots, &length);
+      }
+      watch_daemon_send(client, bytes, length);
+    }
+  }
+}
+
+
+// Watches
+
+static void watch_daemon_watch_release(struct watch_daemon_watch* watch)
+{
+#ifdef __APPLE__
+  if (watch->stream) {
+    FSEventStreamStop(watch->stream);
+    FSEventStreamInvalidate(watch->stream);
+    FSEventStreamRelease(watch->stream);
+  }
+#else
+  if (watch->inotify) {
+    inotify_stream_release(watch->inotify);
+  }
+  if (watch->fanotify) {
+    fanotify_stream_release(watch->fanotify);
+  }
+#endif
+
+#ifdef DEBUG
+  fprintf(stderr, "daemon released watch: %s\n", watch->root);
+#endif
+
+  free(watch->subscribers);
+  free(watch->root);
+  free(watch);
+}
+
+static bool watch_daemon_watch_start(struct watch_daemon_watch* watch)
+{
+#ifdef __APPLE__
+  CFStringRef pathRef = CFStringCreateWithFileSystemRepresentation(kCFAllocatorDefault,
+                                                                   watch->root);
+  CFArrayRef paths = CFArrayCreate(NULL, (const void**)&pathRef, 1, &kCFTypeArrayCallBacks);
+  CFRelease(pathRef);
+
+  FSEventStreamContext context = {0, watch, NULL, NULL, NULL};
+  watch->stream = FSEventStreamCreate(kCFAllocatorDefault,
+                                      (FSEventStreamCallback)&watch_daemon_callback,
+                                      &context,
+                                      paths,
+                                      kFSEventStreamEventIdSinceNow,
+                                      watch->latency,
+                                      watch->flags);
+  CFRelease(paths);
+
+  if (!watch->stream) {
+    return false;
+  }
+
+  FSEventStreamScheduleWithRunLoop(watch->stream,
+                                   CFRunLoopGetCurrent(),
+                                   kCFRunLoopDefaultMode);
+  return FSEventStreamStart(watch->stream);
+#else
+  if (server.event_source == kFSEventWatchEventSourceFanotify) {
+    watch->fanotify = fanotify_stream_create((FSEventStreamCallback)&watch_daemon_callback,
+                                             watch, &watch->root, 1,
+                                             watch->latency, watch->flags);
+    return fanotify_stream_start(watch->fanotify);
+  }
+
+  watch->inotify = inotify_stream_create((FSEventStreamCallback)&watch_daemon_callback,
+                                         watch, &watch->root, 1,
+                                         watch->latency, watch->flags);
+  return inotify_stream_start(watch->inotify);
+#endif
+}
+
+// The watch for a root with these flags and latency, started if need be. A
+// broken one is never handed out again; a fresh watch is started beside it.
+static struct watch_daemon_watch* watch_daemon_watch_find(const char* root,
+                                                          FSEventStreamCreateFlags flags,
+                                                          CFTimeInterval latency)
+{
+  for (struct watch_daemon_watch* watch = server.watches; watch; watch = watch->next) {
+    if (!watch->broken && watch->flags == flags && watch->latency == latency &&
+        strcmp(watch->root, root) == 0) {
+      return watch;
+    }
+  }
+
+  struct watch_daemon_watch* watch = calloc(1, sizeof(struct watch_daemon_watch));
+  if (!watch || !(watch->root = strdup(root))) {
+    fprintf(stderr, "Unable to allocate a watch\n");
+    exit(EXIT_FAILURE);
+  }
+  watch->flags = flags;
+  watch->latency = latency;
+
+  if (!watch_daemon_watch_start(watch)) {
+    watch_daemon_watch_release(watch);
+    return NULL;
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "daemon started watch: %s\n", watch->root);
+#endif
+
+  watch->next = server.watches;
+  server.watches = watch;
+  return watch;
+}
+
+static void watch_daemon_subscribe(struct watch_daemon_client* client,
+                                   struct watch_daemon_watch* watch)
+{
+  for (size_t i = 0; i < client->num_watches; i++) {
+    if (client->watches[i] == watch) {
+      return;
+    }
+  }
+
+  if (watch->num_subscribers == watch->subscribers_cap) {
+    watch->subscribers_cap = watch->subscribers_cap ? watch->subscribers_cap * 2 : 4;
+    watch->subscribers = realloc(watch->subscribers,
+                                 watch->subscribers_cap * sizeof(struct watch_daemon_client*));
+  }
+  client->watches = realloc(client->watches,
+                            (client->num_watches + 1) * sizeof(struct watch_daemon_watch*));
+  if (!watch->subscribers || !client->watches) {
+    fprintf(stderr, "Unable to allocate a subscription\n");
+    exit(EXIT_FAILURE);
+  }
+
+  watch->subscribers[watch->num_subscribers++] = client;
+  client->watches[client->num_watches++] = watch;
+}
+
+static bool watch_daemon_option(const char* arg, size_t name_len,
+                                const char* name, const char* short_name)
+{
+  return (strlen(name) == name_len && strncmp(arg, name, name_len) == 0) ||
+         strcmp(arg, short_name) == 0;
+}
+
+// Parse a complete request and subscribe to everything it names. Returns
+// NULL on success, or why the request was refused.
+static const char* watch_daemon_request(struct watch_daemon_client* client)
+{
+  static char reason[PATH_MAX + 64];
+
+  CFTimeInterval latency = 0.5;
+  FSEventStreamCreateFlags flags = kFSEventStreamCreateFlagNone;
+  enum FSEventWatchOutputFormat format = kFSEventWatchOutputFormatClassic;
+  const char** paths = NULL;
+  size_t num_paths = 0;
+  const char* refusal = NULL;
+
+  // arguments are NUL terminated, and the request ends at an empty one
+  for (const char* arg = client->request; *arg && !refusal; arg += strlen(arg) + 1) {
+    if (arg[0] != '-') {
+      paths = realloc(paths, (num_paths + 1) * sizeof(const char*));
+      if (!paths) {
+        fprintf(stderr, "Unable to allocate a request\n");
+        exit(EXIT_FAILURE);
+      }
+      paths[num_paths++] = arg;
+      continue;
+    }
+
+    const char* value = strchr(arg, '=');
+    size_t name_len = value ? (size_t)(value - arg) : strlen(arg);
+    bool latency_option = watch_daemon_option(arg, name_len, "--latency", "-l");
+    bool format_option = watch_daemon_option(arg, name_len, "--format", "-f");
+
+    if (value) {
+      value++;
+    } else if (latency_option || format_option) {
+      value = arg + strlen(arg) + 1;
+      if (!*value) {
+        snprintf(reason, sizeof(reason), "%s needs a value", arg);
+        refusal = reason;
+        break;
+      }
+      arg = value;
+    }
+
+    if (latency_option) {
+      latency = strtod(value, NULL);
+    } else if (format_option) {
+      if (!cli_parse_format(value, &format)) {
+        snprintf(reason, sizeof(reason), "unknown format: %s", value);
+        refusal = reason;
+      } else if (format == kFSEventWatchOutputFormatInterned) {
+        // its path ids depend on everything one reader was sent before
+        refusal = "interned output can't be shared between subscribers";
+      }
+    } else if (watch_daemon_option(arg, name_len, "--no-defer", "-n")) {
+      flags |= kFSEventStreamCreateFlagNoDefer;
+    } else if (watch_daemon_option(arg, name_len, "--watch-root", "-r")) {
+      flags |= kFSEventStreamCreateFlagWatchRoot;
+    } else if (watch_daemon_option(arg, name_len, "--file-events", "-F")) {
+      flags |= kFSEventStreamCreateFlagFileEvents;
+    } else {
+      snprintf(reason, sizeof(reason), "unsupported in daemon mode: %.*s", (int)name_len, arg);
+      refusal = reason;
+    }
+  }
+
+  if (!refusal && num_paths == 0) {
+    refusal = "no paths given";
+  }
+
+  // every option applies to every path, wherever it was given
+  for (size_t i = 0; i < num_paths && !refusal; i++) {
+    char resolved[PATH_MAX];
+    if (paths[i][0] != '/' || !realpath(paths[i], resolved)) {
+      snprintf(reason, sizeof(reason), "no such absolute path: %s", paths[i]);
+      refusal = reason;
+      break;
+    }
+
+    struct watch_daemon_watch* watch = watch_daemon_watch_find(resolved, flags, latency);
+    if (!watch) {
+      snprintf(reason, sizeof(reason), "unable to watch %s", resolved);
+      refusal = reason;
+      break;
+    }
+    watch_daemon_subscribe(client, watch);
+  }
+
+  free(paths);
+  client->format = format;
+  return refusal;
+}
+
+static void watch_daemon_read(struct watch_daemon_client* client)
+{
+  char buffer[4096];
+
+  for (;;) {
+    ssize_t n = read(client->fd, buffer, sizeof(buffer));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        watch_daemon_drop(client);
+      }
+      return;
+    }
+    if (n == 0) {
+      watch_daemon_drop(client);
+      return;
+    }
+
+    // nothing is expected once subscribed
+    if (client->subscribed) {
+      continue;
+    }
+
+    if (client->request_len + (size_t)n > WATCH_DAEMON_MAX_REQUEST) {
+      watch_daemon_send(client, "error: request too long\n", 24);
+      watch_daemon_drop(client);
+      return;
+    }
+    if (client->request_len + (size_t)n > client->request_cap) {
+      client->request_cap = WATCH_DAEMON_MAX_REQUEST;
+      client->request = realloc(client->request, client->request_cap);
+      if (!client->request) {
+        fprintf(stderr, "Unable to allocate a request\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    memcpy(client->request + client->request_len, buffer, (size_t)n);
+    client->request_len += (size_t)n;
+
+    // complete once an empty argument ends it
+    bool complete = false;
+    for (size_t i = 0; i < client->request_len; i++) {
+      if (client->request[i] == '\0' && (i == 0 || client->request[i - 1] == '\0')) {
+        complete = true;
+        break;
+      }
+    }
+    if (!complete) {
+      continue;
+    }
+
+    const char* reason = watch_daemon_request(client);
+    if (reason) {
+      char reply[PATH_MAX + 128];
+      int length = snprintf(reply, sizeof(reply), "error: %s\n", reason);
+      watch_daemon_send(client, reply, (size_t)length < sizeof(reply) ? (size_t)length : sizeof(reply) - 1);
+      watch_daemon_drop(client);
+      return;
+    }
+
+    client->subscribed = true;
+    free(client->request);
+    client->request = NULL;
+    client->request_len = client->request_cap = 0;
+    watch_daemon_send(client, "ok\n", 3);
+  }
+}
+
+static void watch_daemon_client_free(struct watch_daemon_client* client)
+{
+  for (size_t i = 0; i < client->num_watches; i++) {
+    struct watch_daemon_watch* watch = client->watches[i];
+    for (size_t j = 0; j < watch->num_subscribers; j++) {
+      if (watch->subscribers[j] == client) {
+        watch->subscribers[j] = watch->subscribers[--watch->num_subscribers];
+        break;
+      }
+    }
+  }
+
+#ifdef __APPLE__
+  CFFileDescriptorInvalidate(client->source);
+  CFRelease(client->source);
+#endif
+  close(client->fd);
+
+  free(client->watches);
+  free(client->request);
+  free(client->pending);
+  free(client);
+}
+
+// Free dead clients, then any watch nobody is subscribed to anymore
+static void watch_daemon_sweep(void)
+{
+  for (struct watch_daemon_client** link = &server.clients; *link; ) {
+    struct watch_daemon_client* client = *link;
+    if (client->dead) {
+      *link = client->next;
+      watch_daemon_client_free(client);
+    } else {
+      link = &client->next;
+    }
+  }
+
+  for (struct watch_daemon_watch** link = &server.watches; *link; ) {
+    struct watch_daemon_watch* watch = *link;
+    if (watch->num_subscribers == 0) {
+      *link = watch->next;
+      watch_daemon_watch_release(watch);
+    } else {
+      link = &watch->next;
+    }
+  }
+}
+
+static void watch_daemon_watch_client(struct watch_daemon_client* client);
+
+static void watch_daemon_accept(void)
+{
+  for (;;) {
+    int fd = accept(server.fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept");
+      }
+      return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+    struct watch_daemon_client* client = calloc(1, sizeof(struct watch_daemon_client));
+    if (!client) {
+      fprintf(stderr, "Unable to allocate a client\n");
+      exit(EXIT_FAILURE);
+    }
+    client->fd = fd;
+    client->next = server.clients;
+    server.clients = client;
+    watch_daemon_watch_client(client);
+
+#ifdef DEBUG
+    fprintf(stderr, "daemon accepted client on fd %d\n", fd);
+#endif
+  }
+}
+
+
+// Event loop
+
+#ifdef __APPLE__
+static void watch_daemon_fd_callback(CFFileDescriptorRef source,
+                                     CFOptionFlags callBackTypes,
+                                     void* info)
+{
+  struct watch_daemon_client* client = info;
+
+  if (!client) {
+    watch_daemon_accept();
+    CFFileDescriptorEnableCallBacks(source, kCFFileDescriptorReadCallBack);
+    return;
+  }
+
+  if (callBackTypes & kCFFileDescriptorReadCallBack) {
+    watch_daemon_read(client);
+  }
+  if (callBackTypes & kCFFileDescriptorWriteCallBack) {
+    watch_daemon_flush(client);
+  }
+
+  if (!client->dead) {
+    CFFileDescriptorEnableCallBacks(source, kCFFileDescriptorReadCallBack |
+                                    (client->pending_len ? kCFFileDescriptorWriteCallBack : 0));
+  }
+  watch_daemon_sweep();
+}
+
+static CFFileDescriptorRef watch_daemon_source(int fd, void* info)
+{
+  CFFileDescriptorContext context = {0, info, NULL, NULL, NULL};
+  CFFileDescriptorRef source = CFFileDescriptorCreate(kCFAllocatorDefault, fd, false,
+                                                      &watch_daemon_fd_callback, &context);
+  CFRunLoopSourceRef runLoopSource = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault,
+                                                                         source, 0);
+  CFRunLoopAddSource(CFRunLoopGetCurrent(), runLoopSource, kCFRunLoopDefaultMode);
+  CFRelease(runLoopSource);
+  CFFileDescriptorEnableCallBacks(source, kCFFileDescriptorReadCallBack);
+  return source;
+}
+
+static void watch_daemon_watch_client(struct watch_daemon_client* client)
+{
+  client->source = watch_daemon_source(client->fd, client);
+}
+
+static void watch_daemon_watch_writable(struct watch_daemon_client* client)
+{
+  CFFileDescriptorEnableCallBacks(client->source, kCFFileDescriptorWriteCallBack);
+}
+
+static int watch_daemon_loop(void)
+{
+  CFFileDescriptorRef source = watch_daemon_source(server.fd, NULL);
+  CFRunLoopRun();
+  CFFileDescriptorInvalidate(source);
+  CFRelease(source);
+  return EXIT_FAILURE;
+}
+#else
+static void watch_daemon_watch_client(__attribute__((unused)) struct watch_daemon_client* client)
+{
+}
+
+static void watch_daemon_watch_writable(__attribute__((unused)) struct watch_daemon_client* client)
+{
+}
+
+static int watch_stream_fd(const struct watch_daemon_watch* watch)
+{
+  return watch->inotify ? inotify_stream_fd(watch->inotify)
+                        : fanotify_stream_fd(watch->fanotify);
+}
+
+static int watch_stream_timeout(struct watch_daemon_watch* watch)
+{
+  return watch->inotify ? inotify_stream_timeout(watch->inotify)
+                        : fanotify_stream_timeout(watch->fanotify);
+}
+
+static bool watch_stream_dispatch(struct watch_daemon_watch* watch, bool readable)
+{
+  return watch->inotify ? inotify_stream_dispatch(watch->inotify, readable)
+                        : fanotify_stream_dispatch(watch->fanotify, readable);
+}
+
+static int watch_daemon_loop(void)
+{
+  struct pollfd* fds = NULL;
+  size_t fds_cap = 0;
+
+  for (;;) {
+    size_t num_fds = 1;
+    for (struct watch_daemon_watch* watch = server.watches; watch; watch = watch->next) {
+      num_fds++;
+    }
+    for (struct watch_daemon_client* client = server.clients; client; client = client->next) {
+      num_fds++;
+    }
+    if (num_fds > fds_cap) {
+      fds_cap = num_fds * 2;
+      fds = realloc(fds, fds_cap * sizeof(struct pollfd));
+      if (!fds) {
+        fprintf(stderr, "Unable to allocate %zu poll descriptors\n", fds_cap);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    // the listening socket, then every stream, then every client
+    int timeout = -1;
+    size_t n = 0;
+    fds[n].fd = server.fd;
+    fds[n++].events = POLLIN;
+
+    for (struct watch_daemon_watch* watch = server.watches; watch; watch = watch->next) {
+      int watch_timeout = watch_stream_timeout(watch);
+      if (watch_timeout >= 0 && (timeout < 0 || watch_timeout < timeout)) {
+        timeout = watch_timeout;
+      }
+      fds[n].fd = watch_stream_fd(watch);
+      fds[n++].events = POLLIN;
+    }
+    for (struct watch_daemon_client* client = server.clients; client; client = client->next) {
+      fds[n].fd = client->fd;
+      fds[n++].events = POLLIN | (client->pending_len ? POLLOUT : 0);
+    }
+
+    int ready = poll(fds, num_fds, timeout);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      free(fds);
+      return EXIT_FAILURE;
+    }
+
+    // new watches and clients only ever go in front of the ones polled
+    n = 1;
+    for (struct watch_daemon_watch* watch = server.watches; watch; watch = watch->next) {
+      if (!watch->broken && !watch_stream_dispatch(watch, (fds[n].revents & POLLIN) != 0)) {
+        fprintf(stderr, "lost the watch on %s\n", watch->root);
+        watch->broken = true;
+        for (size_t i = 0; i < watch->num_subscribers; i++) {
+          watch_daemon_drop(watch->subscribers[i]);
+        }
+      }
+      n++;
+    }
+    for (struct watch_daemon_client* client = server.clients; client; client = client->next) {
+      short revents = fds[n++].revents;
+      if (revents & POLLOUT) {
+        watch_daemon_flush(client);
+      }
+      if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        watch_daemon_read(client);
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      watch_daemon_accept();
+    }
+
+    watch_daemon_sweep();
+  }
+}
+#endif
+
+
+// Setup
+
+static void watch_daemon_terminate(__attribute__((unused)) int signal)
+{
+  unlink(server.path);
+  _exit(EXIT_SUCCESS);
+}
+
+static int watch_daemon_listen(const char* path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path is too long: %s\n", path);
+    return -1;
+  }
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  // only the user running the daemon may subscribe
+  mode_t mask = umask(077);
+  int bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+
+  if (bound != 0 && errno == EADDRINUSE) {
+    // a socket left behind by a daemon that is gone can be replaced
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) != 0 &&
+        errno == ECONNREFUSED) {
+      unlink(path);
+      bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    } else {
+      errno = EADDRINUSE;
+    }
+    if (probe >= 0) {
+      close(probe);
+    }
+  }
+  umask(mask);
+
+  if (bound != 0) {
+    if (errno == EADDRINUSE) {
+      fprintf(stderr, "Another daemon is already listening on %s\n", path);
+    } else {
+      perror("bind");
+    }
+    close(fd);
+    return -1;
+  }
+
+  if (listen(fd, SOMAXCONN) != 0) {
+    perror("listen");
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+int watch_daemon_run(const char* path, enum FSEventWatchEventSource eventSource)
+{
+  memset(&server, 0, sizeof(server));
+  server.path = path;
+  server.event_source = eventSource;
+  output_encoder_init(&server.encoder);
+
+  server.fd = watch_daemon_listen(path);
+  if (server.fd < 0) {
+    return EXIT_FAILURE;
+  }
+
+  // a client going away mid-write is handled where the write fails
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, watch_daemon_terminate);
+  signal(SIGTERM, watch_daemon_terminate);
+  signal(SIGHUP, watch_daemon_terminate);
+
+#ifdef DEBUG
+  fprintf(stderr, "daemon listening on %s\n", path);
+#endif
+
+  int status = watch_daemon_loop();
+  unlink(path);
+  return status;
+}
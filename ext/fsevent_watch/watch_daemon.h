@@ -0,0 +1,29 @@
+/**
+ * @headerfile watch_daemon.h
+ * --daemon: one fsevent_watch shared by many clients over a unix socket
+ *
+ * A client connects and sends the arguments it would otherwise have run
+ * fsevent_watch with, each terminated by a NUL byte, and an empty argument
+ * to end the request. Only --latency, --no-defer, --watch-root, --file-events
+ * and --format are understood, and paths must be absolute. The daemon
+ * answers "ok\n", or "error: <reason>\n" before hanging up, followed by
+ * batches in the requested format exactly as they would have been written
+ * to stdout.
+ *
+ * Subscriptions to the same root with the same flags and latency share one
+ * event stream, so the kernel-level watch is only registered once however
+ * many clients listen to it. Each batch is encoded once for every format in
+ * use among the stream's subscribers and the same bytes are written to each
+ * of them. Output a client doesn't read is buffered up to a limit, past
+ * which the client is dropped rather than holding up everyone else.
+ */
+
+#ifndef fsevent_watch_watch_daemon_h
+#define fsevent_watch_watch_daemon_h
+
+#include "common.h"
+
+// Serve subscriptions on a socket at `path` until killed
+int watch_daemon_run(const char* path, enum FSEventWatchEventSource eventSource);
+
+#endif // fsevent_watch_watch_daemon_h
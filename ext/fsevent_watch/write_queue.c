@@ -0,0 +1,469 @@
+#include "write_queue.h"
+#include "coalesce.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define WRITE_BATCH_INITIAL_CAPACITY  64
+#define WRITE_BATCH_INITIAL_BYTES     (WRITE_BATCH_INITIAL_CAPACITY * 64)
+#define WRITE_QUEUE_COMPACT_AT        1024
+
+// Batches of one stream that didn't fit in the ring
+struct write_overflow {
+  void*                     info;
+  struct write_batch*       batch;
+  // merge repeated paths once the batch grows this long
+  size_t                    compact_at;
+};
+
+struct write_queue {
+  enum FSEventWatchOverflow overflow;
+  struct write_batch*       slots;
+  size_t                    capacity;
+
+  // each only ever advanced by one side, on cache lines of their own
+  char                      reserved0[64];
+  atomic_size_t             head;
+  char                      reserved1[64 - sizeof(atomic_size_t)];
+  atomic_size_t             tail;
+  char                      reserved2[64 - sizeof(atomic_size_t)];
+  atomic_bool               closed;
+
+  // for sleeping, never taken while there is room and work
+  pthread_mutex_t           lock;
+  pthread_cond_t            work;
+  pthread_cond_t            room;
+  atomic_bool               consumer_waiting;
+  atomic_bool               producer_waiting;
+
+  // under lock. overflowing stays set until the writer has taken every
+  // overflowed batch, and the producer queues nothing in the ring until then.
+  atomic_bool               overflowing;
+  struct write_overflow*    overflows;
+  size_t                    num_overflows;
+  struct coalesce           producer_coalesce;
+  struct write_batch        producer_scratch;
+
+  // the writer's: the batch it took from the overflow, swapped for an empty
+  // one of its own, and whether write_queue_pop's last batch came from there
+  struct write_batch*       taken;
+  bool                      popped_overflow;
+  struct coalesce           consumer_coalesce;
+  struct write_batch        consumer_scratch;
+};
+
+static void write_batch_init(struct write_batch* batch)
+{
+  memset(batch, 0, sizeof(struct write_batch));
+
+  batch->capacity = WRITE_BATCH_INITIAL_CAPACITY;
+  batch->paths = malloc(batch->capacity * sizeof(char*));
+  batch->flags = malloc(batch->capacity * sizeof(FSEventStreamEventFlags));
+  batch->ids = malloc(batch->capacity * sizeof(FSEventStreamEventId));
+  batch->times = malloc(batch->capacity * sizeof(double));
+
+  batch->bytes_cap = WRITE_BATCH_INITIAL_BYTES;
+  batch->bytes = malloc(batch->bytes_cap);
+
+  if (!batch->paths || !batch->flags || !batch->ids || !batch->times || !batch->bytes) {
+    fprintf(stderr, "Unable to allocate queued batch\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void write_batch_free(struct write_batch* batch)
+{
+  free(batch->paths);
+  free(batch->flags);
+  free(batch->ids);
+  free(batch->times);
+  free(batch->bytes);
+  memset(batch, 0, sizeof(struct write_batch));
+}
+
+static void write_batch_clear(struct write_batch* batch)
+{
+  batch->info = NULL;
+  batch->rescan = false;
+  batch->live = false;
+  batch->num_events = 0;
+  batch->bytes_len = 0;
+}
+
+static void write_batch_reserve(struct write_batch* batch, size_t numEvents, size_t numBytes)
+{
+  if (batch->num_events + numEvents > batch->capacity) {
+    while (batch->num_events + numEvents > batch->capacity) {
+      batch->capacity *= 2;
+    }
+
+    batch->paths = realloc(batch->paths, batch->capacity * sizeof(char*));
+    batch->flags = realloc(batch->flags, batch->capacity * sizeof(FSEventStreamEventFlags));
+    batch->ids = realloc(batch->ids, batch->capacity * sizeof(FSEventStreamEventId));
+    batch->times = realloc(batch->times, batch->capacity * sizeof(double));
+
+    if (!batch->paths || !batch->flags || !batch->ids || !batch->times) {
+      fprintf(stderr, "Unable to grow queued batch to %zu events\n", batch->capacity);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (batch->bytes_len + numBytes > batch->bytes_cap) {
+    while (batch->bytes_len + numBytes > batch->bytes_cap) {
+      batch->bytes_cap *= 2;
+    }
+
+    uintptr_t old = (uintptr_t)batch->bytes;
+    batch->bytes = realloc(batch->bytes, batch->bytes_cap);
+    if (!batch->bytes) {
+      fprintf(stderr, "Unable to grow queued batch to %zu bytes\n", batch->bytes_cap);
+      exit(EXIT_FAILURE);
+    }
+
+    // the paths so far point into the old buffer
+    for (size_t i = 0; i < batch->num_events; i++) {
+      batch->paths[i] = batch->bytes + ((uintptr_t)batch->paths[i] - old);
+    }
+  }
+}
+
+static void write_batch_append(struct write_batch* batch,
+                               size_t numEvents,
+                               char** paths,
+                               const size_t* lengths,
+                               const FSEventStreamEventFlags eventFlags[],
+                               const FSEventStreamEventId eventIds[],
+                               const double* times,
+                               double now)
+{
+  size_t numBytes = 0;
+  for (size_t i = 0; i < numEvents; i++) {
+    numBytes += (lengths ? lengths[i] : strlen(paths[i])) + 1;
+  }
+  write_batch_reserve(batch, numEvents, numBytes);
+
+  for (size_t i = 0; i < numEvents; i++) {
+    size_t length = lengths ? lengths[i] : strlen(paths[i]);
+    size_t at = batch->num_events + i;
+
+    batch->paths[at] = memcpy(batch->bytes + batch->bytes_len, paths[i], length);
+    batch->paths[at][length] = '\0';
+    batch->bytes_len += length + 1;
+    batch->flags[at] = eventFlags[i];
+    batch->ids[at] = eventIds[i];
+    batch->times[at] = times ? times[i] : now;
+  }
+  batch->num_events += numEvents;
+}
+
+// Report each path of the batch once, the way --coalesce does. The merged
+// events keep the time of the batch's first.
+static void write_batch_compact(struct write_batch* batch,
+                                struct coalesce* coalesce,
+                                struct write_batch* scratch)
+{
+  if (batch->num_events == 0) {
+    return;
+  }
+
+  size_t count = coalesce_batch(coalesce, batch->num_events, batch->paths,
+                                batch->flags, batch->ids);
+  write_batch_clear(scratch);
+  write_batch_append(scratch, count, coalesce->events.paths, coalesce->lengths,
+                     coalesce->events.flags, coalesce->events.ids, NULL, batch->times[0]);
+  scratch->info = batch->info;
+  scratch->live = batch->live;
+
+  struct write_batch compacted = *scratch;
+  *scratch = *batch;
+  *batch = compacted;
+}
+
+static inline double write_queue_now(void)
+{
+  return (double)stats_now() / 1e9;
+}
+
+struct write_queue* write_queue_create(size_t capacity, enum FSEventWatchOverflow overflow)
+{
+  struct write_queue* queue = calloc(1, sizeof(struct write_queue));
+  if (!queue) {
+    fprintf(stderr, "Unable to allocate write queue\n");
+    exit(EXIT_FAILURE);
+  }
+
+  queue->overflow = overflow;
+  queue->capacity = 1;
+  while (queue->capacity < capacity) {
+    queue->capacity *= 2;
+  }
+
+  queue->slots = calloc(queue->capacity, sizeof(struct write_batch));
+  queue->taken = malloc(sizeof(struct write_batch));
+  if (!queue->slots || !queue->taken) {
+    fprintf(stderr, "Unable to allocate a write queue of %zu batches\n", queue->capacity);
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < queue->capacity; i++) {
+    write_batch_init(&queue->slots[i]);
+  }
+  write_batch_init(queue->taken);
+
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  atomic_init(&queue->closed, false);
+  atomic_init(&queue->consumer_waiting, false);
+  atomic_init(&queue->producer_waiting, false);
+  atomic_init(&queue->overflowing, false);
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->work, NULL);
+  pthread_cond_init(&queue->room, NULL);
+
+  if (overflow == kFSEventWatchOverflowCoalesce) {
+    coalesce_init(&queue->producer_coalesce);
+    coalesce_init(&queue->consumer_coalesce);
+    write_batch_init(&queue->producer_scratch);
+    write_batch_init(&queue->consumer_scratch);
+  }
+
+  return queue;
+}
+
+void write_queue_release(struct write_queue* queue)
+{
+  for (size_t i = 0; i < queue->capacity; i++) {
+    write_batch_free(&queue->slots[i]);
+  }
+  for (size_t i = 0; i < queue->num_overflows; i++) {
+    write_batch_free(queue->overflows[i].batch);
+    free(queue->overflows[i].batch);
+  }
+  write_batch_free(queue->taken);
+
+  if (queue->overflow == kFSEventWatchOverflowCoalesce) {
+    coalesce_free(&queue->producer_coalesce);
+    coalesce_free(&queue->consumer_coalesce);
+    write_batch_free(&queue->producer_scratch);
+    write_batch_free(&queue->consumer_scratch);
+  }
+
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->work);
+  pthread_cond_destroy(&queue->room);
+  free(queue->slots);
+  free(queue->taken);
+  free(queue->overflows);
+  free(queue);
+}
+
+// Either side announces it's about to sleep with a seq_cst store and then
+// checks the other side's index again, while the other side publishes its
+// index with a seq_cst store and then checks the flag, so at least one of
+// them sees the other and no wakeup is lost.
+static void write_queue_wake(struct write_queue* queue, atomic_bool* waiting, pthread_cond_t* cond)
+{
+  if (atomic_load(waiting)) {
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&queue->lock);
+  }
+}
+
+static struct write_overflow* write_queue_find_overflow(struct write_queue* queue, void* info)
+{
+  for (size_t i = 0; i < queue->num_overflows; i++) {
+    if (queue->overflows[i].info == info) {
+      return &queue->overflows[i];
+    }
+  }
+
+  struct write_overflow* overflows = realloc(queue->overflows,
+    (queue->num_overflows + 1) * sizeof(struct write_overflow));
+  struct write_batch* batch = malloc(sizeof(struct write_batch));
+  if (!overflows || !batch) {
+    fprintf(stderr, "Unable to allocate overflow batch\n");
+    exit(EXIT_FAILURE);
+  }
+  write_batch_init(batch);
+
+  queue->overflows = overflows;
+  struct write_overflow* overflow = &queue->overflows[queue->num_overflows++];
+  overflow->info = info;
+  overflow->batch = batch;
+  overflow->compact_at = WRITE_QUEUE_COMPACT_AT;
+  return overflow;
+}
+
+static void write_queue_spill(struct write_queue* queue,
+                              void* info,
+                              bool live,
+                              size_t numEvents,
+                              char** paths,
+                              const FSEventStreamEventFlags eventFlags[],
+                              const FSEventStreamEventId eventIds[],
+                              const double* times)
+{
+  pthread_mutex_lock(&queue->lock);
+
+  struct write_overflow* overflow = write_queue_find_overflow(queue, info);
+  struct write_batch* batch = overflow->batch;
+  live = live || batch->live;
+  batch->info = info;
+
+  if (queue->overflow == kFSEventWatchOverflowCoalesce && !batch->rescan) {
+    write_batch_append(batch, numEvents, paths, NULL, eventFlags, eventIds, times,
+                       write_queue_now());
+
+    if (batch->num_events >= overflow->compact_at) {
+      write_batch_compact(batch, &queue->producer_coalesce, &queue->producer_scratch);
+      overflow->compact_at = batch->num_events * 2 > WRITE_QUEUE_COMPACT_AT
+                             ? batch->num_events * 2 : WRITE_QUEUE_COMPACT_AT;
+    }
+    if (batch->num_events > WRITE_QUEUE_MAX_OVERFLOW) {
+      write_batch_clear(batch);
+      batch->info = info;
+      batch->rescan = true;
+    }
+  } else {
+    write_batch_clear(batch);
+    batch->info = info;
+    batch->rescan = true;
+  }
+
+  batch->live = live;
+
+  atomic_store(&queue->overflowing, true);
+  pthread_mutex_unlock(&queue->lock);
+
+  stats_add(&stats.events_overflowed, numEvents);
+  write_queue_wake(queue, &queue->consumer_waiting, &queue->work);
+}
+
+void write_queue_push(struct write_queue* queue,
+                      void* info,
+                      bool live,
+                      size_t numEvents,
+                      char** paths,
+                      const FSEventStreamEventFlags eventFlags[],
+                      const FSEventStreamEventId eventIds[],
+                      const double* times)
+{
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+  // once a batch has overflowed, the rest follow it until the writer has
+  // caught up, so nothing overtakes it in the ring
+  if (!atomic_load_explicit(&queue->overflowing, memory_order_acquire)) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (tail - head == queue->capacity && queue->overflow == kFSEventWatchOverflowBlock) {
+      pthread_mutex_lock(&queue->lock);
+      atomic_store(&queue->producer_waiting, true);
+      while (tail - (head = atomic_load(&queue->head)) == queue->capacity) {
+        pthread_cond_wait(&queue->room, &queue->lock);
+      }
+      atomic_store(&queue->producer_waiting, false);
+      pthread_mutex_unlock(&queue->lock);
+    }
+
+    if (tail - head < queue->capacity) {
+      struct write_batch* batch = &queue->slots[tail & (queue->capacity - 1)];
+      write_batch_clear(batch);
+      batch->info = info;
+      batch->live = live;
+      write_batch_append(batch, numEvents, paths, NULL, eventFlags, eventIds, times,
+                         write_queue_now());
+
+      atomic_store(&queue->tail, tail + 1);
+      stats_max(&stats.max_queued, tail + 1 - head);
+      write_queue_wake(queue, &queue->consumer_waiting, &queue->work);
+      return;
+    }
+  }
+
+  write_queue_spill(queue, info, live, numEvents, paths, eventFlags, eventIds, times);
+}
+
+void write_queue_close(struct write_queue* queue)
+{
+  atomic_store(&queue->closed, true);
+  write_queue_wake(queue, &queue->consumer_waiting, &queue->work);
+}
+
+// The first overflowed batch, swapped out for the writer's empty one, or
+// NULL if they have all been taken
+static struct write_batch* write_queue_take_overflow(struct write_queue* queue)
+{
+  struct write_batch* batch = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  for (size_t i = 0; i < queue->num_overflows; i++) {
+    struct write_overflow* overflow = &queue->overflows[i];
+    if (overflow->batch->num_events > 0 || overflow->batch->rescan) {
+      batch = overflow->batch;
+      overflow->batch = queue->taken;
+      overflow->compact_at = WRITE_QUEUE_COMPACT_AT;
+      queue->taken = batch;
+      break;
+    }
+  }
+  if (!batch) {
+    atomic_store(&queue->overflowing, false);
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  if (batch && !batch->rescan && queue->overflow == kFSEventWatchOverflowCoalesce) {
+    write_batch_compact(batch, &queue->consumer_coalesce, &queue->consumer_scratch);
+  }
+  return batch;
+}
+
+struct write_batch* write_queue_pop(struct write_queue* queue)
+{
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+  for (;;) {
+    if (head != atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+      queue->popped_overflow = false;
+      return &queue->slots[head & (queue->capacity - 1)];
+    }
+
+    // the ring is empty, so whatever overflowed is next
+    if (atomic_load(&queue->overflowing)) {
+      struct write_batch* batch = write_queue_take_overflow(queue);
+      if (batch) {
+        queue->popped_overflow = true;
+        return batch;
+      }
+      continue;
+    }
+
+    if (atomic_load(&queue->closed)) {
+      if (head == atomic_load(&queue->tail) && !atomic_load(&queue->overflowing)) {
+        return NULL;
+      }
+      continue;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    atomic_store(&queue->consumer_waiting, true);
+    while (head == atomic_load(&queue->tail) && !atomic_load(&queue->overflowing) &&
+           !atomic_load(&queue->closed)) {
+      pthread_cond_wait(&queue->work, &queue->lock);
+    }
+    atomic_store(&queue->consumer_waiting, false);
+    pthread_mutex_unlock(&queue->lock);
+  }
+}
+
+void write_queue_done(struct write_queue* queue)
+{
+  if (queue->popped_overflow) {
+    write_batch_clear(queue->taken);
+    return;
+  }
+
+  atomic_store(&queue->head, atomic_load_explicit(&queue->head, memory_order_relaxed) + 1);
+  write_queue_wake(queue, &queue->producer_waiting, &queue->room);
+}
@@ -0,0 +1,90 @@
+/**
+ * @headerfile write_queue.h
+ * Batches on their way from the event source to the writer thread
+ *
+ * The stream callback copies every batch into the next free slot of a
+ * bounded single-producer/single-consumer ring and goes back to the event
+ * source, while a writer thread takes the slots in order, filters, formats
+ * and writes them. Head and tail are the only shared state, each advanced by
+ * one side alone, so neither side takes a lock while there is room and work;
+ * a side only sleeps on a condition variable once the other has flagged it
+ * is about to. Slots keep their buffers, so steady state queueing doesn't
+ * allocate.
+ *
+ * When the reader of the output falls behind far enough to fill the ring,
+ * the overflow policy decides what happens to the next batch:
+ *
+ *   block     wait for the writer, as if writing directly (the default)
+ *   coalesce  merge it, and every batch after it until the writer catches
+ *             up, into one batch per stream reporting each path once, like
+ *             --coalesce; past WRITE_QUEUE_MAX_OVERFLOW distinct paths that
+ *             becomes a rescan
+ *   drop      drop it and every batch after it until the writer catches up,
+ *             and send a UserDropped|MustScanSubDirs event on the stream's
+ *             roots in their place, so the reader knows to rescan
+ *
+ * Overflowed batches go out once the writer has emptied the ring, after
+ * everything queued before them.
+ */
+
+#ifndef fsevent_watch_write_queue_h
+#define fsevent_watch_write_queue_h
+
+#include "common.h"
+
+#define WRITE_QUEUE_DEFAULT_CAPACITY  64
+#define WRITE_QUEUE_MAX_OVERFLOW      65536
+
+struct write_queue;
+
+// A batch as the writer gets it. With `rescan` set it has no events, and
+// stands for everything dropped from the stream `info` names. `live` batches
+// hold what the event source read, rather than history replayed from the
+// journal or changes a snapshot scan found.
+struct write_batch {
+  void*                     info;
+  bool                      rescan;
+  bool                      live;
+
+  size_t                    num_events;
+  size_t                    capacity;
+  char**                    paths;
+  FSEventStreamEventFlags*  flags;
+  FSEventStreamEventId*     ids;
+  // when each event was read, in seconds of the monotonic clock
+  double*                   times;
+
+  char*                     bytes;
+  size_t                    bytes_len;
+  size_t                    bytes_cap;
+};
+
+// capacity is rounded up to a power of two
+struct write_queue* write_queue_create(size_t capacity, enum FSEventWatchOverflow overflow);
+void write_queue_release(struct write_queue* queue);
+
+// Queue a copy of a batch, applying the overflow policy if the ring is full.
+// times may be NULL, for a batch read just now. A batch that overflows into
+// another stays live if either was. Producer only.
+void write_queue_push(struct write_queue* queue,
+                      void* info,
+                      bool live,
+                      size_t numEvents,
+                      char** paths,
+                      const FSEventStreamEventFlags eventFlags[],
+                      const FSEventStreamEventId eventIds[],
+                      const double* times);
+
+// Nothing more will be pushed; write_queue_pop returns NULL once the writer
+// has taken everything already queued. Producer only.
+void write_queue_close(struct write_queue* queue);
+
+// The next batch, waiting for one if need be, or NULL once the queue is
+// closed and empty. It stays valid until write_queue_done. Consumer only.
+struct write_batch* write_queue_pop(struct write_queue* queue);
+
+// Hand the batch write_queue_pop returned back to the producer. Consumer
+// only.
+void write_queue_done(struct write_queue* queue);
+
+#endif // fsevent_watch_write_queue_h
@@ -4,8 +4,11 @@ require 'pathname'
 require 'date'
 require 'time'
 require 'rake/clean'
+require 'rbconfig'
 
-raise "unable to find xcodebuild" unless system('which', 'xcodebuild')
+$darwin = !!(RbConfig::CONFIG['host_os'] =~ /darwin/)
+
+raise "unable to find xcodebuild" if $darwin && !system('which', 'xcodebuild')
 
 
 FSEVENT_WATCH_EXE_VERSION = '0.1.4'
@@ -16,14 +19,25 @@ $final_exe = $this_dir.parent.join('bin/fsevent_watch')
 $src_dir = $this_dir.join('fsevent_watch')
 $obj_dir = $this_dir.join('build')
 
-SRC = Pathname.glob("#{$src_dir}/*.c")
+# sources that only build against one platform's SDK
+DARWIN_SRC = %w[FSEventsFix.c TSICTString.c]
+LINUX_SRC  = %w[fanotify_stream.c inotify_stream.c]
+
+SRC = Pathname.glob("#{$src_dir}/*.c").reject do |s|
+  ($darwin ? LINUX_SRC : DARWIN_SRC).include?(s.basename.to_s)
+end
 OBJ = SRC.map {|s| $obj_dir.join("#{s.basename('.c')}.o")}
 
 $now = DateTime.now.xmlschema rescue Time.now.xmlschema
 
 $CC = ENV['CC'] || `which clang || which gcc`.strip
-$CFLAGS = ENV['CFLAGS'] || '-fconstant-cfstrings -fasm-blocks -fstrict-aliasing -Wall'
-$ARCHFLAGS = ENV['ARCHFLAGS'] || '-arch x86_64'
+if $darwin
+  $CFLAGS = ENV['CFLAGS'] || '-fconstant-cfstrings -fasm-blocks -fstrict-aliasing -Wall'
+  $ARCHFLAGS = ENV['ARCHFLAGS'] || '-arch x86_64'
+else
+  $CFLAGS = ENV['CFLAGS'] || '-fstrict-aliasing -Wall'
+  $ARCHFLAGS = ENV['ARCHFLAGS'] || ''
+end
 $DEFINES = "-DNS_BUILD_32_LIKE_64 -DNS_BLOCK_ASSERTIONS -DPROJECT_VERSION=#{FSEVENT_WATCH_EXE_VERSION}"
 
 $GCC_C_LANGUAGE_STANDARD = ENV['GCC_C_LANGUAGE_STANDARD'] || 'gnu11'
@@ -34,7 +48,7 @@ $CODE_SIGN_IDENTITY = 'Developer ID Application'
 
 $arch = `uname -m`.strip
 $os_release = `uname -r`.strip
-$BUILD_TRIPLE = "#{$arch}-apple-darwin#{$os_release}"
+$BUILD_TRIPLE = $darwin ? "#{$arch}-apple-darwin#{$os_release}" : "#{$arch}-#{RbConfig::CONFIG['host_os']}#{$os_release}"
 
 $CCVersion = `#{$CC} --version | head -n 1`.strip
 
@@ -46,6 +60,7 @@ CLOBBER.include $final_exe.to_s
 
 
 task :sw_vers do
+  next unless $darwin
   $mac_product_version = `sw_vers -productVersion`.strip
   $mac_build_version = `sw_vers -buildVersion`.strip
   $MACOSX_DEPLOYMENT_TARGET = ENV['MACOSX_DEPLOYMENT_TARGET'] || $mac_product_version.sub(/\.\d*$/, '')
@@ -54,6 +69,7 @@ end
 
 task :get_sdk_info => :sw_vers do
   $SDK_INFO = {}
+  next unless $darwin
   version_info = `xcodebuild -version -sdk macosx#{$MACOSX_DEPLOYMENT_TARGET}`
   raise "invalid SDK" unless !!$?.exitstatus
   version_info.strip.each_line do |line|
@@ -101,6 +117,24 @@ end
 
 task :setup_env => [:set_build_type, :sw_vers, :get_sdk_info]
 
+def sysroot_flags
+  $darwin ? "-isysroot #{$SDK_INFO['Path']}" : ''
+end
+
+# the Info.plist is embedded into the Mach-O binary, so only darwin needs one;
+# the scanner's threads need pthreads linked in explicitly elsewhere
+def link_flags
+  if $darwin
+    "-framework CoreFoundation -framework CoreServices -sectcreate __TEXT __info_plist #{$obj_dir.join('Info.plist')}"
+  else
+    '-pthread'
+  end
+end
+
+def link_prerequisites
+  $darwin ? [$obj_dir.join('Info.plist').to_s] : []
+end
+
 directory $obj_dir.to_s
 file $obj_dir.to_s => :setup_env
 
@@ -113,8 +147,7 @@ SRC.zip(OBJ).each do |source, object|
       $CFLAGS,
       $DEFINES,
       "-I#{$src_dir}",
-      '-isysroot',
-      $SDK_INFO['Path'],
+      sysroot_flags,
       '-c', source,
       '-o', object
     ]
@@ -189,7 +222,7 @@ desc 'generate an Info.plist used for code signing as well as embedding build se
 task :plist => $obj_dir.join('Info.plist').to_s
 
 
-file $obj_dir.join('fsevent_watch').to_s => [$obj_dir.to_s, $obj_dir.join('Info.plist').to_s] + OBJ.map(&:to_s) do
+file $obj_dir.join('fsevent_watch').to_s => [$obj_dir.to_s] + link_prerequisites + OBJ.map(&:to_s) do
   cmd = [
     $CC,
     $ARCHFLAGS,
@@ -197,11 +230,8 @@ file $obj_dir.join('fsevent_watch').to_s => [$obj_dir.to_s, $obj_dir.join('Info.
     $CFLAGS,
     $DEFINES,
     "-I#{$src_dir}",
-    '-isysroot',
-    $SDK_INFO['Path'],
-    '-framework CoreFoundation -framework CoreServices',
-    '-sectcreate __TEXT __info_plist',
-    $obj_dir.join('Info.plist')
+    sysroot_flags,
+    link_flags
   ] + OBJ + [
     '-o', $obj_dir.join('fsevent_watch')
   ]
@@ -211,6 +241,246 @@ end
 desc 'compile and link build/fsevent_watch'
 task :build => $obj_dir.join('fsevent_watch').to_s
 
+# the microbenchmark is built from source with encoder statistics compiled in,
+# so none of it ends up in fsevent_watch itself
+BENCH_TSTRING_SRC = [$this_dir.join('bench/tstring_bench.c')] +
+  %w[TSITString.c output_encoder.c path_table.c compat.c].map {|s| $src_dir.join(s)} +
+  ($darwin ? [$src_dir.join('TSICTString.c')] : [])
+CLEAN.include $obj_dir.join('tstring_bench').to_s
+
+file $obj_dir.join('tstring_bench').to_s => [$obj_dir.to_s] + BENCH_TSTRING_SRC.map(&:to_s) do
+  cmd = [
+    $CC,
+    $ARCHFLAGS,
+    "-std=#{$GCC_C_LANGUAGE_STANDARD}",
+    $CFLAGS,
+    $DEFINES,
+    '-DTSITSTRING_STATS',
+    "-I#{$src_dir}",
+    sysroot_flags,
+    $darwin ? '-framework CoreFoundation -framework CoreServices' : ''
+  ] + BENCH_TSTRING_SRC + [
+    '-o', $obj_dir.join('tstring_bench')
+  ]
+  sh(cmd.map {|s| s.to_s}.join(' '))
+end
+
+desc 'build and run the TNetstring/OTNetstring encoding microbenchmark'
+task :bench_tstring => $obj_dir.join('tstring_bench').to_s do
+  sh $obj_dir.join('tstring_bench').to_s
+end
+
+BENCH_JOURNAL_SRC = [$this_dir.join('bench/journal_bench.c')] +
+  %w[journal.c TSITString.c compat.c].map {|s| $src_dir.join(s)}
+CLEAN.include $obj_dir.join('journal_bench').to_s
+
+file $obj_dir.join('journal_bench').to_s => [$obj_dir.to_s] + BENCH_JOURNAL_SRC.map(&:to_s) do
+  cmd = [
+    $CC,
+    $ARCHFLAGS,
+    "-std=#{$GCC_C_LANGUAGE_STANDARD}",
+    $CFLAGS,
+    $DEFINES,
+    "-I#{$src_dir}",
+    sysroot_flags,
+    $darwin ? '-framework CoreFoundation -framework CoreServices' : ''
+  ] + BENCH_JOURNAL_SRC + [
+    '-o', $obj_dir.join('journal_bench')
+  ]
+  sh(cmd.map {|s| s.to_s}.join(' '))
+end
+
+desc 'build and run the --journal append and replay microbenchmark'
+task :bench_journal => $obj_dir.join('journal_bench').to_s do
+  sh $obj_dir.join('journal_bench').to_s
+end
+
+BENCH_SCANNER_SRC = [$this_dir.join('bench/scanner_bench.c')] +
+  %w[scanner.c TSITString.c compat.c].map {|s| $src_dir.join(s)}
+CLEAN.include $obj_dir.join('scanner_bench').to_s
+
+file $obj_dir.join('scanner_bench').to_s => [$obj_dir.to_s] + BENCH_SCANNER_SRC.map(&:to_s) do
+  cmd = [
+    $CC,
+    $ARCHFLAGS,
+    "-std=#{$GCC_C_LANGUAGE_STANDARD}",
+    $CFLAGS,
+    $DEFINES,
+    "-I#{$src_dir}",
+    sysroot_flags,
+    $darwin ? '-framework CoreFoundation -framework CoreServices' : '-pthread'
+  ] + BENCH_SCANNER_SRC + [
+    '-o', $obj_dir.join('scanner_bench')
+  ]
+  sh(cmd.map {|s| s.to_s}.join(' '))
+end
+
+desc 'build and run the --snapshot/--crawl directory walk benchmark'
+task :bench_scanner => $obj_dir.join('scanner_bench').to_s do
+  sh $obj_dir.join('scanner_bench').to_s
+end
+
+# every source is built with allocation counting force-included, so the test
+# can tell whether anything a batch passes through still touches the heap
+TEST_ALLOC_SRC = [$this_dir.join('test/batch_alloc_test.c')] +
+  %w[arena.c coalesce.c event_list.c output_encoder.c path_table.c path_filter.c write_queue.c stats.c
+     TSITString.c compat.c].map {|s| $src_dir.join(s)}
+CLEAN.include $obj_dir.join('batch_alloc_test').to_s
+
+file $obj_dir.join('batch_alloc_test').to_s => [$obj_dir.to_s, $this_dir.join('test/alloc_count.h').to_s] + TEST_ALLOC_SRC.map(&:to_s) do
+  cmd = [
+    $CC,
+    $ARCHFLAGS,
+    "-std=#{$GCC_C_LANGUAGE_STANDARD}",
+    $CFLAGS,
+    $DEFINES,
+    "-include #{$this_dir.join('test/alloc_count.h')}",
+    "-I#{$src_dir}",
+    sysroot_flags,
+    $darwin ? '-framework CoreFoundation -framework CoreServices' : '-pthread'
+  ] + TEST_ALLOC_SRC + [
+    '-o', $obj_dir.join('batch_alloc_test')
+  ]
+  sh(cmd.map {|s| s.to_s}.join(' '))
+end
+
+desc 'check that batches stop allocating once fsevent_watch has warmed up'
+task :test_alloc => $obj_dir.join('batch_alloc_test').to_s do
+  sh $obj_dir.join('batch_alloc_test').to_s
+end
+
+# event_batch.c is every event source's batching, which takes its times from
+# the caller, so the test can run it on a clock of its own
+TEST_DEBOUNCE_SRC = [$this_dir.join('test/debounce_test.c')] +
+  %w[event_batch.c stats.c compat.c].map {|s| $src_dir.join(s)}
+CLEAN.include $obj_dir.join('debounce_test').to_s
+
+file $obj_dir.join('debounce_test').to_s => [$obj_dir.to_s] + TEST_DEBOUNCE_SRC.map(&:to_s) do
+  cmd = [
+    $CC,
+    $ARCHFLAGS,
+    "-std=#{$GCC_C_LANGUAGE_STANDARD}",
+    $CFLAGS,
+    $DEFINES,
+    "-I#{$src_dir}",
+    sysroot_flags,
+    $darwin ? '-framework CoreFoundation -framework CoreServices' : '-pthread'
+  ] + TEST_DEBOUNCE_SRC + [
+    '-o', $obj_dir.join('debounce_test')
+  ]
+  sh(cmd.map {|s| s.to_s}.join(' '))
+end
+
+desc 'check when batches go out under --debounce, on a synthetic clock'
+task :test_debounce => $obj_dir.join('debounce_test').to_s do
+  sh $obj_dir.join('debounce_test').to_s
+end
+
+TEST_CONTENT_HASH_SRC = [$this_dir.join('test/content_hash_test.c')] +
+  %w[content_hash.c event_list.c compat.c].map {|s| $src_dir.join(s)}
+CLEAN.include $obj_dir.join('content_hash_test').to_s
+
+file $obj_dir.join('content_hash_test').to_s => [$obj_dir.to_s] + TEST_CONTENT_HASH_SRC.map(&:to_s) do
+  cmd = [
+    $CC,
+    $ARCHFLAGS,
+    "-std=#{$GCC_C_LANGUAGE_STANDARD}",
+    $CFLAGS,
+    $DEFINES,
+    "-I#{$src_dir}",
+    sysroot_flags,
+    $darwin ? '-framework CoreFoundation -framework CoreServices' : '-pthread'
+  ] + TEST_CONTENT_HASH_SRC + [
+    '-o', $obj_dir.join('content_hash_test')
+  ]
+  sh(cmd.map {|s| s.to_s}.join(' '))
+end
+
+desc 'check which modifications --content-hash drops, on files in a temporary directory'
+task :test_content_hash => $obj_dir.join('content_hash_test').to_s do
+  sh $obj_dir.join('content_hash_test').to_s
+end
+
+# path_filter.c is all of --include/--exclude, so the test compiles its
+# globs the way the commandline does and runs paths through them
+TEST_PATH_FILTER_SRC = [$this_dir.join('test/path_filter_test.c')] +
+  %w[path_filter.c event_list.c compat.c].map {|s| $src_dir.join(s)}
+CLEAN.include $obj_dir.join('path_filter_test').to_s
+
+file $obj_dir.join('path_filter_test').to_s => [$obj_dir.to_s] + TEST_PATH_FILTER_SRC.map(&:to_s) do
+  cmd = [
+    $CC,
+    $ARCHFLAGS,
+    "-std=#{$GCC_C_LANGUAGE_STANDARD}",
+    $CFLAGS,
+    $DEFINES,
+    "-I#{$src_dir}",
+    sysroot_flags,
+    $darwin ? '-framework CoreFoundation -framework CoreServices' : '-pthread'
+  ] + TEST_PATH_FILTER_SRC + [
+    '-o', $obj_dir.join('path_filter_test')
+  ]
+  sh(cmd.map {|s| s.to_s}.join(' '))
+end
+
+desc 'check which paths --include and --exclude globs keep'
+task :test_path_filter => $obj_dir.join('path_filter_test').to_s do
+  sh $obj_dir.join('path_filter_test').to_s
+end
+
+# git_ignore.c reads ignore files itself, so the test lays out a worktree in
+# a temporary directory for it
+TEST_GIT_IGNORE_SRC = [$this_dir.join('test/git_ignore_test.c')] +
+  %w[git_ignore.c event_list.c compat.c].map {|s| $src_dir.join(s)}
+CLEAN.include $obj_dir.join('git_ignore_test').to_s
+
+file $obj_dir.join('git_ignore_test').to_s => [$obj_dir.to_s] + TEST_GIT_IGNORE_SRC.map(&:to_s) do
+  cmd = [
+    $CC,
+    $ARCHFLAGS,
+    "-std=#{$GCC_C_LANGUAGE_STANDARD}",
+    $CFLAGS,
+    $DEFINES,
+    "-I#{$src_dir}",
+    sysroot_flags,
+    $darwin ? '-framework CoreFoundation -framework CoreServices' : '-pthread'
+  ] + TEST_GIT_IGNORE_SRC + [
+    '-o', $obj_dir.join('git_ignore_test')
+  ]
+  sh(cmd.map {|s| s.to_s}.join(' '))
+end
+
+desc 'check which paths --gitignore drops, in a worktree in a temporary directory'
+task :test_git_ignore => $obj_dir.join('git_ignore_test').to_s do
+  sh $obj_dir.join('git_ignore_test').to_s
+end
+
+# the reader specs decode output_encoder.c's frames rather than a Ruby copy
+# of it; a small interned table lets a few batches start the table over
+ENCODE_FRAMES_SRC = [$this_dir.join('test/encode_frames.c')] +
+  %w[output_encoder.c path_table.c TSITString.c cli.c compat.c].map {|s| $src_dir.join(s)}
+CLEAN.include $obj_dir.join('encode_frames').to_s
+
+file $obj_dir.join('encode_frames').to_s => [$obj_dir.to_s] + ENCODE_FRAMES_SRC.map(&:to_s) do
+  cmd = [
+    $CC,
+    $ARCHFLAGS,
+    "-std=#{$GCC_C_LANGUAGE_STANDARD}",
+    $CFLAGS,
+    $DEFINES,
+    '-DINTERNED_MAX=64U',
+    "-I#{$src_dir}",
+    sysroot_flags,
+    $darwin ? '-framework CoreFoundation -framework CoreServices' : '-pthread'
+  ] + ENCODE_FRAMES_SRC + [
+    '-o', $obj_dir.join('encode_frames')
+  ]
+  sh(cmd.map {|s| s.to_s}.join(' '))
+end
+
+desc 'build build/encode_frames, which the reader specs encode frames with'
+task :encode_frames => $obj_dir.join('encode_frames').to_s
+
 desc 'codesign build/fsevent_watch binary'
 task :codesign => :build do
   sh "codesign -s '#{$CODE_SIGN_IDENTITY}' #{$obj_dir.join('fsevent_watch')}"
@@ -0,0 +1,32 @@
+//
+//  alloc_count.h
+//  fsevent_watch
+//
+//  Force-included ahead of every source of batch_alloc_test, so each heap
+//  allocation made by the modules a batch passes through is counted. The
+//  system headers are read first, so their own declarations stay as they are.
+//
+
+#ifndef fsevent_watch_alloc_count_h
+#define fsevent_watch_alloc_count_h
+
+#include <stdlib.h>
+#include <string.h>
+
+extern unsigned long long alloc_count;
+
+void* alloc_count_malloc(size_t size);
+void* alloc_count_calloc(size_t count, size_t size);
+void* alloc_count_realloc(void* pointer, size_t size);
+char* alloc_count_strdup(const char* string);
+char* alloc_count_strndup(const char* string, size_t length);
+
+#undef strdup
+#undef strndup
+#define malloc(size)              alloc_count_malloc(size)
+#define calloc(count, size)       alloc_count_calloc(count, size)
+#define realloc(pointer, size)    alloc_count_realloc(pointer, size)
+#define strdup(string)            alloc_count_strdup(string)
+#define strndup(string, length)   alloc_count_strndup(string, length)
+
+#endif // fsevent_watch_alloc_count_h
@@ -0,0 +1,164 @@
+//
+//  batch_alloc_test.c
+//  fsevent_watch
+//
+//  Checks that batches stop allocating once fsevent_watch has warmed up.
+//  Synthetic batches of up to 2,000 events take the path a live batch takes
+//  from the stream callback to the pipe: through the write queue, an
+//  --exclude glob, --coalesce, the roots of niwroot and tnetstring output
+//  carved out of the writer's arena, and every --format. After one batch of
+//  the largest size has grown every buffer, a thousand batches of every size
+//  up to it must not touch the heap at all.
+//
+//  Every source is built with alloc_count.h force-included, which routes
+//  malloc, calloc, realloc, strdup and strndup through the counters here.
+//  Run by `rake test_alloc`, which fails if anything was allocated.
+//
+
+#include "common.h"
+#include "arena.h"
+#include "coalesce.h"
+#include "output_encoder.h"
+#include "path_filter.h"
+#include "write_queue.h"
+
+#define BATCH_ALLOC_TEST_MAX_EVENTS   2000
+#define BATCH_ALLOC_TEST_BATCHES      1000
+
+unsigned long long alloc_count = 0;
+
+// the parentheses keep the macros in alloc_count.h from expanding
+void* alloc_count_malloc(size_t size)
+{
+  alloc_count++;
+  return (malloc)(size);
+}
+
+void* alloc_count_calloc(size_t count, size_t size)
+{
+  alloc_count++;
+  return (calloc)(count, size);
+}
+
+void* alloc_count_realloc(void* pointer, size_t size)
+{
+  alloc_count++;
+  return (realloc)(pointer, size);
+}
+
+char* alloc_count_strdup(const char* string)
+{
+  alloc_count++;
+  return (strdup)(string);
+}
+
+char* alloc_count_strndup(const char* string, size_t length)
+{
+  alloc_count++;
+  return (strndup)(string, length);
+}
+
+static const char* kRoot = "/Users/fsevent/project";
+
+static char* paths[BATCH_ALLOC_TEST_MAX_EVENTS];
+static FSEventStreamEventFlags flags[BATCH_ALLOC_TEST_MAX_EVENTS];
+static FSEventStreamEventId ids[BATCH_ALLOC_TEST_MAX_EVENTS];
+
+static struct write_queue* queue;
+static struct path_filter filter;
+static struct coalesce coalescer;
+static struct output_encoder encoder;
+static struct arena arena;
+
+static const enum FSEventWatchOutputFormat kFormats[] = {
+  kFSEventWatchOutputFormatClassic,
+  kFSEventWatchOutputFormatNIW,
+  kFSEventWatchOutputFormatNIWRoot,
+  kFSEventWatchOutputFormatTNetstring,
+  kFSEventWatchOutputFormatOTNetstring,
+  kFSEventWatchOutputFormatBinary,
+  kFSEventWatchOutputFormatInterned,
+  kFSEventWatchOutputFormatFrontCoded
+};
+
+// What the writer thread does with a batch, once for every format
+static size_t batch_alloc_test_write(size_t numEvents)
+{
+  size_t written = 0;
+
+  write_queue_push(queue, NULL, true, numEvents, paths, flags, ids, NULL);
+  struct write_batch* batch = write_queue_pop(queue);
+
+  size_t count = path_filter_batch(&filter, batch->num_events, batch->paths,
+                                   batch->flags, batch->ids);
+  count = coalesce_batch(&coalescer, count, filter.events.paths, filter.events.flags,
+                         filter.events.ids);
+
+  const char** roots = arena_alloc(&arena, count * sizeof(const char*));
+  for (size_t i = 0; i < count; i++) {
+    roots[i] = kRoot;
+  }
+
+  for (size_t f = 0; f < sizeof(kFormats) / sizeof(kFormats[0]); f++) {
+    size_t length;
+    output_encoder_encode(&encoder, kFormats[f], count, coalescer.events.paths,
+                          coalescer.events.flags, coalescer.events.ids, roots, &length);
+    written += length;
+  }
+
+  write_queue_done(queue);
+  arena_reset(&arena);
+  return written;
+}
+
+int main(void)
+{
+  for (size_t i = 0; i < BATCH_ALLOC_TEST_MAX_EVENTS; i++) {
+    char path[PATH_MAX];
+    // every 10th path is under tmp/ and excluded, and every path repeats
+    // once, for --coalesce to merge
+    snprintf(path, sizeof(path), "%s/%s/dir%02zu/file%04zu.rb", kRoot,
+             i % 10 == 9 ? "tmp" : "app", (i / 2) % 37, i / 2);
+    paths[i] = strdup(path);
+    flags[i] = (FSEventStreamEventFlags)(i & 0xffff);
+    ids[i] = 1000000 + i;
+  }
+
+  queue = write_queue_create(WRITE_QUEUE_DEFAULT_CAPACITY, kFSEventWatchOverflowBlock);
+  path_filter_init(&filter);
+  path_filter_add(&filter, "tmp", true);
+  path_filter_compile(&filter);
+  coalesce_init(&coalescer);
+  output_encoder_init(&encoder);
+  arena_init(&arena);
+
+  unsigned long long start = alloc_count;
+  batch_alloc_test_write(BATCH_ALLOC_TEST_MAX_EVENTS);
+  unsigned long long warmup = alloc_count - start;
+
+  // the ring's slots each warm up on their own
+  for (size_t i = 0; i < WRITE_QUEUE_DEFAULT_CAPACITY; i++) {
+    batch_alloc_test_write(BATCH_ALLOC_TEST_MAX_EVENTS);
+  }
+
+  start = alloc_count;
+  size_t events = 0;
+  size_t bytes = 0;
+  for (size_t b = 0; b < BATCH_ALLOC_TEST_BATCHES; b++) {
+    size_t numEvents = 1 + (b * 7919) % BATCH_ALLOC_TEST_MAX_EVENTS;
+    bytes += batch_alloc_test_write(numEvents);
+    events += numEvents;
+  }
+  unsigned long long steady = alloc_count - start;
+
+  fprintf(stdout, "warm-up batch:    %llu allocations\n", warmup);
+  fprintf(stdout, "%d batches:     %llu allocations for %zu events, %zu bytes of output\n",
+          BATCH_ALLOC_TEST_BATCHES, steady, events, bytes);
+
+  if (steady != 0) {
+    fprintf(stderr, "FAIL: steady state batches allocated\n");
+    return EXIT_FAILURE;
+  }
+  fprintf(stdout, "ok\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,229 @@
+//
+//  content_hash_test.c
+//  fsevent_watch
+//
+//  Writes files in a temporary directory the way editors and generators do,
+//  and checks which of their modification events --content-hash lets
+//  through: a file seen for the first time, one whose contents changed, one
+//  at a new path or over the size cap, and any event that's more than a
+//  modification always; a rewrite with the same contents, or a touch, never.
+//  A batch of many files is hashed on every thread, and XXH64 is checked
+//  against its published test vectors.
+//
+//  Run by `rake test_content_hash`, which fails if any event was wrongly
+//  dropped or kept.
+//
+
+#include "common.h"
+#include "content_hash.h"
+#include <errno.h>
+#include <sys/time.h>
+
+#define CONTENT_HASH_TEST_MAX_SIZE  64
+#define CONTENT_HASH_TEST_FILES     200
+
+static int failures = 0;
+static char dir[PATH_MAX / 2];
+
+static void content_hash_test_expect(const char* what, bool ok)
+{
+  if (ok) {
+    fprintf(stdout, "ok    %s\n", what);
+  } else {
+    fprintf(stdout, "FAIL  %s\n", what);
+    failures++;
+  }
+}
+
+static char* content_hash_test_path(const char* name)
+{
+  static char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  return path;
+}
+
+static void content_hash_test_write(const char* name, const char* contents)
+{
+  FILE* file = fopen(content_hash_test_path(name), "w");
+  if (!file) {
+    fprintf(stderr, "Unable to write %s: %s\n", name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fputs(contents, file);
+  fclose(file);
+}
+
+// Whether a batch of a single event on name kept it
+static bool content_hash_test_kept(struct content_hash* hash, const char* name,
+                                   FSEventStreamEventFlags flags)
+{
+  char* paths[] = {content_hash_test_path(name)};
+  FSEventStreamEventId ids[] = {1};
+  char** outPaths;
+  const FSEventStreamEventFlags* outFlags;
+  const FSEventStreamEventId* outIds;
+  return content_hash_batch(hash, 1, paths, &flags, ids, &outPaths, &outFlags, &outIds) == 1;
+}
+
+static void content_hash_test_vectors(void)
+{
+  const char* nobody = "Nobody inspects the spammish repetition";
+  content_hash_test_expect("xxh64: empty", content_hash_xxh64("", 0) == 0xef46db3751d8e999ULL);
+  content_hash_test_expect("xxh64: a", content_hash_xxh64("a", 1) == 0xd24ec4f1a98c6e5bULL);
+  content_hash_test_expect("xxh64: abc", content_hash_xxh64("abc", 3) == 0x44bc2cf5ad770999ULL);
+  content_hash_test_expect("xxh64: a whole stripe and a tail",
+                           content_hash_xxh64(nobody, strlen(nobody)) == 0xfbcea83c8a378bf1ULL);
+}
+
+static void content_hash_test_single(void)
+{
+  FSEventStreamEventFlags modified = kFSEventStreamEventFlagItemModified |
+                                     kFSEventStreamEventFlagItemIsFile;
+  FSEventStreamEventFlags written = modified | kFSEventStreamEventFlagItemInodeMetaMod;
+  struct content_hash* hash = content_hash_create(CONTENT_HASH_TEST_MAX_SIZE, 1);
+
+  content_hash_test_write("a.rb", "hello");
+  content_hash_test_expect("a file seen for the first time goes through",
+                           content_hash_test_kept(hash, "a.rb", modified));
+
+  content_hash_test_write("a.rb", "hello");
+  content_hash_test_expect("a rewrite with the same contents is dropped",
+                           !content_hash_test_kept(hash, "a.rb", written));
+
+  content_hash_test_write("a.rb", "jello");
+  content_hash_test_expect("new contents of the same size go through",
+                           content_hash_test_kept(hash, "a.rb", written));
+
+  content_hash_test_write("a.rb", "jello!");
+  content_hash_test_expect("new contents of another size go through",
+                           content_hash_test_kept(hash, "a.rb", written));
+
+  content_hash_test_write("a.rb", "jello!");
+  content_hash_test_expect("a rewrite is only checked against the last contents",
+                           !content_hash_test_kept(hash, "a.rb", written));
+
+  content_hash_test_expect("a file that was also created goes through",
+                           content_hash_test_kept(hash, "a.rb",
+                                                  written | kFSEventStreamEventFlagItemCreated));
+  content_hash_test_expect("a file that was also chowned goes through",
+                           content_hash_test_kept(hash, "a.rb",
+                                                  written | kFSEventStreamEventFlagItemChangeOwner));
+
+  utimes(content_hash_test_path("a.rb"), NULL);
+  content_hash_test_expect("a touch is dropped", !content_hash_test_kept(hash, "a.rb", written));
+
+  // a file moved, with what it held, to where another was
+  content_hash_test_write("b.rb", "jello!");
+  content_hash_test_kept(hash, "b.rb", written);
+  char* from = strdup(content_hash_test_path("b.rb"));
+  rename(from, content_hash_test_path("c.rb"));
+  free(from);
+  content_hash_test_expect("a file at a path it wasn't hashed at goes through",
+                           content_hash_test_kept(hash, "c.rb", written));
+  content_hash_test_expect("and is known there from then on",
+                           !content_hash_test_kept(hash, "c.rb", written));
+
+  content_hash_test_write("big.rb", "0123456789012345678901234567890123456789"
+                                    "0123456789012345678901234567890123456789");
+  content_hash_test_expect("a file over the size cap goes through",
+                           content_hash_test_kept(hash, "big.rb", written));
+  content_hash_test_expect("and goes through every time",
+                           content_hash_test_kept(hash, "big.rb", written));
+
+  unlink(content_hash_test_path("a.rb"));
+  content_hash_test_expect("a file that is gone goes through",
+                           content_hash_test_kept(hash, "a.rb", written));
+  content_hash_test_expect("a directory goes through",
+                           content_hash_test_kept(hash, "", kFSEventStreamEventFlagItemModified |
+                                                            kFSEventStreamEventFlagItemIsDir));
+
+  // once a file was hashed after the second it last changed in, its times
+  // vouch for it
+  content_hash_test_write("d.rb", "settled");
+  sleep(1);
+  content_hash_test_kept(hash, "d.rb", written);
+  UInt64 before = content_hash_bytes_hashed(hash);
+  content_hash_test_expect("a file whose times are as hashed is dropped",
+                           !content_hash_test_kept(hash, "d.rb", written));
+  content_hash_test_expect("without being read again", content_hash_bytes_hashed(hash) == before);
+
+  content_hash_release(hash);
+}
+
+static void content_hash_test_parallel(void)
+{
+  FSEventStreamEventFlags written = kFSEventStreamEventFlagItemModified |
+                                    kFSEventStreamEventFlagItemInodeMetaMod |
+                                    kFSEventStreamEventFlagItemIsFile;
+  struct content_hash* hash = content_hash_create(CONTENT_HASH_TEST_MAX_SIZE, CONTENT_HASH_MAX_THREADS);
+
+  char* paths[CONTENT_HASH_TEST_FILES];
+  FSEventStreamEventFlags flags[CONTENT_HASH_TEST_FILES];
+  FSEventStreamEventId ids[CONTENT_HASH_TEST_FILES];
+  char name[64];
+  char contents[64];
+  for (size_t i = 0; i < CONTENT_HASH_TEST_FILES; i++) {
+    snprintf(name, sizeof(name), "gen%03zu.rb", i);
+    snprintf(contents, sizeof(contents), "generated %zu", i);
+    content_hash_test_write(name, contents);
+    paths[i] = strdup(content_hash_test_path(name));
+    flags[i] = written;
+    ids[i] = i;
+  }
+
+  char** outPaths;
+  const FSEventStreamEventFlags* outFlags;
+  const FSEventStreamEventId* outIds;
+  size_t kept = content_hash_batch(hash, CONTENT_HASH_TEST_FILES, paths, flags, ids,
+                                   &outPaths, &outFlags, &outIds);
+  content_hash_test_expect("a generator's first run goes through", kept == CONTENT_HASH_TEST_FILES);
+
+  // the generator runs again, and changes every tenth file
+  for (size_t i = 0; i < CONTENT_HASH_TEST_FILES; i++) {
+    snprintf(name, sizeof(name), "gen%03zu.rb", i);
+    snprintf(contents, sizeof(contents), i % 10 ? "generated %zu" : "regenerated %zu", i);
+    content_hash_test_write(name, contents);
+  }
+  kept = content_hash_batch(hash, CONTENT_HASH_TEST_FILES, paths, flags, ids,
+                            &outPaths, &outFlags, &outIds);
+  bool changed = kept == CONTENT_HASH_TEST_FILES / 10;
+  for (size_t i = 0; changed && i < kept; i++) {
+    changed = outIds[i] == i * 10 && outPaths[i] == paths[i * 10];
+  }
+  content_hash_test_expect("only what a rerun changed goes through, in order", changed);
+  content_hash_test_expect("and the rest is counted",
+                           content_hash_unchanged(hash) == CONTENT_HASH_TEST_FILES - kept);
+
+  for (size_t i = 0; i < CONTENT_HASH_TEST_FILES; i++) {
+    unlink(paths[i]);
+    free(paths[i]);
+  }
+  content_hash_release(hash);
+}
+
+int main(void)
+{
+  const char* tmp = getenv("TMPDIR");
+  snprintf(dir, sizeof(dir), "%s/content_hash_test.XXXXXX", tmp ? tmp : "/tmp");
+  if (!mkdtemp(dir)) {
+    fprintf(stderr, "Unable to create a temporary directory: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  content_hash_test_vectors();
+  content_hash_test_single();
+  content_hash_test_parallel();
+
+  const char* names[] = {"big.rb", "c.rb", "d.rb"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    unlink(content_hash_test_path(names[i]));
+  }
+  rmdir(dir);
+
+  if (failures) {
+    fprintf(stderr, "FAIL: %d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  fprintf(stdout, "ok\n");
+  return EXIT_SUCCESS;
+}
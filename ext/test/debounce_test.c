@@ -0,0 +1,193 @@
+//
+//  debounce_test.c
+//  fsevent_watch
+//
+//  Drives the batching of every event source by a synthetic clock, and
+//  checks when each batch goes out under --debounce: a lone event after a
+//  quiet period at once, the events that follow it in one trailing batch
+//  once the latency period passes without another, and a storm that never
+//  lets up every EVENT_BATCH_DEBOUNCE_MAX_WINDOWS windows. The default
+//  window and --no-defer are checked alongside, since they share the code.
+//
+//  Run by `rake test_debounce`, which fails if any batch went out at the
+//  wrong time or with the wrong events.
+//
+
+#include "common.h"
+#include "event_batch.h"
+
+#define DEBOUNCE_TEST_LATENCY  0.5
+
+static int failures = 0;
+
+// what the stream callback was handed, and when
+static double clock_now = 0;
+static size_t delivered = 0;
+static double delivered_at = -1;
+static char first_path[PATH_MAX];
+
+static void debounce_test_callback(__attribute__((unused)) ConstFSEventStreamRef streamRef,
+                                   __attribute__((unused)) void* clientCallBackInfo,
+                                   size_t numEvents,
+                                   void* eventPaths,
+                                   __attribute__((unused)) const FSEventStreamEventFlags eventFlags[],
+                                   __attribute__((unused)) const FSEventStreamEventId eventIds[])
+{
+  char** paths = eventPaths;
+  delivered = numEvents;
+  delivered_at = clock_now;
+  snprintf(first_path, sizeof(first_path), "%s", paths[0]);
+}
+
+static void debounce_test_append(struct event_batch* batch, const char* path)
+{
+  event_batch_append(batch, path, strlen(path), 0, NULL, 0,
+                     kFSEventStreamEventFlagItemModified, clock_now);
+}
+
+// Step the clock a millisecond at a time until `until`, flushing whatever
+// is due the way an event source's poll loop would
+static void debounce_test_run(struct event_batch* batch, double until)
+{
+  delivered = 0;
+  delivered_at = -1;
+  for (; clock_now < until - 1e-9; clock_now += 0.001) {
+    event_batch_flush_if_due(batch, clock_now);
+    if (delivered) {
+      return;
+    }
+  }
+  clock_now = until;
+  event_batch_flush_if_due(batch, clock_now);
+}
+
+static void debounce_test_expect(const char* what, size_t events, double at, const char* path)
+{
+  bool ok = delivered == events;
+  if (events) {
+    ok = ok && delivered_at > at - 0.0015 && delivered_at < at + 0.0015;
+    ok = ok && strcmp(first_path, path) == 0;
+  }
+  if (ok) {
+    fprintf(stdout, "ok    %s\n", what);
+  } else {
+    fprintf(stdout, "FAIL  %s: %zu events at %.3fs starting with %s, "
+                    "wanted %zu at %.3fs starting with %s\n",
+            what, delivered, delivered_at, delivered ? first_path : "nothing",
+            events, at, events ? path : "nothing");
+    failures++;
+  }
+}
+
+static void debounce_test_setup(struct event_batch* batch, FSEventStreamCreateFlags flags)
+{
+  // the monotonic clock is well past zero by the time anything is watched
+  clock_now = 100.0;
+  event_batch_init(batch, (FSEventStreamCallback)&debounce_test_callback, NULL,
+                   DEBOUNCE_TEST_LATENCY, flags);
+}
+
+static void debounce_test_default(void)
+{
+  struct event_batch batch;
+  debounce_test_setup(&batch, kFSEventStreamCreateFlagNone);
+
+  debounce_test_append(&batch, "/p/a");
+  debounce_test_run(&batch, 101.0);
+  debounce_test_expect("default: a lone event waits out the window", 1, 100.5, "/p/a");
+
+  event_batch_free(&batch);
+}
+
+static void debounce_test_no_defer(void)
+{
+  struct event_batch batch;
+  debounce_test_setup(&batch, kFSEventStreamCreateFlagNoDefer);
+
+  debounce_test_append(&batch, "/p/a");
+  debounce_test_run(&batch, 100.1);
+  debounce_test_expect("no-defer: a lone event goes out at once", 1, 100.0, "/p/a");
+
+  // what follows goes out a window after the last delivery, however it ends
+  clock_now = 100.2;
+  debounce_test_append(&batch, "/p/b");
+  debounce_test_run(&batch, 101.0);
+  debounce_test_expect("no-defer: the next window goes out on a fixed schedule", 1, 100.5, "/p/b");
+
+  event_batch_free(&batch);
+}
+
+static void debounce_test_debounce(void)
+{
+  struct event_batch batch;
+  debounce_test_setup(&batch, kFSEventWatchCreateFlagDebounce);
+
+  // a single save
+  debounce_test_append(&batch, "/p/save");
+  debounce_test_run(&batch, 100.1);
+  debounce_test_expect("debounce: the leading event goes out at once", 1, 100.0, "/p/save");
+
+  debounce_test_run(&batch, 102.0);
+  debounce_test_expect("debounce: nothing trails a lone event", 0, 0, NULL);
+
+  // a burst right after a save trails until it has been quiet for a window
+  clock_now = 103.0;
+  debounce_test_append(&batch, "/p/a");
+  debounce_test_run(&batch, 103.05);
+  debounce_test_expect("debounce: a burst leads with its first event", 1, 103.0, "/p/a");
+
+  for (int i = 0; i < 4; i++) {
+    clock_now = 103.1 + i * 0.2;
+    debounce_test_append(&batch, i % 2 ? "/p/c" : "/p/b");
+    debounce_test_run(&batch, clock_now + 0.19);
+    debounce_test_expect("debounce: the burst is held while it goes on", 0, 0, NULL);
+  }
+  debounce_test_run(&batch, 105.0);
+  debounce_test_expect("debounce: the rest trails once a window passes quietly", 4, 104.2, "/p/b");
+
+  // the trailing batch only went out once it had been quiet for a window,
+  // so whatever comes next leads again
+  clock_now = 104.4;
+  debounce_test_append(&batch, "/p/d");
+  debounce_test_run(&batch, 104.45);
+  debounce_test_expect("debounce: the next event after a trailing batch leads", 1, 104.4, "/p/d");
+  clock_now = 104.5;
+  debounce_test_append(&batch, "/p/e");
+  debounce_test_run(&batch, 105.5);
+  debounce_test_expect("debounce: and one hard on its heels trails", 1, 105.0, "/p/e");
+
+  // a storm that never lets up still goes out every few windows
+  clock_now = 110.0;
+  debounce_test_append(&batch, "/p/storm");
+  debounce_test_run(&batch, 110.01);
+  debounce_test_expect("debounce: a storm leads with its first event", 1, 110.0, "/p/storm");
+
+  double window_start = 110.1;
+  double due = window_start + EVENT_BATCH_DEBOUNCE_MAX_WINDOWS * DEBOUNCE_TEST_LATENCY;
+  size_t held = 0;
+  delivered = 0;
+  for (clock_now = window_start; !delivered && clock_now < due + 1.0; ) {
+    debounce_test_append(&batch, held ? "/p/storm/n" : "/p/storm/0");
+    held++;
+    double next = clock_now + 0.1;
+    debounce_test_run(&batch, next);
+    clock_now = next;
+  }
+  debounce_test_expect("debounce: a storm goes out after the longest hold", held, due, "/p/storm/0");
+
+  event_batch_free(&batch);
+}
+
+int main(void)
+{
+  debounce_test_default();
+  debounce_test_no_defer();
+  debounce_test_debounce();
+
+  if (failures) {
+    fprintf(stderr, "FAIL: %d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  fprintf(stdout, "ok\n");
+  return EXIT_SUCCESS;
+}
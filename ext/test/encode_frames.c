@@ -0,0 +1,102 @@
+//
+//  encode_frames.c
+//  fsevent_watch
+//
+//  Encodes batches with fsevent_watch's own output encoder, so the reader
+//  specs decode what fsevent_watch really writes rather than what a Ruby
+//  copy of the encoder thinks it writes. Reads batches from stdin, each a
+//  u32 event count followed by that many events of a u32 of flags, a u64 id,
+//  a u32 path length and the path's bytes, all little endian, and writes
+//  every batch to stdout in the --format named on the commandline.
+//
+//  Built by `rake encode_frames` with a small interned table, so a handful
+//  of batches is enough to make interned output start its table over.
+//
+
+#include <errno.h>
+#include "common.h"
+#include "cli.h"
+#include "output_encoder.h"
+
+static bool encode_frames_read(void* bytes, size_t length)
+{
+  return fread(bytes, 1, length, stdin) == length;
+}
+
+static UInt32 encode_frames_u32(const unsigned char* p)
+{
+  return (UInt32)p[0] | (UInt32)p[1] << 8 | (UInt32)p[2] << 16 | (UInt32)p[3] << 24;
+}
+
+static bool encode_frames_batch(struct output_encoder* encoder,
+                                enum FSEventWatchOutputFormat format)
+{
+  unsigned char header[4];
+  if (!encode_frames_read(header, sizeof(header))) {
+    return false;
+  }
+
+  size_t numEvents = encode_frames_u32(header);
+  char** paths = calloc(numEvents ? numEvents : 1, sizeof(char*));
+  FSEventStreamEventFlags* flags = calloc(numEvents ? numEvents : 1, sizeof(FSEventStreamEventFlags));
+  FSEventStreamEventId* ids = calloc(numEvents ? numEvents : 1, sizeof(FSEventStreamEventId));
+  if (!paths || !flags || !ids) {
+    fprintf(stderr, "Unable to allocate a batch of %zu events\n", numEvents);
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < numEvents; i++) {
+    unsigned char event[16];
+    if (!encode_frames_read(event, sizeof(event))) {
+      fprintf(stderr, "Truncated event %zu of %zu\n", i, numEvents);
+      exit(EXIT_FAILURE);
+    }
+    flags[i] = encode_frames_u32(event);
+    ids[i] = (UInt64)encode_frames_u32(event + 4) | (UInt64)encode_frames_u32(event + 8) << 32;
+
+    size_t length = encode_frames_u32(event + 12);
+    paths[i] = malloc(length + 1);
+    if (!paths[i]) {
+      fprintf(stderr, "Unable to allocate a path of %zu bytes\n", length);
+      exit(EXIT_FAILURE);
+    }
+    if (!encode_frames_read(paths[i], length)) {
+      fprintf(stderr, "Truncated path of event %zu of %zu\n", i, numEvents);
+      exit(EXIT_FAILURE);
+    }
+    paths[i][length] = '\0';
+  }
+
+  size_t length;
+  const char* bytes = output_encoder_encode(encoder, format, numEvents, paths, flags, ids,
+                                            NULL, &length);
+  if (output_encoder_write(STDOUT_FILENO, bytes, length) < 0) {
+    fprintf(stderr, "Unable to write a batch: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < numEvents; i++) {
+    free(paths[i]);
+  }
+  free(paths);
+  free(flags);
+  free(ids);
+  return true;
+}
+
+int main(int argc, const char* argv[])
+{
+  enum FSEventWatchOutputFormat format;
+  if (argc != 2 || !cli_parse_format(argv[1], &format)) {
+    fprintf(stderr, "usage: encode_frames format < batches\n");
+    return EXIT_FAILURE;
+  }
+
+  struct output_encoder encoder;
+  output_encoder_init(&encoder);
+  while (encode_frames_batch(&encoder, format)) {
+  }
+  output_encoder_free(&encoder);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,206 @@
+//
+//  git_ignore_test.c
+//  fsevent_watch
+//
+//  Lays out a worktree in a temporary directory, with a .git/info/exclude
+//  and .gitignore files at its top and below it, and checks which paths
+//  --gitignore drops the way git would: unanchored globs at any depth but
+//  only whole components, `**/` matching no directories at all, `dir/` only
+//  matching directories, `!` re-including a file, but not below a directory
+//  that is itself ignored, and deeper files overriding shallower ones. An
+//  event on an ignore file re-reads it, including a new one.
+//
+//  Run by `rake test_git_ignore`, which fails if any path was wrongly kept
+//  or dropped.
+//
+
+#include "common.h"
+#include "git_ignore.h"
+#include <errno.h>
+#include <sys/stat.h>
+
+static int failures = 0;
+static char dir[PATH_MAX / 2];
+
+static void git_ignore_test_expect(const char* what, bool ok)
+{
+  if (ok) {
+    fprintf(stdout, "ok    %s\n", what);
+  } else {
+    fprintf(stdout, "FAIL  %s\n", what);
+    failures++;
+  }
+}
+
+static char* git_ignore_test_path(const char* name)
+{
+  static char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  return path;
+}
+
+static void git_ignore_test_write(const char* name, const char* contents)
+{
+  FILE* file = fopen(git_ignore_test_path(name), "w");
+  if (!file) {
+    fprintf(stderr, "Unable to write %s: %s\n", name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fputs(contents, file);
+  fclose(file);
+}
+
+// The worktree, parents first; directories have no contents
+struct git_ignore_test_file {
+  const char* name;
+  const char* contents;
+};
+
+static const struct git_ignore_test_file kFiles[] = {
+  {".git",              NULL},
+  {".git/info",         NULL},
+  {".git/info/exclude", "*.swp\n"},
+  {".gitignore",        "# objects, but not this one\n"
+                        "*.o\n"
+                        "!keep.o\n"
+                        "build/\n"
+                        "/tmp\n"
+                        "**/cache\n"
+                        "doc/**/*.html\n"
+                        "vendor/\n"
+                        "!vendor/keep.rb\n"},
+  {"sub",               NULL},
+  {"sub/.gitignore",    "*.tmp\n"
+                        "!mine.o\n"
+                        "/local\n"},
+  {"new",               NULL},
+};
+
+struct git_ignore_test_case {
+  const char* what;
+  const char* path;
+  bool        is_dir;
+  bool        ignored;
+};
+
+static const struct git_ignore_test_case kCases[] = {
+  {"unanchored glob matches at the top",          "a.o",              false, true},
+  {"unanchored glob matches at any depth",        "src/deep/a.o",     false, true},
+  {"unanchored glob matches whole names",         "src/a.oo",         false, false},
+  {"! re-includes a file",                        "keep.o",           false, false},
+  {"! re-includes a file at any depth",           "src/keep.o",       false, false},
+  {"dir/ matches a directory",                    "build",            true,  true},
+  {"dir/ doesn't match a file",                   "build",            false, false},
+  {"dir/ takes everything below along",           "src/build/x.c",    false, true},
+  {"leading / anchors to the ignore file",        "tmp",              true,  true},
+  {"an anchored glob doesn't match deeper",       "src/tmp",          true,  false},
+  {"**/ matches no directories at all",           "cache",            true,  true},
+  {"**/ matches any number of them",              "src/a/b/cache",    true,  true},
+  {"**/ only matches whole components",           "src/mycache",      true,  false},
+  {"a/**/ matches no directories at all",         "doc/a.html",       false, true},
+  {"a/**/ matches several",                       "doc/x/y/a.html",   false, true},
+  {"a/**/ still needs the rest to match",         "doc/a.txt",        false, false},
+  {"! can't re-include below an ignored parent",  "vendor/keep.rb",   false, true},
+  {"a deeper .gitignore applies below it",        "sub/x.tmp",        false, true},
+  {"a deeper .gitignore doesn't apply above it",  "x.tmp",            false, false},
+  {"a deeper ! overrides a shallower ignore",     "sub/mine.o",       false, false},
+  {"a deeper / anchors to its own directory",     "sub/local",        false, true},
+  {"and not to the ones below it",                "sub/deeper/local", false, false},
+  {".git/info/exclude applies",                   "src/a.swp",        false, true},
+  {".git itself is always ignored",               ".git/index",       false, true},
+  {"anything else is kept",                       "src/a.c",          false, false},
+};
+
+static void git_ignore_test_cases(struct git_ignore* ignore)
+{
+  for (size_t i = 0; i < sizeof(kCases) / sizeof(kCases[0]); i++) {
+    const struct git_ignore_test_case* test = &kCases[i];
+    char what[256];
+    snprintf(what, sizeof(what), "%s: %s %s%s", test->what,
+             test->ignored ? "drops" : "keeps", test->path, test->is_dir ? "/" : "");
+    git_ignore_test_expect(what, git_ignore_ignored(ignore, git_ignore_test_path(test->path),
+                                                    test->is_dir) == test->ignored);
+  }
+}
+
+// Whether a batch of a single event on name kept it, after an event on the
+// ignore file `touched` if there is one
+static bool git_ignore_test_kept(struct git_ignore* ignore, const char* touched, const char* name)
+{
+  char touched_path[PATH_MAX];
+  char name_path[PATH_MAX];
+  snprintf(touched_path, sizeof(touched_path), "%s", git_ignore_test_path(touched));
+  snprintf(name_path, sizeof(name_path), "%s", git_ignore_test_path(name));
+
+  char* paths[] = {touched_path, name_path};
+  FSEventStreamEventFlags flags[] = {
+    kFSEventStreamEventFlagItemModified | kFSEventStreamEventFlagItemIsFile,
+    kFSEventStreamEventFlagItemModified | kFSEventStreamEventFlagItemIsFile
+  };
+  FSEventStreamEventId ids[] = {1, 2};
+  char** outPaths;
+  const FSEventStreamEventFlags* outFlags;
+  const FSEventStreamEventId* outIds;
+  size_t count = git_ignore_batch(ignore, 2, paths, flags, ids, &outPaths, &outFlags, &outIds);
+  return count > 0 && strcmp(outPaths[count - 1], name_path) == 0;
+}
+
+static void git_ignore_test_updates(struct git_ignore* ignore)
+{
+  git_ignore_test_write(".gitignore", "*.o\n*.c\n");
+  git_ignore_test_expect("update: an edited .gitignore is re-read",
+                         !git_ignore_test_kept(ignore, ".gitignore", "src/a.c"));
+  git_ignore_test_expect("update: and its old patterns forgotten",
+                         git_ignore_test_kept(ignore, ".gitignore", "tmp/a"));
+
+  git_ignore_test_write("new/.gitignore", "*.md\n");
+  git_ignore_test_expect("update: a new .gitignore is read",
+                         !git_ignore_test_kept(ignore, "new/.gitignore", "new/a.md"));
+  git_ignore_test_expect("update: and only applies below it",
+                         git_ignore_test_kept(ignore, "new/.gitignore", "a.md"));
+}
+
+int main(void)
+{
+  const char* tmp = getenv("TMPDIR");
+  char template[PATH_MAX / 2];
+  snprintf(template, sizeof(template), "%s/git_ignore_test.XXXXXX", tmp ? tmp : "/tmp");
+  // the ignore trie is keyed on real paths
+  if (!mkdtemp(template) || !realpath(template, dir)) {
+    fprintf(stderr, "Unable to create a temporary directory: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  size_t num_files = sizeof(kFiles) / sizeof(kFiles[0]);
+  for (size_t i = 0; i < num_files; i++) {
+    if (kFiles[i].contents) {
+      git_ignore_test_write(kFiles[i].name, kFiles[i].contents);
+    } else if (mkdir(git_ignore_test_path(kFiles[i].name), 0755) != 0) {
+      fprintf(stderr, "Unable to create %s: %s\n", kFiles[i].name, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  struct git_ignore* ignore = git_ignore_create();
+  git_ignore_add_root(ignore, dir);
+  git_ignore_test_cases(ignore);
+  git_ignore_test_updates(ignore);
+  git_ignore_release(ignore);
+
+  unlink(git_ignore_test_path("new/.gitignore"));
+  for (size_t i = num_files; i > 0; i--) {
+    if (kFiles[i - 1].contents) {
+      unlink(git_ignore_test_path(kFiles[i - 1].name));
+    } else {
+      rmdir(git_ignore_test_path(kFiles[i - 1].name));
+    }
+  }
+  rmdir(dir);
+
+  if (failures) {
+    fprintf(stderr, "FAIL: %d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  fprintf(stdout, "ok\n");
+  return EXIT_SUCCESS;
+}
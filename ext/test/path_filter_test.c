@@ -0,0 +1,139 @@
+//
+//  path_filter_test.c
+//  fsevent_watch
+//
+//  Compiles --include/--exclude globs the way the commandline does and
+//  checks which paths each set of them keeps: `**/` matching no directories
+//  at all, a trailing '/' meaning the directory itself, globs without a
+//  leading '/' matching at any component but never inside one, and
+//  everything below a match going with it. Globs that can't be parsed are
+//  refused, and a batch keeps its survivors in order.
+//
+//  Run by `rake test_path_filter`, which fails if any path was wrongly kept
+//  or dropped.
+//
+
+#include "common.h"
+#include "path_filter.h"
+
+static int failures = 0;
+
+static void path_filter_test_expect(const char* what, bool ok)
+{
+  if (ok) {
+    fprintf(stdout, "ok    %s\n", what);
+  } else {
+    fprintf(stdout, "FAIL  %s\n", what);
+    failures++;
+  }
+}
+
+struct path_filter_test_case {
+  const char* what;
+  const char* include;    // or NULL
+  const char* exclude;    // or NULL
+  const char* path;
+  bool        kept;
+};
+
+static const struct path_filter_test_case kCases[] = {
+  {"**/ matches no directories at all",           NULL, "/src/**/*.o",  "/src/a.o",                   false},
+  {"**/ matches one directory",                   NULL, "/src/**/*.o",  "/src/x/a.o",                 false},
+  {"**/ matches several directories",             NULL, "/src/**/*.o",  "/src/x/y/z/a.o",             false},
+  {"**/ still needs the rest to match",           NULL, "/src/**/*.o",  "/src/x/a.c",                 true},
+  {"**/ doesn't reach outside its prefix",        NULL, "/src/**/*.o",  "/lib/a.o",                   true},
+  {"dir/ matches the directory",                  NULL, "tmp/",         "/app/tmp",                   false},
+  {"dir/ matches below the directory",            NULL, "tmp/",         "/app/tmp/cache/a",           false},
+  {"dir/ doesn't match a longer name",            NULL, "tmp/",         "/app/tmpfile",               true},
+  {"unanchored glob matches at a component",      NULL, "node_modules", "/a/node_modules/left-pad/x", false},
+  {"unanchored glob matches the first component", NULL, "node_modules", "/node_modules",              false},
+  {"unanchored glob doesn't start mid-component", NULL, "node_modules", "/a/my_node_modules/x",       true},
+  {"unanchored glob doesn't end mid-component",   NULL, "node_modules", "/a/node_modules_old/x",      true},
+  {"unanchored * matches at any depth",           NULL, "*.log",        "/app/log/dev.log",           false},
+  {"anchored glob only matches at the root",      NULL, "/tmp",         "/app/tmp",                   true},
+  {"anchored glob matches at the root",           NULL, "/tmp",         "/tmp/a",                     false},
+  {"* doesn't cross a '/'",                       NULL, "/src/*.o",     "/src/a/b.o",                 true},
+  {"* may match nothing",                         NULL, "/src/*.o",     "/src/.o",                    false},
+  {"? matches one byte",                          NULL, "/a?c",         "/abc",                       false},
+  {"? doesn't match a '/'",                       NULL, "/a?c",         "/a/c",                       true},
+  {"[...] matches a listed byte",                 NULL, "*.[oa]",       "/lib/x.a",                   false},
+  {"[...] doesn't match another",                 NULL, "*.[oa]",       "/lib/x.c",                   true},
+  {"[0-9] matches a range",                       NULL, "/v[0-9]",      "/v7",                        false},
+  {"[!...] matches what isn't listed",            NULL, "/v[!0-9]",     "/vx",                        false},
+  {"[!...] doesn't match what is",                NULL, "/v[!0-9]",     "/v7",                        true},
+  {"\\ escapes a wildcard",                       NULL, "/a\\*b",       "/a*b",                       false},
+  {"an escaped wildcard is only itself",          NULL, "/a\\*b",       "/axb",                       true},
+  {"a path matching an include is kept",          "*.rb", NULL,         "/app/x.rb",                  true},
+  {"a path matching no include is dropped",       "*.rb", NULL,         "/app/x.js",                  false},
+  {"an exclude wins over an include",             "/app", "*.log",      "/app/dev.log",               false},
+  {"an include and no exclude keeps",             "/app", "*.log",      "/app/x.rb",                  true},
+  {"outside every include is dropped",            "/app", "*.log",      "/lib/x.rb",                  false},
+};
+
+static void path_filter_test_cases(void)
+{
+  for (size_t i = 0; i < sizeof(kCases) / sizeof(kCases[0]); i++) {
+    const struct path_filter_test_case* test = &kCases[i];
+    struct path_filter filter;
+    path_filter_init(&filter);
+    bool added = (!test->include || path_filter_add(&filter, test->include, false)) &&
+                 (!test->exclude || path_filter_add(&filter, test->exclude, true));
+    path_filter_compile(&filter);
+
+    char what[256];
+    snprintf(what, sizeof(what), "%s: %s%s%s%s%s %s %s", test->what,
+             test->include ? "+" : "", test->include ? test->include : "",
+             test->include && test->exclude ? " " : "",
+             test->exclude ? "-" : "", test->exclude ? test->exclude : "",
+             test->kept ? "keeps" : "drops", test->path);
+    path_filter_test_expect(what, added && path_filter_keep(&filter, test->path) == test->kept);
+    path_filter_free(&filter);
+  }
+}
+
+static void path_filter_test_unparsable(void)
+{
+  struct path_filter filter;
+  path_filter_init(&filter);
+  path_filter_test_expect("an unclosed [ is refused", !path_filter_add(&filter, "/a[bc", true));
+  path_filter_test_expect("an empty glob is refused", !path_filter_add(&filter, "", true));
+  path_filter_free(&filter);
+}
+
+static void path_filter_test_batch(void)
+{
+  struct path_filter filter;
+  path_filter_init(&filter);
+  path_filter_add(&filter, ".git", true);
+  path_filter_compile(&filter);
+
+  char* paths[] = {"/r/a", "/r/.git/index", "/r/b", "/r/.git", "/r/c"};
+  FSEventStreamEventFlags flags[] = {1, 2, 3, 4, 5};
+  FSEventStreamEventId ids[] = {10, 20, 30, 40, 50};
+  size_t count = path_filter_batch(&filter, 5, paths, flags, ids);
+  path_filter_test_expect("batch: keeps the survivors in order",
+                          count == 3 &&
+                          strcmp(filter.events.paths[0], "/r/a") == 0 &&
+                          strcmp(filter.events.paths[1], "/r/b") == 0 &&
+                          strcmp(filter.events.paths[2], "/r/c") == 0);
+  path_filter_test_expect("batch: with their flags and ids",
+                          count == 3 &&
+                          filter.events.flags[1] == 3 && filter.events.ids[1] == 30 &&
+                          filter.events.flags[2] == 5 && filter.events.ids[2] == 50);
+  path_filter_test_expect("batch: counts what it dropped", filter.filtered == 2);
+  path_filter_free(&filter);
+}
+
+int main(void)
+{
+  path_filter_test_cases();
+  path_filter_test_unparsable();
+  path_filter_test_batch();
+
+  if (failures) {
+    fprintf(stderr, "FAIL: %d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  fprintf(stdout, "ok\n");
+  return EXIT_SUCCESS;
+}
@@ -1,4 +1,10 @@
 # -*- encoding: utf-8 -*-
+require 'rb-fsevent/reader'
+
+begin
+  require 'rb-fsevent/fsevent_native'
+rescue LoadError
+end
 
 class FSEvent
   class << self
@@ -12,9 +18,21 @@ class FSEvent
         "#{File.join(FSEvent.root_path, 'bin', 'fsevent_watch')}"
       end
     END
+
+    def reader_class
+      defined?(FSEvent::NativeReader) ? FSEvent::NativeReader : FSEvent::Reader
+    end
+
+    # the native reader copes with any path, classic output can't carry a ':'
+    def default_format
+      reader_class == FSEvent::Reader ? 'classic' : 'otnetstring'
+    end
   end
 
-  attr_reader :paths, :callback
+  # default size of the ring buffer for :transport => 'shm'
+  SHM_SIZE = 4 * 1024 * 1024
+
+  attr_reader :paths, :callback, :format
 
   def initialize args = nil, &block
     watch(args, &block) unless args.nil?
@@ -25,23 +43,42 @@ class FSEvent
     @callback   = block
 
     if options.kind_of?(Hash)
+      @format   = (options[:format] || self.class.default_format).to_s
+      @daemon   = options[:daemon]
+      @shm_size = shm_size(options)
       @options  = parse_options(options)
+      # a path with its own settings is passed once, as a --root
+      @paths   -= (options[:roots] || {}).keys
     elsif options.kind_of?(Array)
+      @format   = format_from_arguments(options)
       @options  = options
     else
-      @options  = []
+      @format   = self.class.default_format
+      @options  = parse_options({})
     end
   end
 
+  # Send events under path to block instead of the watch callback. Formats
+  # that tag events with their root route them with a hash lookup, others by
+  # the longest matching path prefix.
+  def on(path, &block)
+    @routes ||= {}
+    @routes[resolve_path(path)] = block
+    @route_prefixes = @routes.keys.sort_by {|root| -root.length}
+    self
+  end
+
   def run
-    @pipe    = open_pipe
+    @shm     = FSEvent::NativeReader.shm_create(@shm_size) if @shm_size
+    @pipe    = @daemon ? open_socket : open_pipe
     @running = true
+    reader   = @shm ? FSEvent::NativeReader.new(@pipe, @format, @shm) :
+                      self.class.reader_class.new(@pipe, @format)
 
-    # please note the use of IO::select() here, as it is used specifically to
-    # preserve correct signal handling behavior in ruby 1.8.
-    while @running && IO::select([@pipe], nil, nil, nil)
-      if line = @pipe.readline
-        modified_dir_paths = line.split(':').select { |dir| dir != "\n" }
+    while @running && (modified_dir_paths = reader.next_batch)
+      if @routes
+        dispatch(modified_dir_paths, reader.roots)
+      else
         callback.call(modified_dir_paths)
       end
     end
@@ -52,9 +89,10 @@ class FSEvent
 
   def stop
     unless @pipe.nil?
-      Process.kill('KILL', @pipe.pid) if process_running?(@pipe.pid)
+      Process.kill('KILL', @pipe.pid) if @pipe.pid && process_running?(@pipe.pid)
       @pipe.close
     end
+    @shm.close if @shm && !@shm.closed?
   rescue IOError
   ensure
     @running = false
@@ -103,21 +141,128 @@ class FSEvent
     end
   else
     def open_pipe
-      IO.popen([self.class.watcher_path] + @options + @paths)
+      if @shm
+        # the ring buffer goes to the watcher as descriptor 3
+        IO.popen([self.class.watcher_path] + @options + @paths, 'r', 3 => @shm)
+      else
+        IO.popen([self.class.watcher_path] + @options + @paths)
+      end
+    end
+  end
+
+  # Subscribe through a shared fsevent_watch --daemon, starting one if nobody
+  # is listening on the socket yet
+  def open_socket
+    require 'socket'
+    socket = connect_daemon
+    request = @options + @paths.map {|path| File.expand_path(path)}
+    socket.write(request.map {|arg| "#{arg}\0"}.join + "\0")
+
+    # byte by byte, so nothing past the status line is buffered in ruby
+    status = ''
+    status << socket.sysread(1) until status.end_with?("\n")
+    unless status == "ok\n"
+      socket.close
+      raise ArgumentError, "fsevent_watch daemon refused #{@paths.inspect}: #{status.chomp.sub(/\Aerror: /, '')}"
     end
+    socket
   end
 
   private
 
+  def dispatch(paths, roots)
+    routed   = {}
+    unrouted = []
+    paths.each_with_index do |path, i|
+      root = roots && roots[i]
+      root = route_for(path) unless root && @routes.key?(root)
+      if root
+        (routed[root] ||= []) << path
+      else
+        unrouted << path
+      end
+    end
+    routed.each {|root, root_paths| @routes[root].call(root_paths)}
+    callback.call(unrouted) unless unrouted.empty? || callback.nil?
+  end
+
+  def route_for(path)
+    @route_prefixes.find do |root|
+      path.start_with?(root) && (path.length == root.length || path[root.length, 1] == '/')
+    end
+  end
+
+  def resolve_path(path)
+    File.realpath(path)
+  rescue SystemCallError, NoMethodError
+    File.expand_path(path)
+  end
+
+  def connect_daemon
+    UNIXSocket.new(@daemon)
+  rescue Errno::ENOENT, Errno::ECONNREFUSED
+    pid = Process.spawn(self.class.watcher_path, "--daemon=#{@daemon}",
+                        :in => File::NULL, :out => File::NULL, :pgroup => true)
+    Process.detach(pid)
+    50.times do
+      sleep 0.05
+      begin
+        return UNIXSocket.new(@daemon)
+      rescue Errno::ENOENT, Errno::ECONNREFUSED
+      end
+    end
+    UNIXSocket.new(@daemon)
+  end
+
+  # shared memory needs the native reader to map it, otherwise stick to the pipe
+  def shm_size(options)
+    return nil unless options[:transport].to_s == 'shm' && !@daemon
+    return nil unless defined?(FSEvent::NativeReader)
+    options[:shm_size] || SHM_SIZE
+  end
+
   def parse_options(options={})
     opts = []
     opts.concat(['--since-when', options[:since_when]]) if options[:since_when]
+    opts.concat(['--journal', options[:journal]]) if options[:journal]
+    opts.concat(['--snapshot', options[:snapshot]]) if options[:snapshot]
+    opts.push('--crawl') if options[:crawl]
+    opts.concat(['--stats', options[:stats]]) if options[:stats]
+    opts.push("--overflow=#{options[:overflow]}") if options[:overflow]
     opts.concat(['--latency', options[:latency]]) if options[:latency]
+    opts.push("--adaptive-latency=#{Array(options[:adaptive_latency]).join(',')}") if options[:adaptive_latency]
     opts.push('--no-defer') if options[:no_defer]
+    opts.push('--debounce') if options[:debounce]
     opts.push('--watch-root') if options[:watch_root]
     opts.push('--file-events') if options[:file_events]
+    opts.push('--coalesce') if options[:coalesce]
+    opts.push('--content-hash') if options[:content_hash]
+    opts.push("--content-hash-max=#{options[:content_hash]}") if options[:content_hash].is_a?(Integer)
+    opts.push('--gitignore') if options[:gitignore]
+    Array(options[:include]).each {|glob| opts.concat(['--include', glob])}
+    Array(options[:exclude]).each {|glob| opts.concat(['--exclude', glob])}
+    opts.push("--format=#{@format}") unless @format == 'classic'
+    opts.push('--transport=shm') if @shm_size
+    (options[:roots] || {}).each do |path, settings|
+      opts.push("--root=#{path}")
+      opts.concat(['--since-when', settings[:since_when]]) if settings[:since_when]
+      opts.concat(['--latency', settings[:latency]]) if settings[:latency]
+      opts.push('--no-defer') if settings[:no_defer]
+      opts.push('--debounce') if settings[:debounce]
+      opts.push('--watch-root') if settings[:watch_root]
+      opts.push('--file-events') if settings[:file_events]
+    end
     # ruby 1.9's IO.popen(array-of-stuff) syntax requires all items to be strings
     opts.map {|opt| "#{opt}"}
   end
 
+  def format_from_arguments(arguments)
+    arguments = arguments.map {|arg| "#{arg}"}
+    arguments.each_with_index do |arg, i|
+      return arg.split('=', 2).last if arg =~ /\A--format=/
+      return arguments[i + 1] if (arg == '--format' || arg == '-f') && arguments[i + 1]
+    end
+    'classic'
+  end
+
 end
@@ -0,0 +1,251 @@
+# -*- encoding: utf-8 -*-
+
+class FSEvent
+  # Turns fsevent_watch output back into batches of paths. FSEvent::NativeReader,
+  # built from ext/fsevent_native when a compiler is available, has the same
+  # interface and is used in its place.
+  class Reader
+    FORMATS = %w[classic niw niwroot tnetstring otnetstring binary interned frontcoded]
+
+    BINARY_HEADER_SIZE = 8
+    BINARY_EVENT_SIZE  = 16
+    FRONT_CODED_EVENT_SIZE = 20
+
+    # interned frames set the top bit of the count when the table starts over,
+    # and of a path or directory id the first time it's sent
+    INTERNED_RESET = 0x80000000
+    INTERNED_NEW   = 0x80000000
+    INTERNED_NONE  = 0xffffffff
+
+    # Decode the body of a binary frame into [path, flags, id] triples
+    def self.decode_binary(body, count)
+      events = []
+      offset = 0
+      count.times do
+        flags, id_low, id_high, length = body[offset, BINARY_EVENT_SIZE].unpack('VVVV')
+        offset += BINARY_EVENT_SIZE
+        events << [body[offset, length], flags, (id_high << 32) | id_low]
+        offset += length
+      end
+      events
+    end
+
+    # Decode the body of a front-coded frame into [path, flags, id] triples,
+    # in the order of their paths
+    def self.decode_frontcoded(body, count)
+      events = []
+      offset = 0
+      path   = ''
+      count.times do
+        flags, id_low, id_high, shared, length = body[offset, FRONT_CODED_EVENT_SIZE].unpack('VVVVV')
+        offset += FRONT_CODED_EVENT_SIZE
+        raise "malformed frontcoded output from fsevent_watch" if shared > path.length
+        path = path[0, shared] << body[offset, length]
+        offset += length
+        events << [path, flags, (id_high << 32) | id_low]
+      end
+      events
+    end
+
+    # Decode the body of an interned frame into [path, flags, id] triples,
+    # adding the paths it sends for the first time to table, an Array indexed
+    # by path id that is kept from one frame to the next
+    def self.decode_interned(body, count, table)
+      events = []
+      offset = 0
+      count.times do
+        flags, id_low, id_high, ref = body[offset, BINARY_EVENT_SIZE].unpack('VVVV')
+        offset += BINARY_EVENT_SIZE
+        if ref & INTERNED_NEW == 0
+          path = table[ref]
+          raise "malformed interned output from fsevent_watch" unless path
+        else
+          dir, length = body[offset, 8].unpack('VV')
+          offset += 8
+          rest = body[offset, length]
+          offset += length
+          if dir == INTERNED_NONE
+            path = rest
+          elsif dir & INTERNED_NEW == 0
+            prefix = table.fetch(dir)
+            # join the bytes, whatever the encoding makes of them
+            prefix = prefix.dup.force_encoding(rest.encoding) if prefix.respond_to?(:force_encoding)
+            path = prefix + rest
+          else
+            # up to the last '/' before the final byte
+            table[dir & ~INTERNED_NEW] = intern(rest[0, rest.rindex('/', -2) + 1])
+            path = rest
+          end
+          path = table[ref & ~INTERNED_NEW] = intern(path)
+        end
+        events << [path, flags, (id_high << 32) | id_low]
+      end
+      events
+    end
+
+    def self.intern(path)
+      path.force_encoding(Encoding.default_external) if path.respond_to?(:force_encoding)
+      path.freeze
+    end
+    private_class_method :intern
+
+    # The watched root of every path in the last batch, or nil for formats that
+    # don't report one. A path outside every --root has a nil root.
+    attr_reader :roots
+
+    def initialize(io, format = 'classic')
+      @io     = io
+      @format = format.to_s
+      raise ArgumentError, "unknown format: #{@format}" unless FORMATS.include?(@format)
+    end
+
+    # Blocks until the next batch arrives, returning nil once the watcher exits
+    def next_batch
+      # please note the use of IO::select() here, as it is used specifically to
+      # preserve correct signal handling behavior in ruby 1.8.
+      return nil unless IO::select([@io], nil, nil, nil)
+
+      case @format
+      when 'niw'         then read_niw
+      when 'niwroot'     then read_niwroot
+      when 'tnetstring'  then read_tnetstring(false)
+      when 'otnetstring' then read_tnetstring(true)
+      when 'binary'      then read_binary
+      when 'interned'    then read_interned
+      when 'frontcoded'  then read_frontcoded
+      else                    read_classic
+      end
+    rescue EOFError
+      nil
+    end
+
+    private
+
+    def read_classic
+      @roots = nil
+      @io.readline.split(':').select { |dir| dir != "\n" }
+    end
+
+    def read_niw
+      paths  = []
+      @roots = nil
+      while (line = @io.readline) != "\n"
+        # paths may contain ':', so everything after the id belongs to them
+        paths << line.chomp.split(':', 3)[2]
+      end
+      paths
+    end
+
+    def read_niwroot
+      paths  = []
+      @roots = []
+      while (line = @io.readline) != "\n"
+        # paths may contain ':', so everything after the root length belongs to them
+        root_length, path = line.chomp.split(':', 4)[2, 2]
+        root_length = root_length.to_i
+        paths  << path
+        # the length is in bytes
+        @roots << if root_length == 0 then nil
+                  elsif path.respond_to?(:byteslice) then path.byteslice(0, root_length)
+                  else path[0, root_length]
+                  end
+      end
+      paths
+    end
+
+    # the count and body of the next binary, interned or front-coded frame
+    def read_frame
+      header = @io.read(BINARY_HEADER_SIZE)
+      raise EOFError if header.nil? || header.length < BINARY_HEADER_SIZE
+      count, size = header.unpack('VV')
+
+      body = size > 0 ? @io.read(size) : ''
+      raise EOFError if body.nil? || body.length < size
+      [count, body]
+    end
+
+    def read_binary
+      count, body = read_frame
+      @roots = nil
+      self.class.decode_binary(body, count).map do |path, flags, id|
+        path.force_encoding(Encoding.default_external) if path.respond_to?(:force_encoding)
+        path
+      end
+    end
+
+    # the same frame layout as binary, with paths sent in full only once
+    def read_interned
+      count, body = read_frame
+      @table = [] if @table.nil? || count & INTERNED_RESET != 0
+      @roots = nil
+      self.class.decode_interned(body, count & ~INTERNED_RESET, @table).map { |path, _, _| path }
+    end
+
+    def read_frontcoded
+      count, body = read_frame
+      @roots = nil
+      self.class.decode_frontcoded(body, count).map do |path, flags, id|
+        path.force_encoding(Encoding.default_external) if path.respond_to?(:force_encoding)
+        path
+      end
+    end
+
+    def read_tnetstring(ot)
+      length = ''
+      while (c = @io.readchar) =~ /\d/
+        length << c
+      end
+
+      # otnetstring leads with the type tag, tnetstring trails with it
+      size    = ot ? length.to_i : length.to_i + 1
+      payload = @io.read(size)
+      raise EOFError if payload.nil? || payload.length < size
+      tag     = ot ? c : payload.slice!(-1, 1)
+
+      frame  = decode(tag, payload, ot)
+      events = frame['events'] || []
+      @roots = events.map do |event|
+        root = event['root']
+        root.force_encoding(Encoding.default_external) if root.respond_to?(:force_encoding)
+        root.nil? || root.empty? ? nil : root
+      end
+      events.map do |event|
+        path = event['path']
+        path.force_encoding(Encoding.default_external) if path.respond_to?(:force_encoding)
+        path
+      end
+    end
+
+    def decode(tag, payload, ot)
+      case tag
+      when ','      then payload
+      when '#'      then payload.to_i
+      when '^'      then payload.to_f
+      when '!'      then payload == 'true'
+      when '~'      then nil
+      when '}', '{' then Hash[*decode_all(payload, ot)]
+      when ']', '[' then decode_all(payload, ot)
+      else raise "malformed #{ot ? 'otnetstring' : 'tnetstring'} output from fsevent_watch"
+      end
+    end
+
+    def decode_all(data, ot)
+      values = []
+      offset = 0
+      while offset < data.length
+        colon  = ot ? data.index(/\D/, offset) : data.index(':', offset)
+        length = data[offset...colon].to_i
+        if ot
+          tag   = data[colon, 1]
+          value = data[colon + 1, length]
+        else
+          value = data[colon + 1, length]
+          tag   = data[colon + 1 + length, 1]
+        end
+        values << decode(tag, value, ot)
+        offset = colon + 1 + length + (ot ? 0 : 1)
+      end
+      values
+    end
+  end
+end
@@ -0,0 +1,273 @@
+require 'spec_helper'
+
+# Frames as fsevent_watch's own encoder writes them, from ext/build/encode_frames
+module EncodedFrames
+  ENCODE_FRAMES = File.expand_path('../../../ext/build/encode_frames', __FILE__)
+
+  # frames is a list of batches, each a list of [path, flags, id] events
+  def encoded_frames(format, frames)
+    input = frames.map { |events|
+      [events.length].pack('V') + events.map { |path, flags, id|
+        [flags, id, path.bytesize].pack('VQ<V') + path.b
+      }.join
+    }.join
+    IO.popen([ENCODE_FRAMES, format], 'r+b') do |io|
+      writing = Thread.new { io.write input; io.close_write }
+      output = io.read
+      writing.join
+      output
+    end
+  end
+
+  # the count and body of every binary, frontcoded or interned frame in data
+  def frame_bodies(data)
+    bodies = []
+    offset = 0
+    while offset < data.bytesize
+      count, length = data.byteslice(offset, 8).unpack('VV')
+      bodies << [count, data.byteslice(offset + 8, length)]
+      offset += 8 + length
+    end
+    bodies
+  end
+
+  # paths of random bytes, and ones that share prefixes and repeat
+  def random_events(random)
+    Array.new(random.rand(20)) do
+      path = if random.rand(2) == 0
+        Array.new(1 + random.rand(300)) { 1 + random.rand(255) }.pack('C*')
+      else
+        "/src/app#{random.rand(3)}/#{'models/' * random.rand(3)}\xfe#{random.rand(5)}".b
+      end
+      [path, random.rand(2**32), random.rand(2**64)]
+    end
+  end
+
+  def binary_paths(batches)
+    batches.map { |paths| paths.map(&:b) }
+  end
+end
+
+readers = [FSEvent::Reader]
+readers << FSEvent::NativeReader if defined?(FSEvent::NativeReader)
+
+readers.each do |reader_class|
+  describe reader_class do
+    include EncodedFrames
+
+    before(:all) do
+      system "cd ext; rake encode_frames"
+    end
+
+    def frames_for(format, reader_class)
+      reader, writer = IO.pipe
+      writing = Thread.new do
+        yield writer
+        writer.close
+      end
+      batches = []
+      source = reader_class.new(reader, format)
+      while batch = source.next_batch
+        batches << batch
+      end
+      writing.join
+      reader.close
+      batches
+    end
+
+    it "should split classic lines on ':'" do
+      frames_for('classic', reader_class) { |io|
+        io.write "/tmp/a/:/tmp/b/:\n/tmp/c/:\n"
+      }.should == [['/tmp/a/', '/tmp/b/'], ['/tmp/c/']]
+    end
+
+    it "should keep ':' inside niw paths" do
+      frames_for('niw', reader_class) { |io|
+        io.write "0:12:/tmp/a:b/\n0:13:/tmp/c/\n\n"
+        io.write "256:14:/tmp/d\n\n"
+      }.should == [['/tmp/a:b/', '/tmp/c/'], ['/tmp/d']]
+    end
+
+    it "should read niw lines that look like niwroot ones as paths" do
+      reader, writer = IO.pipe
+      writer.write "0:12:6:/tmp/a\n\n"
+      writer.close
+      source = reader_class.new(reader, 'niw')
+      source.next_batch.should == ['6:/tmp/a']
+      source.roots.should == nil
+      reader.close
+    end
+
+    it "should report the root of every niwroot path" do
+      reader, writer = IO.pipe
+      writer.write "0:12:6:/tmp/a:b/c\n0:13:0:/tmp/d\n\n"
+      writer.close
+      source = reader_class.new(reader, 'niwroot')
+      source.next_batch.should == ['/tmp/a:b/c', '/tmp/d']
+      source.roots.should == ['/tmp/a', nil]
+      reader.close
+    end
+
+    it "should report the root of every tnetstring path" do
+      reader, writer = IO.pipe
+      writer.write '88:6:events,59:55:4:path,8:/tmp/a/b,4:root,6:/tmp/a,5:flags,1:0#2:id,1:7#}]9:numEvents,1:1#}'
+      writer.close
+      source = reader_class.new(reader, 'tnetstring')
+      source.next_batch.should == ['/tmp/a/b']
+      source.roots.should == ['/tmp/a']
+      reader.close
+    end
+
+    it "should read tnetstring frames" do
+      frames_for('tnetstring', reader_class) { |io|
+        io.write '72:6:events,43:39:4:path,8:/tmp/a:b,5:flags,1:0#2:id,1:7#}]9:numEvents,1:1#}'
+      }.should == [['/tmp/a:b']]
+    end
+
+    it "should read otnetstring frames" do
+      frames_for('otnetstring', reader_class) { |io|
+        io.write '61{6,events36[33{4,path8,/tmp/a:b5,flags1#02,id1#79,numEvents1#1'
+      }.should == [['/tmp/a:b']]
+    end
+
+    it "should read random binary frames from fsevent_watch" do
+      random = Random.new(4242)
+      frames = Array.new(200) { random_events(random) }
+
+      batches = frames_for('binary', reader_class) { |io|
+        data = encoded_frames('binary', frames)
+        # dribble the stream out in odd sizes so frames straddle reads
+        until data.empty?
+          io.write data.slice!(0, 1 + random.rand(4096))
+        end
+      }
+
+      binary_paths(batches).should == frames.map { |events| events.map(&:first) }
+    end
+
+    it "should read random front-coded frames from fsevent_watch" do
+      random = Random.new(4444)
+      frames = Array.new(200) { random_events(random) }
+
+      batches = frames_for('frontcoded', reader_class) { |io|
+        data = encoded_frames('frontcoded', frames)
+        until data.empty?
+          io.write data.slice!(0, 1 + random.rand(1024))
+        end
+      }
+
+      binary_paths(batches).should == frames.map { |events| events.map(&:first).sort }
+    end
+
+    it "should read random interned frames from fsevent_watch across table resets" do
+      random = Random.new(4343)
+      frames = Array.new(200) { random_events(random) }
+      data = encoded_frames('interned', frames)
+      frame_bodies(data).count { |count, body| count & 0x80000000 != 0 }.should > 1
+
+      batches = frames_for('interned', reader_class) { |io|
+        until data.empty?
+          io.write data.slice!(0, 1 + random.rand(512))
+        end
+      }
+
+      binary_paths(batches).should == frames.map { |events| events.map(&:first) }
+    end
+
+    %w[tnetstring otnetstring].each do |format|
+      it "should read random #{format} frames from fsevent_watch" do
+        random = Random.new(4545)
+        frames = Array.new(100) { random_events(random) }
+
+        batches = frames_for(format, reader_class) { |io|
+          io.write encoded_frames(format, frames)
+        }
+
+        binary_paths(batches).should == frames.map { |events| events.map(&:first) }
+      end
+    end
+
+    it "should hand back the same String for a recurring interned path" do
+      batches = frames_for('interned', reader_class) { |io|
+        io.write encoded_frames('interned', [[['/tmp/a/b', 0, 1]], [['/tmp/a/b', 0, 2], ['/tmp/a/c', 0, 3]]])
+      }
+      batches.should == [['/tmp/a/b'], ['/tmp/a/b', '/tmp/a/c']]
+      batches[1][0].should equal(batches[0][0])
+      batches[1][0].should be_frozen
+    end
+
+  end
+end
+
+describe FSEvent::Reader, ".decode_frontcoded" do
+  it "should rebuild every path from its shared prefix and suffix" do
+    body = [[1, 7, 0, 0, 8, '/tmp/a/b'], [2, 8, 0, 7, 1, 'c'], [4, 9, 0, 5, 5, 'd/e/f']].map { |event|
+      event[0, 5].pack('VVVVV') + event[5]
+    }.join
+    FSEvent::Reader.decode_frontcoded(body, 3).should ==
+      [['/tmp/a/b', 1, 7], ['/tmp/a/c', 2, 8], ['/tmp/d/e/f', 4, 9]]
+  end
+end
+
+describe FSEvent::Reader, "decoding fsevent_watch's frames" do
+  include EncodedFrames
+
+  before(:all) do
+    system "cd ext; rake encode_frames"
+  end
+
+  def decoded(events)
+    events.map { |path, flags, id| [path.b, flags, id] }
+  end
+
+  it "should round-trip flags and ids through binary frames" do
+    random = Random.new(2424)
+    frames = Array.new(100) { random_events(random) }
+    frame_bodies(encoded_frames('binary', frames)).zip(frames).each do |(count, body), events|
+      decoded(FSEvent::Reader.decode_binary(body, count)).should == events
+    end
+  end
+
+  it "should round-trip flags and ids through front-coded frames" do
+    random = Random.new(2525)
+    frames = Array.new(100) { random_events(random) }
+    frame_bodies(encoded_frames('frontcoded', frames)).zip(frames).each do |(count, body), events|
+      decoded(FSEvent::Reader.decode_frontcoded(body, count)).sort.should == events.sort
+    end
+  end
+
+  it "should round-trip flags and ids through interned frames" do
+    random = Random.new(2626)
+    frames = Array.new(100) { random_events(random) }
+    table = []
+    frame_bodies(encoded_frames('interned', frames)).zip(frames).each do |(count, body), events|
+      table = [] if count & FSEvent::Reader::INTERNED_RESET != 0
+      decoded(FSEvent::Reader.decode_interned(body, count & ~FSEvent::Reader::INTERNED_RESET, table)).should == events
+    end
+  end
+end
+
+if defined?(FSEvent::NativeReader)
+  describe FSEvent::NativeReader, "with a ring buffer" do
+    it "should take frames from the ring and the pipe in doorbell order" do
+      shm = FSEvent::NativeReader.shm_create(8192)
+      frames = ["0:1:/tmp/a\n\n", "0:2:/tmp/b\n\n"]
+      record = [frames[0].bytesize].pack('L') + frames[0]
+      record << "\0" * (-record.bytesize % 8)
+      shm.pwrite('FSWRING1' + [8192 - 192].pack('Q'), 0)
+      shm.pwrite([record.bytesize].pack('Q'), 64)
+      shm.pwrite(record, 192)
+
+      reader, writer = IO.pipe
+      writer.write 'p' + frames[1] + 'r'
+      writer.close
+      source = FSEvent::NativeReader.new(reader, 'niw', shm)
+      source.next_batch.should == ['/tmp/b']
+      source.next_batch.should == ['/tmp/a']
+      source.next_batch.should == nil
+      shm.pread(8, 128).unpack('Q').first.should == record.bytesize
+      reader.close
+      shm.close
+    end
+  end
+end